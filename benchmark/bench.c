@@ -0,0 +1,225 @@
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Helpers shared by the benchmarks
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define BENCH_HIST_SUB (1 << BENCH_HIST_SUB_BITS)
+
+/**
+ * Parse a size such as 4096, 4k, 1m or 2g (powers of 1024).  Returns
+ * 0 or -EINVAL.
+ */
+int bench_parse_size(const char *arg, uint64_t *size)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+
+    if (end == arg) return -EINVAL;
+
+    switch (*end) {
+    case 'g': case 'G': value <<= 10; // fall through
+    case 'm': case 'M': value <<= 10; // fall through
+    case 'k': case 'K': value <<= 10; end++; break;
+    case '\0': break;
+    default: return -EINVAL;
+    }
+    if (*end != '\0') return -EINVAL;
+
+    *size = value;
+
+    return 0;
+}
+
+int bench_parse_format(const char *arg, enum bench_format *format)
+{
+    if (!strcmp(arg, "csv")) *format = BENCH_CSV;
+    else if (!strcmp(arg, "json")) *format = BENCH_JSON;
+    else return -EINVAL;
+
+    return 0;
+}
+
+/**
+ * Parse a comma-separated list of positive integers such as 1,2,4 into
+ * values[0..max-1].  Returns how many there were or -EINVAL.
+ */
+int bench_parse_list(const char *arg, int *values, int max)
+{
+    char *end;
+    long value;
+    int n = 0;
+
+    do {
+        value = strtol(arg, &end, 10);
+        if ((end == arg) || (value < 1) || (value > 1 << 30) || (n == max)) return -EINVAL;
+        values[n++] = value;
+        arg = end + 1;
+    } while (*end == ',');
+
+    return (*end == '\0') ? n : -EINVAL;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < BENCH_HIST_SUB) return ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    if (msb >= BENCH_HIST_MAX_BITS) return BENCH_HIST_BUCKETS - 1;
+
+    return (msb - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB +
+           ((ns >> (msb - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+// Middle of the range of latencies that land in bucket b
+static double hist_value(int b)
+{
+    int e = b / BENCH_HIST_SUB;
+
+    if (e == 0) return b;
+
+    return (double) ((uint64_t) (BENCH_HIST_SUB + b % BENCH_HIST_SUB) << (e - 1)) +
+           ((1ull << (e - 1)) - 1) / 2.0;
+}
+
+void bench_hist_add(struct bench_hist *hist, uint64_t ns)
+{
+    hist->count++;
+    hist->sum_ns += ns;
+    if (ns > hist->max_ns) hist->max_ns = ns;
+    hist->buckets[hist_bucket(ns)]++;
+}
+
+void bench_hist_merge(struct bench_hist *sum, const struct bench_hist *hist)
+{
+    int b;
+
+    sum->count += hist->count;
+    sum->sum_ns += hist->sum_ns;
+    if (hist->max_ns > sum->max_ns) sum->max_ns = hist->max_ns;
+    for (b = 0; b < BENCH_HIST_BUCKETS; b++) sum->buckets[b] += hist->buckets[b];
+}
+
+/** Latency at quantile q in microseconds, 0 if nothing was recorded */
+double bench_hist_quantile(const struct bench_hist *hist, double q)
+{
+    uint64_t rank = (uint64_t) (q * hist->count + 0.999999);
+    uint64_t seen = 0;
+    double value = hist->max_ns;
+    int b;
+
+    if (hist->count == 0) return 0;
+    if (rank == 0) rank = 1;
+
+    for (b = 0; b < BENCH_HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) {
+            value = hist_value(b);
+            break;
+        }
+    }
+    if (value > hist->max_ns) value = hist->max_ns;
+
+    return value / 1000.0;
+}
+
+/**
+ * Jain's fairness index of x[0..n-1]: 1 when all are equal, 1/n when
+ * one gets everything.
+ */
+double bench_jain(const double *x, int n)
+{
+    double sum = 0, squares = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum += x[i];
+        squares += x[i] * x[i];
+    }
+
+    return (squares > 0) ? sum * sum / (n * squares) : 1;
+}
+
+void bench_report_begin(struct bench_report *report, FILE *out, enum bench_format format,
+                        const char **names, int columns)
+{
+    int i;
+
+    report->out = out;
+    report->format = format;
+    report->names = names;
+    report->columns = columns;
+    report->rows = 0;
+
+    if (format == BENCH_JSON) {
+        fprintf(out, "[");
+        return;
+    }
+    for (i = 0; i < columns; i++) fprintf(out, "%s%s", i ? "," : "", names[i]);
+    fprintf(out, "\n");
+}
+
+// Values that read as numbers stay numbers in JSON
+static int is_number(const char *value)
+{
+    char *end;
+
+    // strtod() also takes nan and inf, which JSON doesn't
+    if ((*value != '-') && ((*value < '0') || (*value > '9'))) return 0;
+    strtod(value, &end);
+
+    return *end == '\0';
+}
+
+void bench_report_row(struct bench_report *report, const char **values)
+{
+    FILE *out = report->out;
+    int i;
+
+    if (report->format == BENCH_CSV) {
+        for (i = 0; i < report->columns; i++) fprintf(out, "%s%s", i ? "," : "", values[i]);
+        fprintf(out, "\n");
+    } else {
+        fprintf(out, "%s\n  {", report->rows ? "," : "");
+        for (i = 0; i < report->columns; i++) {
+            if (is_number(values[i]))
+                fprintf(out, "%s\"%s\": %s", i ? ", " : "", report->names[i], values[i]);
+            else
+                fprintf(out, "%s\"%s\": \"%s\"", i ? ", " : "", report->names[i], values[i]);
+        }
+        fprintf(out, "}");
+    }
+    report->rows++;
+}
+
+void bench_report_end(struct bench_report *report)
+{
+    if (report->format == BENCH_JSON) fprintf(report->out, "\n]\n");
+    fflush(report->out);
+}
+
+const char *bench_report_num(char *buf, size_t size, double value)
+{
+    // counts are written out in full
+    if ((value < 1e15) && (value > -1e15) && (value == (double) (long long) value))
+        snprintf(buf, size, "%lld", (long long) value);
+    else
+        snprintf(buf, size, "%.6g", value);
+
+    return buf;
+}
@@ -0,0 +1,76 @@
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Helpers shared by the benchmarks: clocks, sizes, latency
+//     histograms and CSV/JSON reports
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Log-linear latency histogram: 16 sub-buckets per power of two of
+// nanoseconds, up to 2^40 ns
+#define BENCH_HIST_SUB_BITS 4
+#define BENCH_HIST_MAX_BITS 40
+#define BENCH_HIST_BUCKETS ((BENCH_HIST_MAX_BITS - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS)
+
+struct bench_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[BENCH_HIST_BUCKETS];
+};
+
+enum bench_format {
+    BENCH_CSV,
+    BENCH_JSON,
+};
+
+static inline uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int bench_parse_size(const char *arg, uint64_t *size);
+int bench_parse_format(const char *arg, enum bench_format *format);
+int bench_parse_list(const char *arg, int *values, int max);
+
+void bench_hist_add(struct bench_hist *hist, uint64_t ns);
+void bench_hist_merge(struct bench_hist *sum, const struct bench_hist *hist);
+double bench_hist_quantile(const struct bench_hist *hist, double q);
+
+double bench_jain(const double *x, int n);
+
+// A report is a header and rows of the same columns, written as CSV
+// or as a JSON array of objects.  Columns are named in the header,
+// values given as text; bench_report_num() formats numbers.
+struct bench_report {
+    FILE *out;
+    enum bench_format format;
+    int columns;
+    const char **names;
+    int rows;
+};
+
+void bench_report_begin(struct bench_report *report, FILE *out, enum bench_format format,
+                        const char **names, int columns);
+void bench_report_row(struct bench_report *report, const char **values);
+void bench_report_end(struct bench_report *report);
+const char *bench_report_num(char *buf, size_t size, double value);
+
+#endif
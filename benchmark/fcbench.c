@@ -0,0 +1,324 @@
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Throughput and fairness of concurrent containers.  N containers
+//     of M worker threads each read and write the same file names in
+//     a mounted fcfuse, so every container works on files of its own.
+//     Each worker joins its container with fcontainer_create(), since
+//     the module tracks containers per thread.  Reports per-container
+//     throughput, latency percentiles and Jain's fairness index as CSV
+//     or JSON.
+//
+////////////////////////////////////////////////////////////////////////
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <fcontainer.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+
+struct worker {
+    int container;          // 0..containers-1
+    int index;              // within the container
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t errors;
+    int failed;             // setup went wrong, errno
+    struct bench_hist read_lat;
+    struct bench_hist write_lat;
+};
+
+static const char *opt_dir;
+static int opt_containers = 1;
+static int opt_workers = 1;
+static int opt_base_cid = 1;
+static uint64_t opt_block = 4096;
+static uint64_t opt_file_size = 64 << 20;
+static int opt_files = 4;
+static int opt_duration = 10;
+static int opt_read_pct = 100;
+static int opt_random;
+static int opt_direct;
+static int opt_no_container;
+static enum bench_format opt_format = BENCH_CSV;
+
+static int devfd = -1;
+static int stop;
+static pthread_barrier_t ready;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: fcbench [options] DIR\n"
+            "  DIR is a directory in a mounted fcfuse\n"
+            "  -c N      containers (1)\n"
+            "  -w M      workers per container (1)\n"
+            "  -C CID    cid of the first container, the others follow (1)\n"
+            "  -b SIZE   block size (4k)\n"
+            "  -s SIZE   file size (64m)\n"
+            "  -f N      files per container (4)\n"
+            "  -t SEC    duration (10)\n"
+            "  -r PCT    share of reads, the rest are writes (100)\n"
+            "  -R        random offsets and files, sequential otherwise\n"
+            "  -d        O_DIRECT\n"
+            "  -N        don't join containers, for a baseline on the backing filesystem\n"
+            "  -o FMT    csv or json (csv)\n");
+    exit(1);
+}
+
+static void file_name(char *buf, size_t size, int file)
+{
+    snprintf(buf, size, "%s/fcbench.%d", opt_dir, file);
+}
+
+// Create the container's files, full length, so reads never hit EOF
+static int prepare(char *buf)
+{
+    char path[4096];
+    struct stat st;
+    uint64_t off;
+    int i, fd;
+
+    for (i = 0; i < opt_files; i++) {
+        file_name(path, sizeof(path), i);
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return -errno;
+        if ((fstat(fd, &st) == 0) && ((uint64_t) st.st_size >= opt_file_size)) {
+            close(fd);
+            continue;
+        }
+        for (off = 0; off < opt_file_size; off += opt_block) {
+            if (pwrite(fd, buf, opt_block, off) != (ssize_t) opt_block) {
+                close(fd);
+                return errno ? -errno : -EIO;
+            }
+        }
+        if (fsync(fd) != 0) {
+            close(fd);
+            return -errno;
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    char path[4096];
+    char *buf = NULL;
+    uint64_t blocks = opt_file_size / opt_block;
+    uint64_t block, start, ns;
+    ssize_t n;
+    int *fds = NULL;
+    int i, file, is_read, retstat = 0;
+
+    if (!opt_no_container && (fcontainer_create(devfd, opt_base_cid + w->container) < 0)) retstat = -errno;
+    if ((retstat == 0) && (posix_memalign((void **) &buf, 4096, opt_block) != 0)) retstat = -ENOMEM;
+    if ((retstat == 0) && ((fds = malloc(opt_files * sizeof(*fds))) == NULL)) retstat = -ENOMEM;
+    for (i = 0; fds && (i < opt_files); i++) fds[i] = -1;
+    if (buf) memset(buf, 'a' + w->container % 26, opt_block);
+
+    // one worker of each container lays its files out
+    if ((retstat == 0) && (w->index == 0)) retstat = prepare(buf);
+    pthread_barrier_wait(&ready);
+
+    for (i = 0; (retstat == 0) && (i < opt_files); i++) {
+        file_name(path, sizeof(path), i);
+        fds[i] = open(path, O_RDWR | (opt_direct ? O_DIRECT : 0));
+        if (fds[i] < 0) retstat = -errno;
+    }
+    w->failed = -retstat;
+
+    // everyone starts together
+    pthread_barrier_wait(&ready);
+
+    file = w->index % opt_files;
+    block = (uint64_t) w->index * blocks / opt_workers;
+    while ((retstat == 0) && !__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if (opt_random) {
+            file = rand_r(&w->seed) % opt_files;
+            block = ((uint64_t) rand_r(&w->seed) << 31 | rand_r(&w->seed)) % blocks;
+        } else if (++block >= blocks) {
+            block = 0;
+        }
+        is_read = (int) (rand_r(&w->seed) % 100) < opt_read_pct;
+
+        start = bench_now();
+        if (is_read) n = pread(fds[file], buf, opt_block, block * opt_block);
+        else n = pwrite(fds[file], buf, opt_block, block * opt_block);
+        ns = bench_now() - start;
+
+        if (n < 0) {
+            w->errors++;
+            continue;
+        }
+        if (is_read) {
+            bench_hist_add(&w->read_lat, ns);
+            w->read_bytes += n;
+        } else {
+            bench_hist_add(&w->write_lat, ns);
+            w->write_bytes += n;
+        }
+    }
+
+    for (i = 0; fds && (i < opt_files); i++)
+        if (fds[i] >= 0) close(fds[i]);
+    if (!opt_no_container) fcontainer_delete(devfd);
+    free(fds);
+    free(buf);
+
+    return NULL;
+}
+
+// One row of the report for the workers of container c, all if c < 0
+static void report_row(struct bench_report *report, struct worker *workers, int c, double seconds,
+                       double fairness)
+{
+    struct bench_hist *lat = calloc(1, sizeof(*lat));
+    uint64_t read_bytes = 0, write_bytes = 0, errors = 0;
+    char num[16][32];
+    const char *values[16];
+    int i, n = 0, nworkers = 0;
+
+    if (lat == NULL) return;
+
+    for (i = 0; i < opt_containers * opt_workers; i++) {
+        if ((c >= 0) && (workers[i].container != c)) continue;
+        nworkers++;
+        read_bytes += workers[i].read_bytes;
+        write_bytes += workers[i].write_bytes;
+        errors += workers[i].errors;
+        bench_hist_merge(lat, &workers[i].read_lat);
+        bench_hist_merge(lat, &workers[i].write_lat);
+    }
+
+    values[n++] = (c < 0) ? "all" : bench_report_num(num[0], 32, c);
+    values[n++] = ((c < 0) || opt_no_container) ? "-" : bench_report_num(num[1], 32, opt_base_cid + c);
+    values[n++] = bench_report_num(num[2], 32, nworkers);
+    values[n++] = bench_report_num(num[3], 32, lat->count);
+    values[n++] = bench_report_num(num[4], 32, errors);
+    values[n++] = bench_report_num(num[5], 32, read_bytes / seconds / 1e6);
+    values[n++] = bench_report_num(num[6], 32, write_bytes / seconds / 1e6);
+    values[n++] = bench_report_num(num[7], 32, (read_bytes + write_bytes) / seconds / 1e6);
+    values[n++] = bench_report_num(num[8], 32, lat->count / seconds);
+    values[n++] = bench_report_num(num[9], 32, bench_hist_quantile(lat, 0.50));
+    values[n++] = bench_report_num(num[10], 32, bench_hist_quantile(lat, 0.90));
+    values[n++] = bench_report_num(num[11], 32, bench_hist_quantile(lat, 0.99));
+    values[n++] = bench_report_num(num[12], 32, bench_hist_quantile(lat, 0.999));
+    values[n++] = bench_report_num(num[13], 32, lat->max_ns / 1000.0);
+    values[n++] = bench_report_num(num[14], 32, fairness);
+
+    bench_report_row(report, values);
+    free(lat);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *columns[] = {
+        "container", "cid", "workers", "ops", "errors", "read_mbps", "write_mbps", "mbps", "iops",
+        "p50_us", "p90_us", "p99_us", "p999_us", "max_us", "fairness"
+    };
+    struct bench_report report;
+    struct worker *workers;
+    double *throughput, seconds, mean = 0;
+    uint64_t start;
+    int opt, i, c, nworkers, failed = 0;
+
+    while ((opt = getopt(argc, argv, "c:w:C:b:s:f:t:r:RdNo:")) != -1) {
+        switch (opt) {
+        case 'c': opt_containers = atoi(optarg); break;
+        case 'w': opt_workers = atoi(optarg); break;
+        case 'C': opt_base_cid = atoi(optarg); break;
+        case 'b': if (bench_parse_size(optarg, &opt_block) != 0) usage(); break;
+        case 's': if (bench_parse_size(optarg, &opt_file_size) != 0) usage(); break;
+        case 'f': opt_files = atoi(optarg); break;
+        case 't': opt_duration = atoi(optarg); break;
+        case 'r': opt_read_pct = atoi(optarg); break;
+        case 'R': opt_random = 1; break;
+        case 'd': opt_direct = 1; break;
+        case 'N': opt_no_container = 1; break;
+        case 'o': if (bench_parse_format(optarg, &opt_format) != 0) usage(); break;
+        default: usage();
+        }
+    }
+    if ((optind != argc - 1) || (opt_containers < 1) || (opt_workers < 1) || (opt_files < 1) ||
+        (opt_duration < 1) || (opt_read_pct < 0) || (opt_read_pct > 100) || (opt_block == 0) ||
+        (opt_file_size < opt_block))
+        usage();
+    opt_dir = argv[optind];
+
+    if (!opt_no_container) {
+        devfd = open("/dev/fcontainer", O_RDWR);
+        if (devfd < 0) {
+            perror("/dev/fcontainer");
+            return 1;
+        }
+    }
+
+    nworkers = opt_containers * opt_workers;
+    workers = calloc(nworkers, sizeof(*workers));
+    throughput = calloc(opt_containers, sizeof(*throughput));
+    if ((workers == NULL) || (throughput == NULL)) {
+        perror("calloc");
+        return 1;
+    }
+    pthread_barrier_init(&ready, NULL, nworkers + 1);
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].container = i / opt_workers;
+        workers[i].index = i % opt_workers;
+        workers[i].seed = 0x9e3779b9u * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "fcbench: %d containers x %d workers, %s %d%% reads of %llu bytes, %d files of %llu bytes\n",
+            opt_containers, opt_workers, opt_random ? "random" : "sequential", opt_read_pct,
+            (unsigned long long) opt_block, opt_files, (unsigned long long) opt_file_size);
+
+    // files are laid out, then everyone opens them
+    pthread_barrier_wait(&ready);
+    pthread_barrier_wait(&ready);
+    start = bench_now();
+    sleep(opt_duration);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < nworkers; i++) pthread_join(workers[i].thread, NULL);
+    seconds = (bench_now() - start) / 1e9;
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].failed) {
+            fprintf(stderr, "fcbench: container %d worker %d: %s\n", workers[i].container, workers[i].index,
+                    strerror(workers[i].failed));
+            failed = 1;
+        }
+        throughput[workers[i].container] += workers[i].read_bytes + workers[i].write_bytes;
+    }
+    for (c = 0; c < opt_containers; c++) mean += throughput[c] / opt_containers;
+
+    bench_report_begin(&report, stdout, opt_format, columns, sizeof(columns) / sizeof(columns[0]));
+    for (c = 0; c < opt_containers; c++)
+        report_row(&report, workers, c, seconds, (mean > 0) ? throughput[c] / mean : 1);
+    report_row(&report, workers, -1, seconds, bench_jain(throughput, opt_containers));
+    bench_report_end(&report);
+
+    return failed;
+}
@@ -0,0 +1,320 @@
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     The file_container ioctls on their own, without FUSE.  Fills the
+//     module's lists with C containers of T tasks each, then has J
+//     threads issue one ioctl as fast as they can:
+//
+//       getcid_miss  GETCID of a task in no container, a full walk
+//       getcid_hit   GETCID of a task in the last container
+//       create       CREATE, each thread into a container of its own
+//       delete       the DELETE issued after each of those CREATEs
+//
+//     for every C, T and J asked for.  Reports ns per call and calls
+//     per second.
+//
+//     The module keeps pointers to the tasks that joined containers,
+//     so every thread stays alive until the lists are emptied again,
+//     which is done with DELETE until it fails.  That also drops
+//     whatever other programs had put in the lists: run it on an
+//     otherwise idle module.
+//
+////////////////////////////////////////////////////////////////////////
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <fcontainer.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "bench.h"
+
+#define MAX_STEPS 16
+
+enum test {
+    T_GETCID_MISS,
+    T_GETCID_HIT,
+    T_CREATE_DELETE,
+    T_MAX
+};
+
+struct caller {
+    int index;
+    pthread_t thread;
+    uint64_t errors[2];
+    struct bench_hist lat[2];       // create and delete for T_CREATE_DELETE
+};
+
+static const char *opt_device = "/dev/fcontainer";
+static int opt_containers[MAX_STEPS] = { 1 };
+static int opt_ncontainers = 1;
+static int opt_tasks[MAX_STEPS] = { 1 };
+static int opt_ntasks = 1;
+static int opt_threads[MAX_STEPS] = { 1 };
+static int opt_nthreads = 1;
+static int opt_base_cid = 1;
+static double opt_seconds = 1;
+static enum bench_format opt_format = BENCH_CSV;
+
+static int devfd = -1;
+static int test;
+static int stop;
+static int containers;              // in this run
+static pthread_barrier_t barrier;
+
+// The task found by getcid_hit, in a container after all the others
+static pid_t tail_tid;
+static pthread_mutex_t tail_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tail_cond = PTHREAD_COND_INITIALIZER;
+static int tail_state;              // 1 once it joined, 2 to let it go
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: fcioctl [options]\n"
+            "  -c LIST   containers in the lists, e.g. 1,100,1000 (1)\n"
+            "  -T LIST   tasks per container (1)\n"
+            "  -j LIST   concurrent callers (1)\n"
+            "  -C CID    cid of the first container, the others follow (1)\n"
+            "  -t SEC    duration of each test (1)\n"
+            "  -D PATH   device (/dev/fcontainer)\n"
+            "  -o FMT    csv or json (csv)\n"
+            "Empties the module's lists when done: run it on an idle module.\n");
+    exit(1);
+}
+
+static pid_t gettid_(void)
+{
+    return syscall(SYS_gettid);
+}
+
+static void *tail_main(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&tail_lock);
+    if (fcontainer_create(devfd, opt_base_cid + containers) != 0) perror("fcioctl: tail create");
+    tail_tid = gettid_();
+    tail_state = 1;
+    pthread_cond_broadcast(&tail_cond);
+    while (tail_state != 2) pthread_cond_wait(&tail_cond, &tail_lock);
+    pthread_mutex_unlock(&tail_lock);
+
+    return NULL;
+}
+
+static void *caller_main(void *arg)
+{
+    struct caller *c = arg;
+    pid_t me = gettid_();
+    int cid = opt_base_cid + containers + 1 + c->index;
+    uint64_t start, mid;
+    int t;
+
+    for (t = 0; t < T_MAX; t++) {
+        pthread_barrier_wait(&barrier);
+        while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+            start = bench_now();
+            switch (test) {
+            case T_GETCID_MISS:
+                if (fcontainer_getcid(devfd, me) >= 0) c->errors[0]++;
+                bench_hist_add(&c->lat[0], bench_now() - start);
+                break;
+            case T_GETCID_HIT:
+                if (fcontainer_getcid(devfd, tail_tid) < 0) c->errors[0]++;
+                bench_hist_add(&c->lat[0], bench_now() - start);
+                break;
+            case T_CREATE_DELETE:
+                if (fcontainer_create(devfd, cid) != 0) c->errors[0]++;
+                mid = bench_now();
+                if (fcontainer_delete(devfd) != 0) c->errors[1]++;
+                bench_hist_add(&c->lat[0], mid - start);
+                bench_hist_add(&c->lat[1], bench_now() - mid);
+                break;
+            }
+        }
+        pthread_barrier_wait(&barrier);
+    }
+
+    // stay around until the lists no longer point at us
+    pthread_barrier_wait(&barrier);
+
+    return NULL;
+}
+
+static void report_row(struct bench_report *report, const char *name, struct caller *callers,
+                       int nthreads, int which, int tasks, double seconds)
+{
+    struct bench_hist *lat = calloc(1, sizeof(*lat));
+    uint64_t errors = 0;
+    char num[16][32];
+    const char *values[16];
+    int i, n = 0;
+
+    if (lat == NULL) return;
+
+    for (i = 0; i < nthreads; i++) {
+        bench_hist_merge(lat, &callers[i].lat[which]);
+        errors += callers[i].errors[which];
+    }
+
+    values[n++] = name;
+    values[n++] = bench_report_num(num[0], 32, containers);
+    values[n++] = bench_report_num(num[1], 32, tasks);
+    values[n++] = bench_report_num(num[2], 32, nthreads);
+    values[n++] = bench_report_num(num[3], 32, lat->count);
+    values[n++] = bench_report_num(num[4], 32, errors);
+    values[n++] = bench_report_num(num[5], 32, lat->count ? (double) lat->sum_ns / lat->count : 0);
+    values[n++] = bench_report_num(num[6], 32, bench_hist_quantile(lat, 0.50) * 1000);
+    values[n++] = bench_report_num(num[7], 32, bench_hist_quantile(lat, 0.99) * 1000);
+    values[n++] = bench_report_num(num[8], 32, lat->count / seconds);
+
+    bench_report_row(report, values);
+    free(lat);
+}
+
+// DELETE until the module has nothing left, returns how many went
+static long drain(void)
+{
+    long n = 0;
+
+    while (fcontainer_delete(devfd) == 0) n++;
+
+    return n;
+}
+
+static int run(struct bench_report *report, int tasks, int nthreads)
+{
+    struct caller *callers;
+    pthread_t tail;
+    uint64_t start;
+    double seconds;
+    int c, i;
+
+    callers = calloc(nthreads, sizeof(*callers));
+    if (callers == NULL) return -ENOMEM;
+
+    // this thread is every task of the populated containers
+    for (c = 0; c < containers; c++) {
+        for (i = 0; i < tasks; i++) {
+            if (fcontainer_create(devfd, opt_base_cid + c) != 0) {
+                perror("fcioctl: create");
+                drain();
+                free(callers);
+                return -1;
+            }
+        }
+    }
+    tail_state = 0;
+    pthread_create(&tail, NULL, tail_main, NULL);
+    pthread_mutex_lock(&tail_lock);
+    while (tail_state != 1) pthread_cond_wait(&tail_cond, &tail_lock);
+    pthread_mutex_unlock(&tail_lock);
+
+    fprintf(stderr, "fcioctl: %d containers x %d tasks, %d callers\n", containers, tasks, nthreads);
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+        callers[i].index = i;
+        if (pthread_create(&callers[i].thread, NULL, caller_main, &callers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    // create_delete goes last, it reorders the lists
+    for (test = 0; test < T_MAX; test++) {
+        __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+        for (i = 0; i < nthreads; i++) {
+            memset(callers[i].lat, 0, sizeof(callers[i].lat));
+            memset(callers[i].errors, 0, sizeof(callers[i].errors));
+        }
+        pthread_barrier_wait(&barrier);
+        start = bench_now();
+        usleep(opt_seconds * 1e6);
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+        pthread_barrier_wait(&barrier);
+        seconds = (bench_now() - start) / 1e9;
+
+        if (test == T_GETCID_MISS) {
+            report_row(report, "getcid_miss", callers, nthreads, 0, tasks, seconds);
+        } else if (test == T_GETCID_HIT) {
+            report_row(report, "getcid_hit", callers, nthreads, 0, tasks, seconds);
+        } else {
+            report_row(report, "create", callers, nthreads, 0, tasks, seconds);
+            report_row(report, "delete", callers, nthreads, 1, tasks, seconds);
+        }
+    }
+
+    drain();
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < nthreads; i++) pthread_join(callers[i].thread, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    pthread_mutex_lock(&tail_lock);
+    tail_state = 2;
+    pthread_cond_broadcast(&tail_cond);
+    pthread_mutex_unlock(&tail_lock);
+    pthread_join(tail, NULL);
+    free(callers);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *columns[] = {
+        "ioctl", "containers", "tasks", "threads", "calls", "errors", "ns_per_call", "p50_ns",
+        "p99_ns", "calls_per_sec"
+    };
+    struct bench_report report;
+    int opt, c, t, j, failed = 0;
+
+    while ((opt = getopt(argc, argv, "c:T:j:C:t:D:o:")) != -1) {
+        switch (opt) {
+        case 'c':
+            if ((opt_ncontainers = bench_parse_list(optarg, opt_containers, MAX_STEPS)) < 0) usage();
+            break;
+        case 'T':
+            if ((opt_ntasks = bench_parse_list(optarg, opt_tasks, MAX_STEPS)) < 0) usage();
+            break;
+        case 'j':
+            if ((opt_nthreads = bench_parse_list(optarg, opt_threads, MAX_STEPS)) < 0) usage();
+            break;
+        case 'C': opt_base_cid = atoi(optarg); break;
+        case 't': opt_seconds = atof(optarg); break;
+        case 'D': opt_device = optarg; break;
+        case 'o': if (bench_parse_format(optarg, &opt_format) != 0) usage(); break;
+        default: usage();
+        }
+    }
+    if ((optind != argc) || (opt_seconds <= 0)) usage();
+
+    devfd = open(opt_device, O_RDWR);
+    if (devfd < 0) {
+        perror(opt_device);
+        return 1;
+    }
+
+    bench_report_begin(&report, stdout, opt_format, columns, sizeof(columns) / sizeof(columns[0]));
+    for (c = 0; c < opt_ncontainers; c++) {
+        containers = opt_containers[c];
+        for (t = 0; t < opt_ntasks; t++)
+            for (j = 0; j < opt_nthreads; j++)
+                if (run(&report, opt_tasks[t], opt_threads[j]) != 0) failed = 1;
+    }
+    bench_report_end(&report);
+
+    return failed;
+}
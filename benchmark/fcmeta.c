@@ -0,0 +1,425 @@
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Metadata storms.  Builds a directory tree in a mounted fcfuse and
+//     has N containers create, stat, access, list, rename and unlink
+//     files in it, for each N and files-per-directory count asked for.
+//     Directories are shared by all containers while every container
+//     has files of its own, so the backing directories grow with both.
+//     Reports the rate and latency of each phase and, given the mount
+//     point, how fcfuse spent its time according to /.fcstats: in the
+//     fcontainer ioctls and resolving backing paths, the two halves of
+//     fcfuse_fullpath(), and in the backing filesystem.
+//
+////////////////////////////////////////////////////////////////////////
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fcontainer.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+
+#define MAX_STEPS 16
+
+enum phase {
+    PH_MKNOD,
+    PH_STAT,
+    PH_ACCESS,
+    PH_READDIR,
+    PH_RENAME,
+    PH_UNLINK,
+    PH_MAX
+};
+
+static const char *phase_names[PH_MAX] = {
+    "mknod", "stat", "access", "readdir", "rename", "unlink"
+};
+
+struct worker {
+    int container;
+    int index;
+    pthread_t thread;
+    int failed;                         // errno of the setup
+    uint64_t errors[PH_MAX];
+    struct bench_hist lat[PH_MAX];
+};
+
+// What fcfuse says it did for our containers, added up from /.fcstats
+struct daemon_totals {
+    uint64_t requests;
+    double total_ns;
+    double ioctl_ns;
+    double resolve_ns;
+    double io_ns;
+};
+
+static const char *opt_dir;
+static const char *opt_mount;
+static int opt_containers[MAX_STEPS] = { 1 };
+static int opt_ncontainers = 1;
+static int opt_files[MAX_STEPS] = { 100 };
+static int opt_nfiles = 1;
+static int opt_workers = 1;
+static int opt_base_cid = 1;
+static int opt_fanout = 4;
+static int opt_levels = 1;
+static int opt_no_container;
+static enum bench_format opt_format = BENCH_CSV;
+
+static int devfd = -1;
+static int leaves;                      // opt_fanout ^ opt_levels
+static int files;                       // per directory in this run
+static int nworkers;                    // in this run
+static pthread_barrier_t phase_barrier;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: fcmeta [options] DIR\n"
+            "  DIR is a directory in a mounted fcfuse\n"
+            "  -c LIST   containers, e.g. 1,4,16 runs each in turn (1)\n"
+            "  -n LIST   files per directory, e.g. 100,10000 (100)\n"
+            "  -w M      workers per container (1)\n"
+            "  -C CID    cid of the first container, the others follow (1)\n"
+            "  -d N      subdirectories per directory (4)\n"
+            "  -l N      levels of subdirectories, files are in the last (1)\n"
+            "  -m MOUNT  mount point, to break down fcfuse's time from its /.fcstats\n"
+            "  -N        don't join containers, for a baseline on the backing filesystem\n"
+            "  -o FMT    csv or json (csv)\n");
+    exit(1);
+}
+
+// Path of directory index of the given level, DIR/fcmeta/d1/d3 for
+// example; the leaves are those of level opt_levels
+static void dir_path(char *buf, size_t size, int index, int levels)
+{
+    int len, level;
+
+    len = snprintf(buf, size, "%s/fcmeta", opt_dir);
+    for (level = 0; level < levels; level++) {
+        len += snprintf(buf + len, size - len, "/d%d", index % opt_fanout);
+        index /= opt_fanout;
+    }
+}
+
+// Create the tree top down, or remove it bottom up
+static int make_tree(int remove)
+{
+    char path[4096];
+    int level, count, index, retstat = 0;
+
+    for (level = remove ? opt_levels : 0; remove ? (level >= 0) : (level <= opt_levels);
+         level += remove ? -1 : 1) {
+        for (count = 1, index = 0; index < level; index++) count *= opt_fanout;
+        for (index = 0; index < count; index++) {
+            dir_path(path, sizeof(path), index, level);
+            if (remove) rmdir(path);
+            else if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) retstat = -errno;
+        }
+    }
+
+    return retstat;
+}
+
+// One operation of container c's phase on file k of a leaf directory;
+// for readdir one listing of the directory
+static int run_op(int phase, const char *dir, int c, int k)
+{
+    char path[4096 + 32], to[4096 + 32];
+    struct stat st;
+    struct dirent *de;
+    DIR *d;
+
+    // outside containers the names have to differ instead
+    if (opt_no_container) {
+        snprintf(path, sizeof(path), "%s/f%d.%d", dir, c, k);
+        snprintf(to, sizeof(to), "%s/r%d.%d", dir, c, k);
+    } else {
+        snprintf(path, sizeof(path), "%s/f%d", dir, k);
+        snprintf(to, sizeof(to), "%s/r%d", dir, k);
+    }
+
+    switch (phase) {
+    case PH_MKNOD:
+        return (mknod(path, S_IFREG | 0644, 0) == 0) ? 0 : -errno;
+    case PH_STAT:
+        return (stat(path, &st) == 0) ? 0 : -errno;
+    case PH_ACCESS:
+        return (access(path, R_OK | W_OK) == 0) ? 0 : -errno;
+    case PH_READDIR:
+        d = opendir(dir);
+        if (d == NULL) return -errno;
+        errno = 0;
+        while ((de = readdir(d)) != NULL) continue;
+        k = errno;
+        closedir(d);
+        return -k;
+    case PH_RENAME:
+        return (rename(path, to) == 0) ? 0 : -errno;
+    case PH_UNLINK:
+        return (unlink(to) == 0) ? 0 : -errno;
+    }
+
+    return -EINVAL;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    char dir[4096];
+    uint64_t start;
+    int phase, leaf, k, ops;
+
+    if (!opt_no_container && (fcontainer_create(devfd, opt_base_cid + w->container) < 0)) w->failed = errno;
+
+    // each phase starts and ends on the barrier, so the main thread
+    // can read /.fcstats in between
+    for (phase = 0; phase < PH_MAX; phase++) {
+        pthread_barrier_wait(&phase_barrier);
+        for (leaf = w->index; !w->failed && (leaf < leaves); leaf += opt_workers) {
+            dir_path(dir, sizeof(dir), leaf, opt_levels);
+            ops = (phase == PH_READDIR) ? 1 : files;
+            for (k = 0; k < ops; k++) {
+                start = bench_now();
+                if (run_op(phase, dir, w->container, k) != 0) w->errors[phase]++;
+                else bench_hist_add(&w->lat[phase], bench_now() - start);
+            }
+        }
+        pthread_barrier_wait(&phase_barrier);
+    }
+
+    if (!opt_no_container && !w->failed) fcontainer_delete(devfd);
+
+    return NULL;
+}
+
+// Is a /.fcstats cid column one of ours
+static int our_cid(const char *cid, int containers)
+{
+    char *end;
+    long value;
+
+    if (opt_no_container) return !strcmp(cid, "-");
+    if (!strcmp(cid, "other")) return 1;
+    value = strtol(cid, &end, 10);
+
+    return (*end == '\0') && (value >= opt_base_cid) && (value < opt_base_cid + containers);
+}
+
+/**
+ * Add up the per-container lines of /.fcstats for our containers.
+ * The ioctl lines are left out, their time is in the lines of the
+ * operations that issued them.  Returns 0 or -errno.
+ */
+static int read_fcstats(struct daemon_totals *t, int containers)
+{
+    char path[4096], line[512], op[32], cid[16];
+    unsigned long long count, errors, bytes;
+    double mean, p50, p90, p99, p999, max, ioctl, resolve, io;
+    FILE *f;
+
+    memset(t, 0, sizeof(*t));
+    snprintf(path, sizeof(path), "%s/.fcstats", opt_mount);
+    f = fopen(path, "r");
+    if (f == NULL) return -errno;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%31s %15s %llu %llu %llu %lf %lf %lf %lf %lf %lf %lf %lf %lf", op, cid,
+                   &count, &errors, &bytes, &mean, &p50, &p90, &p99, &p999, &max, &ioctl,
+                   &resolve, &io) != 14)
+            continue;
+        if (!strncmp(op, "ioctl_", 6) || !our_cid(cid, containers)) continue;
+        t->requests += count;
+        t->total_ns += count * mean * 1000;
+        t->ioctl_ns += count * ioctl * 1000;
+        t->resolve_ns += count * resolve * 1000;
+        t->io_ns += count * io * 1000;
+    }
+    fclose(f);
+
+    return 0;
+}
+
+static void report_phase(struct bench_report *report, struct worker *workers, int phase,
+                         int containers, double seconds, const struct daemon_totals *before,
+                         const struct daemon_totals *after)
+{
+    struct bench_hist *lat = calloc(1, sizeof(*lat));
+    uint64_t errors = 0, requests;
+    double fullpath, backing;
+    char num[16][32];
+    const char *values[16];
+    int i, n = 0;
+
+    if (lat == NULL) return;
+
+    for (i = 0; i < nworkers; i++) {
+        bench_hist_merge(lat, &workers[i].lat[phase]);
+        errors += workers[i].errors[phase];
+    }
+
+    values[n++] = phase_names[phase];
+    values[n++] = bench_report_num(num[0], 32, containers);
+    values[n++] = bench_report_num(num[1], 32, files);
+    values[n++] = bench_report_num(num[2], 32, leaves);
+    values[n++] = bench_report_num(num[3], 32, lat->count);
+    values[n++] = bench_report_num(num[4], 32, errors);
+    values[n++] = bench_report_num(num[5], 32, lat->count / seconds);
+    values[n++] = bench_report_num(num[6], 32, bench_hist_quantile(lat, 0.50));
+    values[n++] = bench_report_num(num[7], 32, bench_hist_quantile(lat, 0.99));
+    values[n++] = bench_report_num(num[8], 32, lat->max_ns / 1000.0);
+
+    requests = after->requests - before->requests;
+    if (opt_mount && requests) {
+        fullpath = (after->ioctl_ns - before->ioctl_ns) + (after->resolve_ns - before->resolve_ns);
+        backing = after->io_ns - before->io_ns;
+        values[n++] = bench_report_num(num[9], 32, requests);
+        values[n++] = bench_report_num(num[10], 32, (after->total_ns - before->total_ns) / 1000 / requests);
+        values[n++] = bench_report_num(num[11], 32, (after->ioctl_ns - before->ioctl_ns) / 1000 / requests);
+        values[n++] = bench_report_num(num[12], 32, (after->resolve_ns - before->resolve_ns) / 1000 / requests);
+        values[n++] = bench_report_num(num[13], 32, backing / 1000 / requests);
+        values[n++] = bench_report_num(num[14], 32,
+                                       (fullpath + backing > 0) ? 100 * fullpath / (fullpath + backing) : 0);
+    } else {
+        for (i = 0; i < 6; i++) values[n++] = "-";
+    }
+
+    bench_report_row(report, values);
+    free(lat);
+}
+
+// One run with the given number of containers and files per directory
+static int run(struct bench_report *report, int containers)
+{
+    struct worker *workers;
+    struct daemon_totals before, after;
+    uint64_t start;
+    double seconds;
+    int i, phase, failed = 0;
+
+    nworkers = containers * opt_workers;
+    workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL) return -ENOMEM;
+    pthread_barrier_init(&phase_barrier, NULL, nworkers + 1);
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].container = i / opt_workers;
+        workers[i].index = i % opt_workers;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    fprintf(stderr, "fcmeta: %d containers x %d workers, %d directories of %d files\n", containers,
+            opt_workers, leaves, files);
+
+    for (phase = 0; phase < PH_MAX; phase++) {
+        if (opt_mount && (read_fcstats(&before, containers) != 0)) {
+            perror("fcmeta: .fcstats");
+            opt_mount = NULL;
+        }
+        pthread_barrier_wait(&phase_barrier);
+        start = bench_now();
+        pthread_barrier_wait(&phase_barrier);
+        seconds = (bench_now() - start) / 1e9;
+        if (opt_mount && (read_fcstats(&after, containers) != 0)) opt_mount = NULL;
+        if (!opt_mount) {
+            memset(&before, 0, sizeof(before));
+            memset(&after, 0, sizeof(after));
+        }
+
+        report_phase(report, workers, phase, containers, seconds, &before, &after);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].failed) {
+            fprintf(stderr, "fcmeta: container %d worker %d: %s\n", workers[i].container,
+                    workers[i].index, strerror(workers[i].failed));
+            failed = 1;
+        }
+    }
+    pthread_barrier_destroy(&phase_barrier);
+    free(workers);
+
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *columns[] = {
+        "phase", "containers", "files_per_dir", "dirs", "ops", "errors", "ops_per_sec", "p50_us",
+        "p99_us", "max_us", "fuse_requests", "daemon_us", "ioctl_us", "resolve_us", "backing_us",
+        "fullpath_pct"
+    };
+    struct bench_report report;
+    int opt, i, c, f, failed = 0;
+
+    while ((opt = getopt(argc, argv, "c:n:w:C:d:l:m:No:")) != -1) {
+        switch (opt) {
+        case 'c':
+            if ((opt_ncontainers = bench_parse_list(optarg, opt_containers, MAX_STEPS)) < 0) usage();
+            break;
+        case 'n':
+            if ((opt_nfiles = bench_parse_list(optarg, opt_files, MAX_STEPS)) < 0) usage();
+            break;
+        case 'w': opt_workers = atoi(optarg); break;
+        case 'C': opt_base_cid = atoi(optarg); break;
+        case 'd': opt_fanout = atoi(optarg); break;
+        case 'l': opt_levels = atoi(optarg); break;
+        case 'm': opt_mount = optarg; break;
+        case 'N': opt_no_container = 1; break;
+        case 'o': if (bench_parse_format(optarg, &opt_format) != 0) usage(); break;
+        default: usage();
+        }
+    }
+    if ((optind != argc - 1) || (opt_workers < 1) || (opt_fanout < 1) || (opt_levels < 1))
+        usage();
+    opt_dir = argv[optind];
+
+    for (leaves = 1, i = 0; i < opt_levels; i++) {
+        if (leaves > (1 << 20) / opt_fanout) usage();
+        leaves *= opt_fanout;
+    }
+
+    if (!opt_no_container) {
+        devfd = open("/dev/fcontainer", O_RDWR);
+        if (devfd < 0) {
+            perror("/dev/fcontainer");
+            return 1;
+        }
+    }
+
+    if ((errno = -make_tree(0)) != 0) {
+        perror("fcmeta: mkdir");
+        return 1;
+    }
+
+    bench_report_begin(&report, stdout, opt_format, columns, sizeof(columns) / sizeof(columns[0]));
+    for (c = 0; c < opt_ncontainers; c++) {
+        for (f = 0; f < opt_nfiles; f++) {
+            files = opt_files[f];
+            failed |= run(&report, opt_containers[c]);
+        }
+    }
+    bench_report_end(&report);
+
+    make_tree(1);
+
+    return failed;
+}
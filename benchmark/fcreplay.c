@@ -0,0 +1,649 @@
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Replays a capture taken with fcfuse -o capture=FILE against a
+//     mounted fcfuse.  The requests of each thread and container of
+//     the capture are issued again by a thread of their own, which
+//     joins the same container, at the original pace, a multiple of
+//     it or as fast as possible.  With -n the whole capture runs in
+//     several copies at once, each in containers of its own.
+//
+//     Requests that had no call of their own are left out: flush,
+//     readdir and releasedir (opendir lists the whole directory),
+//     fsyncdir and the xattr calls, whose names weren't captured.
+//     Reports per operation how many were issued, how many ended
+//     differently from the capture (failed where it succeeded or the
+//     other way round), the rate and the latency, next to the mean
+//     the capture saw.
+//
+////////////////////////////////////////////////////////////////////////
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fcontainer.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+
+#include "bench.h"
+
+#define CAPTURE_MAGIC "# fcfuse capture 1"
+
+enum rop {
+    R_GETATTR,
+    R_FGETATTR,
+    R_READLINK,
+    R_MKNOD,
+    R_MKDIR,
+    R_UNLINK,
+    R_RMDIR,
+    R_SYMLINK,
+    R_RENAME,
+    R_LINK,
+    R_CHMOD,
+    R_CHOWN,
+    R_TRUNCATE,
+    R_FTRUNCATE,
+    R_UTIMENS,
+    R_OPEN,
+    R_READ,
+    R_WRITE,
+    R_COPY_FILE_RANGE,
+    R_LSEEK,
+    R_STATFS,
+    R_RELEASE,
+    R_FSYNC,
+    R_OPENDIR,
+    R_ACCESS,
+    R_MAX
+};
+
+// as fcfuse_op_name() has them
+static const char *rop_names[R_MAX] = {
+    [R_GETATTR] = "getattr",
+    [R_FGETATTR] = "fgetattr",
+    [R_READLINK] = "readlink",
+    [R_MKNOD] = "mknod",
+    [R_MKDIR] = "mkdir",
+    [R_UNLINK] = "unlink",
+    [R_RMDIR] = "rmdir",
+    [R_SYMLINK] = "symlink",
+    [R_RENAME] = "rename",
+    [R_LINK] = "link",
+    [R_CHMOD] = "chmod",
+    [R_CHOWN] = "chown",
+    [R_TRUNCATE] = "truncate",
+    [R_FTRUNCATE] = "ftruncate",
+    [R_UTIMENS] = "utimens",
+    [R_OPEN] = "open",
+    [R_READ] = "read",
+    [R_WRITE] = "write",
+    [R_COPY_FILE_RANGE] = "copy_file_range",
+    [R_LSEEK] = "lseek",
+    [R_STATFS] = "statfs",
+    [R_RELEASE] = "release",
+    [R_FSYNC] = "fsync",
+    [R_OPENDIR] = "opendir",
+    [R_ACCESS] = "access",
+};
+
+struct record {
+    uint64_t start;                 // ns since the capture began
+    uint64_t duration;
+    enum rop op;
+    long result;
+    int64_t off;
+    uint64_t size;
+    uint64_t arg;
+    char *path;                     // NULL where the capture has -
+    char *path2;
+};
+
+// The requests of one thread in one container
+struct stream {
+    int pid;
+    int cid;
+    struct record *recs;
+    size_t count, cap;
+    uint64_t max_size;              // largest read, write or readlink
+};
+
+struct open_file {
+    const char *path;
+    int fd;
+};
+
+struct op_stats {
+    uint64_t diverged;
+    uint64_t captured_ns;
+    struct bench_hist lat;
+};
+
+struct replayer {
+    struct stream *stream;
+    int cid;                        // the stream's, in this copy
+    pthread_t thread;
+    struct open_file *files;
+    int nfiles, files_cap;
+    struct op_stats *stats[R_MAX];  // allocated when first used
+    struct bench_hist lag;
+    int failed;
+};
+
+static const char *opt_mount;
+static int opt_fast;
+static double opt_speed = 1;
+static int opt_copies = 1;
+static int opt_stride = 1000;
+static int opt_no_container;
+static enum bench_format opt_format = BENCH_CSV;
+
+static int devfd = -1;
+static struct stream *streams;
+static int nstreams;
+static uint64_t nrecords, skipped, span_ns;
+static uint64_t replay_start;
+static pthread_barrier_t ready;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: fcreplay [options] CAPTURE MOUNT\n"
+            "  replays CAPTURE, from fcfuse -o capture=FILE, against the fcfuse at MOUNT\n"
+            "  -f        as fast as possible, not at the captured pace\n"
+            "  -S X      X times the captured pace (1)\n"
+            "  -n N      N copies at once (1)\n"
+            "  -s N      copy k replays cid C as C + k * N (1000)\n"
+            "  -N        don't join containers\n"
+            "  -o FMT    csv or json (csv)\n");
+    exit(1);
+}
+
+static pid_t gettid_(void)
+{
+    return syscall(SYS_gettid);
+}
+
+static int unhex(int c)
+{
+    if ((c >= '0') && (c <= '9')) return c - '0';
+    if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+    return -1;
+}
+
+// Undo the %XX escaping in place, NULL for -
+static char *unescape(char *s)
+{
+    char *r = s, *w = s;
+
+    if (!strcmp(s, "-")) return NULL;
+    for (; *r; r++) {
+        if ((r[0] == '%') && (unhex(r[1]) >= 0) && (unhex(r[2]) >= 0)) {
+            *w++ = unhex(r[1]) << 4 | unhex(r[2]);
+            r += 2;
+        } else {
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+
+    return s;
+}
+
+static struct stream *find_stream(int pid, int cid)
+{
+    static struct stream *last;
+    int i;
+
+    if (last && (last->pid == pid) && (last->cid == cid)) return last;
+    for (i = 0; i < nstreams; i++) {
+        if ((streams[i].pid == pid) && (streams[i].cid == cid)) return last = &streams[i];
+    }
+
+    if ((nstreams & (nstreams - 1)) == 0) {
+        struct stream *more = realloc(streams, (nstreams ? 2 * nstreams : 16) * sizeof(*streams));
+        if (more == NULL) return NULL;
+        streams = more;
+    }
+    last = &streams[nstreams++];
+    memset(last, 0, sizeof(*last));
+    last->pid = pid;
+    last->cid = cid;
+
+    return last;
+}
+
+static int load(const char *file)
+{
+    char *line = NULL, name[64], *rest, *save, *path, *path2;
+    unsigned long long start, duration, size, arg;
+    size_t cap = 0;
+    long long off;
+    long result;
+    int pid, cid, n, op, lineno = 0, ret = 0;
+    struct stream *s;
+    struct record *r;
+    FILE *in;
+
+    in = strcmp(file, "-") ? fopen(file, "r") : stdin;
+    if (in == NULL) return -errno;
+
+    // escaping makes a path up to several times as long, so lines are
+    // read whole whatever their length
+    while (getline(&line, &cap, in) != -1) {
+        lineno++;
+        if ((lineno == 1) && strncmp(line, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))) {
+            fprintf(stderr, "fcreplay: %s: not an fcfuse capture\n", file);
+            ret = -EINVAL;
+            break;
+        }
+        if (line[0] == '#') continue;
+
+        if (sscanf(line, "%llu %llu %d %d %63s %ld %lld %llu %llu %n", &start, &duration, &pid, &cid, name,
+                   &result, &off, &size, &arg, &n) < 9) {
+            fprintf(stderr, "fcreplay: %s:%d: bad line\n", file, lineno);
+            continue;
+        }
+        rest = line + n;
+        path = strtok_r(rest, " \n", &save);
+        path2 = strtok_r(NULL, " \n", &save);
+        if ((path == NULL) || (path2 == NULL)) {
+            fprintf(stderr, "fcreplay: %s:%d: bad line\n", file, lineno);
+            continue;
+        }
+        if (start + duration > span_ns) span_ns = start + duration;
+
+        for (op = 0; (op < R_MAX) && strcmp(name, rop_names[op]); op++) continue;
+        if (op == R_MAX) {
+            skipped++;
+            continue;
+        }
+
+        s = find_stream(pid, cid);
+        if (s == NULL) {
+            ret = -ENOMEM;
+            break;
+        }
+        if (s->count == s->cap) {
+            struct record *more = realloc(s->recs, (s->cap ? 2 * s->cap : 64) * sizeof(*more));
+            if (more == NULL) {
+                ret = -ENOMEM;
+                break;
+            }
+            s->recs = more;
+            s->cap = s->cap ? 2 * s->cap : 64;
+        }
+        r = &s->recs[s->count++];
+        r->start = start;
+        r->duration = duration;
+        r->op = op;
+        r->result = result;
+        r->off = off;
+        r->size = size;
+        r->arg = arg;
+        r->path = unescape(path) ? strdup(path) : NULL;
+        r->path2 = unescape(path2) ? strdup(path2) : NULL;
+        if (((op == R_READ) || (op == R_WRITE)) && (size > s->max_size)) s->max_size = size;
+        nrecords++;
+    }
+    free(line);
+    if (in != stdin) fclose(in);
+
+    return ret;
+}
+
+// The fd this stream opened path on last, or one of our own
+static int file_fd(struct replayer *r, const char *path)
+{
+    char full[PATH_MAX + 4096];
+    int i, fd;
+
+    for (i = r->nfiles - 1; i >= 0; i--)
+        if (!strcmp(r->files[i].path, path)) return r->files[i].fd;
+
+    // opened before the capture began
+    snprintf(full, sizeof(full), "%s%s", opt_mount, path);
+    fd = open(full, O_RDWR);
+    if ((fd < 0) && (errno == EISDIR)) fd = open(full, O_RDONLY);
+    if (fd < 0) return -errno;
+
+    if (r->nfiles == r->files_cap) {
+        struct open_file *more = realloc(r->files, (r->files_cap ? 2 * r->files_cap : 16) * sizeof(*more));
+        if (more == NULL) {
+            close(fd);
+            return -ENOMEM;
+        }
+        r->files = more;
+        r->files_cap = r->files_cap ? 2 * r->files_cap : 16;
+    }
+    r->files[r->nfiles].path = path;
+    r->files[r->nfiles++].fd = fd;
+
+    return fd;
+}
+
+static long list_dir(const char *path)
+{
+    DIR *dir = opendir(path);
+
+    if (dir == NULL) return -errno;
+    while (readdir(dir)) continue;
+    closedir(dir);
+
+    return 0;
+}
+
+#define SYS(call) (((call) < 0) ? -errno : 0)
+
+// Issue one request again, returns its result or -errno
+static long issue(struct replayer *r, const struct record *rec, char *buf)
+{
+    char p1[PATH_MAX + 4096], p2[PATH_MAX + 4096];
+    struct statvfs stv;
+    struct stat st;
+    loff_t off_in, off_out;
+    ssize_t n;
+    int fd, i;
+
+    if (rec->path == NULL) return -EBADF;
+    snprintf(p1, sizeof(p1), "%s%s", opt_mount, rec->path);
+    snprintf(p2, sizeof(p2), "%s%s", opt_mount, rec->path2 ? rec->path2 : "");
+
+    switch (rec->op) {
+    case R_GETATTR:
+        return SYS(lstat(p1, &st));
+    case R_READLINK:
+        n = readlink(p1, buf, PATH_MAX);
+        return (n < 0) ? -errno : 0;
+    case R_MKNOD:
+        return SYS(mknod(p1, rec->arg, 0));
+    case R_MKDIR:
+        return SYS(mkdir(p1, rec->arg));
+    case R_UNLINK:
+        return SYS(unlink(p1));
+    case R_RMDIR:
+        return SYS(rmdir(p1));
+    case R_SYMLINK:
+        // path is what the link holds, not a path in the mount
+        return SYS(symlink(rec->path, p2));
+    case R_RENAME:
+        if (rec->arg) return SYS(syscall(SYS_renameat2, AT_FDCWD, p1, AT_FDCWD, p2, (unsigned int) rec->arg));
+        return SYS(rename(p1, p2));
+    case R_LINK:
+        return SYS(link(p1, p2));
+    case R_CHMOD:
+        return SYS(chmod(p1, rec->arg));
+    case R_CHOWN:
+        return SYS(lchown(p1, rec->arg, rec->size));
+    case R_TRUNCATE:
+        return SYS(truncate(p1, rec->off));
+    case R_UTIMENS:
+        return SYS(utimensat(AT_FDCWD, p1, NULL, AT_SYMLINK_NOFOLLOW));
+    case R_STATFS:
+        return SYS(statvfs(p1, &stv));
+    case R_OPENDIR:
+        return list_dir(p1);
+    case R_ACCESS:
+        return SYS(access(p1, rec->arg));
+    case R_OPEN:
+        // O_CREAT never reaches open, fcfuse creates with mknod first
+        fd = open(p1, rec->arg & ~(O_CREAT | O_EXCL));
+        if (fd < 0) return -errno;
+        if (r->nfiles == r->files_cap) {
+            struct open_file *more = realloc(r->files, (r->files_cap ? 2 * r->files_cap : 16) * sizeof(*more));
+            if (more == NULL) {
+                close(fd);
+                return -ENOMEM;
+            }
+            r->files = more;
+            r->files_cap = r->files_cap ? 2 * r->files_cap : 16;
+        }
+        r->files[r->nfiles].path = rec->path;
+        r->files[r->nfiles++].fd = fd;
+        return 0;
+    case R_RELEASE:
+        for (i = r->nfiles - 1; i >= 0; i--) {
+            if (!strcmp(r->files[i].path, rec->path)) {
+                close(r->files[i].fd);
+                r->files[i] = r->files[--r->nfiles];
+                return 0;
+            }
+        }
+        return 0;
+    default:
+        break;
+    }
+
+    // the rest work on an open file
+    fd = file_fd(r, rec->path);
+    if (fd < 0) return fd;
+
+    switch (rec->op) {
+    case R_FGETATTR:
+        return SYS(fstat(fd, &st));
+    case R_FTRUNCATE:
+        return SYS(ftruncate(fd, rec->off));
+    case R_READ:
+        n = pread(fd, buf, rec->size, rec->off);
+        return (n < 0) ? -errno : n;
+    case R_WRITE:
+        n = pwrite(fd, buf, rec->size, rec->off);
+        return (n < 0) ? -errno : n;
+    case R_COPY_FILE_RANGE:
+        if (rec->path2 == NULL) return -EBADF;
+        i = file_fd(r, rec->path2);
+        if (i < 0) return i;
+        off_in = rec->off;
+        off_out = rec->arg;
+        n = copy_file_range(fd, &off_in, i, &off_out, rec->size, 0);
+        return (n < 0) ? -errno : n;
+    case R_LSEEK:
+        return (lseek(fd, rec->off, rec->arg) < 0) ? -errno : 0;
+    case R_FSYNC:
+        return SYS(rec->arg ? fdatasync(fd) : fsync(fd));
+    default:
+        return -ENOSYS;
+    }
+}
+
+// fcfuse takes the calling thread out of its container as it serves
+// reads and writes, so check before every request
+static void join(struct replayer *r, pid_t me)
+{
+    if (opt_no_container || (r->cid < 0)) return;
+    if (fcontainer_getcid(devfd, me) == r->cid) return;
+    if (fcontainer_create(devfd, r->cid) != 0) r->failed = errno;
+}
+
+static void *replayer_main(void *arg)
+{
+    struct replayer *r = arg;
+    struct stream *s = r->stream;
+    const struct record *rec;
+    struct timespec ts;
+    uint64_t due, start, ns;
+    pid_t me = gettid_();
+    char *buf = NULL;
+    size_t i;
+    long res;
+    int op;
+
+    if (posix_memalign((void **) &buf, 4096, (s->max_size > PATH_MAX) ? s->max_size : PATH_MAX) != 0) {
+        r->failed = ENOMEM;
+        buf = NULL;
+    } else {
+        memset(buf, 'r', (s->max_size > PATH_MAX) ? s->max_size : PATH_MAX);
+    }
+    for (op = 0; !r->failed && (op < R_MAX); op++) {
+        // only what the stream has
+        for (i = 0; (i < s->count) && (s->recs[i].op != (enum rop) op); i++) continue;
+        if ((i < s->count) && ((r->stats[op] = calloc(1, sizeof(struct op_stats))) == NULL)) r->failed = ENOMEM;
+    }
+    pthread_barrier_wait(&ready);
+
+    for (i = 0; !r->failed && (i < s->count); i++) {
+        rec = &s->recs[i];
+        if (!opt_fast) {
+            due = replay_start + rec->start / opt_speed;
+            ts.tv_sec = due / 1000000000ull;
+            ts.tv_nsec = due % 1000000000ull;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) continue;
+            ns = bench_now();
+            bench_hist_add(&r->lag, (ns > due) ? ns - due : 0);
+        }
+        join(r, me);
+
+        start = bench_now();
+        res = issue(r, rec, buf);
+        ns = bench_now() - start;
+
+        bench_hist_add(&r->stats[rec->op]->lat, ns);
+        r->stats[rec->op]->captured_ns += rec->duration;
+        if ((res < 0) != (rec->result < 0)) r->stats[rec->op]->diverged++;
+    }
+
+    while (r->nfiles) close(r->files[--r->nfiles].fd);
+    if (!opt_no_container && (r->cid >= 0) && (fcontainer_getcid(devfd, me) == r->cid)) fcontainer_delete(devfd);
+    free(buf);
+
+    return NULL;
+}
+
+static void report_row(struct bench_report *report, const char *name, struct op_stats *st, double seconds)
+{
+    const struct bench_hist *lat = &st->lat;
+    char num[8][32];
+    const char *values[9];
+    int n = 0;
+
+    values[n++] = name;
+    values[n++] = bench_report_num(num[0], 32, lat->count);
+    values[n++] = bench_report_num(num[1], 32, st->diverged);
+    values[n++] = bench_report_num(num[2], 32, lat->count / seconds);
+    values[n++] = bench_report_num(num[3], 32, lat->count ? lat->sum_ns / 1e3 / lat->count : 0);
+    values[n++] = bench_report_num(num[4], 32, bench_hist_quantile(lat, 0.50));
+    values[n++] = bench_report_num(num[5], 32, bench_hist_quantile(lat, 0.99));
+    values[n++] = bench_report_num(num[6], 32, lat->max_ns / 1e3);
+    values[n++] = bench_report_num(num[7], 32, lat->count ? st->captured_ns / 1e3 / lat->count : 0);
+
+    bench_report_row(report, values);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *columns[] = {
+        "op", "count", "diverged", "ops_per_sec", "mean_us", "p50_us", "p99_us", "max_us",
+        "captured_mean_us"
+    };
+    struct bench_report report;
+    struct replayer *replayers;
+    struct op_stats *sum, *all;
+    struct bench_hist *lag;
+    double seconds;
+    int opt, i, nreplayers, op, failed = 0;
+
+    while ((opt = getopt(argc, argv, "fS:n:s:No:")) != -1) {
+        switch (opt) {
+        case 'f': opt_fast = 1; break;
+        case 'S': opt_speed = atof(optarg); break;
+        case 'n': opt_copies = atoi(optarg); break;
+        case 's': opt_stride = atoi(optarg); break;
+        case 'N': opt_no_container = 1; break;
+        case 'o': if (bench_parse_format(optarg, &opt_format) != 0) usage(); break;
+        default: usage();
+        }
+    }
+    if ((argc - optind != 2) || (opt_speed <= 0) || (opt_copies <= 0)) usage();
+    opt_mount = argv[optind + 1];
+
+    i = load(argv[optind]);
+    if (i != 0) {
+        fprintf(stderr, "fcreplay: %s: %s\n", argv[optind], strerror(-i));
+        return 1;
+    }
+    if (!opt_no_container) {
+        devfd = open("/dev/fcontainer", O_RDWR);
+        if (devfd < 0) {
+            perror("/dev/fcontainer");
+            return 1;
+        }
+    }
+
+    nreplayers = nstreams * opt_copies;
+    replayers = calloc(nreplayers ? nreplayers : 1, sizeof(*replayers));
+    sum = calloc(R_MAX + 1, sizeof(*sum));
+    lag = calloc(1, sizeof(*lag));
+    if ((replayers == NULL) || (sum == NULL) || (lag == NULL)) return 1;
+    all = &sum[R_MAX];
+
+    fprintf(stderr, "fcreplay: %llu requests in %d streams, %llu skipped, %d copies\n",
+            (unsigned long long) nrecords, nstreams, (unsigned long long) skipped, opt_copies);
+
+    pthread_barrier_init(&ready, NULL, nreplayers + 1);
+    for (i = 0; i < nreplayers; i++) {
+        replayers[i].stream = &streams[i % nstreams];
+        replayers[i].cid = replayers[i].stream->cid;
+        if (replayers[i].cid >= 0) replayers[i].cid += (i / nstreams) * opt_stride;
+        if (pthread_create(&replayers[i].thread, NULL, replayer_main, &replayers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    // give the threads a moment to line up before the first request is due
+    replay_start = bench_now() + (opt_fast ? 0 : 10000000);
+    pthread_barrier_wait(&ready);
+    for (i = 0; i < nreplayers; i++) pthread_join(replayers[i].thread, NULL);
+    seconds = (bench_now() - replay_start) / 1e9;
+    if (seconds <= 0) seconds = 1e-9;
+
+    for (i = 0; i < nreplayers; i++) {
+        if (replayers[i].failed) {
+            fprintf(stderr, "fcreplay: pid %d cid %d: %s\n", replayers[i].stream->pid, replayers[i].cid,
+                    strerror(replayers[i].failed));
+            failed = 1;
+        }
+        bench_hist_merge(lag, &replayers[i].lag);
+        for (op = 0; op < R_MAX; op++) {
+            if (replayers[i].stats[op] == NULL) continue;
+            bench_hist_merge(&sum[op].lat, &replayers[i].stats[op]->lat);
+            sum[op].diverged += replayers[i].stats[op]->diverged;
+            sum[op].captured_ns += replayers[i].stats[op]->captured_ns;
+            free(replayers[i].stats[op]);
+        }
+    }
+
+    bench_report_begin(&report, stdout, opt_format, columns, sizeof(columns) / sizeof(columns[0]));
+    for (op = 0; op < R_MAX; op++) {
+        if (sum[op].lat.count == 0) continue;
+        bench_hist_merge(&all->lat, &sum[op].lat);
+        all->diverged += sum[op].diverged;
+        all->captured_ns += sum[op].captured_ns;
+        report_row(&report, rop_names[op], &sum[op], seconds);
+    }
+    report_row(&report, "all", all, seconds);
+    bench_report_end(&report);
+
+    fprintf(stderr, "fcreplay: %.3f s, captured %.3f s", seconds, span_ns / 1e9);
+    if (!opt_fast)
+        fprintf(stderr, ", late by p50 %.1f us, p99 %.1f us, max %.1f us", bench_hist_quantile(lag, 0.50),
+                bench_hist_quantile(lag, 0.99), lag->max_ns / 1e3);
+    fprintf(stderr, "\n");
+
+    return failed;
+}
@@ -0,0 +1,351 @@
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Fast validate: compares a file in a container with a reference,
+//     by default stdin as validate does.  A regular reference file is
+//     split into chunks that worker threads read into large buffers
+//     (or map, with -m) and compare 32 or 16 bytes at a time with
+//     AVX2 or SSE2.  A piped reference is streamed through one thread.
+//     Prints the first mismatching offset, or Pass, and the GB/s
+//     reached.  Exits 0 on a match, 1 on a mismatch, 2 on errors.
+//
+////////////////////////////////////////////////////////////////////////
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <fcontainer.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "bench.h"
+
+static int opt_cid = -1;
+static int opt_threads;
+static uint64_t opt_chunk = 8 << 20;
+static int opt_mmap;
+
+static int file_fd, ref_fd;
+static const unsigned char *file_map, *ref_map;
+static uint64_t total;                      // bytes both have
+static uint64_t nchunks;
+static uint64_t next_chunk;
+static uint64_t first_bad = UINT64_MAX;     // lowest mismatching offset so far
+static int io_error;
+
+// First offset in [0, n) where a and b differ, n if they don't
+static size_t (*compare)(const unsigned char *a, const unsigned char *b, size_t n);
+
+static size_t compare_words(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    uint64_t x, y;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) break;
+    }
+    for (; i < n; i++)
+        if (a[i] != b[i]) return i;
+
+    return n;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t compare_sse2(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    unsigned int mask;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)),
+                                                _mm_loadu_si128((const __m128i *) (b + i))));
+        if (mask != 0xffff) return i + __builtin_ctz(~mask);
+    }
+
+    return i + compare_words(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t compare_avx2(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    uint64_t mask;
+    size_t i;
+
+    // two vectors a round, one test
+    for (i = 0; i + 64 <= n; i += 64) {
+        mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                   _mm256_loadu_si256((const __m256i *) (a + i)),
+                   _mm256_loadu_si256((const __m256i *) (b + i))));
+        mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                   _mm256_loadu_si256((const __m256i *) (a + i + 32)),
+                   _mm256_loadu_si256((const __m256i *) (b + i + 32)))) << 32;
+        if (mask != UINT64_MAX) return i + __builtin_ctzll(~mask);
+    }
+
+    return i + compare_sse2(a + i, b + i, n - i);
+}
+#endif
+
+static const char *pick_compare(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        compare = compare_avx2;
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        compare = compare_sse2;
+        return "sse2";
+    }
+#endif
+    compare = compare_words;
+
+    return "words";
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: fcvalidate [options] FILE [REFERENCE]\n"
+            "  compares FILE with REFERENCE, stdin if there is none or it is -\n"
+            "  -C CID    open FILE in container CID\n"
+            "  -j N      threads (online CPUs)\n"
+            "  -b SIZE   chunk size (8m)\n"
+            "  -m        map both files instead of reading them\n");
+    exit(2);
+}
+
+// Read n bytes at off, all of them unless the file ends.  Returns the
+// count or -errno.
+static ssize_t read_full(int fd, unsigned char *buf, size_t n, off_t off)
+{
+    size_t done = 0;
+    ssize_t r;
+
+    while (done < n) {
+        r = (off < 0) ? read(fd, buf + done, n - done) : pread(fd, buf + done, n - done, off + done);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (r == 0) break;
+        done += r;
+    }
+
+    return done;
+}
+
+static void note_mismatch(uint64_t off)
+{
+    uint64_t seen = __atomic_load_n(&first_bad, __ATOMIC_RELAXED);
+
+    while ((off < seen) &&
+           !__atomic_compare_exchange_n(&first_bad, &seen, off, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        continue;
+}
+
+static void *worker_main(void *arg)
+{
+    unsigned char *a = NULL, *b = NULL;
+    uint64_t chunk, off, len;
+    ssize_t ra, rb;
+    size_t diff;
+
+    (void) arg;
+
+    if (!opt_mmap && ((posix_memalign((void **) &a, 4096, opt_chunk) != 0) ||
+                      (posix_memalign((void **) &b, 4096, opt_chunk) != 0))) {
+        __atomic_store_n(&io_error, ENOMEM, __ATOMIC_RELAXED);
+        free(a);
+        return NULL;
+    }
+
+    while ((chunk = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < nchunks) {
+        off = chunk * opt_chunk;
+        // nothing past a mismatch already found matters
+        if ((off >= __atomic_load_n(&first_bad, __ATOMIC_RELAXED)) ||
+            __atomic_load_n(&io_error, __ATOMIC_RELAXED))
+            break;
+        len = (total - off < opt_chunk) ? total - off : opt_chunk;
+
+        if (opt_mmap) {
+            diff = compare(file_map + off, ref_map + off, len);
+        } else {
+            ra = read_full(file_fd, a, len, off);
+            rb = read_full(ref_fd, b, len, off);
+            if ((ra < 0) || (rb < 0)) {
+                __atomic_store_n(&io_error, (ra < 0) ? -ra : -rb, __ATOMIC_RELAXED);
+                break;
+            }
+            // a short read means the file shrank under us, a mismatch
+            diff = compare(a, b, (ra < rb) ? ra : rb);
+        }
+        if (diff < len) note_mismatch(off + diff);
+    }
+
+    free(a);
+    free(b);
+
+    return NULL;
+}
+
+// A piped reference can only be read in order, by one thread
+static int stream(void)
+{
+    unsigned char *a = NULL, *b = NULL;
+    uint64_t off = 0;
+    ssize_t ra, rb;
+    size_t diff;
+    int retstat = 0;
+
+    if ((posix_memalign((void **) &a, 4096, opt_chunk) != 0) ||
+        (posix_memalign((void **) &b, 4096, opt_chunk) != 0)) {
+        free(a);
+        return -ENOMEM;
+    }
+
+    for (;;) {
+        rb = read_full(ref_fd, b, opt_chunk, -1);
+        // at the end of the reference, one more byte of the file
+        // means it is longer
+        ra = (rb < 0) ? 0 : read_full(file_fd, a, rb ? rb : 1, off);
+        if ((rb < 0) || (ra < 0)) {
+            retstat = (rb < 0) ? rb : ra;
+            break;
+        }
+        diff = compare(a, b, (ra < rb) ? ra : rb);
+        if ((diff < (size_t) ((ra < rb) ? ra : rb)) || (ra != rb)) {
+            first_bad = off + diff;
+            break;
+        }
+        if (rb == 0) break;
+        off += rb;
+    }
+    total = off;
+    free(a);
+    free(b);
+
+    return retstat;
+}
+
+int main(int argc, char **argv)
+{
+    struct stat file_st, ref_st;
+    const char *ref_name, *how;
+    pthread_t *threads;
+    uint64_t start;
+    double seconds;
+    int opt, i, devfd, piped, retstat = 0;
+
+    while ((opt = getopt(argc, argv, "C:j:b:m")) != -1) {
+        switch (opt) {
+        case 'C': opt_cid = atoi(optarg); break;
+        case 'j': opt_threads = atoi(optarg); break;
+        case 'b': if ((bench_parse_size(optarg, &opt_chunk) != 0) || (opt_chunk == 0)) usage(); break;
+        case 'm': opt_mmap = 1; break;
+        default: usage();
+        }
+    }
+    if ((argc - optind < 1) || (argc - optind > 2)) usage();
+    ref_name = (argc - optind == 2) ? argv[optind + 1] : "-";
+    if (opt_threads <= 0) opt_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt_threads <= 0) opt_threads = 1;
+
+    // only the open has to happen in the container, fcfuse resolves
+    // the path then
+    if (opt_cid >= 0) {
+        devfd = open("/dev/fcontainer", O_RDWR);
+        if ((devfd < 0) || (fcontainer_create(devfd, opt_cid) != 0)) {
+            perror("fcvalidate: container");
+            return 2;
+        }
+    }
+    file_fd = open(argv[optind], O_RDONLY);
+    if (file_fd < 0) {
+        perror(argv[optind]);
+        return 2;
+    }
+    ref_fd = strcmp(ref_name, "-") ? open(ref_name, O_RDONLY) : 0;
+    if (ref_fd < 0) {
+        perror(ref_name);
+        return 2;
+    }
+    if ((fstat(file_fd, &file_st) != 0) || (fstat(ref_fd, &ref_st) != 0)) {
+        perror("fcvalidate: fstat");
+        return 2;
+    }
+    piped = !S_ISREG(ref_st.st_mode);
+    how = pick_compare();
+
+    start = bench_now();
+    if (piped) {
+        if (opt_mmap) fprintf(stderr, "fcvalidate: reference is not a file, reading it\n");
+        opt_threads = 1;
+        retstat = stream();
+    } else {
+        total = (file_st.st_size < ref_st.st_size) ? file_st.st_size : ref_st.st_size;
+        if (file_st.st_size != ref_st.st_size) first_bad = total;
+        nchunks = (total + opt_chunk - 1) / opt_chunk;
+
+        if (opt_mmap && total) {
+            file_map = mmap(NULL, total, PROT_READ, MAP_SHARED, file_fd, 0);
+            ref_map = mmap(NULL, total, PROT_READ, MAP_SHARED, ref_fd, 0);
+            if ((file_map == MAP_FAILED) || (ref_map == MAP_FAILED)) {
+                perror("fcvalidate: mmap");
+                return 2;
+            }
+            madvise((void *) file_map, total, MADV_SEQUENTIAL);
+            madvise((void *) ref_map, total, MADV_SEQUENTIAL);
+        }
+
+        threads = calloc(opt_threads, sizeof(*threads));
+        if (threads == NULL) return 2;
+        for (i = 0; i < opt_threads; i++) {
+            if (pthread_create(&threads[i], NULL, worker_main, NULL) != 0) {
+                perror("pthread_create");
+                return 2;
+            }
+        }
+        for (i = 0; i < opt_threads; i++) pthread_join(threads[i], NULL);
+        retstat = -io_error;
+    }
+    seconds = (bench_now() - start) / 1e9;
+
+    if (retstat < 0) {
+        fprintf(stderr, "fcvalidate: %s\n", strerror(-retstat));
+        return 2;
+    }
+
+    // bytes compared: all of them on a match, up to the mismatch otherwise
+    if (first_bad != UINT64_MAX) {
+        fprintf(stderr, "Failed at %llu%s\n", (unsigned long long) first_bad,
+                (!piped && first_bad == total) ? " (lengths differ)" : "");
+        total = first_bad;
+    } else {
+        fprintf(stderr, "Pass\n");
+    }
+    fprintf(stderr, "%llu bytes in %.3f s, %.2f GB/s, %d threads, %s%s\n", (unsigned long long) total,
+            seconds, total / seconds / 1e9, opt_threads, how, opt_mmap && !piped ? ", mapped" : "");
+
+    return (first_bad != UINT64_MAX) ? 1 : 0;
+}
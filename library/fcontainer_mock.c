@@ -0,0 +1,612 @@
+//////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     User space stand-in for /dev/fcontainer, loaded with LD_PRELOAD.
+//     Opening the device (FCONTAINER_MOCK_DEVICE, /dev/fcontainer by
+//     default) opens a shared state file instead (FCONTAINER_MOCK,
+//     /dev/shm/fcontainer-mock by default), and the CREATE, GETCID and
+//     DELETE ioctls on it are served from that file with the same
+//     semantics as kernel_module/src/ioctl.c.  Every process that
+//     preloads the library and uses the same state file sees the same
+//     containers, so fcfuse and the programs using it need neither
+//     the module nor root.  Each of them holds a shared flock on the
+//     file while it lives, and the last one to exit removes it, so a
+//     new run starts without containers.  Descriptors of the device
+//     made with dup(), dup2(), dup3() or fcntl(F_DUPFD) are the device
+//     too.
+//
+//     FCONTAINER_MOCK_LATENCY adds a busy wait to every ioctl, in
+//     microseconds: "5" for all of them or "getcid=2,create=20,delete=10".
+//     CREATE and DELETE wait with the lock held, as the module does
+//     its work under its mutex; GETCID waits without it.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <file_container/file_container.h>
+
+#define MOCK_MAGIC 0x31306b636f6d6366ull       // "fcmock01"
+#define MOCK_CONTAINERS 1024
+#define MOCK_TASKS 16384
+#define MOCK_FDS 1024
+
+struct mock_container {
+    int used;
+    int cid;
+    uint64_t order;         // place in the module's container queue
+};
+
+struct mock_task {
+    int container;          // index into containers, -1 if the slot is free
+    int tid;
+    int tgid;
+    uint64_t seq;           // place in the container's task queue
+};
+
+struct mock_state {
+    uint64_t magic;
+    pthread_mutex_t lock;
+    uint64_t next_seq;
+    int containers_used;    // no container at or past this index is used
+    int tasks_used;         // nor any task
+    struct mock_container containers[MOCK_CONTAINERS];
+    struct mock_task tasks[MOCK_TASKS];
+};
+
+enum { LAT_CREATE, LAT_GETCID, LAT_DELETE, LAT_MAX };
+
+static struct mock_state *state;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t latency_ns[LAT_MAX];
+static unsigned char mock_fds[MOCK_FDS];        // fds that are the device
+static dev_t state_dev;
+static ino_t state_ino;
+static int state_fd = -1;       // holds our shared flock on the file
+static pid_t state_pid;         // the process that holds it
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static int (*real_dup)(int);
+static int (*real_dup2)(int, int);
+static int (*real_dup3)(int, int, int);
+static int (*real_fcntl)(int, int, ...);
+static int (*real_fcntl64)(int, int, ...);
+
+static const char *mock_device(void)
+{
+    const char *device = getenv("FCONTAINER_MOCK_DEVICE");
+
+    return device ? device : "/dev/fcontainer";
+}
+
+static const char *mock_file(void)
+{
+    const char *file = getenv("FCONTAINER_MOCK");
+
+    return file ? file : "/dev/shm/fcontainer-mock";
+}
+
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+
+static void resolve(void)
+{
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_open64 = dlsym(RTLD_NEXT, "open64");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    real_dup = dlsym(RTLD_NEXT, "dup");
+    real_dup2 = dlsym(RTLD_NEXT, "dup2");
+    real_dup3 = dlsym(RTLD_NEXT, "dup3");
+    real_fcntl = dlsym(RTLD_NEXT, "fcntl");
+    // glibc 2.28 and later only
+    real_fcntl64 = dlsym(RTLD_NEXT, "fcntl64");
+}
+
+static inline void mock_resolve(void)
+{
+    pthread_once(&resolve_once, resolve);
+}
+
+// FCONTAINER_MOCK_LATENCY, see the top of the file
+static void parse_latency(void)
+{
+    static const char *names[LAT_MAX] = { "create", "getcid", "delete" };
+    const char *p = getenv("FCONTAINER_MOCK_LATENCY");
+    char *end;
+    double us;
+    int i, len;
+
+    if (p == NULL) return;
+
+    while (*p) {
+        for (i = 0; i < LAT_MAX; i++) {
+            len = strlen(names[i]);
+            if (!strncmp(p, names[i], len) && (p[len] == '=')) break;
+        }
+        if (i < LAT_MAX) p += strlen(names[i]) + 1;
+        us = strtod(p, &end);
+        if ((end == p) || (us < 0)) {
+            fprintf(stderr, "fcontainer_mock: bad FCONTAINER_MOCK_LATENCY\n");
+            return;
+        }
+        if (i < LAT_MAX) {
+            latency_ns[i] = us * 1000;
+        } else {
+            for (i = 0; i < LAT_MAX; i++) latency_ns[i] = us * 1000;
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
+
+// In a child, take a shared flock of our own: the one inherited is
+// the parent's
+static void state_atfork_child(void)
+{
+    int fd;
+
+    if (state_fd < 0) return;
+    fd = real_open(mock_file(), O_RDWR | O_CLOEXEC);
+    real_close(state_fd);
+    state_fd = -1;
+    if (fd < 0) return;
+    flock(fd, LOCK_SH);
+    state_fd = fd;
+    state_pid = getpid();
+}
+
+// The last process out removes the file
+__attribute__((destructor)) static void state_detach(void)
+{
+    if ((state_fd < 0) || (state_pid != getpid())) return;
+
+    // nobody else holds it shared; newcomers waiting for the lock see
+    // the file gone and make a new one
+    if (flock(state_fd, LOCK_EX | LOCK_NB) == 0) unlink(mock_file());
+    real_close(state_fd);
+    state_fd = -1;
+}
+
+/**
+ * Map the state file, creating and initializing it if nobody has, and
+ * keep a shared flock on it.  init_lock must be held.  Returns 0 or
+ * -errno.
+ */
+static int state_attach(void)
+{
+    pthread_mutexattr_t attr;
+    struct mock_state *map;
+    struct stat st, path_st;
+    int fd, mfd, alone, retstat = 0;
+
+    for (;;) {
+        fd = real_open(mock_file(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) return -errno;
+        // alone, we may have to lay the file out; otherwise whoever
+        // holds it did, and we wait only for one doing that or
+        // removing the file
+        alone = (flock(fd, LOCK_EX | LOCK_NB) == 0);
+        if (!alone) flock(fd, LOCK_SH);
+        if (fstat(fd, &st) != 0) {
+            retstat = -errno;
+            real_close(fd);
+            return retstat;
+        }
+        // the last process out may have removed it while we waited
+        if ((stat(mock_file(), &path_st) == 0) && (path_st.st_dev == st.st_dev) &&
+            (path_st.st_ino == st.st_ino))
+            break;
+        real_close(fd);
+    }
+
+    if (alone && (st.st_size < (off_t) sizeof(*state)) && (ftruncate(fd, sizeof(*state)) != 0))
+        retstat = -errno;
+    // mapped through a description of its own: a mapping keeps the
+    // one it was made from alive, and with it any flock, in every
+    // child we fork
+    if (retstat == 0) {
+        mfd = real_open(mock_file(), O_RDWR | O_CLOEXEC);
+        if (mfd < 0) retstat = -errno;
+    }
+    if (retstat == 0) {
+        map = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+        if (map == MAP_FAILED) retstat = -errno;
+        real_close(mfd);
+    }
+    if ((retstat == 0) && alone && (map->magic != MOCK_MAGIC)) {
+        memset(map, 0, sizeof(*map));
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&map->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        for (int i = 0; i < MOCK_TASKS; i++) map->tasks[i].container = -1;
+        __atomic_store_n(&map->magic, MOCK_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (retstat != 0) {
+        real_close(fd);
+        return retstat;
+    }
+
+    // the lock stays, shared, for as long as we live
+    flock(fd, LOCK_SH);
+    state_fd = fd;
+    state_pid = getpid();
+    pthread_atfork(NULL, NULL, state_atfork_child);
+    state_dev = st.st_dev;
+    state_ino = st.st_ino;
+    parse_latency();
+    __atomic_store_n(&state, map, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Open the state file for a device open, attaching to it first if we
+ * haven't.  Returns the fd or -errno.
+ */
+static int state_open(void)
+{
+    int fd, retstat = 0;
+
+    pthread_mutex_lock(&init_lock);
+    if (state == NULL) retstat = state_attach();
+    pthread_mutex_unlock(&init_lock);
+    if (retstat != 0) return retstat;
+
+    fd = real_open(mock_file(), O_RDWR | O_CLOEXEC);
+
+    return (fd < 0) ? -errno : fd;
+}
+
+static int is_device(int fd)
+{
+    struct stat st;
+
+    if ((fd >= 0) && (fd < MOCK_FDS)) return __atomic_load_n(&mock_fds[fd], __ATOMIC_RELAXED);
+
+    return (state != NULL) && (fstat(fd, &st) == 0) && (st.st_dev == state_dev) &&
+           (st.st_ino == state_ino);
+}
+
+static void spin(uint64_t ns)
+{
+    struct timespec ts;
+    uint64_t now, end;
+
+    if (ns == 0) return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    end = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec + ns;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    } while (now < end);
+}
+
+static void state_lock(void)
+{
+    if (pthread_mutex_lock(&state->lock) == EOWNERDEAD) pthread_mutex_consistent(&state->lock);
+}
+
+// The container at the head of the queue, -1 if there is none
+static int head_container(void)
+{
+    int i, head = -1;
+
+    for (i = 0; i < state->containers_used; i++) {
+        if (!state->containers[i].used) continue;
+        if ((head < 0) || (state->containers[i].order < state->containers[head].order)) head = i;
+    }
+
+    return head;
+}
+
+// Move the high-water marks down past slots freed at the end
+static void shrink(void)
+{
+    while ((state->tasks_used > 0) && (state->tasks[state->tasks_used - 1].container < 0))
+        state->tasks_used--;
+    while ((state->containers_used > 0) && !state->containers[state->containers_used - 1].used)
+        state->containers_used--;
+}
+
+// Drop the tasks of threads that have exited, the module would keep
+// pointing at them
+static void reap_tasks(void)
+{
+    struct mock_task *t;
+    int i;
+
+    for (i = 0; i < state->tasks_used; i++) {
+        t = &state->tasks[i];
+        if ((t->container >= 0) && (syscall(SYS_tgkill, t->tgid, t->tid, 0) != 0) && (errno == ESRCH))
+            t->container = -1;
+    }
+    shrink();
+}
+
+// file_container_create(): put the calling thread in container cid,
+// which joins the tail of the queue if it is new
+static int mock_create(int cid)
+{
+    struct mock_container *c = NULL;
+    int i, slot = -1, task = -1;
+
+    state_lock();
+    spin(latency_ns[LAT_CREATE]);
+
+    for (i = 0; i < state->containers_used; i++) {
+        if (state->containers[i].used && (state->containers[i].cid == cid)) break;
+        if (!state->containers[i].used && (slot < 0)) slot = i;
+    }
+    if (i < state->containers_used) slot = i;
+    else if ((slot < 0) && (state->containers_used < MOCK_CONTAINERS)) slot = state->containers_used;
+
+    for (i = 0; (i < MOCK_TASKS) && (task < 0); i++)
+        if (state->tasks[i].container < 0) task = i;
+    if (task < 0) {
+        reap_tasks();
+        for (i = 0; (i < MOCK_TASKS) && (task < 0); i++)
+            if (state->tasks[i].container < 0) task = i;
+    }
+    if ((slot < 0) || (task < 0)) {
+        pthread_mutex_unlock(&state->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (slot >= state->containers_used) state->containers_used = slot + 1;
+    if (task >= state->tasks_used) state->tasks_used = task + 1;
+    c = &state->containers[slot];
+    if (!c->used) {
+        c->used = 1;
+        c->cid = cid;
+        c->order = ++state->next_seq;
+    }
+    state->tasks[task].tid = syscall(SYS_gettid);
+    state->tasks[task].tgid = getpid();
+    state->tasks[task].seq = ++state->next_seq;
+    state->tasks[task].container = slot;
+
+    pthread_mutex_unlock(&state->lock);
+
+    return 0;
+}
+
+// file_container_get_container_id(): the container of thread pid,
+// the first one in the queue if it was put in several
+static int mock_getcid(int pid)
+{
+    struct mock_task *t;
+    int i, found = -1;
+
+    spin(latency_ns[LAT_GETCID]);
+    state_lock();
+    for (i = 0; i < state->tasks_used; i++) {
+        t = &state->tasks[i];
+        if ((t->container < 0) || (t->tid != pid)) continue;
+        if ((found < 0) || (state->containers[t->container].order < state->containers[found].order))
+            found = t->container;
+    }
+    found = (found < 0) ? -1 : state->containers[found].cid;
+    pthread_mutex_unlock(&state->lock);
+
+    // the module returns -1, which ioctl() turns into EPERM
+    if (found < 0) errno = EPERM;
+
+    return found;
+}
+
+// file_container_delete(): take the first task off the container at
+// the head of the queue, whoever calls it, and send the container to
+// the tail, or free it if that was its last task
+static int mock_delete(void)
+{
+    int i, head, task = -1, left = 0;
+
+    state_lock();
+    spin(latency_ns[LAT_DELETE]);
+
+    head = head_container();
+    for (i = 0; (head >= 0) && (i < state->tasks_used); i++) {
+        if (state->tasks[i].container != head) continue;
+        if ((task < 0) || (state->tasks[i].seq < state->tasks[task].seq)) task = i;
+        left++;
+    }
+    if (task < 0) {
+        pthread_mutex_unlock(&state->lock);
+        errno = EPERM;
+        return -1;
+    }
+
+    state->tasks[task].container = -1;
+    if (left == 1) state->containers[head].used = 0;
+    else state->containers[head].order = ++state->next_seq;
+    shrink();
+
+    pthread_mutex_unlock(&state->lock);
+
+    return 0;
+}
+
+// open() and open64(), the latter if large is set
+static int open_device(const char *path, int flags, mode_t mode, int large)
+{
+    int fd;
+
+    mock_resolve();
+    if ((path == NULL) || strcmp(path, mock_device()))
+        return large ? real_open64(path, flags, mode) : real_open(path, flags, mode);
+
+    fd = state_open();
+    if (fd < 0) {
+        errno = -fd;
+        return -1;
+    }
+    if (fd < MOCK_FDS) __atomic_store_n(&mock_fds[fd], 1, __ATOMIC_RELAXED);
+
+    return fd;
+}
+
+static mode_t open_mode(int flags, va_list ap)
+{
+    return ((flags & O_CREAT) || ((flags & O_TMPFILE) == O_TMPFILE)) ? va_arg(ap, mode_t) : 0;
+}
+
+int open(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode;
+
+    va_start(ap, flags);
+    mode = open_mode(flags, ap);
+    va_end(ap);
+
+    return open_device(path, flags, mode, 0);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode;
+
+    va_start(ap, flags);
+    mode = open_mode(flags, ap);
+    va_end(ap);
+
+    return open_device(path, flags, mode, 1);
+}
+
+// newfd, if not -1, is a copy of oldfd: the device if oldfd is
+static int track_dup(int oldfd, int newfd)
+{
+    if ((newfd >= 0) && (newfd < MOCK_FDS))
+        __atomic_store_n(&mock_fds[newfd], is_device(oldfd), __ATOMIC_RELAXED);
+
+    return newfd;
+}
+
+int close(int fd)
+{
+    mock_resolve();
+    if ((fd >= 0) && (fd < MOCK_FDS)) __atomic_store_n(&mock_fds[fd], 0, __ATOMIC_RELAXED);
+
+    return real_close(fd);
+}
+
+int dup(int oldfd)
+{
+    mock_resolve();
+
+    return track_dup(oldfd, real_dup(oldfd));
+}
+
+int dup2(int oldfd, int newfd)
+{
+    mock_resolve();
+
+    return track_dup(oldfd, real_dup2(oldfd, newfd));
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+    mock_resolve();
+
+    return track_dup(oldfd, real_dup3(oldfd, newfd, flags));
+}
+
+// fcntl() and fcntl64(); every command takes an int, a pointer or
+// nothing, all of which pass as a pointer-sized argument
+static int mock_fcntl(int (*real)(int, int, ...), int fd, int cmd, void *arg)
+{
+    int ret;
+
+    mock_resolve();
+    ret = real(fd, cmd, arg);
+    if ((cmd == F_DUPFD) || (cmd == F_DUPFD_CLOEXEC)) track_dup(fd, ret);
+
+    return ret;
+}
+
+int fcntl(int fd, int cmd, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    return mock_fcntl(real_fcntl, fd, cmd, arg);
+}
+
+int fcntl64(int fd, int cmd, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+    mock_resolve();
+
+    // real_fcntl64 is only known after mock_resolve()
+    return mock_fcntl(real_fcntl64 ? real_fcntl64 : real_fcntl, fd, cmd, arg);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    struct file_container_cmd *cmd;
+    va_list ap;
+
+    va_start(ap, request);
+    cmd = va_arg(ap, struct file_container_cmd *);
+    va_end(ap);
+    mock_resolve();
+
+    if (!is_device(fd)) return real_ioctl(fd, request, cmd);
+
+    switch (request) {
+    case FCONTAINER_IOCTL_CREATE:
+        return mock_create((int) cmd->cid);
+    case FCONTAINER_IOCTL_GETCID:
+        return mock_getcid(cmd->pid);
+    case FCONTAINER_IOCTL_DELETE:
+        return mock_delete();
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
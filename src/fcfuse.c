@@ -25,11 +25,28 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include "fcfuse_bcache.h"
+#include "fcfuse_capture.h"
+#include "fcfuse_ctl.h"
+#include "fcfuse_direct.h"
+#include "fcfuse_fdcache.h"
+#include "fcfuse_gcommit.h"
+#include "fcfuse_journal.h"
+#include "fcfuse_lookup.h"
+#include "fcfuse_mmap.h"
+#include "fcfuse_probes.h"
+#include "fcfuse_profile.h"
+#include "fcfuse_slowlog.h"
+#include "fcfuse_stats.h"
+#include "fcfuse_stream.h"
+#include "fcfuse_trash.h"
+#include "fcfuse_uring.h"
 //#define HAVE_SYS_XATTR_H 1
 #ifdef HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
@@ -37,59 +54,326 @@
 
 struct fcfuse_state *fcfuse_data;
 
+// Every callback goes through fcfuse_op_begin() and fcfuse_op_end()
+// so that each request is timed exactly once, however it returns.
+// note passes the arguments the capture wants to fcfuse_op_note().
+#define FCFUSE_OP_NOTE(rtype, name, op, params, args, note) \
+    static rtype fcfuse_##name##_op params \
+    { \
+	rtype retstat; \
+	fcfuse_op_begin(op, path); \
+	FCFS_PROBE2(op__entry, op, path); \
+	retstat = fcfuse_##name args; \
+	note; \
+	fcfuse_op_end(retstat); \
+	return retstat; \
+    }
+#define FCFUSE_OP(rtype, name, op, params, args) FCFUSE_OP_NOTE(rtype, name, op, params, args, )
+
+#if FUSE_USE_VERSION >= 30
+FCFUSE_OP(int, getattr, FCOP_GETATTR,
+	  (const char *path, struct stat *statbuf, struct fuse_file_info *fi), (path, statbuf, fi))
+#else
+FCFUSE_OP(int, getattr, FCOP_GETATTR, (const char *path, struct stat *statbuf), (path, statbuf))
+#endif
+FCFUSE_OP(int, readlink, FCOP_READLINK, (const char *path, char *link, size_t size), (path, link, size))
+FCFUSE_OP_NOTE(int, mknod, FCOP_MKNOD, (const char *path, mode_t mode, dev_t dev), (path, mode, dev),
+	       fcfuse_op_note(0, 0, mode, NULL))
+FCFUSE_OP_NOTE(int, mkdir, FCOP_MKDIR, (const char *path, mode_t mode), (path, mode),
+	       fcfuse_op_note(0, 0, mode, NULL))
+FCFUSE_OP(int, unlink, FCOP_UNLINK, (const char *path), (path))
+FCFUSE_OP(int, rmdir, FCOP_RMDIR, (const char *path), (path))
+FCFUSE_OP_NOTE(int, symlink, FCOP_SYMLINK, (const char *path, const char *link), (path, link),
+	       fcfuse_op_note(0, 0, 0, link))
+#if FUSE_USE_VERSION >= 30
+FCFUSE_OP_NOTE(int, rename, FCOP_RENAME,
+	       (const char *path, const char *newpath, unsigned int flags), (path, newpath, flags),
+	       fcfuse_op_note(0, 0, flags, newpath))
+#else
+FCFUSE_OP_NOTE(int, rename, FCOP_RENAME, (const char *path, const char *newpath), (path, newpath),
+	       fcfuse_op_note(0, 0, 0, newpath))
+#endif
+FCFUSE_OP_NOTE(int, link, FCOP_LINK, (const char *path, const char *newpath), (path, newpath),
+	       fcfuse_op_note(0, 0, 0, newpath))
+#if FUSE_USE_VERSION >= 30
+FCFUSE_OP_NOTE(int, chmod, FCOP_CHMOD,
+	       (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi),
+	       fcfuse_op_note(0, 0, mode, NULL))
+FCFUSE_OP_NOTE(int, chown, FCOP_CHOWN,
+	       (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi), (path, uid, gid, fi),
+	       fcfuse_op_note(0, gid, uid, NULL))
+FCFUSE_OP_NOTE(int, truncate, FCOP_TRUNCATE,
+	       (const char *path, off_t newsize, struct fuse_file_info *fi), (path, newsize, fi),
+	       fcfuse_op_note(newsize, 0, 0, NULL))
+FCFUSE_OP(int, utimens, FCOP_UTIMENS,
+	  (const char *path, const struct timespec tv[2], struct fuse_file_info *fi), (path, tv, fi))
+#else
+FCFUSE_OP_NOTE(int, chmod, FCOP_CHMOD, (const char *path, mode_t mode), (path, mode),
+	       fcfuse_op_note(0, 0, mode, NULL))
+FCFUSE_OP_NOTE(int, chown, FCOP_CHOWN, (const char *path, uid_t uid, gid_t gid), (path, uid, gid),
+	       fcfuse_op_note(0, gid, uid, NULL))
+FCFUSE_OP_NOTE(int, truncate, FCOP_TRUNCATE, (const char *path, off_t newsize), (path, newsize),
+	       fcfuse_op_note(newsize, 0, 0, NULL))
+FCFUSE_OP(int, utime, FCOP_UTIMENS, (const char *path, struct utimbuf *ubuf), (path, ubuf))
+#endif
+FCFUSE_OP_NOTE(int, open, FCOP_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi),
+	       fcfuse_op_note(0, 0, fi->flags, NULL))
+FCFUSE_OP_NOTE(int, read, FCOP_READ,
+	       (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+	       (path, buf, size, offset, fi),
+	       fcfuse_op_note(offset, size, 0, NULL))
+FCFUSE_OP_NOTE(int, write, FCOP_WRITE,
+	       (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+	       (path, buf, size, offset, fi),
+	       fcfuse_op_note(offset, size, 0, NULL))
+FCFUSE_OP(int, statfs, FCOP_STATFS, (const char *path, struct statvfs *statv), (path, statv))
+FCFUSE_OP(int, flush, FCOP_FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi))
+FCFUSE_OP(int, release, FCOP_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi))
+FCFUSE_OP_NOTE(int, fsync, FCOP_FSYNC,
+	       (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi),
+	       fcfuse_op_note(0, 0, datasync, NULL))
+#ifdef HAVE_SYS_XATTR_H
+FCFUSE_OP(int, setxattr, FCOP_SETXATTR,
+	  (const char *path, const char *name, const char *value, size_t size, int flags),
+	  (path, name, value, size, flags))
+FCFUSE_OP(int, getxattr, FCOP_GETXATTR,
+	  (const char *path, const char *name, char *value, size_t size), (path, name, value, size))
+FCFUSE_OP(int, listxattr, FCOP_LISTXATTR, (const char *path, char *list, size_t size), (path, list, size))
+FCFUSE_OP(int, removexattr, FCOP_REMOVEXATTR, (const char *path, const char *name), (path, name))
+#endif
+FCFUSE_OP(int, opendir, FCOP_OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi))
+#if FUSE_USE_VERSION >= 30
+FCFUSE_OP(int, readdir, FCOP_READDIR,
+	  (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+	   enum fuse_readdir_flags flags),
+	  (path, buf, filler, offset, fi, flags))
+#else
+FCFUSE_OP(int, readdir, FCOP_READDIR,
+	  (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+	  (path, buf, filler, offset, fi))
+#endif
+FCFUSE_OP(int, releasedir, FCOP_RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi))
+FCFUSE_OP(int, fsyncdir, FCOP_FSYNCDIR,
+	  (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+FCFUSE_OP_NOTE(int, access, FCOP_ACCESS, (const char *path, int mask), (path, mask),
+	       fcfuse_op_note(0, 0, mask, NULL))
+#if FUSE_USE_VERSION >= 30
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+FCFUSE_OP_NOTE(ssize_t, copy_file_range, FCOP_COPY_FILE_RANGE,
+	       (const char *path, struct fuse_file_info *fi_in, off_t offset_in,
+		const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags),
+	       (path, fi_in, offset_in, path_out, fi_out, offset_out, size, flags),
+	       fcfuse_op_note(offset_in, size, offset_out, path_out))
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+FCFUSE_OP_NOTE(off_t, lseek, FCOP_LSEEK,
+	       (const char *path, off_t off, int whence, struct fuse_file_info *fi), (path, off, whence, fi),
+	       fcfuse_op_note(off, 0, whence, NULL))
+#endif
+#else
+FCFUSE_OP_NOTE(int, ftruncate, FCOP_FTRUNCATE,
+	       (const char *path, off_t offset, struct fuse_file_info *fi), (path, offset, fi),
+	       fcfuse_op_note(offset, 0, 0, NULL))
+FCFUSE_OP(int, fgetattr, FCOP_FGETATTR,
+	  (const char *path, struct stat *statbuf, struct fuse_file_info *fi), (path, statbuf, fi))
+#endif
+
 struct fuse_operations fcfuse_oper = {
-  .getattr = fcfuse_getattr,
-  .readlink = fcfuse_readlink,
+  .getattr = fcfuse_getattr_op,
+  .readlink = fcfuse_readlink_op,
+#if FUSE_USE_VERSION < 30
   // no .getdir -- that's deprecated
   .getdir = NULL,
-  .mknod = fcfuse_mknod,
-  .mkdir = fcfuse_mkdir,
-  .unlink = fcfuse_unlink,
-  .rmdir = fcfuse_rmdir,
-  .symlink = fcfuse_symlink,
-  .rename = fcfuse_rename,
-  .link = fcfuse_link,
-  .chmod = fcfuse_chmod,
-  .chown = fcfuse_chown,
-  .truncate = fcfuse_truncate,
-  .utime = fcfuse_utime,
-  .open = fcfuse_open,
-  .read = fcfuse_read,
-  .write = fcfuse_write,
-  .statfs = fcfuse_statfs,
+#endif
+  .mknod = fcfuse_mknod_op,
+  .mkdir = fcfuse_mkdir_op,
+  .unlink = fcfuse_unlink_op,
+  .rmdir = fcfuse_rmdir_op,
+  .symlink = fcfuse_symlink_op,
+  .rename = fcfuse_rename_op,
+  .link = fcfuse_link_op,
+  .chmod = fcfuse_chmod_op,
+  .chown = fcfuse_chown_op,
+  .truncate = fcfuse_truncate_op,
+#if FUSE_USE_VERSION >= 30
+  .utimens = fcfuse_utimens_op,
+#else
+  .utime = fcfuse_utime_op,
+#endif
+  .open = fcfuse_open_op,
+  .read = fcfuse_read_op,
+  .write = fcfuse_write_op,
+  .statfs = fcfuse_statfs_op,
   /** Just a placeholder, don't set */ // huh???
-  .flush = fcfuse_flush,
-  .release = fcfuse_release,
-  .fsync = fcfuse_fsync,
+  .flush = fcfuse_flush_op,
+  .release = fcfuse_release_op,
+  .fsync = fcfuse_fsync_op,
   
 #ifdef HAVE_SYS_XATTR_H
-  .setxattr = fcfuse_setxattr,
-  .getxattr = fcfuse_getxattr,
-  .listxattr = fcfuse_listxattr,
-  .removexattr = fcfuse_removexattr,
+  .setxattr = fcfuse_setxattr_op,
+  .getxattr = fcfuse_getxattr_op,
+  .listxattr = fcfuse_listxattr_op,
+  .removexattr = fcfuse_removexattr_op,
 #endif
   
-  .opendir = fcfuse_opendir,
-  .readdir = fcfuse_readdir,
-  .releasedir = fcfuse_releasedir,
-  .fsyncdir = fcfuse_fsyncdir,
+  .opendir = fcfuse_opendir_op,
+  .readdir = fcfuse_readdir_op,
+  .releasedir = fcfuse_releasedir_op,
+  .fsyncdir = fcfuse_fsyncdir_op,
   .init = fcfuse_init,
   .destroy = fcfuse_destroy,
-  .access = fcfuse_access,
-  .ftruncate = fcfuse_ftruncate,
-  .fgetattr = fcfuse_fgetattr
+  .access = fcfuse_access_op,
+#if FUSE_USE_VERSION >= 30
+  // ftruncate and fgetattr were folded into truncate and getattr
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+  .copy_file_range = fcfuse_copy_file_range_op,
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+  .lseek = fcfuse_lseek_op,
+#endif
+#else
+  .ftruncate = fcfuse_ftruncate_op,
+  .fgetattr = fcfuse_fgetattr_op
+#endif
+};
+
+// fcfuse's own -o options.  fuse_opt_parse() takes them out of the
+// argument list before the rest goes to fuse_main().
+#define FCFUSE_OPT(t, p, v) { t, offsetof(struct fcfuse_state, p), v }
+
+enum {
+    KEY_LOOKUP_TIMEOUT,
+    KEY_DIRECT,
+    KEY_STREAM,
+    KEY_BLOCK_CACHE_LIMIT,
+    KEY_MMAP,
+};
+
+static struct fuse_opt fcfuse_opts[] = {
+    FCFUSE_OPT("writeback", writeback, 1),
+    FCFUSE_OPT("lookup_attr_timeout=%lf", lookup_attr_timeout, 0),
+    FCFUSE_OPT("lookup_negative_timeout=%lf", lookup_negative_timeout, 0),
+    FUSE_OPT_KEY("lookup_timeout=", KEY_LOOKUP_TIMEOUT),
+    FCFUSE_OPT("fd_cache=%d", fd_cache, 0),
+    FCFUSE_OPT("log_level=%s", log_level, 0),
+    FCFUSE_OPT("trace_sample=%u", trace_sample, 0),
+    FCFUSE_OPT("trace_file=%s", trace_file, 0),
+    FCFUSE_OPT("slow_threshold=%lf", slow_threshold, 0),
+    FCFUSE_OPT("slow_p99=%lf", slow_p99, 0),
+    FCFUSE_OPT("ctl_socket=%s", ctl_socket, 0),
+    FCFUSE_OPT("profile=%s", profile, 0),
+    FCFUSE_OPT("profile_hz=%u", profile_hz, 0),
+    FCFUSE_OPT("capture=%s", capture, 0),
+    FCFUSE_OPT("uring=%u", uring, 0),
+    FUSE_OPT_KEY("direct=", KEY_DIRECT),
+    FCFUSE_OPT("direct_buffers=%u", direct_buffers, 0),
+    FUSE_OPT_KEY("stream=", KEY_STREAM),
+    FCFUSE_OPT("block_cache=%u", block_cache, 0),
+    FUSE_OPT_KEY("block_cache_limit=", KEY_BLOCK_CACHE_LIMIT),
+    FUSE_OPT_KEY("mmap=", KEY_MMAP),
+    FCFUSE_OPT("group_commit", group_commit, 1),
+    FCFUSE_OPT("group_commit_delay=%u", group_commit_delay, 0),
+    FCFUSE_OPT("journal", journal, 1),
+    FCFUSE_OPT("journal_interval=%u", journal_interval, 0),
+    FCFUSE_OPT("trash", trash, 1),
+    FCFUSE_OPT("trash_min=%u", trash_min, 0),
+    FCFUSE_OPT("trash_rate=%u", trash_rate, 0),
+    FUSE_OPT_END
 };
 
+static int fcfuse_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    int cid;
+    unsigned int mb;
+    double attr_timeout, negative_timeout;
+
+    switch (key) {
+    case KEY_LOOKUP_TIMEOUT:
+	// lookup_timeout=CID:ATTR:NEGATIVE, may be given once per container
+	if ((sscanf(arg, "lookup_timeout=%d:%lf:%lf", &cid, &attr_timeout, &negative_timeout) != 3) ||
+	    (fcfuse_lookup_set_timeout(cid, attr_timeout, negative_timeout) != 0)) {
+	    fprintf(stderr, "bad option %s\n", arg);
+	    return -1;
+	}
+	return 0;
+    case KEY_DIRECT:
+	// direct=CID, once per container
+	if ((sscanf(arg, "direct=%d", &cid) != 1) || (fcfuse_direct_add(cid) != 0)) {
+	    fprintf(stderr, "bad option %s\n", arg);
+	    return -1;
+	}
+	return 0;
+    case KEY_STREAM:
+	// stream=CID, once per container
+	if ((sscanf(arg, "stream=%d", &cid) != 1) || (fcfuse_stream_add(cid) != 0)) {
+	    fprintf(stderr, "bad option %s\n", arg);
+	    return -1;
+	}
+	return 0;
+    case KEY_BLOCK_CACHE_LIMIT:
+	// block_cache_limit=CID:MB, once per container
+	if ((sscanf(arg, "block_cache_limit=%d:%u", &cid, &mb) != 2) || (fcfuse_bcache_set_limit(cid, mb) != 0)) {
+	    fprintf(stderr, "bad option %s\n", arg);
+	    return -1;
+	}
+	return 0;
+    case KEY_MMAP:
+	// mmap=CID, once per container
+	if ((sscanf(arg, "mmap=%d", &cid) != 1) || (fcfuse_mmap_add(cid) != 0)) {
+	    fprintf(stderr, "bad option %s\n", arg);
+	    return -1;
+	}
+	return 0;
+    default:
+	// everything else is for fuse_main()
+	return 1;
+    }
+}
 
 void fcfuse_usage()
 {
     fprintf(stderr, "usage:  fcfuse [FUSE and mount options] npheap_device_name dataLocation mountPoint\n");
+    fprintf(stderr, "fcfuse options:\n");
+    fprintf(stderr, "    -o writeback           enable the kernel writeback cache (libfuse 3)\n");
+    fprintf(stderr, "    -o lookup_attr_timeout=T\n");
+    fprintf(stderr, "                           keep getattr results in the daemon for T seconds (0)\n");
+    fprintf(stderr, "    -o lookup_negative_timeout=T\n");
+    fprintf(stderr, "                           keep ENOENT from getattr in the daemon for T seconds (0)\n");
+    fprintf(stderr, "    -o lookup_timeout=CID:ATTR:NEG\n");
+    fprintf(stderr, "                           both timeouts for container CID\n");
+    fprintf(stderr, "    -o fd_cache=N          keep up to N backing descriptors open (0)\n");
+    fprintf(stderr, "    -o log_level=LEVEL     off, error, warn, info or debug (info)\n");
+    fprintf(stderr, "    -o trace_sample=N      trace one request in N, dumped on SIGUSR1 (0)\n");
+    fprintf(stderr, "    -o trace_file=FILE     where traces are dumped (fcfs-trace.json)\n");
+    fprintf(stderr, "    -o slow_threshold=US   record requests slower than US microseconds\n");
+    fprintf(stderr, "    -o slow_p99=K          record requests slower than K times their p99\n");
+    fprintf(stderr, "    -o ctl_socket=PATH     listen for control commands on a Unix socket\n");
+    fprintf(stderr, "    -o profile=FILE        sample worker threads, folded stacks to FILE\n");
+    fprintf(stderr, "    -o profile_hz=N        samples per second of CPU time (99)\n");
+    fprintf(stderr, "    -o capture=FILE        record every request to FILE for fcreplay\n");
+    fprintf(stderr, "    -o uring=DEPTH         backing I/O through an io_uring of DEPTH entries (0)\n");
+    fprintf(stderr, "    -o direct=CID          open container CID's files with O_DIRECT\n");
+    fprintf(stderr, "    -o direct_buffers=N    aligned bounce buffers for O_DIRECT (16)\n");
+    fprintf(stderr, "    -o stream=CID          keep container CID's files out of the page cache\n");
+    fprintf(stderr, "    -o block_cache=MB      cache up to MB of backing blocks in the daemon (0)\n");
+    fprintf(stderr, "    -o block_cache_limit=CID:MB\n");
+    fprintf(stderr, "                           most of the block cache container CID may hold\n");
+    fprintf(stderr, "    -o mmap=CID            read container CID's read-only files through mappings\n");
+    fprintf(stderr, "    -o group_commit        share one syncfs among concurrent fsyncs\n");
+    fprintf(stderr, "    -o group_commit_delay=US\n");
+    fprintf(stderr, "                           have each group wait US microseconds for more (0)\n");
+    fprintf(stderr, "    -o journal             acknowledge namespace changes once journaled\n");
+    fprintf(stderr, "    -o journal_interval=MS apply journaled changes every MS milliseconds (10)\n");
+    fprintf(stderr, "    -o trash               unlink large files by moving them to a trash emptied later\n");
+    fprintf(stderr, "    -o trash_min=MB        smallest file that goes to the trash (1)\n");
+    fprintf(stderr, "    -o trash_rate=MB       free at most MB megabytes a second emptying it (1024)\n");
     abort();
 }
 
 int main(int argc, char *argv[])
 {
     int fuse_stat;
+    struct fuse_args args;
 
     // NPHeapFS doesn't do any access checking on its own (the comment
     // blocks in fuse.h mention some of the functions that need
@@ -116,7 +400,7 @@ int main(int argc, char *argv[])
     if ((argc < 4) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
 	fcfuse_usage();
 
-    fcfuse_data = (struct fcfuse_state *)malloc(sizeof(struct fcfuse_state));
+    fcfuse_data = (struct fcfuse_state *)calloc(1, sizeof(struct fcfuse_state));
     if (fcfuse_data == NULL) {
 	perror("main calloc");
 	abort();
@@ -132,13 +416,78 @@ int main(int argc, char *argv[])
     argv[argc-1] = NULL;
     argv[argc-2] = NULL;
     argc-=2;
+
+    args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+    fcfuse_lookup_init();
+    if (fuse_opt_parse(&args, fcfuse_data, fcfuse_opts, fcfuse_opt_proc) == -1)
+	fcfuse_usage();
+    if (fcfuse_lookup_set_timeout(FCFUSE_LOOKUP_DEFAULT, fcfuse_data->lookup_attr_timeout,
+				  fcfuse_data->lookup_negative_timeout) != 0)
+	fcfuse_usage();
+    if (fcfuse_data->log_level) {
+	int level = log_parse_level(fcfuse_data->log_level);
+	if (level < LOG_LEVEL_OFF) fcfuse_usage();
+	log_set_level(level);
+    }
+    if (fcfuse_trace_init(fcfuse_data->trace_file, fcfuse_data->trace_sample) != 0)
+	fcfuse_usage();
+    fcfuse_slowlog_set(fcfuse_data->slow_threshold, fcfuse_data->slow_p99);
+    if (fcfuse_data->profile &&
+	(fcfuse_profile_init(fcfuse_data->profile, fcfuse_data->profile_hz ? fcfuse_data->profile_hz : 99) != 0))
+	fcfuse_usage();
+    if (fcfuse_data->capture) {
+	int ret = fcfuse_capture_init(fcfuse_data->capture);
+	if (ret != 0) {
+	    fprintf(stderr, "capture %s: %s\n", fcfuse_data->capture, strerror(-ret));
+	    return 1;
+	}
+    }
+    if (fcfuse_data->ctl_socket) {
+	int ret = fcfuse_ctl_init(fcfuse_data->ctl_socket);
+	if (ret != 0) {
+	    fprintf(stderr, "ctl_socket %s: %s\n", fcfuse_data->ctl_socket, strerror(-ret));
+	    return 1;
+	}
+    }
+    fcfuse_uring_init(fcfuse_data->uring);
+    fcfuse_direct_init(fcfuse_data->direct_buffers);
+    fcfuse_gcommit_init(fcfuse_data->group_commit, fcfuse_data->group_commit_delay);
+    if (fcfuse_bcache_init(fcfuse_data->block_cache) != 0) {
+	fprintf(stderr, "block_cache: %s\n", strerror(ENOMEM));
+	return 1;
+    }
+    if (fcfuse_fdcache_init(fcfuse_data->fd_cache) < fcfuse_data->fd_cache)
+	fprintf(stderr, "fd_cache limited to half of RLIMIT_NOFILE\n");
+    {
+	int ret = fcfuse_trash_init(fcfuse_data->rootdir, fcfuse_data->trash, fcfuse_data->trash_min,
+				    fcfuse_data->trash_rate);
+	if (ret < 0) {
+	    fprintf(stderr, "trash: %s\n", strerror(-ret));
+	    return 1;
+	}
+    }
+    {
+	int ret = fcfuse_journal_init(fcfuse_data->rootdir, fcfuse_data->journal, fcfuse_data->journal_interval);
+	if (ret < 0) {
+	    fprintf(stderr, "journal: %s\n", strerror(-ret));
+	    return 1;
+	}
+	if (ret > 0) fprintf(stderr, "journal: %d changes replayed\n", ret);
+    }
+#if FUSE_USE_VERSION < 30
+    if (fcfuse_data->writeback) {
+	fprintf(stderr, "-o writeback needs fcfuse built against libfuse 3\n");
+	return 1;
+    }
+#endif
     // You can output to a log file for debugging if you would like to.
     fcfuse_data->logfile = log_open();
     
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main %s\n",fcfuse_data->rootdir);
-    fuse_stat = fuse_main(argc, argv, &fcfuse_oper, fcfuse_data);
+    fuse_stat = fuse_main(args.argc, args.argv, &fcfuse_oper, fcfuse_data);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    fuse_opt_free_args(&args);
     
     return fuse_stat;
 }
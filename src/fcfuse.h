@@ -12,16 +12,29 @@
 #define _PARAMS_H_
 
 // The FUSE API has been changed a number of times.  So, our code
-// needs to define the version of the API that we assume.  As of this
-// writing, the most current API version is 29
+// needs to define the version of the API that we assume.  configure
+// picks libfuse 2 (API 29) or libfuse 3 (API 31) and passes the
+// matching FUSE_USE_VERSION on the command line; a hand build without
+// it gets the old API.
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 29
+#endif
 
 // need this to get pwrite().  I have to use setvbuf() instead of
 // setlinebuf() later in consequence.
 #define _XOPEN_SOURCE 500
 
+// copy_file_range() and SEEK_DATA/SEEK_HOLE are GNU extensions
+#define _GNU_SOURCE
+
+// Largest read/write request we ask the kernel for.  libfuse 3 turns
+// this into max_pages on kernels that support it (4.20 and later) and
+// clamps it to its own buffer size on older ones.
+#define FCFUSE_MAX_REQUEST (1024 * 1024)
+
 #include <limits.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define NPHFS_DATA ((struct fcfuse_state *) fuse_get_context()->private_data)
 #include "fcfuse_extra.h"
@@ -45,19 +58,34 @@
 #endif
 
 #include "log.h"
+#if FUSE_USE_VERSION >= 30
+int fcfuse_getattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi);
+#else
 int fcfuse_getattr(const char *path, struct stat *statbuf);
+#endif
 int fcfuse_readlink(const char *path, char *link, size_t size);
 int fcfuse_mknod(const char *path, mode_t mode, dev_t dev);
 int fcfuse_mkdir(const char *path, mode_t mode);
 int fcfuse_unlink(const char *path);
 int fcfuse_rmdir(const char *path);
 int fcfuse_symlink(const char *path, const char *link);
+#if FUSE_USE_VERSION >= 30
+int fcfuse_rename(const char *path, const char *newpath, unsigned int flags);
+#else
 int fcfuse_rename(const char *path, const char *newpath);
+#endif
 int fcfuse_link(const char *path, const char *newpath);
+#if FUSE_USE_VERSION >= 30
+int fcfuse_chmod(const char *path, mode_t mode, struct fuse_file_info *fi);
+int fcfuse_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi);
+int fcfuse_truncate(const char *path, off_t newsize, struct fuse_file_info *fi);
+int fcfuse_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi);
+#else
 int fcfuse_chmod(const char *path, mode_t mode);
 int fcfuse_chown(const char *path, uid_t uid, gid_t gid);
 int fcfuse_truncate(const char *path, off_t newsize);
 int fcfuse_utime(const char *path, struct utimbuf *ubuf);
+#endif
 int fcfuse_open(const char *path, struct fuse_file_info *fi);
 int fcfuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 int fcfuse_write(const char *path, const char *buf, size_t size, off_t offset,
@@ -74,11 +102,26 @@ int fcfuse_listxattr(const char *path, char *list, size_t size);
 int fcfuse_removexattr(const char *path, const char *name);
 #endif
 int fcfuse_opendir(const char *path, struct fuse_file_info *fi);
+#if FUSE_USE_VERSION >= 30
+int fcfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+	     enum fuse_readdir_flags flags);
+#else
 int fcfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+#endif
 int fcfuse_releasedir(const char *path, struct fuse_file_info *fi);
 int fcfuse_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi);
+#if FUSE_USE_VERSION >= 30
+void *fcfuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+#else
 void *fcfuse_init(struct fuse_conn_info *conn);
+#endif
 void fcfuse_destroy(void *userdata);
 int fcfuse_access(const char *path, int mask);
+#if FUSE_USE_VERSION >= 30
+off_t fcfuse_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi);
+ssize_t fcfuse_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+	     const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags);
+#else
 int fcfuse_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
 int fcfuse_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi);
+#endif
@@ -0,0 +1,679 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  When the backing store is slow or remote, the host's page cache in
+  front of it is not ours to size or share out.  With -o block_cache=MB
+  the daemon keeps blocks of the backing files itself, up to MB
+  mebibytes of data, and serves reads from them.
+
+  Blocks are BCACHE_BLOCK bytes, keyed by backing inode and block
+  number, and spread over BCACHE_SHARDS shards with a lock and a hash
+  table each; a shard holds its share of the budget.  A miss reads the
+  whole run of missing blocks the request touches in one call.
+
+  Eviction is CLOCK-Pro, simplified.  New blocks are cold; a cold block
+  read again before the hand reaches it turns hot, and hot blocks are
+  demoted only once the hot hand finds them unread.  A block evicted
+  cold leaves a ghost behind, and a miss on a ghost brings the block
+  back hot and gives cold blocks more of the shard; a ghost that
+  expires unread gives them less.  A scan thus passes through the cold
+  blocks without touching the hot ones.
+
+  No container gets to fill the cache on its own: once a shard is
+  full, a container holding more than its fair share of the budget
+  (the budget over the containers that hold blocks) evicts its own
+  blocks first, and -o block_cache_limit=CID:MB caps a container's
+  blocks even when the cache isn't full.
+
+  Writes through fcfuse_write() drop the blocks they cover.  Truncation
+  and O_TRUNC advance the file's generation instead, which is part of
+  the key, so its old blocks are never found again and age out; so
+  does creating a file, whose inode may be that of one removed while
+  its blocks were cached.  A reader only inserts what it read if no
+  write or truncation of the file came in between.  Changes made to
+  the backing files behind the daemon's back are not seen.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fcfuse_bcache.h"
+#include "fcfuse_stats.h"
+#include "fcfuse_uring.h"
+
+#define BCACHE_BLOCK (64 * 1024)
+#define BCACHE_SHARDS 64                        // power of two
+#define BCACHE_GENS 4096                        // power of two
+#define BCACHE_CONTAINERS FCFUSE_BCACHE_CONTAINERS
+#define BCACHE_SCAN 64                          // blocks looked at for a container's own
+
+#define CID_FREE INT_MIN
+
+enum { BCACHE_COLD, BCACHE_HOT, BCACHE_GHOST, BCACHE_LISTS };
+
+struct bcache_key {
+    dev_t dev;
+    ino_t ino;
+    uint32_t gen;
+    off_t block;
+};
+
+struct bcache_container {
+    int cid;                        // CID_FREE while the slot is free
+    size_t limit;                   // bytes, 0 for none
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct bcache_entry {
+    struct bcache_key key;
+    struct bcache_entry *hash_next;
+    struct bcache_entry *prev, *next;   // on the shard's list
+    int list;                           // BCACHE_COLD, BCACHE_HOT or BCACHE_GHOST
+    int ref;                            // read since the hand last passed
+    struct bcache_container *owner;     // container that read it in
+    size_t len;                         // short at the end of the file
+    char *data;                         // NULL for ghosts
+};
+
+struct bcache_list {
+    struct bcache_entry *head, *tail;   // the hand is at the head
+    unsigned int n;
+};
+
+struct bcache_shard {
+    pthread_mutex_t lock;
+    struct bcache_entry **hash;
+    size_t hash_mask;
+    struct bcache_list lists[BCACHE_LISTS];
+    unsigned int cold_target;           // resident blocks the cold ones may take
+};
+
+// A file's generation, and the writes to it; files share a slot when
+// they hash alike, which costs them no more than a few misses
+struct bcache_gen {
+    uint32_t gen;
+    uint32_t writes;
+};
+
+static struct bcache_shard *bcache_shards;
+static unsigned int shard_blocks;      // resident blocks per shard
+static size_t bcache_bytes;            // the budget
+static struct bcache_gen bcache_gens[BCACHE_GENS];
+
+// Containers by cid, open addressing; slots are taken, never freed.
+// Limits are set before fuse_main(), use is counted after.
+static struct bcache_container bcache_containers[BCACHE_CONTAINERS] = {
+    [0 ... BCACHE_CONTAINERS - 1] = { .cid = CID_FREE }
+};
+static struct bcache_container bcache_overflow = { .cid = -1 };
+static unsigned int bcache_active;     // containers holding blocks
+
+static uint64_t bcache_hash(dev_t dev, ino_t ino, uint64_t x)
+{
+    uint64_t h = ((uint64_t) ino * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t) dev * 0xc2b2ae3d27d4eb4fULL) ^
+                 (x * 0x165667b19e3779f9ULL);
+
+    h ^= h >> 31;
+    h *= 0xd6e8feb86659fd93ULL;
+    return h ^ (h >> 32);
+}
+
+static struct bcache_gen *gen_of(dev_t dev, ino_t ino)
+{
+    return &bcache_gens[bcache_hash(dev, ino, 0) & (BCACHE_GENS - 1)];
+}
+
+static struct bcache_container *container_of(int cid)
+{
+    unsigned int i, n;
+    int seen;
+
+    for (n = 0, i = (unsigned int) cid * 2654435761U; n < BCACHE_CONTAINERS; n++, i++) {
+        struct bcache_container *c = &bcache_containers[i & (BCACHE_CONTAINERS - 1)];
+
+        seen = __atomic_load_n(&c->cid, __ATOMIC_ACQUIRE);
+        if (seen == CID_FREE) {
+            if (__atomic_compare_exchange_n(&c->cid, &seen, cid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return c;
+        }
+        if (seen == cid) return c;
+    }
+
+    // more containers than slots share one, which isn't reported
+    return &bcache_overflow;
+}
+
+static void container_account(struct bcache_container *c, ssize_t len)
+{
+    size_t bytes = __atomic_add_fetch(&c->bytes, len, __ATOMIC_RELAXED);
+
+    if ((len > 0) && (bytes == (size_t) len)) __atomic_add_fetch(&bcache_active, 1, __ATOMIC_RELAXED);
+    if ((len < 0) && (bytes == 0)) __atomic_sub_fetch(&bcache_active, 1, __ATOMIC_RELAXED);
+}
+
+// Whether c may not take len more bytes at all
+static int container_over_limit(struct bcache_container *c, size_t len)
+{
+    return c->limit && (__atomic_load_n(&c->bytes, __ATOMIC_RELAXED) + len > c->limit);
+}
+
+// Whether c holds more than its share of a full cache
+static int container_over_share(struct bcache_container *c, size_t len)
+{
+    unsigned int active = __atomic_load_n(&bcache_active, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(&c->bytes, __ATOMIC_RELAXED) + len > bcache_bytes / (active ? active : 1);
+}
+
+/** -o block_cache_limit=CID:MB, before fuse_main().  Returns 0 or -EINVAL. */
+int fcfuse_bcache_set_limit(int cid, unsigned int mb)
+{
+    struct bcache_container *c;
+
+    if (cid == CID_FREE) return -EINVAL;
+    c = container_of(cid);
+    if (c == &bcache_overflow) return -EINVAL;
+    c->limit = (size_t) mb << 20;
+
+    return 0;
+}
+
+/** -o block_cache=MB, before fuse_main().  Returns 0 or -ENOMEM. */
+int fcfuse_bcache_init(unsigned int mb)
+{
+    size_t buckets = 16;
+    int s;
+
+    if (mb == 0) return 0;
+
+    bcache_shards = calloc(BCACHE_SHARDS, sizeof(*bcache_shards));
+    if (bcache_shards == NULL) return -ENOMEM;
+    shard_blocks = ((size_t) mb << 20) / BCACHE_BLOCK / BCACHE_SHARDS;
+    if (shard_blocks == 0) shard_blocks = 1;
+    // residents and ghosts, one each per block
+    while (buckets < 2 * shard_blocks) buckets *= 2;
+
+    for (s = 0; s < BCACHE_SHARDS; s++) {
+        struct bcache_shard *shard = &bcache_shards[s];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->hash = calloc(buckets, sizeof(*shard->hash));
+        if (shard->hash == NULL) {
+            while (s--) free(bcache_shards[s].hash);
+            free(bcache_shards);
+            bcache_shards = NULL;
+            return -ENOMEM;
+        }
+        shard->hash_mask = buckets - 1;
+        shard->cold_target = (shard_blocks > 4) ? shard_blocks / 4 : 1;
+    }
+    bcache_bytes = (size_t) shard_blocks * BCACHE_SHARDS * BCACHE_BLOCK;
+
+    return 0;
+}
+
+/** Whether -o block_cache was given */
+int fcfuse_bcache_enabled(void)
+{
+    return bcache_shards != NULL;
+}
+
+/** The budget in bytes, 0 without a cache */
+size_t fcfuse_bcache_budget(void)
+{
+    return bcache_bytes;
+}
+
+void fcfuse_bcache_destroy(void)
+{
+    uint64_t hits, misses;
+    struct bcache_entry *e, *next;
+    int s, l;
+
+    if (bcache_shards == NULL) return;
+
+    hits = bcache_overflow.hits;
+    misses = bcache_overflow.misses;
+    for (s = 0; s < BCACHE_CONTAINERS; s++) {
+        hits += bcache_containers[s].hits;
+        misses += bcache_containers[s].misses;
+    }
+    log_msg("    block cache: %llu hits, %llu misses\n", (unsigned long long) hits, (unsigned long long) misses);
+
+    for (s = 0; s < BCACHE_SHARDS; s++) {
+        for (l = 0; l < BCACHE_LISTS; l++) {
+            for (e = bcache_shards[s].lists[l].head; e; e = next) {
+                next = e->next;
+                free(e->data);
+                free(e);
+            }
+        }
+        free(bcache_shards[s].hash);
+        pthread_mutex_destroy(&bcache_shards[s].lock);
+    }
+    free(bcache_shards);
+    bcache_shards = NULL;
+}
+
+// Everything below runs under the shard's lock
+
+static struct bcache_shard *shard_of(const struct bcache_key *key, uint64_t *hash)
+{
+    *hash = bcache_hash(key->dev, key->ino, ((uint64_t) key->block << 32) ^ key->gen);
+
+    return &bcache_shards[*hash >> 58 & (BCACHE_SHARDS - 1)];
+}
+
+static int key_equal(const struct bcache_key *a, const struct bcache_key *b)
+{
+    return (a->block == b->block) && (a->ino == b->ino) && (a->dev == b->dev) && (a->gen == b->gen);
+}
+
+static struct bcache_entry **shard_slot(struct bcache_shard *shard, uint64_t hash, const struct bcache_key *key)
+{
+    struct bcache_entry **p = &shard->hash[hash & shard->hash_mask];
+
+    while (*p && !key_equal(&(*p)->key, key)) p = &(*p)->hash_next;
+
+    return p;
+}
+
+static void list_append(struct bcache_shard *shard, struct bcache_entry *e, int list)
+{
+    struct bcache_list *l = &shard->lists[list];
+
+    e->list = list;
+    e->next = NULL;
+    e->prev = l->tail;
+    if (l->tail) l->tail->next = e;
+    else l->head = e;
+    l->tail = e;
+    l->n++;
+}
+
+static void list_remove(struct bcache_shard *shard, struct bcache_entry *e)
+{
+    struct bcache_list *l = &shard->lists[e->list];
+
+    if (e->prev) e->prev->next = e->next;
+    else l->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else l->tail = e->prev;
+    l->n--;
+}
+
+static void entry_free(struct bcache_shard *shard, struct bcache_entry *e)
+{
+    uint64_t hash;
+
+    list_remove(shard, e);
+    shard_of(&e->key, &hash);
+    *shard_slot(shard, hash, &e->key) = e->hash_next;
+    if (e->data) container_account(e->owner, -(ssize_t) e->len);
+    free(e->data);
+    free(e);
+}
+
+static unsigned int resident(struct bcache_shard *shard)
+{
+    return shard->lists[BCACHE_COLD].n + shard->lists[BCACHE_HOT].n;
+}
+
+// Evict e, keeping its key as a ghost for as long as the shard has
+// blocks; a ghost that expires means cold blocks had enough room
+static void entry_evict(struct bcache_shard *shard, struct bcache_entry *e)
+{
+    struct bcache_entry *ghost;
+
+    list_remove(shard, e);
+    container_account(e->owner, -(ssize_t) e->len);
+    free(e->data);
+    e->data = NULL;
+    e->ref = 0;
+    list_append(shard, e, BCACHE_GHOST);
+
+    while (shard->lists[BCACHE_GHOST].n > shard_blocks) {
+        ghost = shard->lists[BCACHE_GHOST].head;
+        entry_free(shard, ghost);
+        if (shard->cold_target > 1) shard->cold_target--;
+    }
+}
+
+// The hot hand: demote the first hot block it finds unread
+static void hot_hand(struct bcache_shard *shard)
+{
+    struct bcache_entry *e;
+
+    while ((e = shard->lists[BCACHE_HOT].head)) {
+        list_remove(shard, e);
+        if (e->ref) {
+            e->ref = 0;
+            list_append(shard, e, BCACHE_HOT);
+        } else {
+            list_append(shard, e, BCACHE_COLD);
+            return;
+        }
+    }
+}
+
+// The cold hand: evict the first cold block it finds unread, turning
+// those that were read hot
+static void cold_hand(struct bcache_shard *shard)
+{
+    struct bcache_entry *e;
+
+    for (;;) {
+        if ((shard->lists[BCACHE_HOT].n + shard->cold_target > shard_blocks) ||
+            (shard->lists[BCACHE_COLD].n == 0))
+            hot_hand(shard);
+        e = shard->lists[BCACHE_COLD].head;
+        if (e == NULL) return;
+        if (!e->ref) {
+            entry_evict(shard, e);
+            return;
+        }
+        list_remove(shard, e);
+        e->ref = 0;
+        list_append(shard, e, BCACHE_HOT);
+    }
+}
+
+// Evict one of c's blocks, cold ones first, if the shard has one near
+// the hands.  Returns whether it did.
+static int evict_own(struct bcache_shard *shard, struct bcache_container *c)
+{
+    static const int lists[] = { BCACHE_COLD, BCACHE_HOT };
+    struct bcache_entry *e;
+    int l, n;
+
+    for (l = 0; l < 2; l++) {
+        for (e = shard->lists[lists[l]].head, n = 0; e && (n < BCACHE_SCAN); e = e->next, n++) {
+            if (e->owner == c) {
+                entry_evict(shard, e);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Copy up to size bytes from offset in of the block into buf.  Returns
+// what was copied, or -1 if the block isn't there or ends before the
+// request does (the file may have grown since).
+static ssize_t shard_copy(const struct bcache_key *key, size_t in, char *buf, size_t size)
+{
+    struct bcache_shard *shard;
+    struct bcache_entry *e;
+    ssize_t n = -1;
+    uint64_t hash;
+
+    shard = shard_of(key, &hash);
+    pthread_mutex_lock(&shard->lock);
+    e = *shard_slot(shard, hash, key);
+    if (e && e->data && (in + size <= e->len)) {
+        memcpy(buf, e->data + in, size);
+        e->ref = 1;
+        n = size;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return n;
+}
+
+static int shard_has(const struct bcache_key *key)
+{
+    struct bcache_shard *shard;
+    struct bcache_entry *e;
+    uint64_t hash;
+
+    shard = shard_of(key, &hash);
+    pthread_mutex_lock(&shard->lock);
+    e = *shard_slot(shard, hash, key);
+    pthread_mutex_unlock(&shard->lock);
+
+    return e && e->data;
+}
+
+// Insert a block c read, unless the file was written or truncated
+// since the reader looked (writes) or c may not have it
+static void shard_insert(struct bcache_container *c, const struct bcache_key *key, const char *src, size_t len,
+                         struct bcache_gen *gen, uint32_t writes)
+{
+    struct bcache_shard *shard;
+    struct bcache_entry *e, **slot;
+    uint64_t hash;
+    char *data;
+
+    data = malloc(len);
+    if (data == NULL) return;
+    memcpy(data, src, len);
+
+    shard = shard_of(key, &hash);
+    pthread_mutex_lock(&shard->lock);
+    if ((__atomic_load_n(&gen->gen, __ATOMIC_ACQUIRE) != key->gen) ||
+        (__atomic_load_n(&gen->writes, __ATOMIC_ACQUIRE) != writes))
+        goto drop;
+
+    e = *shard_slot(shard, hash, key);
+    if (e && e->data) {
+        // another reader got here first, or the block grew
+        container_account(e->owner, -(ssize_t) e->len);
+        free(e->data);
+        e->data = data;
+        e->len = len;
+        e->owner = c;
+        container_account(c, len);
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    while (container_over_limit(c, len))
+        if (!evict_own(shard, c)) goto drop;
+    if (resident(shard) >= shard_blocks) {
+        if (!(container_over_share(c, len) && evict_own(shard, c))) cold_hand(shard);
+    }
+
+    // eviction may have expired the ghost
+    slot = shard_slot(shard, hash, key);
+    e = *slot;
+    if (e) {
+        // read again after it was evicted: cold blocks need more room
+        list_remove(shard, e);
+        if (shard->cold_target + 1 < shard_blocks) shard->cold_target++;
+        list_append(shard, e, BCACHE_HOT);
+    } else {
+        e = calloc(1, sizeof(*e));
+        if (e == NULL) goto drop;
+        e->key = *key;
+        *slot = e;
+        list_append(shard, e, BCACHE_COLD);
+    }
+    e->data = data;
+    e->len = len;
+    e->owner = c;
+    container_account(c, len);
+    pthread_mutex_unlock(&shard->lock);
+    return;
+
+drop:
+    pthread_mutex_unlock(&shard->lock);
+    free(data);
+}
+
+static void shard_drop(const struct bcache_key *key)
+{
+    struct bcache_shard *shard;
+    struct bcache_entry *e;
+    uint64_t hash;
+
+    shard = shard_of(key, &hash);
+    pthread_mutex_lock(&shard->lock);
+    e = *shard_slot(shard, hash, key);
+    if (e) entry_free(shard, e);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Read the run of missing blocks from key->block on, up to the one
+// holding the last byte wanted, and copy from offset in of the first
+// into buf.  Returns what was copied, or -1 with errno set; *eof is set
+// if the file ended before the run did.
+static ssize_t bcache_fill(int fd, struct bcache_container *c, struct bcache_key key, struct bcache_gen *gen,
+                           size_t in, char *buf, size_t size, int *eof)
+{
+    off_t first = key.block, last = key.block + (in + size - 1) / BCACHE_BLOCK;
+    uint32_t writes = __atomic_load_n(&gen->writes, __ATOMIC_ACQUIRE);
+    size_t span, len;
+    ssize_t n;
+    char *run;
+
+    for (key.block = first + 1; (key.block <= last) && !shard_has(&key); key.block++)
+        ;
+    span = (key.block - first) * BCACHE_BLOCK;
+
+    run = malloc(span);
+    if (run == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    n = FCFS_IO(fcfuse_uring_pread(fd, run, span, first * BCACHE_BLOCK));
+    if (n < 0) {
+        free(run);
+        return -1;
+    }
+    __atomic_add_fetch(&c->misses, (n + BCACHE_BLOCK - 1) / BCACHE_BLOCK, __ATOMIC_RELAXED);
+    *eof = ((size_t) n < span);
+
+    for (key.block = first; (key.block - first) * BCACHE_BLOCK < n; key.block++) {
+        len = n - (key.block - first) * BCACHE_BLOCK;
+        if (len > BCACHE_BLOCK) len = BCACHE_BLOCK;
+        shard_insert(c, &key, run + (key.block - first) * BCACHE_BLOCK, len, gen, writes);
+    }
+
+    len = ((size_t) n > in) ? n - in : 0;
+    if (len > size) len = size;
+    memcpy(buf, run + in, len);
+    free(run);
+
+    return len;
+}
+
+/** pread() through the cache, for a handle of container cid on the
+    backing inode dev:ino */
+ssize_t fcfuse_bcache_pread(int fd, dev_t dev, ino_t ino, int cid, char *buf, size_t size, off_t offset)
+{
+    struct bcache_container *c = container_of(cid);
+    struct bcache_gen *gen = gen_of(dev, ino);
+    struct bcache_key key;
+    size_t done = 0, in, want;
+    ssize_t n;
+    int eof = 0;
+
+    memset(&key, 0, sizeof(key));
+    key.dev = dev;
+    key.ino = ino;
+
+    while (done < size) {
+        key.gen = __atomic_load_n(&gen->gen, __ATOMIC_ACQUIRE);
+        key.block = (offset + done) / BCACHE_BLOCK;
+        in = (offset + done) % BCACHE_BLOCK;
+        want = size - done;
+        if (want > BCACHE_BLOCK - in) want = BCACHE_BLOCK - in;
+
+        n = shard_copy(&key, in, buf + done, want);
+        if (n >= 0) {
+            __atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+            done += n;
+            continue;
+        }
+
+        n = bcache_fill(fd, c, key, gen, in, buf + done, size - done, &eof);
+        if (n < 0) return done ? (ssize_t) done : -1;
+        done += n;
+        if (eof) break;
+    }
+
+    return done;
+}
+
+/** After a write of size bytes at offset to dev:ino went to the
+    backing file, successful or not */
+void fcfuse_bcache_write(dev_t dev, ino_t ino, off_t offset, size_t size)
+{
+    struct bcache_gen *gen = gen_of(dev, ino);
+    struct bcache_key key;
+    off_t last;
+
+    if ((bcache_shards == NULL) || (size == 0)) return;
+
+    // readers that looked before this won't insert, and whatever was
+    // inserted before this is dropped below
+    __atomic_add_fetch(&gen->writes, 1, __ATOMIC_ACQ_REL);
+
+    memset(&key, 0, sizeof(key));
+    key.dev = dev;
+    key.ino = ino;
+    key.gen = __atomic_load_n(&gen->gen, __ATOMIC_ACQUIRE);
+    last = (offset + size - 1) / BCACHE_BLOCK;
+    for (key.block = offset / BCACHE_BLOCK; key.block <= last; key.block++) shard_drop(&key);
+}
+
+/** dev:ino was truncated, or its inode may be reused: forget its
+    blocks, and advance its generation for fcfuse_mmap.c too */
+void fcfuse_bcache_truncate(dev_t dev, ino_t ino)
+{
+    __atomic_add_fetch(&gen_of(dev, ino)->gen, 1, __ATOMIC_ACQ_REL);
+}
+
+/** The truncation generation of dev:ino, which
+    fcfuse_bcache_truncate() advances; files may share one */
+uint32_t *fcfuse_bcache_generation(dev_t dev, ino_t ino)
+{
+    return &gen_of(dev, ino)->gen;
+}
+
+/** Up to max containers' use of the cache, returns how many */
+int fcfuse_bcache_usage(struct fcfuse_bcache_usage *rows, int max)
+{
+    int i, n = 0;
+
+    for (i = 0; (i < BCACHE_CONTAINERS) && (n < max); i++) {
+        struct bcache_container *c = &bcache_containers[i];
+        int cid = __atomic_load_n(&c->cid, __ATOMIC_ACQUIRE);
+
+        if (cid == CID_FREE) continue;
+        rows[n].cid = cid;
+        rows[n].bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+        rows[n].limit = c->limit;
+        rows[n].hits = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+        rows[n].misses = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+        n++;
+    }
+
+    return n;
+}
+
+/** Calls fn for each resident block, under its shard's lock */
+void fcfuse_bcache_foreach(void (*fn)(int cid, int hot, void *arg), void *arg)
+{
+    struct bcache_entry *e;
+    int s, l;
+
+    if (bcache_shards == NULL) return;
+
+    for (s = 0; s < BCACHE_SHARDS; s++) {
+        pthread_mutex_lock(&bcache_shards[s].lock);
+        for (l = BCACHE_COLD; l <= BCACHE_HOT; l++)
+            for (e = bcache_shards[s].lists[l].head; e; e = e->next) fn(e->owner->cid, l == BCACHE_HOT, arg);
+        pthread_mutex_unlock(&bcache_shards[s].lock);
+    }
+}
@@ -0,0 +1,42 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A sharded cache of backing-file blocks in the daemon, with a global
+  memory budget (-o block_cache) and per-container limits
+  (-o block_cache_limit).
+*/
+
+#ifndef _FCFUSE_BCACHE_H_
+#define _FCFUSE_BCACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Containers fcfuse_bcache_usage() may report, a power of two
+#define FCFUSE_BCACHE_CONTAINERS 256
+
+// One container's use of the cache, see fcfuse_bcache_usage()
+struct fcfuse_bcache_usage {
+    int cid;
+    size_t bytes;
+    size_t limit;                   // 0 if it has none
+    uint64_t hits;                  // blocks
+    uint64_t misses;
+};
+
+int  fcfuse_bcache_set_limit(int cid, unsigned int mb);
+int  fcfuse_bcache_init(unsigned int mb);
+int  fcfuse_bcache_enabled(void);
+void fcfuse_bcache_destroy(void);
+
+ssize_t fcfuse_bcache_pread(int fd, dev_t dev, ino_t ino, int cid, char *buf, size_t size, off_t offset);
+void fcfuse_bcache_write(dev_t dev, ino_t ino, off_t offset, size_t size);
+void fcfuse_bcache_truncate(dev_t dev, ino_t ino);
+uint32_t *fcfuse_bcache_generation(dev_t dev, ino_t ino);
+
+size_t fcfuse_bcache_budget(void);
+int  fcfuse_bcache_usage(struct fcfuse_bcache_usage *rows, int max);
+void fcfuse_bcache_foreach(void (*fn)(int cid, int hot, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  With -o capture=FILE every request is written to FILE, one line
+  each, so benchmark/fcreplay can issue the same stream again:
+
+    START DURATION PID CID OP RESULT OFFSET SIZE ARG PATH PATH2
+
+  START is when the request came in, in ns since capture began, and
+  DURATION how long it took.  PID is the calling thread and CID its
+  container, -1 outside any.  OFFSET and SIZE are those of reads,
+  writes and copies, and OFFSET the new size for truncates.  ARG holds
+  the mode of mknod, mkdir and chmod, the flags of open, the mask of
+  access and the like.  PATH2 is the second path of rename, link,
+  symlink and copy_file_range, - otherwise.  Spaces, control
+  characters and % in paths are written as %XX.
+
+  Nothing touches the disk in the request's thread: lines go into a
+  buffer that a thread of our own writes out every CAPTURE_INTERVAL_MS
+  or when it is half full.  When the writer can't keep up, requests
+  are dropped rather than waited for, and the count is written at the
+  end of the file.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fcfuse_capture.h"
+
+#define CAPTURE_BUF (8 << 20)
+#define CAPTURE_LINE (6 * PATH_MAX + 256)
+#define CAPTURE_INTERVAL_MS 200
+
+int fcfuse_capture_on;
+
+static FILE *capture_file;
+static uint64_t capture_epoch;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;
+static char *capture_buf[2];
+static size_t capture_fill;             // bytes in capture_buf[capture_cur]
+static int capture_cur;
+static uint64_t capture_dropped;
+static int capture_stopping;
+static pthread_t capture_thread;
+static int capture_running;
+
+/**
+ * Open FILE for -o capture, before fuse_main() so a bad path stops the
+ * mount.  Returns 0 or -errno.
+ */
+int fcfuse_capture_init(const char *file)
+{
+    capture_file = fopen(file, "w");
+    if (capture_file == NULL) return -errno;
+
+    return 0;
+}
+
+// Write out what the request threads put in the buffer.  Returns
+// whether there is more to come.
+static int capture_flush(void)
+{
+    struct timespec deadline;
+    char *buf;
+    size_t len;
+    int more;
+
+    pthread_mutex_lock(&capture_lock);
+    if (!capture_stopping && (capture_fill < CAPTURE_BUF / 2)) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CAPTURE_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&capture_cond, &capture_lock, &deadline);
+    }
+    buf = capture_buf[capture_cur];
+    len = capture_fill;
+    capture_cur ^= 1;
+    capture_fill = 0;
+    more = !capture_stopping;
+    pthread_mutex_unlock(&capture_lock);
+
+    if (len && (fwrite(buf, 1, len, capture_file) != len))
+        log_at(LOG_LEVEL_ERROR, "capture: write failed: %s\n", strerror(errno));
+    fflush(capture_file);
+
+    return more;
+}
+
+static void *capture_main(void *arg)
+{
+    (void) arg;
+
+    while (capture_flush()) continue;
+
+    return NULL;
+}
+
+/** Begin capturing, from fcfuse_init().  Returns 0 or -errno. */
+int fcfuse_capture_start(void)
+{
+    int retstat;
+
+    if (capture_file == NULL) return 0;
+
+    capture_buf[0] = malloc(CAPTURE_BUF);
+    capture_buf[1] = malloc(CAPTURE_BUF);
+    if ((capture_buf[0] == NULL) || (capture_buf[1] == NULL)) return -ENOMEM;
+
+    // not in fcfuse_capture_init(), where the parent that fuse_main()
+    // leaves behind would write it again on exit
+    fprintf(capture_file, FCFUSE_CAPTURE_MAGIC "\n"
+            "# start duration pid cid op result offset size arg path path2\n");
+    capture_epoch = fcfuse_now();
+
+    retstat = -pthread_create(&capture_thread, NULL, capture_main, NULL);
+    if (retstat != 0) return retstat;
+    capture_running = 1;
+    __atomic_store_n(&fcfuse_capture_on, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void fcfuse_capture_stop(void)
+{
+    if (!capture_running) return;
+
+    __atomic_store_n(&fcfuse_capture_on, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&capture_lock);
+    capture_stopping = 1;
+    pthread_cond_signal(&capture_cond);
+    pthread_mutex_unlock(&capture_lock);
+    pthread_join(capture_thread, NULL);
+    capture_running = 0;
+
+    // whatever came in after the last flush
+    capture_flush();
+    if (capture_dropped)
+        fprintf(capture_file, "# dropped %llu\n", (unsigned long long) capture_dropped);
+    fclose(capture_file);
+    capture_file = NULL;
+}
+
+// Append path to the line at p, escaped; returns the new end
+static char *put_path(char *p, const char *path)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *) path;
+
+    if ((path == NULL) || !strcmp(path, "-")) {
+        // - alone stands for no path
+        if (path) p = stpcpy(p, "%2d");
+        else *p++ = '-';
+        return p;
+    }
+
+    for (; *s; s++) {
+        if ((*s <= ' ') || (*s == '%') || (*s == 0x7f)) {
+            *p++ = '%';
+            *p++ = hex[*s >> 4];
+            *p++ = hex[*s & 15];
+        } else {
+            *p++ = *s;
+        }
+    }
+
+    return p;
+}
+
+/** Add the request that just ended, which took ns */
+void fcfuse_capture_record(const struct fcfuse_op *cur, uint64_t ns, long retstat)
+{
+    char line[CAPTURE_LINE];
+    char *p = line;
+    size_t len;
+
+    p += sprintf(p, "%llu %llu %d %d %s %ld %lld %llu %llu ",
+                 (unsigned long long) (cur->start - capture_epoch), (unsigned long long) ns,
+                 (int) fuse_get_context()->pid, cur->cid, fcfuse_op_name(cur->op), retstat,
+                 (long long) cur->off, (unsigned long long) cur->size, (unsigned long long) cur->arg);
+    p = put_path(p, cur->path);
+    *p++ = ' ';
+    p = put_path(p, cur->path2);
+    *p++ = '\n';
+    len = p - line;
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_fill + len > CAPTURE_BUF) {
+        capture_dropped++;
+    } else {
+        memcpy(capture_buf[capture_cur] + capture_fill, line, len);
+        capture_fill += len;
+        if (capture_fill >= CAPTURE_BUF / 2) pthread_cond_signal(&capture_cond);
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,22 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Capture of every request to a file, for benchmark/fcreplay.
+*/
+
+#ifndef _FCFUSE_CAPTURE_H_
+#define _FCFUSE_CAPTURE_H_
+
+#include "fcfuse_stats.h"
+
+#define FCFUSE_CAPTURE_MAGIC "# fcfuse capture 1"
+
+extern int fcfuse_capture_on;
+
+int  fcfuse_capture_init(const char *file);
+int  fcfuse_capture_start(void);
+void fcfuse_capture_stop(void);
+void fcfuse_capture_record(const struct fcfuse_op *cur, uint64_t ns, long retstat);
+
+#endif
@@ -0,0 +1,37 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A handful of containers at most get each option, so a set is an
+  array searched from the start.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "fcfuse_cidset.h"
+
+/** Add cid to set.  Returns 0 or -ENOMEM. */
+int fcfuse_cidset_add(struct fcfuse_cidset *set, int cid)
+{
+    int *cids;
+
+    if (fcfuse_cidset_has(set, cid)) return 0;
+    cids = realloc(set->cids, (set->n + 1) * sizeof(*cids));
+    if (cids == NULL) return -ENOMEM;
+    set->cids = cids;
+    set->cids[set->n++] = cid;
+
+    return 0;
+}
+
+/** Whether cid is in set */
+int fcfuse_cidset_has(const struct fcfuse_cidset *set, int cid)
+{
+    int i;
+
+    for (i = 0; i < set->n; i++)
+        if (set->cids[i] == cid) return 1;
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Sets of container ids, for the options given once per container
+  (-o direct=CID, -o stream=CID, -o mmap=CID).
+*/
+
+#ifndef _FCFUSE_CIDSET_H_
+#define _FCFUSE_CIDSET_H_
+
+// Filled before fuse_main() and only read after, so without a lock
+struct fcfuse_cidset {
+    int *cids;
+    int n;
+};
+
+int  fcfuse_cidset_add(struct fcfuse_cidset *set, int cid);
+int  fcfuse_cidset_has(const struct fcfuse_cidset *set, int cid);
+
+#endif
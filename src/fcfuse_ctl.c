@@ -0,0 +1,877 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  With -o ctl_socket=PATH the daemon listens on a Unix-domain socket
+  for commands, one per line, e.g.
+
+    socat - UNIX-CONNECT:fcfs.sock
+    set log_level debug
+    invalidate 3
+
+  Each reply is the command's output followed by a line saying "ok"
+  or "error: <why>".  An HTTP GET of /metrics, /stats or /caches gets
+  the same text over HTTP/1.0, so a scraper can read
+
+    curl --unix-socket fcfs.sock http://localhost/metrics
+
+  The socket is only accessible to its owner, and connections from
+  other users are refused.  Commands are served one at a time by a
+  thread of our own; nothing here runs in a request's thread.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "fcfuse_bcache.h"
+#include "fcfuse_ctl.h"
+#include "fcfuse_fdcache.h"
+#include "fcfuse_lookup.h"
+#include "fcfuse_slowlog.h"
+#include "fcfuse_stats.h"
+#include "fcfuse_trace.h"
+#include "fcfuse_trash.h"
+#include "fcfuse_view.h"
+
+#define CTL_LINE 1024
+#define CTL_TIMEOUT 60                      // seconds a client may stay quiet
+#define CTL_ALL (-1)                        // cid of "all"
+
+struct ctl_conn {
+    int fd;
+    size_t len;             // bytes in buf
+    size_t next;            // where the line after the current one starts
+    char buf[CTL_LINE];
+};
+
+struct ctl_command {
+    const char *name;
+    const char *usage;
+    int (*run)(FILE *out, char *arg);
+};
+
+struct ctl_knob {
+    const char *name;
+    int (*set)(const char *value);
+    void (*get)(FILE *out);
+};
+
+// Entries of one cache and container, by state
+struct ctl_usage {
+    int cid;
+    int count[2];
+};
+
+struct ctl_usage_table {
+    struct ctl_usage *rows;
+    int n;
+    int size;
+};
+
+struct ctl_cache {
+    const char *name;
+    const char *states[2];  // what foreach's 0 and 1 stand for
+    void (*foreach)(void (*fn)(int cid, int state, void *arg), void *arg);
+};
+
+static const struct ctl_cache ctl_caches[] = {
+    { "lookup", { "positive", "negative" }, fcfuse_lookup_foreach },
+    { "fd", { "idle", "busy" }, fcfuse_fdcache_foreach },
+    { "view", { "idle", "open" }, fcfuse_view_foreach },
+    { "block", { "cold", "hot" }, fcfuse_bcache_foreach },
+};
+
+#define CTL_CACHES (sizeof(ctl_caches) / sizeof(ctl_caches[0]))
+
+static char ctl_path[PATH_MAX];
+static int ctl_fd = -1;
+static int ctl_wake[2] = { -1, -1 };
+static pthread_t ctl_thread;
+static int ctl_running;
+
+// Runs under the cache's lock, so no more than counting
+static void usage_add(int cid, int state, void *arg)
+{
+    struct ctl_usage_table *table = arg;
+    struct ctl_usage *rows;
+    int i;
+
+    for (i = 0; i < table->n; i++)
+        if (table->rows[i].cid == cid) break;
+
+    if (i == table->n) {
+        if (table->n == table->size) {
+            rows = realloc(table->rows, (table->size * 2 + 16) * sizeof(*rows));
+            if (rows == NULL) return;
+            table->rows = rows;
+            table->size = table->size * 2 + 16;
+        }
+        memset(&table->rows[i], 0, sizeof(table->rows[i]));
+        table->rows[i].cid = cid;
+        table->n++;
+    }
+
+    table->rows[i].count[state != 0]++;
+}
+
+static int usage_compare(const void *a, const void *b)
+{
+    const struct ctl_usage *ua = a, *ub = b;
+
+    return (ua->cid > ub->cid) - (ua->cid < ub->cid);
+}
+
+static void usage_collect(const struct ctl_cache *cache, struct ctl_usage_table *table)
+{
+    table->n = 0;
+    cache->foreach(usage_add, table);
+    qsort(table->rows, table->n, sizeof(*table->rows), usage_compare);
+}
+
+// Containers as the stats show them
+static void ctl_cid_name(int cid, char *buf, size_t size, const char *none)
+{
+    if (cid < 0) snprintf(buf, size, "%s", none);
+    else snprintf(buf, size, "%d", cid);
+}
+
+static int ctl_parse_cid(const char *arg, int *cid)
+{
+    char *end;
+    long value;
+
+    if ((arg == NULL) || (*arg == '\0')) return -EINVAL;
+    if (!strcmp(arg, "all")) {
+        *cid = CTL_ALL;
+        return 0;
+    }
+
+    value = strtol(arg, &end, 10);
+    if ((*end != '\0') || (value < 0) || (value > INT_MAX)) return -EINVAL;
+    *cid = value;
+
+    return 0;
+}
+
+static int ctl_parse_double(const char *arg, double *value)
+{
+    char *end;
+
+    if ((arg == NULL) || (*arg == '\0')) return -EINVAL;
+    *value = strtod(arg, &end);
+    if ((*end != '\0') || (*value < 0)) return -EINVAL;
+
+    return 0;
+}
+
+// Knobs, named as the -o options that set them at mount time
+
+static int knob_set_log_level(const char *value)
+{
+    int level = log_parse_level(value);
+
+    if (level < LOG_LEVEL_OFF) return -EINVAL;
+    log_set_level(level);
+
+    return 0;
+}
+
+static void knob_get_log_level(FILE *out)
+{
+    fprintf(out, "%s\n", log_level_name(__atomic_load_n(&log_level, __ATOMIC_RELAXED)));
+}
+
+static int knob_set_trace_sample(const char *value)
+{
+    char *end;
+    unsigned long sample = strtoul(value, &end, 10);
+
+    if ((*value == '\0') || (*end != '\0') || (sample > UINT_MAX)) return -EINVAL;
+    fcfuse_trace_set_sample(sample);
+
+    return 0;
+}
+
+static void knob_get_trace_sample(FILE *out)
+{
+    fprintf(out, "%u\n", __atomic_load_n(&fcfuse_trace_sample, __ATOMIC_RELAXED));
+}
+
+static int knob_set_slow_threshold(const char *value)
+{
+    double threshold, multiple, us;
+
+    if (ctl_parse_double(value, &us) != 0) return -EINVAL;
+    fcfuse_slowlog_get(&threshold, &multiple);
+    fcfuse_slowlog_set(us, multiple);
+
+    return 0;
+}
+
+static void knob_get_slow_threshold(FILE *out)
+{
+    double threshold, multiple;
+
+    fcfuse_slowlog_get(&threshold, &multiple);
+    fprintf(out, "%g\n", threshold);
+}
+
+static int knob_set_slow_p99(const char *value)
+{
+    double threshold, multiple, k;
+
+    if (ctl_parse_double(value, &k) != 0) return -EINVAL;
+    fcfuse_slowlog_get(&threshold, &multiple);
+    fcfuse_slowlog_set(threshold, k);
+
+    return 0;
+}
+
+static void knob_get_slow_p99(FILE *out)
+{
+    double threshold, multiple;
+
+    fcfuse_slowlog_get(&threshold, &multiple);
+    fprintf(out, "%g\n", multiple);
+}
+
+static int knob_set_fd_cache(const char *value)
+{
+    char *end;
+    long max = strtol(value, &end, 10);
+
+    if ((*value == '\0') || (*end != '\0') || (max < 0) || (max > INT_MAX)) return -EINVAL;
+    fcfuse_fdcache_set_max(max);
+
+    return 0;
+}
+
+static void knob_get_fd_cache(FILE *out)
+{
+    fprintf(out, "%d\n", fcfuse_fdcache_get_max());
+}
+
+static int knob_set_lookup_attr_timeout(const char *value)
+{
+    double attr, negative, timeout;
+
+    if (ctl_parse_double(value, &timeout) != 0) return -EINVAL;
+    fcfuse_lookup_get_timeout(FCFUSE_LOOKUP_DEFAULT, &attr, &negative);
+
+    return fcfuse_lookup_set_timeout(FCFUSE_LOOKUP_DEFAULT, timeout, negative);
+}
+
+static void knob_get_lookup_attr_timeout(FILE *out)
+{
+    double attr, negative;
+
+    fcfuse_lookup_get_timeout(FCFUSE_LOOKUP_DEFAULT, &attr, &negative);
+    fprintf(out, "%g\n", attr);
+}
+
+static int knob_set_lookup_negative_timeout(const char *value)
+{
+    double attr, negative, timeout;
+
+    if (ctl_parse_double(value, &timeout) != 0) return -EINVAL;
+    fcfuse_lookup_get_timeout(FCFUSE_LOOKUP_DEFAULT, &attr, &negative);
+
+    return fcfuse_lookup_set_timeout(FCFUSE_LOOKUP_DEFAULT, attr, timeout);
+}
+
+static void knob_get_lookup_negative_timeout(FILE *out)
+{
+    double attr, negative;
+
+    fcfuse_lookup_get_timeout(FCFUSE_LOOKUP_DEFAULT, &attr, &negative);
+    fprintf(out, "%g\n", negative);
+}
+
+// CID:ATTR:NEG, as -o lookup_timeout= takes it
+static int knob_set_lookup_timeout(const char *value)
+{
+    double attr, negative;
+    int cid, n = 0;
+
+    if ((sscanf(value, "%d:%lf:%lf%n", &cid, &attr, &negative, &n) != 3) || (value[n] != '\0') ||
+        (cid < 0))
+        return -EINVAL;
+
+    return fcfuse_lookup_set_timeout(cid, attr, negative);
+}
+
+static void knob_get_lookup_timeout(FILE *out)
+{
+    fcfuse_lookup_dump_timeouts(out);
+}
+
+static const struct ctl_knob ctl_knobs[] = {
+    { "log_level", knob_set_log_level, knob_get_log_level },
+    { "trace_sample", knob_set_trace_sample, knob_get_trace_sample },
+    { "slow_threshold", knob_set_slow_threshold, knob_get_slow_threshold },
+    { "slow_p99", knob_set_slow_p99, knob_get_slow_p99 },
+    { "fd_cache", knob_set_fd_cache, knob_get_fd_cache },
+    { "lookup_attr_timeout", knob_set_lookup_attr_timeout, knob_get_lookup_attr_timeout },
+    { "lookup_negative_timeout", knob_set_lookup_negative_timeout, knob_get_lookup_negative_timeout },
+    { "lookup_timeout", knob_set_lookup_timeout, knob_get_lookup_timeout },
+};
+
+#define CTL_KNOBS (sizeof(ctl_knobs) / sizeof(ctl_knobs[0]))
+
+static const struct ctl_knob *ctl_knob(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < CTL_KNOBS; i++)
+        if (!strcmp(ctl_knobs[i].name, name)) return &ctl_knobs[i];
+
+    return NULL;
+}
+
+// Commands.  arg is the rest of the line, NULL if there is none.
+
+static int cmd_help(FILE *out, char *arg);
+
+// Blocks and bytes per container; one block is one hit or miss
+static int metrics_bcache(FILE *out)
+{
+    struct fcfuse_bcache_usage *rows;
+    char cid[16];
+    int i, n;
+
+    rows = calloc(FCFUSE_BCACHE_CONTAINERS, sizeof(*rows));
+    if (rows == NULL) return -ENOMEM;
+    n = fcfuse_bcache_usage(rows, FCFUSE_BCACHE_CONTAINERS);
+
+    fprintf(out, "# HELP fcfuse_block_cache_budget_bytes Backing data the block cache may hold.\n");
+    fprintf(out, "# TYPE fcfuse_block_cache_budget_bytes gauge\n");
+    fprintf(out, "fcfuse_block_cache_budget_bytes %zu\n", fcfuse_bcache_budget());
+    fprintf(out, "# HELP fcfuse_block_cache_bytes Backing data held in the block cache.\n");
+    fprintf(out, "# TYPE fcfuse_block_cache_bytes gauge\n");
+    for (i = 0; i < n; i++) {
+        ctl_cid_name(rows[i].cid, cid, sizeof(cid), "none");
+        fprintf(out, "fcfuse_block_cache_bytes{cid=\"%s\"} %zu\n", cid, rows[i].bytes);
+    }
+    fprintf(out, "# HELP fcfuse_block_cache_limit_bytes Backing data a container may hold in the block cache.\n");
+    fprintf(out, "# TYPE fcfuse_block_cache_limit_bytes gauge\n");
+    for (i = 0; i < n; i++) {
+        if (rows[i].limit == 0) continue;
+        ctl_cid_name(rows[i].cid, cid, sizeof(cid), "none");
+        fprintf(out, "fcfuse_block_cache_limit_bytes{cid=\"%s\"} %zu\n", cid, rows[i].limit);
+    }
+    fprintf(out, "# HELP fcfuse_block_cache_hits_total Blocks served from the block cache.\n");
+    fprintf(out, "# TYPE fcfuse_block_cache_hits_total counter\n");
+    for (i = 0; i < n; i++) {
+        ctl_cid_name(rows[i].cid, cid, sizeof(cid), "none");
+        fprintf(out, "fcfuse_block_cache_hits_total{cid=\"%s\"} %llu\n", cid, (unsigned long long) rows[i].hits);
+    }
+    fprintf(out, "# HELP fcfuse_block_cache_misses_total Blocks read from the backing files into the block cache.\n");
+    fprintf(out, "# TYPE fcfuse_block_cache_misses_total counter\n");
+    for (i = 0; i < n; i++) {
+        ctl_cid_name(rows[i].cid, cid, sizeof(cid), "none");
+        fprintf(out, "fcfuse_block_cache_misses_total{cid=\"%s\"} %llu\n", cid,
+                (unsigned long long) rows[i].misses);
+    }
+    free(rows);
+
+    return 0;
+}
+
+static int cmd_metrics(FILE *out, char *arg)
+{
+    struct ctl_usage_table table = { NULL, 0, 0 };
+    char cid[16];
+    size_t c;
+    int i, s, retstat;
+
+    retstat = fcfuse_stats_metrics(out);
+    if (retstat != 0) return retstat;
+
+    fprintf(out, "# HELP fcfuse_cache_entries Entries held by the daemon's caches.\n");
+    fprintf(out, "# TYPE fcfuse_cache_entries gauge\n");
+    for (c = 0; c < CTL_CACHES; c++) {
+        usage_collect(&ctl_caches[c], &table);
+        for (i = 0; i < table.n; i++) {
+            ctl_cid_name(table.rows[i].cid, cid, sizeof(cid), "none");
+            for (s = 0; s < 2; s++)
+                fprintf(out, "fcfuse_cache_entries{cache=\"%s\",cid=\"%s\",state=\"%s\"} %d\n",
+                        ctl_caches[c].name, cid, ctl_caches[c].states[s], table.rows[i].count[s]);
+        }
+    }
+    free(table.rows);
+
+    fprintf(out, "# HELP fcfuse_fd_cache_max Backing descriptors the fd cache may keep.\n");
+    fprintf(out, "# TYPE fcfuse_fd_cache_max gauge\n");
+    fprintf(out, "fcfuse_fd_cache_max %d\n", fcfuse_fdcache_get_max());
+
+    if (fcfuse_bcache_enabled()) return metrics_bcache(out);
+
+    return 0;
+}
+
+static int cmd_stats(FILE *out, char *arg)
+{
+    char *buf;
+    size_t len;
+    int retstat;
+
+    retstat = fcfuse_stats_snapshot(&buf, &len);
+    if (retstat != 0) return retstat;
+    fwrite(buf, 1, len, out);
+    free(buf);
+
+    return 0;
+}
+
+static int cmd_caches(FILE *out, char *arg)
+{
+    struct ctl_usage_table table = { NULL, 0, 0 };
+    char cid[16];
+    int total[2];
+    size_t c;
+    int i, s;
+
+    fprintf(out, "%-8s %-6s %-10s %10s\n", "cache", "cid", "state", "entries");
+    for (c = 0; c < CTL_CACHES; c++) {
+        usage_collect(&ctl_caches[c], &table);
+        total[0] = total[1] = 0;
+        for (i = 0; i < table.n; i++)
+            for (s = 0; s < 2; s++) total[s] += table.rows[i].count[s];
+        for (s = 0; s < 2; s++)
+            fprintf(out, "%-8s %-6s %-10s %10d\n", ctl_caches[c].name, "all", ctl_caches[c].states[s], total[s]);
+        for (i = 0; i < table.n; i++) {
+            ctl_cid_name(table.rows[i].cid, cid, sizeof(cid), "-");
+            for (s = 0; s < 2; s++)
+                fprintf(out, "%-8s %-6s %-10s %10d\n", ctl_caches[c].name, cid, ctl_caches[c].states[s],
+                        table.rows[i].count[s]);
+        }
+    }
+    free(table.rows);
+    fprintf(out, "fd_cache %d\n", fcfuse_fdcache_get_max());
+    if (fcfuse_bcache_enabled()) fprintf(out, "block_cache %zu\n", fcfuse_bcache_budget());
+
+    return 0;
+}
+
+// Make what the container wrote through its cached descriptors durable
+static int cmd_flush(FILE *out, char *arg)
+{
+    int cid;
+
+    if (ctl_parse_cid(arg, &cid) != 0) return -EINVAL;
+
+    return fcfuse_fdcache_sync(cid);
+}
+
+// Drop whatever the daemon and the kernel cache for the container
+static int cmd_invalidate(FILE *out, char *arg)
+{
+    int cid;
+
+    if (ctl_parse_cid(arg, &cid) != 0) return -EINVAL;
+
+    if (cid == CTL_ALL) fcfuse_lookup_flush();
+    else fcfuse_lookup_flush_container(cid);
+    fcfuse_fdcache_flush(cid);
+    fcfuse_view_flush(cid);
+
+    return 0;
+}
+
+// Delete everything the container has in the data location
+static int cmd_purge(FILE *out, char *arg)
+{
+    int cid, n;
+
+    if ((ctl_parse_cid(arg, &cid) != 0) || (cid == CTL_ALL)) return -EINVAL;
+
+    n = fcfuse_trash_purge(cid);
+    if (n < 0) return n;
+    fprintf(out, "purged %d\n", n);
+
+    fcfuse_lookup_flush_container(cid);
+    fcfuse_fdcache_flush(cid);
+    fcfuse_view_flush(cid);
+
+    return 0;
+}
+
+static int cmd_get(FILE *out, char *arg)
+{
+    const struct ctl_knob *knob;
+    size_t i;
+
+    if (arg != NULL) {
+        knob = ctl_knob(arg);
+        if (knob == NULL) {
+            fprintf(out, "no knob %s\n", arg);
+            return -ENOENT;
+        }
+        knob->get(out);
+        return 0;
+    }
+
+    for (i = 0; i < CTL_KNOBS; i++) {
+        // lookup_timeout writes a line per container of its own
+        if (ctl_knobs[i].get == knob_get_lookup_timeout) {
+            ctl_knobs[i].get(out);
+            continue;
+        }
+        fprintf(out, "%s ", ctl_knobs[i].name);
+        ctl_knobs[i].get(out);
+    }
+
+    return 0;
+}
+
+static int cmd_set(FILE *out, char *arg)
+{
+    const struct ctl_knob *knob;
+    char *value;
+
+    if ((arg == NULL) || ((value = strchr(arg, ' ')) == NULL)) return -EINVAL;
+    *value++ = '\0';
+    while (*value == ' ') value++;
+
+    knob = ctl_knob(arg);
+    if (knob == NULL) {
+        fprintf(out, "no knob %s\n", arg);
+        return -ENOENT;
+    }
+    if (knob->set(value) != 0) return -EINVAL;
+    log_msg("control: set %s %s\n", arg, value);
+
+    return 0;
+}
+
+static int cmd_trace_dump(FILE *out, char *arg)
+{
+    return fcfuse_trace_dump(arg);
+}
+
+static const struct ctl_command ctl_commands[] = {
+    { "help", "help", cmd_help },
+    { "metrics", "metrics", cmd_metrics },
+    { "stats", "stats", cmd_stats },
+    { "caches", "caches", cmd_caches },
+    { "flush", "flush CID|all", cmd_flush },
+    { "invalidate", "invalidate CID|all", cmd_invalidate },
+    { "purge", "purge CID", cmd_purge },
+    { "get", "get [KNOB]", cmd_get },
+    { "set", "set KNOB VALUE", cmd_set },
+    { "trace_dump", "trace_dump [FILE]", cmd_trace_dump },
+};
+
+#define CTL_COMMANDS (sizeof(ctl_commands) / sizeof(ctl_commands[0]))
+
+static int cmd_help(FILE *out, char *arg)
+{
+    size_t i;
+
+    for (i = 0; i < CTL_COMMANDS; i++) fprintf(out, "%s\n", ctl_commands[i].usage);
+    fprintf(out, "knobs:");
+    for (i = 0; i < CTL_KNOBS; i++) fprintf(out, " %s", ctl_knobs[i].name);
+    fprintf(out, "\n");
+
+    return 0;
+}
+
+static const struct ctl_command *ctl_command(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < CTL_COMMANDS; i++)
+        if (!strcmp(ctl_commands[i].name, name)) return &ctl_commands[i];
+
+    return NULL;
+}
+
+static int ctl_send(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Next line of the connection without its line end; NULL on EOF, a
+// line too long, a client quiet for too long or fcfuse_ctl_stop()
+static char *ctl_getline(struct ctl_conn *conn)
+{
+    struct pollfd fds[2];
+    char *nl;
+    ssize_t n;
+
+    if (conn->next) {
+        memmove(conn->buf, conn->buf + conn->next, conn->len - conn->next);
+        conn->len -= conn->next;
+        conn->next = 0;
+    }
+
+    for (;;) {
+        nl = memchr(conn->buf, '\n', conn->len);
+        if (nl != NULL) {
+            *nl = '\0';
+            conn->next = nl - conn->buf + 1;
+            if ((nl > conn->buf) && (nl[-1] == '\r')) nl[-1] = '\0';
+            return conn->buf;
+        }
+        if (conn->len == sizeof(conn->buf)) return NULL;
+
+        fds[0].fd = conn->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = ctl_wake[0];
+        fds[1].events = POLLIN;
+        n = poll(fds, 2, CTL_TIMEOUT * 1000);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if ((n <= 0) || fds[1].revents) return NULL;
+
+        n = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, 0);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return NULL;
+        conn->len += n;
+    }
+}
+
+// Run one command line into out; returns what the command returned
+static int ctl_run(FILE *out, char *line, const struct ctl_command **cmdp)
+{
+    const struct ctl_command *cmd;
+    char *arg;
+
+    while (*line == ' ') line++;
+    arg = strchr(line, ' ');
+    if (arg != NULL) {
+        *arg++ = '\0';
+        while (*arg == ' ') arg++;
+        if (*arg == '\0') arg = NULL;
+    }
+
+    *cmdp = cmd = ctl_command(line);
+    if (cmd == NULL) return -ENOSYS;
+
+    return cmd->run(out, arg);
+}
+
+// GET /metrics and friends; line is the request line
+static void ctl_http(struct ctl_conn *conn, char *line)
+{
+    const struct ctl_command *cmd = NULL;
+    char header[128], path[64], *buf = NULL;
+    size_t len = 0;
+    FILE *out;
+    int retstat = -ENOENT;
+
+    // line goes when the next one is read
+    if (sscanf(line, "GET %63s", path) != 1) path[0] = '\0';
+
+    // the headers say nothing we need
+    while (((line = ctl_getline(conn)) != NULL) && (*line != '\0'))
+        ;
+
+    out = open_memstream(&buf, &len);
+    if (out == NULL) return;
+    if (!strcmp(path, "/metrics") || !strcmp(path, "/stats") || !strcmp(path, "/caches"))
+        retstat = ctl_run(out, path + 1, &cmd);
+    if (fclose(out) != 0) return;
+
+    if (retstat == 0)
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                 len);
+    else
+        snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Length: 0\r\n\r\n",
+                 (retstat == -ENOENT) ? "404 Not Found" : "500 Internal Server Error");
+
+    if ((ctl_send(conn->fd, header, strlen(header)) == 0) && (retstat == 0)) ctl_send(conn->fd, buf, len);
+    free(buf);
+}
+
+static void ctl_serve(int fd)
+{
+    const struct ctl_command *cmd;
+    struct ctl_conn *conn;
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    char *line, *buf;
+    size_t len;
+    FILE *out;
+    int retstat;
+
+    if ((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0) || (cred.uid != geteuid())) {
+        log_at(LOG_LEVEL_WARN, "control: refused connection from uid %d\n", (int) cred.uid);
+        return;
+    }
+
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) return;
+    conn->fd = fd;
+
+    while ((line = ctl_getline(conn)) != NULL) {
+        if (!strncmp(line, "GET ", 4)) {
+            ctl_http(conn, line);
+            break;
+        }
+        if (*line == '\0') continue;
+
+        buf = NULL;
+        len = 0;
+        out = open_memstream(&buf, &len);
+        if (out == NULL) break;
+
+        cmd = NULL;
+        retstat = ctl_run(out, line, &cmd);
+        if (retstat == 0) fprintf(out, "ok\n");
+        else if (retstat == -ENOSYS) fprintf(out, "error: unknown command, try help\n");
+        else if ((retstat == -EINVAL) && cmd) fprintf(out, "error: usage: %s\n", cmd->usage);
+        else fprintf(out, "error: %s\n", strerror(-retstat));
+
+        retstat = (fclose(out) == 0) ? ctl_send(fd, buf, len) : -ENOMEM;
+        free(buf);
+        if (retstat != 0) break;
+    }
+
+    free(conn);
+}
+
+static void *ctl_server(void *arg)
+{
+    struct pollfd fds[2];
+    int fd;
+
+    fds[0].fd = ctl_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = ctl_wake[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        ctl_serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+// Whether a daemon still listens on the socket at addr
+static int ctl_in_use(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int in_use;
+
+    if (fd < 0) return 1;
+    in_use = (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0) || (errno != ECONNREFUSED);
+    close(fd);
+
+    return in_use;
+}
+
+/**
+ * Bind and listen on the socket at path.  Runs from main() so a bad
+ * path stops the mount; path is made absolute since the daemon
+ * changes to / when it goes to the background.  A socket left behind
+ * by a daemon that is gone is replaced.  Returns 0 or -errno.
+ */
+int fcfuse_ctl_init(const char *path)
+{
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX];
+    int fd, retstat;
+
+    if (path[0] == '/') {
+        if (strlen(path) >= sizeof(ctl_path)) return -ENAMETOOLONG;
+        strcpy(ctl_path, path);
+    } else {
+        if (getcwd(cwd, sizeof(cwd)) == NULL) return -errno;
+        if (snprintf(ctl_path, sizeof(ctl_path), "%s/%s", cwd, path) >= (int) sizeof(ctl_path))
+            return -ENAMETOOLONG;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(ctl_path) >= sizeof(addr.sun_path)) return -ENAMETOOLONG;
+    strcpy(addr.sun_path, ctl_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -errno;
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        if ((errno != EADDRINUSE) || ctl_in_use(&addr) || (unlink(ctl_path) != 0) ||
+            (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0))
+            goto fail;
+    }
+    if ((chmod(ctl_path, S_IRUSR | S_IWUSR) != 0) || (listen(fd, 8) != 0)) {
+        unlink(ctl_path);
+        goto fail;
+    }
+
+    ctl_fd = fd;
+
+    return 0;
+
+fail:
+    retstat = -errno;
+    close(fd);
+    ctl_path[0] = '\0';
+
+    return retstat;
+}
+
+/** Start serving the socket; runs from fcfuse_init() */
+int fcfuse_ctl_start(void)
+{
+    int retstat;
+
+    if (ctl_fd < 0) return 0;
+    if (pipe2(ctl_wake, O_CLOEXEC) != 0) return -errno;
+
+    retstat = pthread_create(&ctl_thread, NULL, ctl_server, NULL);
+    if (retstat) return -retstat;
+    ctl_running = 1;
+
+    return 0;
+}
+
+void fcfuse_ctl_stop(void)
+{
+    if (ctl_running) {
+        if (write(ctl_wake[1], "", 1) == 1) pthread_join(ctl_thread, NULL);
+        else pthread_detach(ctl_thread);
+        ctl_running = 0;
+    }
+
+    if (ctl_fd >= 0) {
+        close(ctl_fd);
+        ctl_fd = -1;
+        unlink(ctl_path);
+    }
+}
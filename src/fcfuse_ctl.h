@@ -0,0 +1,16 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Unix-domain control socket for inspecting and tuning a running
+  daemon.
+*/
+
+#ifndef _FCFUSE_CTL_H_
+#define _FCFUSE_CTL_H_
+
+int  fcfuse_ctl_init(const char *path);
+int  fcfuse_ctl_start(void);
+void fcfuse_ctl_stop(void);
+
+#endif
@@ -0,0 +1,287 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Containers given with -o direct=CID stream files too large to be
+  worth caching.  Their backing files are opened with O_DIRECT, and
+  their handles with direct_io, so neither the backing filesystem's
+  page cache nor the kernel's cache of the mount keeps their data and
+  pushes out that of other tenants.
+
+  O_DIRECT wants the buffer, offset and length aligned to the
+  device's block size; DIRECT_ALIGN covers every common one.  FUSE
+  hands us whatever the application asked for, so requests that are
+  not aligned go through a bounce buffer spanning the blocks they
+  touch.  A write that starts or ends inside a block reads that block
+  first and writes it back whole, with the file's other writers held
+  off for the time.  If the file ends inside the span, writing it
+  whole would make the file longer than it is, if only for a moment:
+  the partial block at the new end goes through the page cache
+  instead, written only up to that end.
+
+  Bounce buffers are allocated when first needed and reused after
+  that.  At most -o direct_buffers of them (DIRECT_BUFFERS by default)
+  exist at once; further requests wait for one, which keeps the memory
+  the bulk tenants use bounded.
+
+  Appending handles, and backing filesystems that refuse O_DIRECT,
+  keep the page cache.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fcfuse_cidset.h"
+#include "fcfuse_direct.h"
+#include "fcfuse_uring.h"
+
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF (FCFUSE_MAX_REQUEST + 2 * DIRECT_ALIGN)
+#define DIRECT_BUFFERS 16
+#define DIRECT_LOCKS 64                         // power of two
+
+#define ALIGN_DOWN(x) ((x) & ~(off_t) (DIRECT_ALIGN - 1))
+#define ALIGN_UP(x) (((x) + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1))
+#define ALIGNED(x) (((uintptr_t) (x) & (DIRECT_ALIGN - 1)) == 0)
+
+// Containers with -o direct
+static struct fcfuse_cidset direct_cids;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static void **pool_free;
+static unsigned int pool_nfree;
+static unsigned int pool_allocated;
+static unsigned int pool_max = DIRECT_BUFFERS;
+
+// Writes to a file, by inode, so a block read for a partial write
+// isn't changed before it is written back
+static pthread_mutex_t direct_locks[DIRECT_LOCKS] = {
+    [0 ... DIRECT_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/** -o direct_buffers, before fuse_main() */
+void fcfuse_direct_init(unsigned int buffers)
+{
+    if (buffers) pool_max = buffers;
+}
+
+/** -o direct=CID.  Returns 0 or -ENOMEM. */
+int fcfuse_direct_add(int cid)
+{
+    return fcfuse_cidset_add(&direct_cids, cid);
+}
+
+/** Whether container cid opens its files with O_DIRECT */
+int fcfuse_direct_enabled(int cid)
+{
+    return fcfuse_cidset_has(&direct_cids, cid);
+}
+
+void fcfuse_direct_destroy(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    while (pool_nfree) free(pool_free[--pool_nfree]);
+    free(pool_free);
+    pool_free = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    log_msg("    direct: %u bounce buffers used\n", pool_allocated);
+}
+
+// A bounce buffer of at least len bytes, NULL if out of memory.
+// Requests larger than FUSE sends get one of their own.
+static void *pool_get(size_t len)
+{
+    void *buf = NULL;
+
+    if (len > DIRECT_BUF) return (posix_memalign(&buf, DIRECT_ALIGN, len) == 0) ? buf : NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if ((pool_free == NULL) && ((pool_free = calloc(pool_max, sizeof(*pool_free))) == NULL)) {
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+    while ((pool_nfree == 0) && (pool_allocated >= pool_max)) pthread_cond_wait(&pool_cond, &pool_lock);
+    if (pool_nfree) {
+        buf = pool_free[--pool_nfree];
+        pthread_mutex_unlock(&pool_lock);
+        return buf;
+    }
+    pool_allocated++;
+    pthread_mutex_unlock(&pool_lock);
+
+    if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_BUF) != 0) {
+        pthread_mutex_lock(&pool_lock);
+        pool_allocated--;
+        pthread_cond_signal(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+
+    return buf;
+}
+
+static void pool_put(void *buf, size_t len)
+{
+    if (len > DIRECT_BUF) {
+        free(buf);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool_free[pool_nfree++] = buf;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Without the inode (ino 0), every file shares one lock
+static pthread_mutex_t *direct_lock(dev_t dev, ino_t ino)
+{
+    if (ino == 0) return &direct_locks[0];
+
+    return &direct_locks[(ino ^ dev) & (DIRECT_LOCKS - 1)];
+}
+
+/** pread() of an O_DIRECT descriptor, any alignment */
+ssize_t fcfuse_direct_pread(int fd, void *buf, size_t size, off_t offset)
+{
+    off_t start = ALIGN_DOWN(offset);
+    size_t head = offset - start;
+    size_t span = ALIGN_UP(head + size);
+    ssize_t n;
+    char *bounce;
+    int err;
+
+    if (ALIGNED(buf) && ALIGNED(offset) && ALIGNED(size)) return fcfuse_uring_pread(fd, buf, size, offset);
+
+    bounce = pool_get(span);
+    if (bounce == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    n = fcfuse_uring_pread(fd, bounce, span, start);
+    err = errno;
+    if (n >= 0) {
+        // the file may end before offset, or before offset + size
+        n = ((size_t) n > head) ? n - head : 0;
+        if ((size_t) n > size) n = size;
+        memcpy(buf, bounce + head, n);
+    }
+    pool_put(bounce, span);
+    errno = err;
+
+    return n;
+}
+
+// Read the block at off into buf for a partial write; zeroes what
+// lies past the end of the file and notes where that is in *eof
+static int read_block(int fd, char *buf, off_t off, off_t *eof)
+{
+    ssize_t n = fcfuse_uring_pread(fd, buf, DIRECT_ALIGN, off);
+
+    if (n < 0) return -1;
+    if (n < DIRECT_ALIGN) {
+        memset(buf + n, 0, DIRECT_ALIGN - n);
+        if (*eof < 0) *eof = off + n;
+    }
+
+    return 0;
+}
+
+// pwrite() on an O_DIRECT descriptor through the page cache.  The
+// caller holds the descriptor's lock, so no other writer sees the flag
+// change; a reader that does reads through the cache, which is safe.
+static ssize_t buffered_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+    int flags = fcntl(fd, F_GETFL);
+    ssize_t n;
+    int err;
+
+    if ((flags == -1) || (fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0)) return -1;
+    n = pwrite(fd, buf, size, offset);
+    err = errno;
+    if (fcntl(fd, F_SETFL, flags) != 0)
+        log_at(LOG_LEVEL_WARN, "    direct: fd %d left without O_DIRECT: %s\n", fd, strerror(errno));
+    errno = err;
+
+    return n;
+}
+
+/** pwrite() of an O_DIRECT descriptor of the backing inode dev:ino
+    (ino 0 if unknown), any alignment */
+ssize_t fcfuse_direct_pwrite(int fd, dev_t dev, ino_t ino, const void *buf, size_t size, off_t offset)
+{
+    off_t start = ALIGN_DOWN(offset);
+    off_t end = offset + size;
+    size_t head = offset - start;
+    size_t span = ALIGN_UP(head + size);
+    off_t last = start + span - DIRECT_ALIGN;   // the block end falls in
+    off_t eof = -1;                             // where the file ends, if before start + span
+    size_t whole = span, tail = 0;              // written direct, then through the cache
+    pthread_mutex_t *lock;
+    ssize_t n, t;
+    char *bounce;
+    int err;
+
+    if (size == 0) return 0;
+    lock = direct_lock(dev, ino);
+
+    if (ALIGNED(buf) && ALIGNED(offset) && ALIGNED(size)) {
+        pthread_mutex_lock(lock);
+        n = fcfuse_uring_pwrite(fd, buf, size, offset);
+        err = errno;
+        pthread_mutex_unlock(lock);
+        errno = err;
+        return n;
+    }
+
+    bounce = pool_get(span);
+    if (bounce == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(lock);
+    n = 0;
+    if (head && (read_block(fd, bounce, start, &eof) != 0)) n = -1;
+    if ((n == 0) && (end & (DIRECT_ALIGN - 1)) && !(head && (last == start)) &&
+        (read_block(fd, bounce + span - DIRECT_ALIGN, last, &eof) != 0))
+        n = -1;
+    if (n == 0) {
+        memcpy(bounce + head, buf, size);
+        // the zeroes past the end of the file weren't written by
+        // anyone: stop at the new end
+        if (eof >= 0) {
+            if (eof < end) eof = end;
+            whole = ALIGN_DOWN(eof) - start;
+            tail = eof - ALIGN_DOWN(eof);
+        }
+        n = whole ? fcfuse_uring_pwrite(fd, bounce, whole, start) : 0;
+        if ((n == (ssize_t) whole) && tail) {
+            t = buffered_pwrite(fd, bounce + whole, tail, start + whole);
+            if (t < 0) n = -1;
+            else n += t;
+        }
+        if (n == (ssize_t) (whole + tail)) n = span;
+    }
+    err = errno;
+    if (n == (ssize_t) span) {
+        n = size;
+    } else if (n >= 0) {
+        n = ((size_t) n > head) ? n - head : 0;
+        if ((size_t) n > size) n = size;
+    }
+    pthread_mutex_unlock(lock);
+    pool_put(bounce, span);
+    errno = err;
+
+    return n;
+}
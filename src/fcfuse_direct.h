@@ -0,0 +1,22 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  O_DIRECT backing files for the containers given with -o direct=CID,
+  through a pool of aligned bounce buffers.
+*/
+
+#ifndef _FCFUSE_DIRECT_H_
+#define _FCFUSE_DIRECT_H_
+
+#include <sys/types.h>
+
+void fcfuse_direct_init(unsigned int buffers);
+int  fcfuse_direct_add(int cid);
+int  fcfuse_direct_enabled(int cid);
+void fcfuse_direct_destroy(void);
+
+ssize_t fcfuse_direct_pread(int fd, void *buf, size_t size, off_t offset);
+ssize_t fcfuse_direct_pwrite(int fd, dev_t dev, ino_t ino, const void *buf, size_t size, off_t offset);
+
+#endif
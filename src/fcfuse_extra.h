@@ -12,6 +12,49 @@ struct fcfuse_state {
     char *device_name;
     int devfd;
     char *rootdir;
+    // mount options, see fcfuse_opts in fcfuse.c
+    int writeback;
+    double lookup_attr_timeout;
+    double lookup_negative_timeout;
+    int fd_cache;
+    char *log_level;
+    unsigned int trace_sample;
+    char *trace_file;
+    double slow_threshold;
+    double slow_p99;
+    char *ctl_socket;
+    char *profile;
+    unsigned int profile_hz;
+    char *capture;
+    unsigned int uring;
+    unsigned int direct_buffers;
+    unsigned int block_cache;
+    int group_commit;
+    unsigned int group_commit_delay;
+    int journal;
+    unsigned int journal_interval;
+    int trash;
+    unsigned int trash_min;
+    unsigned int trash_rate;
+};
+
+// What fi->fh points to for files opened by fcfuse_open().
+// Directories keep their DIR * in fi->fh.
+struct fcfuse_file {
+    int fd;                         // backing descriptor
+    int cid;                        // container that opened it
+    struct fcfuse_fdent *fdent;     // fd cache entry, NULL if not shared
+    struct fcfuse_view *view;       // writeback view, see fcfuse_view.c
+    int cached;                     // shares the kernel's page cache
+    int direct;                     // fd has O_DIRECT, see fcfuse_direct.c
+    struct fcfuse_stream *stream;   // page-cache tracking, see fcfuse_stream.c
+    int bcache;                     // reads go through the block cache
+    struct fcfuse_mmap *map;        // read-only mapping, see fcfuse_mmap.c
+    dev_t dev;                      // backing inode, ino 0 if unknown
+    ino_t ino;
+    char *stats;                    // FCFUSE_STATS_PATH snapshot, fd is -1
+    size_t stats_len;
 };
 
 #define FCFS_DATA ((struct fcfuse_state *) fuse_get_context()->private_data)
+#define FCFS_FILE(fi) ((struct fcfuse_file *) (uintptr_t) (fi)->fh)
@@ -0,0 +1,360 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Hot container files get reopened thousands of times a second, and
+  open()/close() of the backing file dominated the daemon's syscalls.
+  Descriptors are kept in a bounded LRU keyed by container, backing
+  inode and the open flags that change how I/O behaves, and handed to
+  every FUSE handle that opens the same thing.  A hit costs one stat.
+
+  Sharing a descriptor between handles is safe because the daemon
+  never uses the file offset: reads and writes are positional and the
+  kernel keeps the position of each open file.  Opens that create or
+  truncate always get a descriptor of their own.
+
+  Idle descriptors are closed when the LRU is over budget and when
+  their file is unlinked or renamed over through the mount; busy ones
+  are closed on their last release.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "fcfuse_fdcache.h"
+#include "fcfuse_probes.h"
+#include "fcfuse_uring.h"
+
+#define FDCACHE_BUCKETS 4096
+
+// flags that make two descriptors of the same file behave differently
+#define FDCACHE_CLASS (O_ACCMODE | O_APPEND | O_DIRECT | O_SYNC | O_DSYNC | O_NOATIME)
+// flags that have an effect on open itself
+#define FDCACHE_NEVER (O_CREAT | O_EXCL | O_TRUNC | O_PATH | O_TMPFILE)
+
+struct fcfuse_fdent {
+    int cid;
+    dev_t dev;
+    ino_t ino;
+    int fclass;
+    int fd;
+    int refs;               // handles using fd
+    int dead;               // close on last release
+    struct fcfuse_fdent *next;                  // hash chain
+    struct fcfuse_fdent *lru_prev, *lru_next;   // idle list, refs == 0
+};
+
+static struct fcfuse_fdent *fdcache_table[FDCACHE_BUCKETS];
+static struct fcfuse_fdent *lru_head, *lru_tail;
+static int fdcache_count;
+static int fdcache_max;
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int fdcache_hash(dev_t dev, ino_t ino)
+{
+    return (unsigned int) ((ino * 0x9e3779b97f4a7c15ull) ^ dev) % FDCACHE_BUCKETS;
+}
+
+// fdcache_lock must be held for all of the helpers below
+
+static void lru_unlink(struct fcfuse_fdent *ent)
+{
+    if (ent->lru_prev) ent->lru_prev->lru_next = ent->lru_next;
+    else lru_head = ent->lru_next;
+    if (ent->lru_next) ent->lru_next->lru_prev = ent->lru_prev;
+    else lru_tail = ent->lru_prev;
+    ent->lru_prev = ent->lru_next = NULL;
+}
+
+static void lru_push(struct fcfuse_fdent *ent)
+{
+    ent->lru_prev = NULL;
+    ent->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = ent;
+    else lru_tail = ent;
+    lru_head = ent;
+}
+
+static void hash_unlink(struct fcfuse_fdent *ent)
+{
+    struct fcfuse_fdent **link = &fdcache_table[fdcache_hash(ent->dev, ent->ino)];
+
+    while (*link != ent) link = &(*link)->next;
+    *link = ent->next;
+}
+
+// Take an idle entry out of the cache; the caller closes ent->fd
+static void fdcache_drop(struct fcfuse_fdent *ent)
+{
+    lru_unlink(ent);
+    hash_unlink(ent);
+    fdcache_count--;
+}
+
+/**
+ * Keep at most max descriptors.  Half of RLIMIT_NOFILE is left for
+ * handles that aren't cached, directories and libfuse itself.  A
+ * smaller budget closes idle descriptors right away; busy ones go as
+ * they are released.  Returns the budget actually used.
+ */
+int fcfuse_fdcache_set_max(int max)
+{
+    struct fcfuse_fdent *ent, *victims = NULL;
+    struct rlimit rl;
+
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur != RLIM_INFINITY) &&
+        ((rlim_t) max > rl.rlim_cur / 2))
+        max = rl.rlim_cur / 2;
+    if (max < 0) max = 0;
+
+    pthread_mutex_lock(&fdcache_lock);
+    __atomic_store_n(&fdcache_max, max, __ATOMIC_RELAXED);
+    while ((fdcache_count > max) && ((ent = lru_tail) != NULL)) {
+        fdcache_drop(ent);
+        ent->next = victims;
+        victims = ent;
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+
+    while ((ent = victims) != NULL) {
+        victims = ent->next;
+        close(ent->fd);
+        free(ent);
+    }
+
+    return max;
+}
+
+int fcfuse_fdcache_init(int max)
+{
+    return fcfuse_fdcache_set_max(max);
+}
+
+int fcfuse_fdcache_get_max(void)
+{
+    return __atomic_load_n(&fdcache_max, __ATOMIC_RELAXED);
+}
+
+void fcfuse_fdcache_destroy(void)
+{
+    struct fcfuse_fdent *ent;
+
+    pthread_mutex_lock(&fdcache_lock);
+    while ((ent = lru_tail) != NULL) {
+        fdcache_drop(ent);
+        close(ent->fd);
+        free(ent);
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+/**
+ * open() replacement for backing files.  Returns a descriptor or -1
+ * with errno set; *entp is what fcfuse_fdcache_close() needs back
+ * (NULL if the descriptor isn't shared).
+ */
+int fcfuse_fdcache_open(const char *fpath, int cid, int flags, struct fcfuse_fdent **entp)
+{
+    struct fcfuse_fdent *ent, *victim = NULL;
+    struct stat st;
+    int fd, fclass = flags & FDCACHE_CLASS;
+    unsigned int h;
+
+    *entp = NULL;
+
+    if ((__atomic_load_n(&fdcache_max, __ATOMIC_RELAXED) == 0) || (flags & FDCACHE_NEVER) ||
+        (stat(fpath, &st) != 0) || !S_ISREG(st.st_mode))
+        return fcfuse_uring_open(fpath, flags, 0);
+
+    h = fdcache_hash(st.st_dev, st.st_ino);
+
+    pthread_mutex_lock(&fdcache_lock);
+    for (ent = fdcache_table[h]; ent != NULL; ent = ent->next) {
+        if ((ent->ino == st.st_ino) && (ent->dev == st.st_dev) && (ent->cid == cid) &&
+            (ent->fclass == fclass) && !ent->dead) {
+            if (ent->refs++ == 0) lru_unlink(ent);
+            pthread_mutex_unlock(&fdcache_lock);
+            FCFS_PROBE2(fdcache__hit, cid, ent->fd);
+            *entp = ent;
+            return ent->fd;
+        }
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+
+    FCFS_PROBE2(fdcache__miss, cid, flags);
+    fd = fcfuse_uring_open(fpath, flags, 0);
+    if (fd == -1) return -1;
+
+    // the path may have been replaced since the stat
+    if ((fstat(fd, &st) != 0) || ((ent = calloc(1, sizeof(*ent))) == NULL)) return fd;
+    ent->cid = cid;
+    ent->dev = st.st_dev;
+    ent->ino = st.st_ino;
+    ent->fclass = fclass;
+    ent->fd = fd;
+    ent->refs = 1;
+
+    pthread_mutex_lock(&fdcache_lock);
+    if (fdcache_count >= fdcache_max) {
+        // over budget: make room from the idle end, or don't cache
+        if (lru_tail == NULL) {
+            pthread_mutex_unlock(&fdcache_lock);
+            free(ent);
+            return fd;
+        }
+        victim = lru_tail;
+        fdcache_drop(victim);
+    }
+    h = fdcache_hash(ent->dev, ent->ino);
+    ent->next = fdcache_table[h];
+    fdcache_table[h] = ent;
+    fdcache_count++;
+    pthread_mutex_unlock(&fdcache_lock);
+
+    if (victim) {
+        close(victim->fd);
+        free(victim);
+    }
+
+    *entp = ent;
+    return fd;
+}
+
+/** close() replacement for descriptors from fcfuse_fdcache_open() */
+void fcfuse_fdcache_close(int fd, struct fcfuse_fdent *ent)
+{
+    if (ent == NULL) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&fdcache_lock);
+    if (--ent->refs > 0) {
+        pthread_mutex_unlock(&fdcache_lock);
+        return;
+    }
+    if (!ent->dead) {
+        lru_push(ent);
+        pthread_mutex_unlock(&fdcache_lock);
+        return;
+    }
+    hash_unlink(ent);
+    fdcache_count--;
+    pthread_mutex_unlock(&fdcache_lock);
+
+    close(ent->fd);
+    free(ent);
+}
+
+/**
+ * The backing file at fpath is about to be unlinked or renamed over.
+ * Nothing may pick up its descriptors any more, and idle ones are
+ * closed so the cache doesn't keep the file's space allocated.
+ */
+void fcfuse_fdcache_evict(const char *fpath)
+{
+    struct fcfuse_fdent *ent, *next, *victims = NULL;
+    struct stat st;
+    unsigned int h;
+
+    if ((__atomic_load_n(&fdcache_max, __ATOMIC_RELAXED) == 0) || (lstat(fpath, &st) != 0) ||
+        !S_ISREG(st.st_mode))
+        return;
+
+    h = fdcache_hash(st.st_dev, st.st_ino);
+
+    pthread_mutex_lock(&fdcache_lock);
+    for (ent = fdcache_table[h]; ent != NULL; ent = next) {
+        next = ent->next;
+        if ((ent->ino != st.st_ino) || (ent->dev != st.st_dev)) continue;
+        ent->dead = 1;
+        if (ent->refs == 0) {
+            fdcache_drop(ent);
+            ent->next = victims;
+            victims = ent;
+        }
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+
+    while ((ent = victims) != NULL) {
+        victims = ent->next;
+        close(ent->fd);
+        free(ent);
+    }
+}
+
+/** Close the idle descriptors of container cid, of all if cid is -1 */
+void fcfuse_fdcache_flush(int cid)
+{
+    struct fcfuse_fdent *ent, *prev, *victims = NULL;
+
+    pthread_mutex_lock(&fdcache_lock);
+    for (ent = lru_tail; ent != NULL; ent = prev) {
+        prev = ent->lru_prev;
+        if ((cid != -1) && (ent->cid != cid)) continue;
+        fdcache_drop(ent);
+        ent->next = victims;
+        victims = ent;
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+
+    while ((ent = victims) != NULL) {
+        victims = ent->next;
+        close(ent->fd);
+        free(ent);
+    }
+}
+
+/**
+ * fdatasync() every descriptor container cid (all if -1) has in the
+ * cache.  Returns 0 or the first -errno.
+ */
+int fcfuse_fdcache_sync(int cid)
+{
+    struct fcfuse_fdent *ent, **held;
+    int h, i, n = 0, retstat = 0;
+
+    pthread_mutex_lock(&fdcache_lock);
+    held = malloc(fdcache_count * sizeof(*held) + 1);
+    if (held == NULL) {
+        pthread_mutex_unlock(&fdcache_lock);
+        return -ENOMEM;
+    }
+    // hold a reference so nothing closes them while we sync
+    for (h = 0; h < FDCACHE_BUCKETS; h++) {
+        for (ent = fdcache_table[h]; ent != NULL; ent = ent->next) {
+            if (((cid != -1) && (ent->cid != cid)) || ((ent->fclass & O_ACCMODE) == O_RDONLY)) continue;
+            if (ent->refs++ == 0) lru_unlink(ent);
+            held[n++] = ent;
+        }
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+
+    for (i = 0; i < n; i++) {
+        if ((fdatasync(held[i]->fd) != 0) && (retstat == 0)) retstat = -errno;
+        fcfuse_fdcache_close(held[i]->fd, held[i]);
+    }
+    free(held);
+
+    return retstat;
+}
+
+/** Call fn for every cached descriptor, with its container and whether a handle uses it */
+void fcfuse_fdcache_foreach(void (*fn)(int cid, int busy, void *arg), void *arg)
+{
+    struct fcfuse_fdent *ent;
+    int h;
+
+    pthread_mutex_lock(&fdcache_lock);
+    for (h = 0; h < FDCACHE_BUCKETS; h++)
+        for (ent = fdcache_table[h]; ent != NULL; ent = ent->next) fn(ent->cid, ent->refs > 0, arg);
+    pthread_mutex_unlock(&fdcache_lock);
+}
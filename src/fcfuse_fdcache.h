@@ -0,0 +1,24 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Backing file descriptors kept open across open/release cycles.
+*/
+
+#ifndef _FCFUSE_FDCACHE_H_
+#define _FCFUSE_FDCACHE_H_
+
+struct fcfuse_fdent;
+
+int  fcfuse_fdcache_init(int max);
+int  fcfuse_fdcache_set_max(int max);
+int  fcfuse_fdcache_get_max(void);
+void fcfuse_fdcache_destroy(void);
+int  fcfuse_fdcache_open(const char *fpath, int cid, int flags, struct fcfuse_fdent **entp);
+void fcfuse_fdcache_close(int fd, struct fcfuse_fdent *ent);
+void fcfuse_fdcache_evict(const char *fpath);
+void fcfuse_fdcache_flush(int cid);
+int  fcfuse_fdcache_sync(int cid);
+void fcfuse_fdcache_foreach(void (*fn)(int cid, int busy, void *arg), void *arg);
+
+#endif
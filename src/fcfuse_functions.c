@@ -5,6 +5,23 @@
 #include <sys/types.h>
 #include <sys/unistd.h>
 #include <fcontainer.h>
+#include "fcfuse_bcache.h"
+#include "fcfuse_capture.h"
+#include "fcfuse_ctl.h"
+#include "fcfuse_direct.h"
+#include "fcfuse_fdcache.h"
+#include "fcfuse_gcommit.h"
+#include "fcfuse_journal.h"
+#include "fcfuse_lookup.h"
+#include "fcfuse_mmap.h"
+#include "fcfuse_probes.h"
+#include "fcfuse_profile.h"
+#include "fcfuse_slowlog.h"
+#include "fcfuse_stats.h"
+#include "fcfuse_stream.h"
+#include "fcfuse_trash.h"
+#include "fcfuse_uring.h"
+#include "fcfuse_view.h"
 
 extern struct fcfuse_state *fcfuse_data;
 
@@ -22,19 +39,108 @@ void _get_container_directory(char *root, int cid)
     strncat(root, str, PATH_MAX);
 }   
 
-static void fcfuse_fullpath(char fpath[PATH_MAX], const char *path)
+// Container of the calling task, -1 if it is not in one
+static int fcfuse_getcid(void)
 {
+    uint64_t start = fcfuse_now();
+    int cid;
+
+    FCFS_PROBE1(ioctl__entry, FCOP_IOCTL_GETCID);
+    cid = fcontainer_getcid(FCFS_DATA->devfd, fuse_get_context()->pid);
+
+    fcfuse_op_ioctl(FCOP_IOCTL_GETCID, start, cid);
+
+    return cid;
+}
+
+// Tell the kernel module the caller's request is done
+static void fcfuse_delete(int cid)
+{
+    uint64_t start = fcfuse_now();
+
+    FCFS_PROBE1(ioctl__entry, FCOP_IOCTL_DELETE);
+    fcontainer_delete(FCFS_DATA->devfd);
+    fcfuse_op_ioctl(FCOP_IOCTL_DELETE, start, cid);
+}
+
+// The stats file isn't backed by anything
+static int _is_stats(const char *path)
+{
+    return strcmp(path, FCFUSE_STATS_PATH) == 0;
+}
+
+static void _stats_stat(struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+}
+
+// Resolve a mount-relative path to the backing file of container cid
+static void fcfuse_containerpath(char fpath[PATH_MAX], const char *path, int cid)
+{
+    uint64_t start = fcfuse_now();
+
     strcpy(fpath, FCFS_DATA->rootdir);
     
-    int cid = fcontainer_getcid(FCFS_DATA->devfd, fuse_get_context()->pid);
-
     strncat(fpath, path, PATH_MAX);
 
-    int is_dir = _is_directory(fpath);
+    // a directory may only be in the journal so far
+    int is_dir = fcfuse_journal_isdir(fpath);
+    if (is_dir < 0) is_dir = _is_directory(fpath);
 
     if ((cid != -1) && !is_dir && (cid != NULL)) {
         _get_container_directory(fpath, cid);
     }
+
+    fcfuse_op_phase(FCPH_RESOLVE, start);
+}
+
+// Resolve a mount-relative path to the backing file of the calling
+// task's container.  Returns the container id, -1 if the caller is not
+// in a container.
+static int fcfuse_fullpath(char fpath[PATH_MAX], const char *path)
+{
+    int cid = fcfuse_getcid();
+
+    fcfuse_containerpath(fpath, path, cid);
+
+    return cid;
+}
+
+// Which containers see a change to fpath: only cid if
+// fcfuse_containerpath() gave it its own .containerN file, all of them
+// (-1) for directories and for callers outside any container.
+static int _view_cid(const char *path, const char *fpath, int cid)
+{
+    if (strlen(fpath) == strlen(FCFS_DATA->rootdir) + strlen(path)) return -1;
+    return cid;
+}
+
+// The block cache and file mappings know files by backing inode (see
+// fcfuse_bcache.c and fcfuse_mmap.c)
+static int _inodes_tracked(void)
+{
+    return fcfuse_bcache_enabled() || fcfuse_mmap_any();
+}
+
+// dev:ino was truncated or is a new file: forget what is known of its
+// contents; file mappings check the same generation
+static void _inode_truncated(dev_t dev, ino_t ino)
+{
+    fcfuse_bcache_truncate(dev, ino);
+}
+
+// The same for fpath, or fd if fpath is NULL
+static void _inode_forget(int fd, const char *fpath)
+{
+    struct stat st;
+
+    if (!_inodes_tracked()) return;
+    if ((fpath ? stat(fpath, &st) : fstat(fd, &st)) == 0) _inode_truncated(st.st_dev, st.st_ino);
 }
 
 /** Get file attributes.
@@ -43,16 +149,66 @@ static void fcfuse_fullpath(char fpath[PATH_MAX], const char *path)
  * ignored.  The 'st_ino' field is ignored except if the 'use_ino'
  * mount option is given.
  */
+#if FUSE_USE_VERSION >= 30
+int fcfuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+#else
 int fcfuse_getattr(const char *path, struct stat *stbuf)
+#endif
 {
     char fpath[PATH_MAX];
     int retstat = -ENOENT;
+    uint64_t stamp;
+    int cid;
+
+#if FUSE_USE_VERSION >= 30
+    // libfuse 3 folded fgetattr() in here; the handle was already
+    // resolved to the right container file by fcfuse_open()
+    if ((fi != NULL) && FCFS_FILE(fi)->stats) {
+        _stats_stat(stbuf);
+        stbuf->st_size = FCFS_FILE(fi)->stats_len;
+        return 0;
+    }
+    if (fi != NULL) {
+        retstat = FCFS_IO(fcfuse_uring_fstat(FCFS_FILE(fi)->fd, stbuf));
+        if (retstat == -1) return -errno;
+        return retstat;
+    }
+#endif
+
+    // size 0, it is opened with direct_io and read to EOF
+    if (_is_stats(path)) {
+        _stats_stat(stbuf);
+        return 0;
+    }
+
+    cid = fcfuse_getcid();
+
+    // a cached miss never touches the backing tree
+    retstat = fcfuse_lookup_get(path, cid, stbuf);
+    if (retstat != 0) {
+        FCFS_PROBE3(lookup__hit, cid, path, retstat < 0);
+        return (retstat > 0) ? 0 : retstat;
+    }
+    FCFS_PROBE2(lookup__miss, cid, path);
+
+    // whatever invalidates path from here on wins over this lookup
+    stamp = fcfuse_lookup_stamp(path);
         
-    fcfuse_fullpath(fpath, path);
+    fcfuse_containerpath(fpath, path, cid);
+
+    // a change the journal has yet to make
+    retstat = fcfuse_journal_getattr(fpath, stbuf);
+    if (retstat != 0) return (retstat > 0) ? 0 : retstat;
    
-    retstat = lstat(fpath, stbuf);
+    retstat = FCFS_IO(fcfuse_uring_lstat(fpath, stbuf));
 
-    if (retstat == -1) return -errno;
+    if (retstat == -1) {
+        retstat = -errno;
+        if (retstat == -ENOENT) fcfuse_lookup_put(path, cid, NULL, stamp);
+        return retstat;
+    }
+
+    fcfuse_lookup_put(path, cid, stbuf, stamp);
 
     return retstat;
 }
@@ -75,8 +231,9 @@ int fcfuse_readlink(const char *path, char *link, size_t size)
     int retstat = -ENOENT;
     
     fcfuse_fullpath(fpath, path);
+    fcfuse_journal_barrier(fpath);
 
-    retstat = readlink(fpath, link, size-1);
+    retstat = FCFS_IO(readlink(fpath, link, size-1));
     
     if (retstat >= 0) {
        link[retstat] = '\0';
@@ -97,25 +254,35 @@ int fcfuse_mknod(const char *path, mode_t mode, dev_t dev)
 {
     char fpath[PATH_MAX];
     int retstat = -ENOENT;
+    int cid;
     
-    fcfuse_fullpath(fpath, path);
+    cid = fcfuse_fullpath(fpath, path);
     
-    // On Linux this could just be 'mknod(path, mode, dev)' but this
-    // tries to be be more portable by honoring the quote in the Linux
-    // mknod man page stating the only portable use of mknod() is to
-    // make a fifo, but saying it should never actually be used for
-    // that.
-    if (S_ISREG(mode)) {
-        retstat = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
-        if (retstat >= 0) retstat = close(retstat);
-    } else {
-        if (S_ISFIFO(mode)) retstat = mkfifo(fpath, mode);
-        else retstat = mknod(fpath, mode, dev);
+    // acknowledged once journaled, if -o journal (see fcfuse_journal.c)
+    if (fcfuse_journal_mknod(fpath, mode) != 0) {
+        // On Linux this could just be 'mknod(path, mode, dev)' but this
+        // tries to be be more portable by honoring the quote in the Linux
+        // mknod man page stating the only portable use of mknod() is to
+        // make a fifo, but saying it should never actually be used for
+        // that.
+        if (S_ISREG(mode)) {
+            retstat = FCFS_IO(fcfuse_uring_open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode));
+            if (retstat >= 0) {
+                _inode_forget(retstat, NULL);
+                retstat = close(retstat);
+            }
+        } else {
+            if (S_ISFIFO(mode)) retstat = FCFS_IO(mkfifo(fpath, mode));
+            else retstat = FCFS_IO(mknod(fpath, mode, dev));
+        }
+        if (retstat == -1) retstat = -errno;
+        fcfuse_journal_done();
+        if (retstat < 0) return retstat;
     }
 
-    if (retstat == -1) return -errno;
+    fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
 
-    return retstat;
+    return 0;
 }
 
 /** Create a directory */
@@ -126,9 +293,15 @@ int fcfuse_mkdir(const char *path, mode_t mode)
     
     fcfuse_fullpath(fpath, path);
 
-    retstat = mkdir(fpath, mode);
-    
-    if (retstat == -1) return -errno;
+    if (fcfuse_journal_mkdir(fpath, mode) != 0) {
+        retstat = FCFS_IO(mkdir(fpath, mode));
+        if (retstat == -1) retstat = -errno;
+        fcfuse_journal_done();
+        if (retstat < 0) return retstat;
+    }
+
+    // directories are shared by all containers
+    fcfuse_lookup_invalidate(path, -1);
 
     return 0;
 }
@@ -137,13 +310,23 @@ int fcfuse_mkdir(const char *path, mode_t mode)
 int fcfuse_unlink(const char *path)
 {
     int retstat;
+    int cid;
     char fpath[PATH_MAX];
     
-    fcfuse_fullpath(fpath, path);
+    cid = fcfuse_fullpath(fpath, path);
 
-    retstat = unlink(fpath);
+    fcfuse_fdcache_evict(fpath);
 
-    if (retstat == -1) return -errno;
+    if (fcfuse_journal_unlink(fpath) != 0) {
+        retstat = FCFS_IO(fcfuse_trash_unlink(fpath));
+        if (retstat == -1) retstat = -errno;
+        fcfuse_journal_done();
+        if (retstat < 0) return retstat;
+    }
+
+    fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
+
+    if (FCFS_DATA->writeback) fcfuse_view_changed(path, cid);
 
     return 0;
 }
@@ -156,9 +339,14 @@ int fcfuse_rmdir(const char *path)
     
     fcfuse_fullpath(fpath, path);
 
-    retstat = rmdir(fpath);
+    fcfuse_journal_hold();
+    retstat = FCFS_IO(rmdir(fpath));
+    if (retstat == -1) retstat = -errno;
+    fcfuse_journal_done();
 
-    if (retstat == -1) return -errno;
+    if (retstat < 0) return retstat;
+
+    fcfuse_lookup_invalidate(path, -1);
 
     return 0;
 }
@@ -171,31 +359,66 @@ int fcfuse_rmdir(const char *path)
 int fcfuse_symlink(const char *path, const char *link)
 {
     int retstat;
+    int cid;
     char flink[PATH_MAX];
     
-    fcfuse_fullpath(flink, link);
+    cid = fcfuse_fullpath(flink, link);
 
-    retstat = symlink(path, flink);
+    fcfuse_journal_hold();
+    retstat = FCFS_IO(symlink(path, flink));
+    if (retstat == -1) retstat = -errno;
+    fcfuse_journal_done();
 
-    if (retstat == -1) return -errno;
+    if (retstat < 0) return retstat;
+
+    fcfuse_lookup_invalidate(link, _view_cid(link, flink, cid));
 
     return 0;
 }
 
 /** Rename a file */
 // both path and newpath are fs-relative
+#if FUSE_USE_VERSION >= 30
+int fcfuse_rename(const char *path, const char *newpath, unsigned int flags)
+#else
 int fcfuse_rename(const char *path, const char *newpath)
+#endif
 {
     int retstat;
+    int cid;
+    int is_dir = 0;
     char fpath[PATH_MAX];
     char fnewpath[PATH_MAX];
     
-    fcfuse_fullpath(fpath, path);
+#if FUSE_USE_VERSION >= 30
+    // RENAME_NOREPLACE/RENAME_EXCHANGE are not supported
+    if (flags) return -EINVAL;
+#endif
+
+    cid = fcfuse_fullpath(fpath, path);
     fcfuse_fullpath(fnewpath, newpath);
 
-    retstat = rename(fpath, fnewpath);
+    fcfuse_fdcache_evict(fpath);
+    fcfuse_fdcache_evict(fnewpath);
 
-    if (retstat == -1) return -errno;
+    // only files are journaled
+    if (fcfuse_journal_rename(fpath, fnewpath) != 0) {
+        retstat = FCFS_IO(rename(fpath, fnewpath));
+        if (retstat == -1) retstat = -errno;
+        else is_dir = _is_directory(fnewpath);
+        fcfuse_journal_done();
+        if (retstat < 0) return retstat;
+    }
+
+    // everything below a renamed directory moved with it
+    if (is_dir) {
+        fcfuse_lookup_flush();
+    } else {
+        fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
+        fcfuse_lookup_invalidate(newpath, _view_cid(newpath, fnewpath, cid));
+    }
+
+    if (FCFS_DATA->writeback) fcfuse_view_renamed(path, newpath, cid);
 
     return 0;
 }
@@ -204,75 +427,163 @@ int fcfuse_rename(const char *path, const char *newpath)
 int fcfuse_link(const char *path, const char *newpath)
 {
     int retstat;
+    int cid;
     char fpath[PATH_MAX], fnewpath[PATH_MAX];
     
     fcfuse_fullpath(fpath, path);
-    fcfuse_fullpath(fnewpath, newpath);
+    cid = fcfuse_fullpath(fnewpath, newpath);
 
-    retstat = link(fpath, fnewpath);
+    if (fcfuse_journal_link(fpath, fnewpath) != 0) {
+        retstat = FCFS_IO(link(fpath, fnewpath));
+        if (retstat == -1) retstat = -errno;
+        fcfuse_journal_done();
+        if (retstat < 0) return retstat;
+    }
 
-    if (retstat == -1) return -errno;
+    // the link count of the target changed too
+    fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
+    fcfuse_lookup_invalidate(newpath, _view_cid(newpath, fnewpath, cid));
+
+    if (FCFS_DATA->writeback) fcfuse_view_changed(newpath, cid);
 
     return 0;
 }
 
 /** Change the permission bits of a file */
+#if FUSE_USE_VERSION >= 30
+int fcfuse_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+#else
 int fcfuse_chmod(const char *path, mode_t mode)
+#endif
 {
     int retstat = -ENOENT;
+    int cid;
     char fpath[PATH_MAX];
     
-    fcfuse_fullpath(fpath, path);
+    cid = fcfuse_fullpath(fpath, path);
+    fcfuse_journal_barrier(fpath);
 
-    retstat = chmod(fpath, mode);
+    retstat = FCFS_IO(chmod(fpath, mode));
 
     if (retstat == -1) return -errno;
 
+    fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
+
+    if (FCFS_DATA->writeback) fcfuse_view_changed(path, cid);
+
     return retstat;
 }
 
 /** Change the owner and group of a file */
+#if FUSE_USE_VERSION >= 30
+int fcfuse_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+#else
 int fcfuse_chown(const char *path, uid_t uid, gid_t gid)
+#endif
 {
     int retstat;
+    int cid;
     char fpath[PATH_MAX];
     
-    fcfuse_fullpath(fpath, path);
+    cid = fcfuse_fullpath(fpath, path);
+    fcfuse_journal_barrier(fpath);
 
-    retstat = chown(fpath, uid, gid);
+    retstat = FCFS_IO(chown(fpath, uid, gid));
 
     if (retstat == -1) return -errno;
 
+    fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
+
+    if (FCFS_DATA->writeback) fcfuse_view_changed(path, cid);
+
     return 0;
 }
 
 /** Change the size of a file */
+#if FUSE_USE_VERSION >= 30
+int fcfuse_truncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+#else
 int fcfuse_truncate(const char *path, off_t newsize)
+#endif
 {
     int retstat;
+    int cid;
     char fpath[PATH_MAX];
     
-    fcfuse_fullpath(fpath, path);
+#if FUSE_USE_VERSION >= 30
+    // ftruncate() from libfuse 2 arrives here with the open handle
+    if (fi != NULL) {
+        retstat = FCFS_IO(ftruncate(FCFS_FILE(fi)->fd, newsize));
+        if (retstat == -1) return -errno;
+        if (FCFS_FILE(fi)->ino) _inode_truncated(FCFS_FILE(fi)->dev, FCFS_FILE(fi)->ino);
+        fcfuse_lookup_invalidate(path, -1);
+        return 0;
+    }
+#endif
+
+    cid = fcfuse_fullpath(fpath, path);
+    fcfuse_journal_barrier(fpath);
 
-    retstat = truncate(fpath, newsize);
+    retstat = FCFS_IO(truncate(fpath, newsize));
 
     if (retstat == -1) return -errno;
 
+    _inode_forget(-1, fpath);
+
+    fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
+
+    if (FCFS_DATA->writeback) fcfuse_view_changed(path, cid);
+
     return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+/** Change the access and modification times of a file with
+ * nanosecond resolution
+ *
+ * utime() is gone in libfuse 3, this replaces it.
+ */
+int fcfuse_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+    int retstat;
+    int cid;
+    char fpath[PATH_MAX];
+
+    if (fi != NULL) {
+        retstat = FCFS_IO(futimens(FCFS_FILE(fi)->fd, tv));
+        if (retstat == 0) fcfuse_lookup_invalidate(path, -1);
+    } else {
+        cid = fcfuse_fullpath(fpath, path);
+        fcfuse_journal_barrier(fpath);
+        retstat = FCFS_IO(utimensat(AT_FDCWD, fpath, tv, AT_SYMLINK_NOFOLLOW));
+        if (retstat == 0) {
+            fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
+            if (FCFS_DATA->writeback) fcfuse_view_changed(path, cid);
+        }
+    }
+
+    if (retstat == -1) return -errno;
+
+    return 0;
+}
+#else
 /** Change the access and/or modification times of a file */
 int fcfuse_utime(const char *path, struct utimbuf *ubuf)
 {
     int retstat = 0;
+    int cid;
     char fpath[PATH_MAX];
 
-    fcfuse_fullpath(fpath, path);
+    cid = fcfuse_fullpath(fpath, path);
+    fcfuse_journal_barrier(fpath);
 
-    retstat = utime(fpath, ubuf);
+    retstat = FCFS_IO(utime(fpath, ubuf));
+
+    if (retstat == 0) fcfuse_lookup_invalidate(path, _view_cid(path, fpath, cid));
 
     return retstat;
 }
+#endif
 
 /** File open operation
  *
@@ -283,20 +594,104 @@ int fcfuse_utime(const char *path, struct utimbuf *ubuf)
  * which will be passed to all file operations.
  *
  * Changed in version 2.2
+ *
+ * In writeback mode the handle shares the kernel's page cache only
+ * if its container owns the cached view of the path (see
+ * fcfuse_view.c); otherwise it is opened with direct_io.
+ *
+ * The backing descriptor may be shared with other handles of the
+ * same container through the fd cache (see fcfuse_fdcache.c).
+ *
+ * Containers given with -o direct bypass both page caches (see
+ * fcfuse_direct.c), those given with -o stream keep little in them
+ * (see fcfuse_stream.c).  Read-only handles of -o mmap containers
+ * read from a mapping (see fcfuse_mmap.c), other handles through the
+ * block cache if there is one (see fcfuse_bcache.c).
  */
 int fcfuse_open(const char *path, struct fuse_file_info *fi)
 {
-    int fd;
+    struct fcfuse_file *file;
+    struct stat st;
+    int flags = fi->flags;
     int retstat = 0;
     char fpath[PATH_MAX];
     
-    fcfuse_fullpath(fpath, path);
+    file = calloc(1, sizeof(*file));
+    if (file == NULL) return -ENOMEM;
+
+    // the stats file is rendered once per open
+    if (_is_stats(path)) {
+        if ((flags & O_ACCMODE) != O_RDONLY) retstat = -EACCES;
+        else retstat = fcfuse_stats_snapshot(&file->stats, &file->stats_len);
+        if (retstat != 0) {
+            free(file);
+            return retstat;
+        }
+        file->fd = -1;
+        file->cid = -1;
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t) file;
+        return 0;
+    }
+
+    file->cid = fcfuse_fullpath(fpath, path);
+    fcfuse_journal_barrier(fpath);
 
-    fd = open(fpath, fi->flags);
+    // O_DIRECT can't append at the offset the kernel gives us
+    if (fcfuse_direct_enabled(file->cid) && !(flags & O_APPEND)) {
+        file->direct = 1;
+        flags |= O_DIRECT;
+        fi->direct_io = 1;
+    }
+
+    if (FCFS_DATA->writeback) {
+        if (fcfuse_view_open(path, file, file->direct)) {
+            // The kernel reads pages of write-only files and does
+            // O_APPEND itself, so the backing file has to be readable
+            // and must not append on its own.
+            if ((flags & O_ACCMODE) == O_WRONLY) flags = (flags & ~O_ACCMODE) | O_RDWR;
+            flags &= ~O_APPEND;
+            fi->keep_cache = 1;
+        } else {
+            // the kernel's i_size belongs to another container, so
+            // this handle appends on its own
+            fi->direct_io = 1;
+        }
+    }
+
+    file->fd = FCFS_IO(fcfuse_fdcache_open(fpath, file->cid, flags, &file->fdent));
+    if ((file->fd == -1) && (errno == EINVAL) && file->direct) {
+        // the backing filesystem doesn't do O_DIRECT
+        log_at(LOG_LEVEL_WARN, "    %s: no O_DIRECT, using the page cache\n", fpath);
+        file->direct = 0;
+        flags &= ~O_DIRECT;
+        file->fd = FCFS_IO(fcfuse_fdcache_open(fpath, file->cid, flags, &file->fdent));
+    }
+    // without the memory it is just not tracked
+    if ((file->fd != -1) && !file->direct && fcfuse_stream_enabled(file->cid))
+        file->stream = fcfuse_stream_open();
+    // every handle's writes and truncations keep the block cache and
+    // mappings coherent; read-only handles of -o mmap containers read
+    // from a mapping, other buffered ones through the block cache.
+    // Direct writes are serialized by inode.
+    if ((file->fd != -1) && (file->direct || _inodes_tracked()) && (fstat(file->fd, &st) == 0)) {
+        file->dev = st.st_dev;
+        file->ino = st.st_ino;
+        if (flags & O_TRUNC) _inode_truncated(file->dev, file->ino);
+        if (!file->direct && !file->stream && ((flags & O_ACCMODE) == O_RDONLY) &&
+            fcfuse_mmap_enabled(file->cid))
+            file->map = fcfuse_mmap_open(file->fd, &st);
+        file->bcache = fcfuse_bcache_enabled() && !file->direct && !file->stream && !file->map;
+    }
 
-    if (fd == -1) return -errno;
+    if (file->fd == -1) {
+        retstat = -errno;
+        if (FCFS_DATA->writeback) fcfuse_view_release(path, file);
+        free(file);
+        return retstat;
+    }
 	
-    fi->fh = fd;
+    fi->fh = (uintptr_t) file;
 
     return retstat;
 
@@ -320,12 +715,28 @@ int fcfuse_open(const char *path, struct fuse_file_info *fi)
 // returned by read.
 int fcfuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    struct fcfuse_file *file = FCFS_FILE(fi);
     int retstat = 0;
+
+    if (file->stats) {
+        if (offset >= (off_t) file->stats_len) return 0;
+        if (size > file->stats_len - offset) size = file->stats_len - offset;
+        memcpy(buf, file->stats + offset, size);
+        return size;
+    }
         
-    retstat = pread(fi->fh, buf, size, offset);
+    // mappings and the block cache time their own backing calls
+    if (file->direct) retstat = FCFS_IO(fcfuse_direct_pread(file->fd, buf, size, offset));
+    else if (file->map) retstat = fcfuse_mmap_pread(file->map, file->fd, buf, size, offset);
+    else if (file->bcache) retstat = fcfuse_bcache_pread(file->fd, file->dev, file->ino, file->cid, buf, size, offset);
+    else retstat = FCFS_IO(fcfuse_uring_pread(file->fd, buf, size, offset));
+
+    if (file->stream && (retstat > 0)) fcfuse_stream_read(file->stream, file->fd, offset, retstat);
 
-    int cid = fcontainer_getcid(FCFS_DATA->devfd, fuse_get_context()->pid);
-    if((cid != -1) && (cid != NULL)) fcontainer_delete(FCFS_DATA->devfd);
+    int cid = fcfuse_getcid();
+    if((cid != -1) && (cid != NULL)) fcfuse_delete(cid);
+
+    FCFS_PROBE4(read, cid, size, offset, retstat);
 
     if (retstat == -1) return -errno;
 
@@ -341,14 +752,24 @@ int fcfuse_read(const char *path, char *buf, size_t size, off_t offset, struct f
  */
 int fcfuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    struct fcfuse_file *file = FCFS_FILE(fi);
     int retstat = 0;
 
-    retstat = pwrite(fi->fh, buf, size, offset);
+    if (file->direct) retstat = FCFS_IO(fcfuse_direct_pwrite(file->fd, file->dev, file->ino, buf, size, offset));
+    else retstat = FCFS_IO(fcfuse_uring_pwrite(file->fd, buf, size, offset));
+    if (file->stream && (retstat > 0)) fcfuse_stream_write(file->stream, file->fd, offset, retstat);
+    if (file->ino) fcfuse_bcache_write(file->dev, file->ino, offset, size);
+
+    int cid = fcfuse_getcid();
+    if((cid != -1) && (cid != NULL)) fcfuse_delete(cid);
 
-    int cid = fcontainer_getcid(FCFS_DATA->devfd, fuse_get_context()->pid);
-    if((cid != -1) && (cid != NULL)) fcontainer_delete(FCFS_DATA->devfd);
+    FCFS_PROBE4(write, cid, size, offset, retstat);
 
     if (retstat == -1) return -errno;
+
+    // size and mtime changed for the container that opened the handle
+    // (writeback comes from the kernel, not from the caller's container)
+    fcfuse_lookup_invalidate(path, file->cid);
     
     return retstat;
 }
@@ -368,7 +789,7 @@ int fcfuse_statfs(const char *path, struct statvfs *statv)
     fcfuse_fullpath(fpath, path);
     
     // get stats for underlying filesystem
-    retstat = statvfs(fpath, statv);
+    retstat = FCFS_IO(statvfs(fpath, statv));
     
     if (retstat == -1) return -errno;
     
@@ -402,7 +823,9 @@ int fcfuse_flush(const char *path, struct fuse_file_info *fi)
 {	
     int retstat;
 
-    retstat = close(dup(fi->fh));
+    if (FCFS_FILE(fi)->stats) return 0;
+
+    retstat = FCFS_IO(close(dup(FCFS_FILE(fi)->fd)));
 
     if (retstat == -1) return -errno;
 
@@ -425,7 +848,20 @@ int fcfuse_flush(const char *path, struct fuse_file_info *fi)
  */
 int fcfuse_release(const char *path, struct fuse_file_info *fi)
 {
-    close(fi->fh);
+    struct fcfuse_file *file = FCFS_FILE(fi);
+
+    if (file->stats) {
+        free(file->stats);
+        free(file);
+        return 0;
+    }
+
+    if (FCFS_DATA->writeback) fcfuse_view_release(path, file);
+    if (file->stream) fcfuse_stream_release(file->stream, file->fd);
+    if (file->map) fcfuse_mmap_release(file->map);
+
+    fcfuse_fdcache_close(file->fd, file->fdent);
+    free(file);
 
     return 0;
 }
@@ -440,12 +876,9 @@ int fcfuse_release(const char *path, struct fuse_file_info *fi)
 int fcfuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
     int retstat = 0;
-#ifdef HAVE_FDATASYNC
-    if (datasync)
-        return fdatasync(fi->fh);
-    else
-#endif
-        retstat = fsync(fi->fh);
+
+    if (FCFS_FILE(fi)->stats) return 0;
+    retstat = FCFS_IO(fcfuse_gcommit_fsync(FCFS_FILE(fi)->fd, datasync));
     if (retstat == -1) return -errno;
 	return retstat;
 }
@@ -490,10 +923,11 @@ int fcfuse_opendir(const char *path, struct fuse_file_info *fi)
     char fpath[PATH_MAX];
     
     fcfuse_fullpath(fpath, path);
+    fcfuse_journal_barrier(fpath);
 
     // since opendir returns a pointer, takes some custom handling of
     // return status.
-    dp = opendir(fpath);
+    dp = FCFS_IO(opendir(fpath));
 
     if (dp == NULL) return -errno;
     
@@ -522,13 +956,43 @@ int fcfuse_opendir(const char *path, struct fuse_file_info *fi)
  * '1'.
  *
  * Introduced in version 2.3
+ *
+ * With libfuse 3 the kernel may ask for READDIRPLUS, in which case
+ * the attributes of every entry go back with the listing and save a
+ * getattr round trip per entry.
  */
 
+#if FUSE_USE_VERSION >= 30
+// Attributes of a directory entry as fcfuse_getattr() would report
+// them for a task in container cid.
+static int _readdir_stat(DIR *dp, const char *name, int cid, struct stat *stbuf)
+{
+    char cname[PATH_MAX];
+
+    if (fstatat(dirfd(dp), name, stbuf, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+
+    if ((cid == -1) || S_ISDIR(stbuf->st_mode)) return 0;
+
+    snprintf(cname, PATH_MAX, "%s.container%d", name, cid);
+    return fstatat(dirfd(dp), cname, stbuf, AT_SYMLINK_NOFOLLOW);
+}
+
+int fcfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+	     enum fuse_readdir_flags flags)
+#else
 int fcfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+#endif
 {
     int retstat = 0;
     DIR *dp;
     struct dirent *de;
+#if FUSE_USE_VERSION >= 30
+    struct stat stbuf;
+    int cid = -1;
+
+    if (flags & FUSE_READDIR_PLUS)
+        cid = fcfuse_getcid();
+#endif
     
     // once again, no need for fullpath -- but note that I need to cast fi->fh
     dp = (DIR *) (uintptr_t) fi->fh;
@@ -545,9 +1009,25 @@ int fcfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t of
     // returns something non-zero.  The first case just means I've
     // read the whole directory; the second means the buffer is full.
     do {
+        // the journal and the trash are the daemon's own
+        if ((path[1] == '\0') && (!strcmp(de->d_name, FCFUSE_JOURNAL_NAME) || !strcmp(de->d_name, FCFUSE_TRASH_NAME)))
+            continue;
+#if FUSE_USE_VERSION >= 30
+        // an entry we can't stat just goes back without attributes
+        if ((flags & FUSE_READDIR_PLUS) && _readdir_stat(dp, de->d_name, cid, &stbuf) == 0) {
+            if (filler(buf, de->d_name, &stbuf, 0, FUSE_FILL_DIR_PLUS) != 0) {
+                return -ENOMEM;
+            }
+            continue;
+        }
+    	if (filler(buf, de->d_name, NULL, 0, 0) != 0) {
+            return -ENOMEM;
+        }
+#else
     	if (filler(buf, de->d_name, NULL, 0) != 0) {
             return -ENOMEM;
         }
+#endif
     } while ((de = readdir(dp)) != NULL);
     
     return retstat;
@@ -559,7 +1039,7 @@ int fcfuse_releasedir(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
     
-    retstat = closedir((DIR *) (uintptr_t) fi->fh);
+    retstat = FCFS_IO(closedir((DIR *) (uintptr_t) fi->fh));
     
     if (retstat == -1) return -errno;
 
@@ -586,17 +1066,73 @@ int fcfuse_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 int fcfuse_access(const char *path, int mask)
 {
     int retstat;
+    int cid;
     char fpath[PATH_MAX];
+
+    if (_is_stats(path)) return (mask & (W_OK | X_OK)) ? -EACCES : 0;
+
+    cid = fcfuse_getcid();
+    if (fcfuse_lookup_get(path, cid, NULL) == -ENOENT) {
+        FCFS_PROBE3(lookup__hit, cid, path, 1);
+        return -ENOENT;
+    }
        
-    fcfuse_fullpath(fpath, path);
+    fcfuse_containerpath(fpath, path, cid);
+    fcfuse_journal_barrier(fpath);
     
-    retstat = access(fpath, mask);
+    retstat = FCFS_IO(access(fpath, mask));
     
     if (retstat < 0) return -errno;
     
     return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+/**
+ * Find next data or hole after the specified offset
+ *
+ * Introduced in libfuse 3.8
+ */
+off_t fcfuse_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+    off_t retstat;
+
+    retstat = FCFS_IO(lseek(FCFS_FILE(fi)->fd, off, whence));
+
+    if (retstat == -1) return -errno;
+
+    return retstat;
+}
+
+/**
+ * Copy a range of data from one file to another
+ *
+ * Both handles were resolved by fcfuse_open(), so the copy stays
+ * inside the backing filesystem and never passes through the daemon.
+ *
+ * Introduced in libfuse 3.4
+ */
+ssize_t fcfuse_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+	     const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags)
+{
+    ssize_t retstat;
+    off_t start_out = offset_out;
+
+    retstat = FCFS_IO(copy_file_range(FCFS_FILE(fi_in)->fd, &offset_in, FCFS_FILE(fi_out)->fd, &offset_out, size, flags));
+    if (FCFS_FILE(fi_out)->ino) fcfuse_bcache_write(FCFS_FILE(fi_out)->dev, FCFS_FILE(fi_out)->ino, start_out, size);
+
+    int cid = fcfuse_getcid();
+    if (cid != -1) fcfuse_delete(cid);
+
+    FCFS_PROBE3(copy__range, cid, size, retstat);
+
+    if (retstat == -1) return -errno;
+
+    fcfuse_lookup_invalidate(path_out, -1);
+
+    return retstat;
+}
+#else
 /**
  * Change the size of an open file
  *
@@ -613,10 +1149,13 @@ int fcfuse_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
     int retstat;
     
-    retstat = ftruncate(fi->fh, offset);
+    retstat = FCFS_IO(ftruncate(FCFS_FILE(fi)->fd, offset));
     
     if (retstat == -1) return -errno;
 
+    if (FCFS_FILE(fi)->ino) _inode_truncated(FCFS_FILE(fi)->dev, FCFS_FILE(fi)->ino);
+    fcfuse_lookup_invalidate(path, -1);
+
     return 0;
 }
 
@@ -640,21 +1179,101 @@ int fcfuse_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_inf
     // special case of a path of "/", I need to do a getattr on the
     // underlying root directory instead of doing the fgetattr().
     if (!strcmp(path, "/")) return fcfuse_getattr(path, statbuf);
+
+    if (FCFS_FILE(fi)->stats) {
+        _stats_stat(statbuf);
+        statbuf->st_size = FCFS_FILE(fi)->stats_len;
+        return 0;
+    }
     
-    retstat = fstat(fi->fh, statbuf);
+    retstat = FCFS_IO(fcfuse_uring_fstat(FCFS_FILE(fi)->fd, statbuf));
     
     // if (retstat < 0) return -errno;
         
     return retstat;
 }
 
+#endif
+
+/**
+ * Initialize filesystem
+ *
+ * Ask for the largest requests the kernel and libfuse will agree to:
+ * request size and request count are what limit our throughput.
+ * Reads may run asynchronously and lookups in one directory in
+ * parallel, since every callback resolves its own backing path.
+ */
+#if FUSE_USE_VERSION >= 30
+void *fcfuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    if (log_start() != 0) fprintf(stderr, "fcfuse: logging unavailable\n");
+    if (fcfuse_trace_start() != 0) log_at(LOG_LEVEL_WARN, "    tracing unavailable\n");
+    if (fcfuse_slowlog_start() != 0) log_at(LOG_LEVEL_WARN, "    adaptive slow thresholds unavailable\n");
+    if (fcfuse_ctl_start() != 0) log_at(LOG_LEVEL_WARN, "    control socket unavailable\n");
+    if (fcfuse_profile_start() != 0) log_at(LOG_LEVEL_WARN, "    profiling unavailable\n");
+    if (fcfuse_capture_start() != 0) log_at(LOG_LEVEL_WARN, "    capture unavailable\n");
+    if (fcfuse_uring_start() != 0) log_at(LOG_LEVEL_WARN, "    io_uring unavailable, using system calls\n");
+    if (fcfuse_mmap_start() != 0) log_at(LOG_LEVEL_WARN, "    mmap reads unavailable\n");
+    if (fcfuse_gcommit_start() != 0) log_at(LOG_LEVEL_WARN, "    group commit needs Linux 5.8 or later, fsyncs go alone\n");
+    if (fcfuse_journal_start() != 0) log_at(LOG_LEVEL_WARN, "    metadata journal unavailable, changes are made synchronously\n");
+    if (fcfuse_trash_start() != 0) log_at(LOG_LEVEL_WARN, "    trash unavailable, files are unlinked right away\n");
+    log_msg("\nfcfuse_init()\n");
+
+    // max_pages is derived from max_write, and the kernel sizes read
+    // requests from max_pages and max_readahead
+    conn->max_write = FCFUSE_MAX_REQUEST;
+    conn->max_readahead = FCFUSE_MAX_REQUEST;
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_ASYNC_DIO |
+                                   FUSE_CAP_PARALLEL_DIROPS | FUSE_CAP_READDIRPLUS |
+                                   FUSE_CAP_READDIRPLUS_AUTO);
+
+    // Small writes get merged in the page cache and sent as large
+    // requests.  The kernel's cache is per path, not per container,
+    // so fcfuse_view.c decides who may use it.
+    if (FCFS_DATA->writeback) {
+        if ((conn->capable & FUSE_CAP_WRITEBACK_CACHE) &&
+            (fcfuse_view_init(fuse_get_context()->fuse) == 0)) {
+            conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+            // names can't be invalidated from here, only inodes: look
+            // them up every time (fcfuse_lookup.c makes that cheap)
+            cfg->entry_timeout = 0;
+        } else {
+            log_msg("    writeback cache not available\n");
+            FCFS_DATA->writeback = 0;
+        }
+    }
+
+    log_conn(conn);
+    log_fuse_context(fuse_get_context());
+    return FCFS_DATA;
+}
+#else
 void *fcfuse_init(struct fuse_conn_info *conn)
 {
+    if (log_start() != 0) fprintf(stderr, "fcfuse: logging unavailable\n");
+    if (fcfuse_trace_start() != 0) log_at(LOG_LEVEL_WARN, "    tracing unavailable\n");
+    if (fcfuse_slowlog_start() != 0) log_at(LOG_LEVEL_WARN, "    adaptive slow thresholds unavailable\n");
+    if (fcfuse_ctl_start() != 0) log_at(LOG_LEVEL_WARN, "    control socket unavailable\n");
+    if (fcfuse_profile_start() != 0) log_at(LOG_LEVEL_WARN, "    profiling unavailable\n");
+    if (fcfuse_capture_start() != 0) log_at(LOG_LEVEL_WARN, "    capture unavailable\n");
+    if (fcfuse_uring_start() != 0) log_at(LOG_LEVEL_WARN, "    io_uring unavailable, using system calls\n");
+    if (fcfuse_mmap_start() != 0) log_at(LOG_LEVEL_WARN, "    mmap reads unavailable\n");
+    if (fcfuse_gcommit_start() != 0) log_at(LOG_LEVEL_WARN, "    group commit needs Linux 5.8 or later, fsyncs go alone\n");
+    if (fcfuse_journal_start() != 0) log_at(LOG_LEVEL_WARN, "    metadata journal unavailable, changes are made synchronously\n");
+    if (fcfuse_trash_start() != 0) log_at(LOG_LEVEL_WARN, "    trash unavailable, files are unlinked right away\n");
     log_msg("\nfcfuse_init()\n");
+
+    // libfuse 2 caps this at 128 KiB on its own
+    conn->max_write = FCFUSE_MAX_REQUEST;
+    conn->max_readahead = FCFUSE_MAX_REQUEST;
+    conn->async_read = 1;
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES);
+
     log_conn(conn);
     log_fuse_context(fuse_get_context());
     return FCFS_DATA;
 }
+#endif
 
 /**
  * Clean up filesystem
@@ -665,5 +1284,22 @@ void *fcfuse_init(struct fuse_conn_info *conn)
  */
 void fcfuse_destroy(void *userdata)
 {
+    fcfuse_ctl_stop();
+    fcfuse_journal_stop();
+    fcfuse_trash_stop();
+    fcfuse_fdcache_destroy();
+    fcfuse_uring_stop();
+    fcfuse_direct_destroy();
+    fcfuse_bcache_destroy();
+    fcfuse_mmap_stop();
+    fcfuse_gcommit_stop();
+
+    if (((struct fcfuse_state *) userdata)->writeback) fcfuse_view_destroy();
+
+    fcfuse_profile_stop();
+    fcfuse_capture_stop();
+    fcfuse_slowlog_stop();
+    fcfuse_trace_stop();
+    log_close();
     free(userdata);
 }
@@ -0,0 +1,246 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  When many tenants fsync small files at once, every fsync of the
+  backing file is a journal commit and a cache flush of the device.
+  With -o group_commit they are committed in groups instead.
+
+  Requests are grouped by backing filesystem.  An fsync that finds its
+  filesystem idle goes ahead on its own, as it would without the
+  option.  Those that come in while it runs gather in one pending
+  batch, and once the running flush is done the batch is made durable
+  with a single syncfs().  The flush that is running is the window:
+  the more requests arrive, the larger the batches.
+  -o group_commit_delay=US has a batch wait that much longer for
+  latecomers.  A batch of one does its own fsync.
+
+  syncfs() writes back and flushes everything on the filesystem, which
+  covers what each fsync or fdatasync in the batch asked for.  If it
+  fails, every request in the batch gets its error.  What it reports
+  is the filesystem's error as seen from the descriptor it was given,
+  though, not that of each file.  So once it succeeds, every request
+  in the batch also collects the writeback error of its own
+  descriptor with sync_file_range(SYNC_FILE_RANGE_WAIT_AFTER), which
+  waits for writeback and checks the file's error sequence without
+  another flush of the device: an fdatasync() of a clean file would
+  still send one on ext4 and XFS.  The group commit is off on kernels
+  before 5.8, where the syncfs() could lose errors of metadata
+  writeback.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "fcfuse_gcommit.h"
+#include "fcfuse_uring.h"
+
+// Requests that share one syncfs()
+struct gc_batch {
+    int n;                          // requests in the batch
+    int waiters;                    // of those, still to see it done
+    int done;
+    int err;                        // errno of the syncfs(), 0 if none
+};
+
+// One backing filesystem
+struct gc_fs {
+    dev_t dev;
+    int syncing;                    // a flush is running
+    struct gc_batch *pending;       // requests waiting for it to end
+    pthread_cond_t cond;            // syncing or a batch changed
+    struct gc_fs *next;
+};
+
+static int gc_on;
+static unsigned int gc_delay_us;
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gc_fs *gc_filesystems;
+static unsigned long long gc_requests;  // fsyncs seen
+static unsigned long long gc_flushes;   // fsyncs and syncfs() calls sent
+
+/** -o group_commit and -o group_commit_delay, before fuse_main() */
+void fcfuse_gcommit_init(int on, unsigned int delay_us)
+{
+    gc_on = on;
+    gc_delay_us = delay_us;
+}
+
+/** From fcfuse_init().  Returns 0, or -ENOSYS if syncfs() wouldn't
+    report errors and group commit is off. */
+int fcfuse_gcommit_start(void)
+{
+    struct utsname uts;
+    int major, minor;
+
+    if (!gc_on) return 0;
+    if ((uname(&uts) != 0) || (sscanf(uts.release, "%d.%d", &major, &minor) != 2) ||
+        (major < 5) || ((major == 5) && (minor < 8))) {
+        gc_on = 0;
+        return -ENOSYS;
+    }
+
+    return 0;
+}
+
+void fcfuse_gcommit_stop(void)
+{
+    struct gc_fs *fs;
+
+    if (!gc_on) return;
+
+    pthread_mutex_lock(&gc_lock);
+    while ((fs = gc_filesystems)) {
+        gc_filesystems = fs->next;
+        pthread_cond_destroy(&fs->cond);
+        free(fs);
+    }
+    pthread_mutex_unlock(&gc_lock);
+
+    log_msg("    group commit: %llu fsyncs in %llu flushes\n", gc_requests, gc_flushes);
+}
+
+// The filesystem dev, NULL if out of memory
+static struct gc_fs *gc_fs_get(dev_t dev)
+{
+    struct gc_fs *fs;
+
+    for (fs = gc_filesystems; fs; fs = fs->next)
+        if (fs->dev == dev) return fs;
+
+    fs = calloc(1, sizeof(*fs));
+    if (fs == NULL) return NULL;
+    fs->dev = dev;
+    pthread_cond_init(&fs->cond, NULL);
+    fs->next = gc_filesystems;
+    gc_filesystems = fs;
+
+    return fs;
+}
+
+// A flush of fs is over: let the pending batch go
+static void gc_fs_done(struct gc_fs *fs)
+{
+    fs->syncing = 0;
+    pthread_cond_broadcast(&fs->cond);
+}
+
+// Leave a done batch, freeing it with the last one out.  Returns the
+// errno of its syncfs().
+static int gc_batch_leave(struct gc_batch *batch)
+{
+    int err = batch->err;
+
+    if (--batch->waiters == 0) free(batch);
+
+    return err;
+}
+
+// The result of a request in a batch whose syncfs() ended with err:
+// that error, or else the writeback error of fd itself
+static int gc_result(int fd, int err)
+{
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_AFTER);
+}
+
+/** fsync() (fdatasync() if datasync) of fd, possibly as part of a
+    syncfs() of its filesystem.  Returns 0, or -1 with errno set. */
+int fcfuse_gcommit_fsync(int fd, int datasync)
+{
+    struct gc_batch *batch;
+    struct gc_fs *fs;
+    struct stat st;
+    int retstat = 0, err = 0;
+
+    if (!gc_on || (fstat(fd, &st) != 0)) return fcfuse_uring_fsync(fd, datasync);
+
+    pthread_mutex_lock(&gc_lock);
+    gc_requests++;
+    fs = gc_fs_get(st.st_dev);
+    if (fs == NULL) {
+        gc_flushes++;
+        pthread_mutex_unlock(&gc_lock);
+        return fcfuse_uring_fsync(fd, datasync);
+    }
+
+    if (fs->pending) {
+        // join the batch and wait for whoever leads it
+        batch = fs->pending;
+        batch->n++;
+        batch->waiters++;
+        while (!batch->done) pthread_cond_wait(&fs->cond, &gc_lock);
+        err = gc_batch_leave(batch);
+        pthread_mutex_unlock(&gc_lock);
+        return gc_result(fd, err);
+    }
+
+    if (!fs->syncing) {
+        // nothing to wait for
+        fs->syncing = 1;
+        gc_flushes++;
+        pthread_mutex_unlock(&gc_lock);
+        retstat = fcfuse_uring_fsync(fd, datasync);
+        pthread_mutex_lock(&gc_lock);
+        gc_fs_done(fs);
+        pthread_mutex_unlock(&gc_lock);
+        return retstat;
+    }
+
+    // lead the next batch once the running flush is done
+    batch = calloc(1, sizeof(*batch));
+    if (batch == NULL) {
+        gc_flushes++;
+        pthread_mutex_unlock(&gc_lock);
+        return fcfuse_uring_fsync(fd, datasync);
+    }
+    batch->n = batch->waiters = 1;
+    fs->pending = batch;
+    while (fs->syncing) pthread_cond_wait(&fs->cond, &gc_lock);
+    if (gc_delay_us) {
+        struct timespec ts = { gc_delay_us / 1000000, (gc_delay_us % 1000000) * 1000 };
+
+        pthread_mutex_unlock(&gc_lock);
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&gc_lock);
+    }
+    // the batch can't grow any more
+    fs->pending = NULL;
+    fs->syncing = 1;
+    gc_flushes++;
+    if (batch->n == 1) {
+        // alone after all
+        pthread_mutex_unlock(&gc_lock);
+        retstat = fcfuse_uring_fsync(fd, datasync);
+        pthread_mutex_lock(&gc_lock);
+        gc_fs_done(fs);
+        free(batch);
+        pthread_mutex_unlock(&gc_lock);
+        return retstat;
+    }
+    pthread_mutex_unlock(&gc_lock);
+
+    if (syncfs(fd) != 0) err = errno;
+
+    pthread_mutex_lock(&gc_lock);
+    batch->err = err;
+    batch->done = 1;
+    gc_fs_done(fs);
+    gc_batch_leave(batch);
+    pthread_mutex_unlock(&gc_lock);
+
+    return gc_result(fd, err);
+}
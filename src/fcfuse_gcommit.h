@@ -0,0 +1,18 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Group commit for fsync (-o group_commit): concurrent fsyncs of files
+  on one backing filesystem share a single syncfs().
+*/
+
+#ifndef _FCFUSE_GCOMMIT_H_
+#define _FCFUSE_GCOMMIT_H_
+
+void fcfuse_gcommit_init(int on, unsigned int delay_us);
+int  fcfuse_gcommit_start(void);
+void fcfuse_gcommit_stop(void);
+
+int  fcfuse_gcommit_fsync(int fd, int datasync);
+
+#endif
@@ -0,0 +1,871 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Every create, mkdir, unlink, rename and link through the mount is a
+  synchronous metadata operation on the backing filesystem, and on one
+  mounted with dirsync, or over the network, it waits for a commit.
+  With -o journal, the changes we can tell will succeed are appended to
+  FCFUSE_JOURNAL_NAME in the data location and acknowledged.  A thread
+  applies them to the backing tree in batches, every -o
+  journal_interval=MS (10) or as soon as JR_BATCH are waiting.  When
+  mounting, whatever the last mount journaled but didn't apply is
+  replayed.  The journal is not fsynced: it covers the daemon dying.
+  If the machine goes down, the last changes may be lost, as the
+  backing filesystem's own recent metadata may be.
+
+  Until it is applied, a change lives in a table of pending paths,
+  which the other operations consult:
+  - getattr answers for a new file or directory from the table, and
+    gives ENOENT for an unlinked one;
+  - path resolution sees a new directory;
+  - anything else that needs the backing tree as the mount shows it
+    applies the journal first.  That covers opening a pending path,
+    listing a directory with pending entries, and the attributes of
+    a renamed or linked file.
+
+  A change is journaled only if it can't fail: the target is absent
+  (or a file, for unlink and rename), the parent directory exists and
+  is writable, and a rename or link stays on one filesystem.  If not,
+  the caller applies the journal and makes the change itself, with the
+  journal held so that nothing journaled comes in between; that way
+  it gets the right error.  So do the other namespace changes: rmdir,
+  symlink, directory renames and nodes other than files.
+
+  Each record carries a sequence number and a checksum.  The header
+  holds the sequence number of the last record applied, updated after
+  each one, so a replay repeats at most one change, which it
+  tolerates.  Once everything is applied, the journal is truncated to
+  its header.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fcfuse_bcache.h"
+#include "fcfuse_journal.h"
+#include "fcfuse_trash.h"
+
+#define JR_BATCH 256                    // records that wake the applier early
+#define JR_MAX_RECORDS 16384            // past these an appender applies them itself
+#define JR_MAX_BYTES (16 << 20)         // or past this size of the journal
+#define JR_BUCKETS 4096                 // power of two
+#define JR_MAGIC 0x4c4e524a             // "JRNL"
+
+enum { JR_MKNOD = 1, JR_MKDIR, JR_UNLINK, JR_RENAME, JR_LINK };
+
+static const char *jr_opname[] = { "?", "mknod", "mkdir", "unlink", "rename", "link" };
+
+// What a pending path will be once the journal is applied
+enum {
+    JE_NONE,                        // as on the backing tree, only has pending entries
+    JE_FILE,                        // a new file, st is its attributes
+    JE_DIR,                         // a new directory, likewise
+    JE_GONE,                        // unlinked or renamed away
+    JE_CHANGED,                     // renamed or linked to; st is the old attributes
+};
+
+struct jr_header {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t applied;               // sequence number of the last record applied
+};
+
+// A record in the journal, followed by its paths relative to the data
+// location, without NULs
+struct jr_disk {
+    uint32_t sum;                   // FNV-1a of the rest of the record
+    uint16_t op;
+    uint16_t len;
+    uint16_t len2;                  // the new path of a rename or link
+    uint16_t pad;
+    uint32_t mode;
+    uint64_t seq;
+};
+
+// A record waiting to be applied
+struct jr_rec {
+    uint64_t seq;
+    int op;
+    mode_t mode;
+    char *path;                     // backing paths
+    char *path2;
+    struct jr_rec *next;
+};
+
+struct jr_entry {
+    char *fpath;
+    int state;                      // JE_*
+    struct stat st;
+    uint64_t seq;                   // the last record that changed it
+    int children;                   // entries directly below it that aren't JE_NONE
+    struct jr_entry *parent;        // counts this one, unless JE_NONE
+    struct jr_entry *next;
+};
+
+static int jr_on;
+static unsigned int jr_interval_ms;
+static const char *jr_root;
+static size_t jr_rootlen;
+static mode_t jr_umask;
+static int jr_fd = -1;
+static off_t jr_end;                    // where the next record goes
+
+static pthread_mutex_t jr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jr_work = PTHREAD_COND_INITIALIZER;   // records queued, or stopping
+static pthread_cond_t jr_idle = PTHREAD_COND_INITIALIZER;   // a batch was applied
+static struct jr_rec *jr_head, *jr_tail;
+static int jr_queued;
+static int jr_applying;                 // a batch is out of the queue
+static uint64_t jr_seq;                 // the last record appended
+static struct jr_entry *jr_table[JR_BUCKETS];
+static int jr_entries;                  // read without the lock when it is 0
+static pthread_t jr_thread;
+static int jr_running;
+static int jr_stopping;
+
+static unsigned long long jr_journaled, jr_synchronous, jr_batches, jr_lost;
+
+static uint32_t jr_fnv(uint32_t h, const void *p, size_t n)
+{
+    const unsigned char *c = p;
+
+    while (n--) h = (h ^ *c++) * 16777619u;
+
+    return h;
+}
+
+static struct jr_entry **jr_bucket(const char *fpath)
+{
+    return &jr_table[jr_fnv(2166136261u, fpath, strlen(fpath)) & (JR_BUCKETS - 1)];
+}
+
+static struct jr_entry *jr_find(const char *fpath)
+{
+    struct jr_entry *e;
+
+    for (e = *jr_bucket(fpath); e; e = e->next)
+        if (strcmp(e->fpath, fpath) == 0) return e;
+
+    return NULL;
+}
+
+// fpath's entry, made if it has none.  NULL if out of memory.
+static struct jr_entry *jr_get(const char *fpath)
+{
+    struct jr_entry *e = jr_find(fpath), **bucket;
+
+    if (e) return e;
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) return NULL;
+    e->fpath = strdup(fpath);
+    if (e->fpath == NULL) {
+        free(e);
+        return NULL;
+    }
+    bucket = jr_bucket(fpath);
+    e->next = *bucket;
+    *bucket = e;
+    __atomic_add_fetch(&jr_entries, 1, __ATOMIC_RELEASE);
+
+    return e;
+}
+
+// Drop e if nothing is pending at or below it
+static void jr_put(struct jr_entry *e)
+{
+    struct jr_entry **p;
+
+    if ((e->state != JE_NONE) || e->children) return;
+
+    for (p = jr_bucket(e->fpath); *p != e; p = &(*p)->next)
+        ;
+    *p = e->next;
+    free(e->fpath);
+    free(e);
+    __atomic_sub_fetch(&jr_entries, 1, __ATOMIC_RELEASE);
+}
+
+static void jr_parent(char parent[PATH_MAX], const char *fpath)
+{
+    char *slash;
+
+    strcpy(parent, fpath);
+    slash = strrchr(parent, '/');
+    if (slash == parent) slash[1] = '\0';
+    else if (slash) *slash = '\0';
+}
+
+// fpath's entry and its parent's, so that jr_set() can't fail.  NULL
+// if out of memory.
+static struct jr_entry *jr_reserve(const char *fpath)
+{
+    char parent[PATH_MAX];
+    struct jr_entry *e, *p;
+
+    jr_parent(parent, fpath);
+    p = jr_get(parent);
+    if (p == NULL) return NULL;
+    e = jr_get(fpath);
+    if (e == NULL) jr_put(p);
+
+    return e;
+}
+
+// Undo jr_reserve() of an entry that jr_set() wasn't called for
+static void jr_unreserve(struct jr_entry *e)
+{
+    char parent[PATH_MAX];
+    struct jr_entry *p;
+
+    jr_parent(parent, e->fpath);
+    jr_put(e);
+    if ((p = jr_find(parent))) jr_put(p);
+}
+
+static void jr_set(struct jr_entry *e, int state, const struct stat *st)
+{
+    char parent[PATH_MAX];
+
+    if (e->state == JE_NONE) {
+        jr_parent(parent, e->fpath);
+        e->parent = jr_find(parent);
+        e->parent->children++;
+    }
+    e->state = state;
+    e->st = *st;
+    e->seq = jr_seq;
+}
+
+// The record seq was applied: fpath is as the backing tree has it,
+// unless a later record changed it again
+static void jr_settle(const char *fpath, uint64_t seq)
+{
+    struct jr_entry *e = jr_find(fpath), *p;
+
+    if ((e == NULL) || (e->state == JE_NONE) || (e->seq > seq)) return;
+
+    p = e->parent;
+    e->state = JE_NONE;
+    p->children--;
+    jr_put(e);
+    jr_put(p);
+}
+
+// What fpath is as the mount sees it: 0 with st filled in, or -errno.
+// The attributes of a JE_CHANGED path may be out of date.
+static int jr_stat(const char *fpath, struct stat *st, int follow)
+{
+    struct jr_entry *e = jr_find(fpath);
+
+    if (e && (e->state == JE_GONE)) return -ENOENT;
+    if (e && (e->state != JE_NONE)) {
+        *st = e->st;
+        return 0;
+    }
+    if ((follow ? stat(fpath, st) : lstat(fpath, st)) != 0) return -errno;
+
+    return 0;
+}
+
+// Whether the directory fpath is in exists and we may change it; its
+// attributes go in dir
+static int jr_dir_ok(const char *fpath, struct stat *dir)
+{
+    char parent[PATH_MAX];
+    struct jr_entry *e;
+
+    jr_parent(parent, fpath);
+    if ((jr_stat(parent, dir, 1) != 0) || !S_ISDIR(dir->st_mode)) return 0;
+
+    // one we made is ours
+    e = jr_find(parent);
+    if (e && (e->state == JE_DIR)) return (dir->st_mode & 0300) == 0300;
+
+    return access(parent, W_OK | X_OK) == 0;
+}
+
+// Whether fpath, which st describes, may be unlinked or renamed; its
+// directory's attributes go in dir
+static int jr_removable(const char *fpath, const struct stat *st, struct stat *dir)
+{
+    if (!jr_dir_ok(fpath, dir)) return 0;
+
+    // sticky directories only let owners remove entries
+    return !(dir->st_mode & S_ISVTX) || (st->st_uid == geteuid()) || (dir->st_uid == geteuid());
+}
+
+// Attributes of what mknod() or mkdir() would make in dir
+static void jr_new(struct stat *st, const struct stat *dir, mode_t mode)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    memset(st, 0, sizeof(*st));
+    st->st_dev = dir->st_dev;
+    st->st_uid = geteuid();
+    st->st_gid = (dir->st_mode & S_ISGID) ? dir->st_gid : getegid();
+    if (S_ISDIR(mode)) {
+        st->st_mode = S_IFDIR | (mode & 01777 & ~jr_umask) | (dir->st_mode & S_ISGID);
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | (mode & 07777 & ~jr_umask);
+        st->st_nlink = 1;
+    }
+    st->st_blksize = 4096;
+    st->st_atim = st->st_mtim = st->st_ctim = now;
+}
+
+static void jr_free(struct jr_rec *rec)
+{
+    free(rec->path);
+    free(rec->path2);
+    free(rec);
+}
+
+static void jr_mark(uint64_t seq)
+{
+    if (pwrite(jr_fd, &seq, sizeof(seq), offsetof(struct jr_header, applied)) != sizeof(seq))
+        log_at(LOG_LEVEL_WARN, "    journal: can't record progress: %s\n", strerror(errno));
+}
+
+// Write a record to the journal and queue it.  0 or -errno.
+static int jr_append(int op, mode_t mode, const char *fpath, const char *fnewpath)
+{
+    char buf[sizeof(struct jr_disk) + 2 * PATH_MAX];
+    struct jr_disk *d = (struct jr_disk *) buf;
+    const char *rel = fpath + jr_rootlen;
+    const char *rel2 = fnewpath ? fnewpath + jr_rootlen : "";
+    size_t len = strlen(rel), len2 = strlen(rel2);
+    size_t n = sizeof(*d) + len + len2;
+    struct jr_rec *rec;
+
+    if ((len >= PATH_MAX) || (len2 >= PATH_MAX)) return -ENAMETOOLONG;
+
+    rec = calloc(1, sizeof(*rec));
+    if (rec == NULL) return -ENOMEM;
+    rec->path = strdup(fpath);
+    rec->path2 = fnewpath ? strdup(fnewpath) : NULL;
+    if ((rec->path == NULL) || (fnewpath && (rec->path2 == NULL))) {
+        jr_free(rec);
+        return -ENOMEM;
+    }
+
+    memset(d, 0, sizeof(*d));
+    d->op = op;
+    d->len = len;
+    d->len2 = len2;
+    d->mode = mode;
+    d->seq = jr_seq + 1;
+    memcpy(buf + sizeof(*d), rel, len);
+    memcpy(buf + sizeof(*d) + len, rel2, len2);
+    d->sum = jr_fnv(2166136261u, buf + sizeof(d->sum), n - sizeof(d->sum));
+
+    // a short write is overwritten by the next record, and a replay
+    // stops at it
+    if (pwrite(jr_fd, buf, n, jr_end) != (ssize_t) n) {
+        jr_free(rec);
+        return -EIO;
+    }
+    jr_end += n;
+
+    rec->seq = ++jr_seq;
+    rec->op = op;
+    rec->mode = mode;
+    if (jr_tail) jr_tail->next = rec;
+    else jr_head = rec;
+    jr_tail = rec;
+    jr_queued++;
+    if ((jr_queued == 1) || (jr_queued == JR_BATCH)) pthread_cond_signal(&jr_work);
+    jr_journaled++;
+
+    return 0;
+}
+
+// Make rec's change to the backing tree.  Returns 0 or -errno; in a
+// replay, a change that was already made counts as done.
+static int jr_do(const struct jr_rec *rec, int replay)
+{
+    struct stat st;
+    int ret = 0;
+    int fd;
+
+    switch (rec->op) {
+    case JR_MKNOD:
+        fd = open(rec->path, O_CREAT | O_EXCL | O_WRONLY, rec->mode);
+        if (fd == -1) {
+            ret = -errno;
+            break;
+        }
+        // the inode may be that of a file still cached or mapped
+        if (fstat(fd, &st) == 0) fcfuse_bcache_truncate(st.st_dev, st.st_ino);
+        close(fd);
+        break;
+    case JR_MKDIR:
+        if (mkdir(rec->path, rec->mode) != 0) ret = -errno;
+        break;
+    case JR_UNLINK:
+        if (fcfuse_trash_unlink(rec->path) != 0) ret = -errno;
+        break;
+    case JR_RENAME:
+        if (rename(rec->path, rec->path2) != 0) ret = -errno;
+        break;
+    case JR_LINK:
+        if (link(rec->path, rec->path2) != 0) ret = -errno;
+        break;
+    default:
+        ret = -EINVAL;
+    }
+
+    if (replay && (ret == -EEXIST) && ((rec->op == JR_MKNOD) || (rec->op == JR_MKDIR) || (rec->op == JR_LINK)))
+        ret = 0;
+    if (replay && (ret == -ENOENT) && ((rec->op == JR_UNLINK) || (rec->op == JR_RENAME)))
+        ret = 0;
+
+    return ret;
+}
+
+// Apply the queued records as one batch.  With jr_lock held, which is
+// let go meanwhile.
+static void jr_apply(void)
+{
+    struct jr_rec *batch = jr_head, *rec, *next;
+    unsigned long long lost = 0;
+    int ret;
+
+    jr_head = jr_tail = NULL;
+    jr_queued = 0;
+    jr_applying = 1;
+    pthread_mutex_unlock(&jr_lock);
+
+    for (rec = batch; rec; rec = rec->next) {
+        ret = jr_do(rec, 0);
+        if (ret != 0) {
+            log_at(LOG_LEVEL_WARN, "    journal: %s %s: %s, the change is lost\n",
+                   jr_opname[rec->op], rec->path, strerror(-ret));
+            lost++;
+        }
+        jr_mark(rec->seq);
+    }
+
+    pthread_mutex_lock(&jr_lock);
+    for (rec = batch; rec; rec = next) {
+        next = rec->next;
+        jr_settle(rec->path, rec->seq);
+        if (rec->path2) jr_settle(rec->path2, rec->seq);
+        jr_free(rec);
+    }
+    jr_lost += lost;
+    jr_batches++;
+    jr_applying = 0;
+    if ((jr_head == NULL) && (ftruncate(jr_fd, sizeof(struct jr_header)) == 0))
+        jr_end = sizeof(struct jr_header);
+    pthread_cond_broadcast(&jr_idle);
+}
+
+// Apply everything journaled so far.  With jr_lock held.
+static void jr_drain(void)
+{
+    while (jr_applying || jr_head) {
+        if (jr_applying) pthread_cond_wait(&jr_idle, &jr_lock);
+        else jr_apply();
+    }
+}
+
+static void *jr_applier(void *arg)
+{
+    struct timespec until;
+
+    pthread_mutex_lock(&jr_lock);
+    while (!jr_stopping) {
+        if ((jr_head == NULL) || jr_applying) {
+            pthread_cond_wait(&jr_work, &jr_lock);
+            continue;
+        }
+
+        // give the batch the interval to fill
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += jr_interval_ms / 1000;
+        until.tv_nsec += (jr_interval_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (!jr_stopping && jr_head && (jr_queued < JR_BATCH))
+            if (pthread_cond_timedwait(&jr_work, &jr_lock, &until) == ETIMEDOUT) break;
+
+        if (jr_head && !jr_applying) jr_apply();
+    }
+    pthread_mutex_unlock(&jr_lock);
+
+    return NULL;
+}
+
+// Apply what the last mount journaled but didn't, and start the
+// journal afresh.  Returns the changes replayed or -errno.
+static int jr_replay(void)
+{
+    char buf[2 * PATH_MAX], path[PATH_MAX], path2[PATH_MAX];
+    struct jr_header h;
+    struct jr_disk d;
+    struct jr_rec rec;
+    off_t off = sizeof(h);
+    ssize_t got;
+    uint32_t sum;
+    int n = 0;
+    int ret;
+
+    got = pread(jr_fd, &h, sizeof(h), 0);
+    if (got < 0) return -errno;
+    if ((got == sizeof(h)) && (h.magic != JR_MAGIC)) return -EINVAL;
+    if (got < (ssize_t) sizeof(h)) {
+        memset(&h, 0, sizeof(h));
+        h.magic = JR_MAGIC;
+        if (pwrite(jr_fd, &h, sizeof(h), 0) != sizeof(h)) return -EIO;
+    }
+    jr_seq = h.applied;
+
+    // up to the first record that didn't make it whole
+    while (pread(jr_fd, &d, sizeof(d), off) == sizeof(d)) {
+        if ((d.len >= PATH_MAX) || (d.len2 >= PATH_MAX)) break;
+        if (pread(jr_fd, buf, d.len + d.len2, off + sizeof(d)) != d.len + d.len2) break;
+        sum = jr_fnv(2166136261u, (char *) &d + sizeof(d.sum), sizeof(d) - sizeof(d.sum));
+        if (jr_fnv(sum, buf, d.len + d.len2) != d.sum) break;
+        off += sizeof(d) + d.len + d.len2;
+        if (d.seq <= h.applied) continue;
+
+        snprintf(path, PATH_MAX, "%s%.*s", jr_root, (int) d.len, buf);
+        snprintf(path2, PATH_MAX, "%s%.*s", jr_root, (int) d.len2, buf + d.len);
+        rec.op = d.op;
+        rec.mode = d.mode;
+        rec.path = path;
+        rec.path2 = path2;
+        ret = jr_do(&rec, 1);
+        if (ret != 0)
+            fprintf(stderr, "journal: %s %s: %s\n", jr_opname[(d.op <= JR_LINK) ? d.op : 0], path, strerror(-ret));
+        jr_seq = d.seq;
+        jr_mark(jr_seq);
+        n++;
+    }
+
+    if (ftruncate(jr_fd, sizeof(h)) != 0) return -errno;
+    jr_end = sizeof(h);
+
+    return n;
+}
+
+/** -o journal and -o journal_interval, before fuse_main().  Replays
+    what the last mount left.  Returns the changes replayed or -errno. */
+int fcfuse_journal_init(const char *rootdir, int on, unsigned int interval_ms)
+{
+    char path[PATH_MAX];
+    int ret;
+
+    if (!on) return 0;
+
+    jr_root = rootdir;
+    jr_rootlen = strlen(rootdir);
+    jr_interval_ms = interval_ms ? interval_ms : 10;
+    jr_umask = umask(0);
+    umask(jr_umask);
+
+    snprintf(path, PATH_MAX, "%s/%s", rootdir, FCFUSE_JOURNAL_NAME);
+    jr_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (jr_fd == -1) return -errno;
+
+    ret = jr_replay();
+    if (ret < 0) {
+        close(jr_fd);
+        jr_fd = -1;
+        return ret;
+    }
+    jr_on = 1;
+
+    return ret;
+}
+
+/** From fcfuse_init().  Returns 0, or -errno with the journal off. */
+int fcfuse_journal_start(void)
+{
+    int ret;
+
+    if (!jr_on) return 0;
+
+    ret = pthread_create(&jr_thread, NULL, jr_applier, NULL);
+    if (ret != 0) {
+        close(jr_fd);
+        jr_fd = -1;
+        jr_on = 0;
+        return -ret;
+    }
+    jr_running = 1;
+
+    return 0;
+}
+
+/** Apply everything that is left and close the journal */
+void fcfuse_journal_stop(void)
+{
+    if (!jr_on) return;
+
+    if (jr_running) {
+        pthread_mutex_lock(&jr_lock);
+        jr_stopping = 1;
+        pthread_cond_broadcast(&jr_work);
+        pthread_mutex_unlock(&jr_lock);
+        pthread_join(jr_thread, NULL);
+        jr_running = 0;
+    }
+
+    pthread_mutex_lock(&jr_lock);
+    jr_drain();
+    jr_on = 0;
+    pthread_mutex_unlock(&jr_lock);
+    close(jr_fd);
+    jr_fd = -1;
+
+    log_msg("    journal: %llu changes journaled in %llu batches, %llu made synchronously, %llu lost\n",
+            jr_journaled, jr_batches, jr_synchronous, jr_lost);
+}
+
+/** Apply the journal and hold it, for a namespace change the caller
+    makes itself.  fcfuse_journal_done() lets it go. */
+void fcfuse_journal_hold(void)
+{
+    if (!jr_on) return;
+
+    pthread_mutex_lock(&jr_lock);
+    jr_drain();
+    jr_synchronous++;
+}
+
+void fcfuse_journal_done(void)
+{
+    if (jr_on) pthread_mutex_unlock(&jr_lock);
+}
+
+// A change that can't be journaled: the caller makes it.  With jr_lock
+// held, which stays held.
+static int jr_fallback(void)
+{
+    jr_drain();
+    jr_synchronous++;
+
+    return 1;
+}
+
+// A change was journaled
+static int jr_journaled_one(void)
+{
+    if ((jr_queued >= JR_MAX_RECORDS) || (jr_end >= JR_MAX_BYTES)) jr_drain();
+    pthread_mutex_unlock(&jr_lock);
+
+    return 0;
+}
+
+/** Create the file fpath */
+int fcfuse_journal_mknod(const char *fpath, mode_t mode)
+{
+    struct stat st, dir;
+    struct jr_entry *e;
+
+    if (!jr_on) return 1;
+
+    pthread_mutex_lock(&jr_lock);
+    if (!S_ISREG(mode) || (jr_stat(fpath, &st, 0) != -ENOENT) || !jr_dir_ok(fpath, &dir))
+        return jr_fallback();
+    if ((e = jr_reserve(fpath)) == NULL) return jr_fallback();
+    if (jr_append(JR_MKNOD, mode, fpath, NULL) != 0) {
+        jr_unreserve(e);
+        return jr_fallback();
+    }
+
+    jr_new(&st, &dir, mode);
+    jr_set(e, JE_FILE, &st);
+
+    return jr_journaled_one();
+}
+
+/** Create the directory fpath */
+int fcfuse_journal_mkdir(const char *fpath, mode_t mode)
+{
+    struct stat st, dir;
+    struct jr_entry *e;
+
+    if (!jr_on) return 1;
+
+    pthread_mutex_lock(&jr_lock);
+    if ((jr_stat(fpath, &st, 0) != -ENOENT) || !jr_dir_ok(fpath, &dir)) return jr_fallback();
+    if ((e = jr_reserve(fpath)) == NULL) return jr_fallback();
+    if (jr_append(JR_MKDIR, mode, fpath, NULL) != 0) {
+        jr_unreserve(e);
+        return jr_fallback();
+    }
+
+    jr_new(&st, &dir, S_IFDIR | mode);
+    jr_set(e, JE_DIR, &st);
+
+    return jr_journaled_one();
+}
+
+/** Remove the file fpath */
+int fcfuse_journal_unlink(const char *fpath)
+{
+    struct stat st, dir;
+    struct jr_entry *e;
+
+    if (!jr_on) return 1;
+
+    pthread_mutex_lock(&jr_lock);
+    if ((jr_stat(fpath, &st, 0) != 0) || S_ISDIR(st.st_mode) || !jr_removable(fpath, &st, &dir))
+        return jr_fallback();
+    if ((e = jr_reserve(fpath)) == NULL) return jr_fallback();
+    if (jr_append(JR_UNLINK, 0, fpath, NULL) != 0) {
+        jr_unreserve(e);
+        return jr_fallback();
+    }
+
+    jr_set(e, JE_GONE, &st);
+
+    return jr_journaled_one();
+}
+
+/** Rename the file fpath to fnewpath */
+int fcfuse_journal_rename(const char *fpath, const char *fnewpath)
+{
+    struct stat st, old, dir, newdir;
+    struct jr_entry *e, *e2;
+    int exists;
+
+    if (!jr_on) return 1;
+
+    pthread_mutex_lock(&jr_lock);
+    if ((strcmp(fpath, fnewpath) == 0) || (jr_stat(fpath, &st, 0) != 0) || S_ISDIR(st.st_mode) ||
+        !jr_removable(fpath, &st, &dir))
+        return jr_fallback();
+    exists = (jr_stat(fnewpath, &old, 0) == 0);
+    // renaming a file onto a link to it does nothing at all
+    if (exists && (S_ISDIR(old.st_mode) || !jr_removable(fnewpath, &old, &newdir) ||
+                   ((old.st_dev == st.st_dev) && (old.st_ino == st.st_ino))))
+        return jr_fallback();
+    if ((!exists && !jr_dir_ok(fnewpath, &newdir)) || (newdir.st_dev != st.st_dev))
+        return jr_fallback();
+    if ((e = jr_reserve(fpath)) == NULL) return jr_fallback();
+    if ((e2 = jr_reserve(fnewpath)) == NULL) {
+        jr_unreserve(e);
+        return jr_fallback();
+    }
+    if (jr_append(JR_RENAME, 0, fpath, fnewpath) != 0) {
+        jr_unreserve(e2);
+        jr_unreserve(e);
+        return jr_fallback();
+    }
+
+    jr_set(e, JE_GONE, &st);
+    jr_set(e2, JE_CHANGED, &st);
+
+    return jr_journaled_one();
+}
+
+/** Make fnewpath a hard link to the file fpath */
+int fcfuse_journal_link(const char *fpath, const char *fnewpath)
+{
+    struct stat st, old, newdir;
+    struct jr_entry *e, *e2;
+
+    if (!jr_on) return 1;
+
+    pthread_mutex_lock(&jr_lock);
+    // protected_hardlinks may refuse links to other users' files
+    if ((jr_stat(fpath, &st, 0) != 0) || S_ISDIR(st.st_mode) || (st.st_uid != geteuid()) ||
+        (jr_stat(fnewpath, &old, 0) != -ENOENT) || !jr_dir_ok(fnewpath, &newdir) ||
+        (newdir.st_dev != st.st_dev))
+        return jr_fallback();
+    if ((e = jr_reserve(fpath)) == NULL) return jr_fallback();
+    if ((e2 = jr_reserve(fnewpath)) == NULL) {
+        jr_unreserve(e);
+        return jr_fallback();
+    }
+    if (jr_append(JR_LINK, 0, fpath, fnewpath) != 0) {
+        jr_unreserve(e2);
+        jr_unreserve(e);
+        return jr_fallback();
+    }
+
+    jr_set(e, JE_CHANGED, &st);
+    jr_set(e2, JE_CHANGED, &st);
+
+    return jr_journaled_one();
+}
+
+/** Apply the journal if fpath, or anything in it, has changes waiting */
+void fcfuse_journal_barrier(const char *fpath)
+{
+    char key[PATH_MAX];
+    size_t len;
+
+    if (!jr_on || !__atomic_load_n(&jr_entries, __ATOMIC_ACQUIRE)) return;
+
+    // the root resolves with a trailing slash
+    strcpy(key, fpath);
+    len = strlen(key);
+    while ((len > 1) && (key[len - 1] == '/')) key[--len] = '\0';
+
+    pthread_mutex_lock(&jr_lock);
+    if (jr_find(key)) jr_drain();
+    pthread_mutex_unlock(&jr_lock);
+}
+
+/** 1 if fpath is a directory the journal has yet to make, 0 if it is
+    another path with changes waiting, -1 if the backing tree knows */
+int fcfuse_journal_isdir(const char *fpath)
+{
+    struct jr_entry *e;
+    int ret = -1;
+
+    if (!jr_on || !__atomic_load_n(&jr_entries, __ATOMIC_ACQUIRE)) return -1;
+
+    pthread_mutex_lock(&jr_lock);
+    e = jr_find(fpath);
+    if (e && (e->state != JE_NONE)) ret = (e->state == JE_DIR);
+    pthread_mutex_unlock(&jr_lock);
+
+    return ret;
+}
+
+/** fcfuse_getattr() of fpath while it has changes waiting: 1 with
+    stbuf filled in, -ENOENT, or 0 to ask the backing tree, to which
+    the journal has been applied if it had to be */
+int fcfuse_journal_getattr(const char *fpath, struct stat *stbuf)
+{
+    struct jr_entry *e;
+    int ret = 0;
+
+    if (!jr_on || !__atomic_load_n(&jr_entries, __ATOMIC_ACQUIRE)) return 0;
+
+    pthread_mutex_lock(&jr_lock);
+    e = jr_find(fpath);
+    if (e && ((e->state == JE_FILE) || (e->state == JE_DIR))) {
+        *stbuf = e->st;
+        ret = 1;
+    } else if (e && (e->state == JE_GONE)) {
+        ret = -ENOENT;
+    } else if (e && (e->state == JE_CHANGED)) {
+        jr_drain();
+    }
+    pthread_mutex_unlock(&jr_lock);
+
+    return ret;
+}
@@ -0,0 +1,38 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Metadata journal (-o journal): creates, mkdirs, unlinks, renames and
+  links are acknowledged once appended to a journal in the data
+  location and applied to the backing tree in batches.
+*/
+
+#ifndef _FCFUSE_JOURNAL_H_
+#define _FCFUSE_JOURNAL_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// The journal, in the root of the data location
+#define FCFUSE_JOURNAL_NAME ".fcfuse-journal"
+
+int  fcfuse_journal_init(const char *rootdir, int on, unsigned int interval_ms);
+int  fcfuse_journal_start(void);
+void fcfuse_journal_stop(void);
+
+// Each returns 0 if the change was journaled.  Otherwise it returns 1
+// with the journal applied and held: the caller makes the change
+// itself and then calls fcfuse_journal_done().
+int  fcfuse_journal_mknod(const char *fpath, mode_t mode);
+int  fcfuse_journal_mkdir(const char *fpath, mode_t mode);
+int  fcfuse_journal_unlink(const char *fpath);
+int  fcfuse_journal_rename(const char *fpath, const char *fnewpath);
+int  fcfuse_journal_link(const char *fpath, const char *fnewpath);
+void fcfuse_journal_hold(void);
+void fcfuse_journal_done(void);
+
+void fcfuse_journal_barrier(const char *fpath);
+int  fcfuse_journal_isdir(const char *fpath);
+int  fcfuse_journal_getattr(const char *fpath, struct stat *stbuf);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Shells and build tools probe for lots of paths that don't exist,
+  and every miss used to cost a GETCID ioctl plus two stats of the
+  backing tree.  This remembers what fcfuse_getattr() found for each
+  (container, path): the attributes for a positive entry, ENOENT for
+  a negative one, each for as long as that container's timeout says.
+
+  Entries of one path share a hash bucket, so changes that every
+  container sees (directories, raw .containerN names touched from
+  outside any container) can drop all of them at once.  Renaming a
+  directory flushes the whole cache.
+
+  A getattr result may be overtaken by a change whose invalidation
+  comes in before it is put.  Every lock stripe counts the entries
+  dropped under it; getattr takes fcfuse_lookup_stamp() before asking
+  the backing tree, and fcfuse_lookup_put() caches nothing if the
+  count has moved since.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fcfuse_lookup.h"
+
+#define LOOKUP_BUCKETS (16 * 1024)
+#define LOOKUP_LOCKS 64                 // divides LOOKUP_BUCKETS
+#define LOOKUP_MAX (256 * 1024)
+
+struct lookup_entry {
+    char *path;
+    int cid;
+    int negative;
+    struct stat st;
+    uint64_t expires;       // CLOCK_MONOTONIC_COARSE, ns
+    uint64_t gen;
+    struct lookup_entry *next;
+};
+
+struct lookup_timeout {
+    int cid;
+    uint64_t attr;          // ns
+    uint64_t negative;      // ns
+};
+
+static struct lookup_entry *lookup_table[LOOKUP_BUCKETS];
+static pthread_mutex_t lookup_locks[LOOKUP_LOCKS];
+static uint64_t lookup_stamps[LOOKUP_LOCKS];   // drops under each lock
+static int lookup_count;
+static uint64_t lookup_gen;
+static int lookup_enabled;
+
+static struct lookup_timeout lookup_default;
+static struct lookup_timeout *lookup_timeouts;
+static int lookup_ntimeouts;
+static pthread_rwlock_t lookup_timeout_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint64_t lookup_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned int lookup_hash(const char *path)
+{
+    unsigned int h = 2166136261u;
+
+    while (*path) h = (h ^ (unsigned char) *path++) * 16777619u;
+
+    return h % LOOKUP_BUCKETS;
+}
+
+static pthread_mutex_t *lookup_lock(unsigned int h)
+{
+    return &lookup_locks[h % LOOKUP_LOCKS];
+}
+
+// The lock of bucket h must be held
+static void lookup_stamp_bump(unsigned int h)
+{
+    __atomic_add_fetch(&lookup_stamps[h % LOOKUP_LOCKS], 1, __ATOMIC_RELEASE);
+}
+
+// Every lock stripe at once, for the flushes
+static void lookup_stamp_bump_all(void)
+{
+    int i;
+
+    for (i = 0; i < LOOKUP_LOCKS; i++) {
+        pthread_mutex_lock(&lookup_locks[i]);
+        lookup_stamp_bump(i);
+        pthread_mutex_unlock(&lookup_locks[i]);
+    }
+}
+
+// lookup_timeout_lock must be held
+static const struct lookup_timeout *lookup_timeout_of(int cid)
+{
+    int i;
+
+    for (i = 0; i < lookup_ntimeouts; i++)
+        if (lookup_timeouts[i].cid == cid) return &lookup_timeouts[i];
+
+    return &lookup_default;
+}
+
+static void lookup_free(struct lookup_entry *entry)
+{
+    free(entry->path);
+    free(entry);
+    __atomic_sub_fetch(&lookup_count, 1, __ATOMIC_RELAXED);
+}
+
+void fcfuse_lookup_init(void)
+{
+    int i;
+
+    for (i = 0; i < LOOKUP_LOCKS; i++) pthread_mutex_init(&lookup_locks[i], NULL);
+}
+
+/**
+ * Set how long getattr results of container cid are kept, in
+ * seconds; FCFUSE_LOOKUP_DEFAULT sets them for all other containers.
+ * A timeout of 0 disables that kind of entry.  Entries already
+ * cached keep the timeout they got.
+ */
+int fcfuse_lookup_set_timeout(int cid, double attr_timeout, double negative_timeout)
+{
+    struct lookup_timeout *timeout = NULL, *timeouts;
+    int i;
+
+    if ((attr_timeout < 0) || (negative_timeout < 0)) return -EINVAL;
+
+    pthread_rwlock_wrlock(&lookup_timeout_lock);
+    if (cid == FCFUSE_LOOKUP_DEFAULT) {
+        timeout = &lookup_default;
+    } else {
+        for (i = 0; i < lookup_ntimeouts; i++)
+            if (lookup_timeouts[i].cid == cid) timeout = &lookup_timeouts[i];
+        if (timeout == NULL) {
+            timeouts = realloc(lookup_timeouts, (lookup_ntimeouts + 1) * sizeof(*timeouts));
+            if (timeouts == NULL) {
+                pthread_rwlock_unlock(&lookup_timeout_lock);
+                return -ENOMEM;
+            }
+            lookup_timeouts = timeouts;
+            timeout = &lookup_timeouts[lookup_ntimeouts++];
+        }
+    }
+
+    timeout->cid = cid;
+    timeout->attr = attr_timeout * 1e9;
+    timeout->negative = negative_timeout * 1e9;
+    if (timeout->attr || timeout->negative) __atomic_store_n(&lookup_enabled, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&lookup_timeout_lock);
+
+    return 0;
+}
+
+/** The timeouts container cid gets, in seconds */
+void fcfuse_lookup_get_timeout(int cid, double *attr_timeout, double *negative_timeout)
+{
+    const struct lookup_timeout *timeout;
+
+    pthread_rwlock_rdlock(&lookup_timeout_lock);
+    timeout = (cid == FCFUSE_LOOKUP_DEFAULT) ? &lookup_default : lookup_timeout_of(cid);
+    *attr_timeout = timeout->attr / 1e9;
+    *negative_timeout = timeout->negative / 1e9;
+    pthread_rwlock_unlock(&lookup_timeout_lock);
+}
+
+/** Write the containers with timeouts of their own as lookup_timeout= options */
+void fcfuse_lookup_dump_timeouts(FILE *out)
+{
+    int i;
+
+    pthread_rwlock_rdlock(&lookup_timeout_lock);
+    for (i = 0; i < lookup_ntimeouts; i++)
+        fprintf(out, "lookup_timeout %d:%g:%g\n", lookup_timeouts[i].cid,
+                lookup_timeouts[i].attr / 1e9, lookup_timeouts[i].negative / 1e9);
+    pthread_rwlock_unlock(&lookup_timeout_lock);
+}
+
+/**
+ * Look path up for container cid.  Returns 1 and fills stbuf (if
+ * not NULL) on a positive hit, -ENOENT on a negative hit and 0 if
+ * the backing tree has to be asked.
+ */
+int fcfuse_lookup_get(const char *path, int cid, struct stat *stbuf)
+{
+    struct lookup_entry *entry;
+    unsigned int h;
+    uint64_t gen;
+    int retstat = 0;
+
+    if (!__atomic_load_n(&lookup_enabled, __ATOMIC_RELAXED)) return 0;
+
+    h = lookup_hash(path);
+    gen = __atomic_load_n(&lookup_gen, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(lookup_lock(h));
+    for (entry = lookup_table[h]; entry != NULL; entry = entry->next) {
+        if ((entry->cid != cid) || strcmp(entry->path, path)) continue;
+        if ((entry->gen == gen) && (entry->expires > lookup_now())) {
+            if (entry->negative) retstat = -ENOENT;
+            else {
+                if (stbuf) *stbuf = entry->st;
+                retstat = 1;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(lookup_lock(h));
+
+    return retstat;
+}
+
+/** Taken before asking the backing tree about path, for fcfuse_lookup_put() */
+uint64_t fcfuse_lookup_stamp(const char *path)
+{
+    if (!__atomic_load_n(&lookup_enabled, __ATOMIC_RELAXED)) return 0;
+
+    return __atomic_load_n(&lookup_stamps[lookup_hash(path) % LOOKUP_LOCKS], __ATOMIC_ACQUIRE);
+}
+
+// Full: make room by dropping the oldest entry of bucket h, or of the
+// next bucket under the same lock that has any, which must be held.
+// A lock over no entries at all lets the cache go over LOOKUP_MAX by
+// one, once.
+static void lookup_evict(unsigned int h)
+{
+    struct lookup_entry **link;
+    unsigned int i, b;
+
+    for (i = 0; i < LOOKUP_BUCKETS / LOOKUP_LOCKS; i++) {
+        b = (h + i * LOOKUP_LOCKS) % LOOKUP_BUCKETS;
+        if (lookup_table[b] == NULL) continue;
+        for (link = &lookup_table[b]; (*link)->next; link = &(*link)->next)
+            ;
+        lookup_free(*link);
+        *link = NULL;
+        return;
+    }
+}
+
+/**
+ * Remember what getattr found; stbuf NULL means ENOENT.  Nothing is
+ * remembered if path may have changed since stamp was taken.
+ */
+void fcfuse_lookup_put(const char *path, int cid, const struct stat *stbuf, uint64_t stamp)
+{
+    const struct lookup_timeout *timeout;
+    struct lookup_entry *entry, **link;
+    uint64_t ttl;
+    unsigned int h;
+
+    if (!__atomic_load_n(&lookup_enabled, __ATOMIC_RELAXED)) return;
+
+    pthread_rwlock_rdlock(&lookup_timeout_lock);
+    timeout = lookup_timeout_of(cid);
+    ttl = stbuf ? timeout->attr : timeout->negative;
+    pthread_rwlock_unlock(&lookup_timeout_lock);
+    if (ttl == 0) return;
+
+    h = lookup_hash(path);
+
+    pthread_mutex_lock(lookup_lock(h));
+
+    // an invalidation came in after the backing tree was asked
+    if (__atomic_load_n(&lookup_stamps[h % LOOKUP_LOCKS], __ATOMIC_RELAXED) != stamp) goto out;
+
+    for (link = &lookup_table[h]; (entry = *link) != NULL; link = &entry->next)
+        if ((entry->cid == cid) && !strcmp(entry->path, path)) break;
+
+    if (entry == NULL) {
+        if (__atomic_load_n(&lookup_count, __ATOMIC_RELAXED) >= LOOKUP_MAX) lookup_evict(h);
+        entry = calloc(1, sizeof(*entry));
+        if (entry == NULL) goto out;
+        entry->path = strdup(path);
+        if (entry->path == NULL) {
+            free(entry);
+            goto out;
+        }
+        entry->cid = cid;
+        entry->next = lookup_table[h];
+        lookup_table[h] = entry;
+        __atomic_add_fetch(&lookup_count, 1, __ATOMIC_RELAXED);
+    }
+
+    entry->negative = (stbuf == NULL);
+    if (stbuf) entry->st = *stbuf;
+    entry->gen = __atomic_load_n(&lookup_gen, __ATOMIC_ACQUIRE);
+    entry->expires = lookup_now() + ttl;
+
+out:
+    pthread_mutex_unlock(lookup_lock(h));
+}
+
+static void lookup_drop(const char *path, int cid)
+{
+    struct lookup_entry *entry, **link;
+    unsigned int h = lookup_hash(path);
+
+    pthread_mutex_lock(lookup_lock(h));
+    lookup_stamp_bump(h);
+    link = &lookup_table[h];
+    while ((entry = *link) != NULL) {
+        if (((cid == -1) || (entry->cid == cid)) && !strcmp(entry->path, path)) {
+            *link = entry->next;
+            lookup_free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(lookup_lock(h));
+}
+
+/**
+ * path changed for container cid.  cid -1 means the change is seen
+ * by every container: a directory, or a raw name changed from outside
+ * any container, which for "name.containerN" is also container N's
+ * "name".
+ */
+void fcfuse_lookup_invalidate(const char *path, int cid)
+{
+    char base[PATH_MAX];
+    const char *suffix;
+    char *end;
+    long ncid;
+
+    if (!__atomic_load_n(&lookup_enabled, __ATOMIC_RELAXED)) return;
+
+    lookup_drop(path, cid);
+    if (cid != -1) return;
+
+    suffix = strstr(path, ".container");
+    while (suffix != NULL) {
+        ncid = strtol(suffix + strlen(".container"), &end, 10);
+        if ((*end == '\0') && (end != suffix + strlen(".container")) &&
+            (suffix - path < PATH_MAX)) {
+            memcpy(base, path, suffix - path);
+            base[suffix - path] = '\0';
+            lookup_drop(base, ncid);
+            break;
+        }
+        suffix = strstr(suffix + 1, ".container");
+    }
+}
+
+/** Forget everything, e.g. after a directory was renamed */
+void fcfuse_lookup_flush(void)
+{
+    if (!__atomic_load_n(&lookup_enabled, __ATOMIC_RELAXED)) return;
+
+    // entries of an older generation are never returned; they get
+    // replaced or pushed out as new results come in
+    __atomic_add_fetch(&lookup_gen, 1, __ATOMIC_ACQ_REL);
+    lookup_stamp_bump_all();
+}
+
+/** Forget every entry of container cid */
+void fcfuse_lookup_flush_container(int cid)
+{
+    struct lookup_entry *entry, **link;
+    unsigned int h;
+
+    lookup_stamp_bump_all();
+    for (h = 0; h < LOOKUP_BUCKETS; h++) {
+        pthread_mutex_lock(lookup_lock(h));
+        link = &lookup_table[h];
+        while ((entry = *link) != NULL) {
+            if (entry->cid == cid) {
+                *link = entry->next;
+                lookup_free(entry);
+            } else {
+                link = &entry->next;
+            }
+        }
+        pthread_mutex_unlock(lookup_lock(h));
+    }
+}
+
+/**
+ * Call fn for every entry that can still be returned, with its
+ * container and whether it is negative.  fn runs with a bucket lock
+ * held.
+ */
+void fcfuse_lookup_foreach(void (*fn)(int cid, int negative, void *arg), void *arg)
+{
+    struct lookup_entry *entry;
+    uint64_t gen = __atomic_load_n(&lookup_gen, __ATOMIC_ACQUIRE);
+    uint64_t now = lookup_now();
+    unsigned int h;
+
+    for (h = 0; h < LOOKUP_BUCKETS; h++) {
+        pthread_mutex_lock(lookup_lock(h));
+        for (entry = lookup_table[h]; entry != NULL; entry = entry->next)
+            if ((entry->gen == gen) && (entry->expires > now)) fn(entry->cid, entry->negative, arg);
+        pthread_mutex_unlock(lookup_lock(h));
+    }
+}
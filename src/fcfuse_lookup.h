@@ -0,0 +1,31 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  In-daemon cache of getattr results per (container, path), both
+  positive and negative, with timeouts configurable per container.
+*/
+
+#ifndef _FCFUSE_LOOKUP_H_
+#define _FCFUSE_LOOKUP_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+// cid for timeouts that apply to every container without its own
+#define FCFUSE_LOOKUP_DEFAULT (-2)
+
+void fcfuse_lookup_init(void);
+int  fcfuse_lookup_set_timeout(int cid, double attr_timeout, double negative_timeout);
+void fcfuse_lookup_get_timeout(int cid, double *attr_timeout, double *negative_timeout);
+void fcfuse_lookup_dump_timeouts(FILE *out);
+int  fcfuse_lookup_get(const char *path, int cid, struct stat *stbuf);
+uint64_t fcfuse_lookup_stamp(const char *path);
+void fcfuse_lookup_put(const char *path, int cid, const struct stat *stbuf, uint64_t stamp);
+void fcfuse_lookup_invalidate(const char *path, int cid);
+void fcfuse_lookup_flush(void);
+void fcfuse_lookup_flush_container(int cid);
+void fcfuse_lookup_foreach(void (*fn)(int cid, int negative, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Containers given with -o mmap=CID read reference data: small random
+  reads of files nobody writes.  Each of them costs a pread() in the
+  daemon.  Instead, their read-only handles map the backing file when
+  it is opened, and reads are a memcpy() out of the mapping.
+
+  The mapping covers the file as it was at open.  What lies past that
+  (the file may have grown since) is read with pread(), as is
+  everything once the file has been truncated through the mount: the
+  truncation advances the file's generation, the one the block cache
+  keys its blocks with (see fcfuse_bcache.c), which the handle checks
+  on each read.
+
+  A file truncated behind the daemon's back turns the mapped pages
+  past its new end into SIGBUS.  Copies out of a mapping run with a
+  per-thread jump buffer set, and our SIGBUS handler jumps back out of
+  the copy, after which the handle reads with pread().  A SIGBUS that
+  isn't ours goes to whatever handled it before us.
+
+  Access patterns are tracked per handle and given to the kernel with
+  madvise(): MADV_SEQUENTIAL once MMAP_SEQUENTIAL reads have followed
+  each other, MADV_RANDOM once MMAP_RANDOM haven't.  Only a change of
+  pattern costs a system call.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "fcfuse_bcache.h"
+#include "fcfuse_cidset.h"
+#include "fcfuse_mmap.h"
+#include "fcfuse_stats.h"
+#include "fcfuse_uring.h"
+
+#define MMAP_SEQUENTIAL 2
+#define MMAP_RANDOM 4
+
+struct fcfuse_mmap {
+    char *addr;
+    size_t len;
+    uint32_t *gen;                  // the file's truncation generation
+    uint32_t seen;                  // and what it was at open
+    int broken;                     // faulted, pread() from now on
+    // access pattern; shared by the handle's workers without a lock,
+    // a lost update only delays a hint
+    off_t next;                     // where a sequential read would start
+    int sequential;                 // reads in a row that followed each other
+    int random;                     // and that didn't
+    int advice;                     // MADV_NORMAL, MADV_SEQUENTIAL or MADV_RANDOM
+};
+
+// Containers with -o mmap
+static struct fcfuse_cidset mmap_cids;
+
+static struct sigaction mmap_old_sigbus;
+static int mmap_handling;
+
+// Set while this thread copies out of a mapping
+static __thread sigjmp_buf *mmap_jmp;
+
+/** -o mmap=CID.  Returns 0 or -ENOMEM. */
+int fcfuse_mmap_add(int cid)
+{
+    return fcfuse_cidset_add(&mmap_cids, cid);
+}
+
+/** Whether container cid maps its read-only files */
+int fcfuse_mmap_enabled(int cid)
+{
+    return fcfuse_cidset_has(&mmap_cids, cid);
+}
+
+/** Whether any container does */
+int fcfuse_mmap_any(void)
+{
+    return mmap_cids.n > 0;
+}
+
+static void mmap_sigbus(int sig, siginfo_t *info, void *context)
+{
+    if (mmap_jmp) siglongjmp(*mmap_jmp, 1);
+
+    // Not a copy of ours: hand the signal back.  The faulting
+    // instruction runs again and raises it there.
+    sigaction(SIGBUS, &mmap_old_sigbus, NULL);
+}
+
+/** From fcfuse_init(), once there are threads to fault.  Returns 0 or
+    -errno. */
+int fcfuse_mmap_start(void)
+{
+    struct sigaction sa;
+
+    if (!fcfuse_mmap_any()) return 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = mmap_sigbus;
+    // the handler doesn't return, so SIGBUS must not stay blocked
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, &mmap_old_sigbus) != 0) return -errno;
+    mmap_handling = 1;
+
+    return 0;
+}
+
+void fcfuse_mmap_stop(void)
+{
+    if (!mmap_handling) return;
+    sigaction(SIGBUS, &mmap_old_sigbus, NULL);
+    mmap_handling = 0;
+}
+
+/** Map the file fd, which st describes, for reading.  NULL if it is
+    empty, not a regular file or can't be mapped. */
+struct fcfuse_mmap *fcfuse_mmap_open(int fd, const struct stat *st)
+{
+    struct fcfuse_mmap *map;
+
+    if (!mmap_handling || !S_ISREG(st->st_mode) || (st->st_size <= 0)) return NULL;
+
+    map = calloc(1, sizeof(*map));
+    if (map == NULL) return NULL;
+    map->gen = fcfuse_bcache_generation(st->st_dev, st->st_ino);
+    map->seen = __atomic_load_n(map->gen, __ATOMIC_ACQUIRE);
+    map->len = st->st_size;
+    map->addr = mmap(NULL, map->len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map->addr == MAP_FAILED) {
+        log_at(LOG_LEVEL_DEBUG, "    mmap: %s, using pread\n", strerror(errno));
+        free(map);
+        return NULL;
+    }
+    map->advice = MADV_NORMAL;
+
+    return map;
+}
+
+// Give the kernel the handle's access pattern if it changed
+static void mmap_advise(struct fcfuse_mmap *map, off_t offset, size_t size)
+{
+    int advice = map->advice;
+
+    if (offset == map->next) {
+        map->sequential++;
+        map->random = 0;
+    } else {
+        map->sequential = 0;
+        map->random++;
+    }
+    map->next = offset + size;
+
+    if (map->sequential >= MMAP_SEQUENTIAL) advice = MADV_SEQUENTIAL;
+    else if (map->random >= MMAP_RANDOM) advice = MADV_RANDOM;
+    if (advice == map->advice) return;
+
+    map->advice = advice;
+    madvise(map->addr, map->len, advice);
+}
+
+// Copy out of a mapping.  Returns 0, or -1 if the pages are gone.
+static int mmap_copy(char *buf, const char *src, size_t size)
+{
+    sigjmp_buf jmp;
+
+    // the mask needn't be saved, SA_NODEFER leaves it alone
+    if (sigsetjmp(jmp, 0)) {
+        mmap_jmp = NULL;
+        return -1;
+    }
+    mmap_jmp = &jmp;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    memcpy(buf, src, size);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    mmap_jmp = NULL;
+
+    return 0;
+}
+
+/** pread() of fd through its mapping */
+ssize_t fcfuse_mmap_pread(struct fcfuse_mmap *map, int fd, char *buf, size_t size, off_t offset)
+{
+    size_t mapped = 0;
+    ssize_t n;
+
+    if (!map->broken && (__atomic_load_n(map->gen, __ATOMIC_ACQUIRE) != map->seen)) map->broken = 1;
+
+    if (!map->broken && (offset < (off_t) map->len)) {
+        mapped = map->len - offset;
+        if (mapped > size) mapped = size;
+        mmap_advise(map, offset, mapped);
+        if (mmap_copy(buf, map->addr + offset, mapped) != 0) {
+            log_at(LOG_LEVEL_WARN, "    mmap: backing file truncated under the mapping, using pread\n");
+            map->broken = 1;
+            mapped = 0;
+        }
+    }
+    if (mapped == size) return size;
+
+    // past the mapping, or all of it once the mapping is stale
+    n = FCFS_IO(fcfuse_uring_pread(fd, buf + mapped, size - mapped, offset + mapped));
+    if (n < 0) return mapped ? (ssize_t) mapped : -1;
+
+    return mapped + n;
+}
+
+void fcfuse_mmap_release(struct fcfuse_mmap *map)
+{
+    munmap(map->addr, map->len);
+    free(map);
+}
@@ -0,0 +1,27 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Read-only handles of the containers given with -o mmap=CID read
+  out of a mapping of the backing file instead of calling pread().
+*/
+
+#ifndef _FCFUSE_MMAP_H_
+#define _FCFUSE_MMAP_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct fcfuse_mmap;
+
+int  fcfuse_mmap_add(int cid);
+int  fcfuse_mmap_enabled(int cid);
+int  fcfuse_mmap_any(void);
+int  fcfuse_mmap_start(void);
+void fcfuse_mmap_stop(void);
+
+struct fcfuse_mmap *fcfuse_mmap_open(int fd, const struct stat *st);
+ssize_t fcfuse_mmap_pread(struct fcfuse_mmap *map, int fd, char *buf, size_t size, off_t offset);
+void fcfuse_mmap_release(struct fcfuse_mmap *map);
+
+#endif
@@ -0,0 +1,56 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Statically defined tracing probes (USDT) of the fcfuse provider.
+  A probe that nobody attached to is a nop instruction; bpftrace,
+  perf and SystemTap find them in the binary's .note.stapsdt section,
+  e.g.
+
+    bpftrace -l 'usdt:./src/fcfuse:fcfuse:*'
+
+  Build with -DFCFUSE_NO_PROBES, or without systemtap-sdt-dev /
+  systemtap-sdt-devel installed, to leave them out.  See
+  tools/bpftrace/ for scripts that use them.
+
+  Probes and arguments:
+
+    op__entry        op, path
+    op__return       op, cid, retstat, latency ns
+    read, write      cid, size, offset, retstat
+    copy__range      cid, size, retstat
+    ioctl__entry     ioctl op
+    ioctl__return    ioctl op, cid, latency ns
+    lookup__hit      cid, path, negative
+    lookup__miss     cid, path
+    fdcache__hit     cid, fd
+    fdcache__miss    cid, flags
+    view__open       cid, path, cached
+
+  op is an enum fcfuse_opcode; fcfuse_stats.c has the names.
+*/
+
+#ifndef _FCFUSE_PROBES_H_
+#define _FCFUSE_PROBES_H_
+
+#if !defined(FCFUSE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define FCFUSE_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef FCFUSE_HAVE_PROBES
+#include <sys/sdt.h>
+
+#define FCFS_PROBE1(name, a) DTRACE_PROBE1(fcfuse, name, a)
+#define FCFS_PROBE2(name, a, b) DTRACE_PROBE2(fcfuse, name, a, b)
+#define FCFS_PROBE3(name, a, b, c) DTRACE_PROBE3(fcfuse, name, a, b, c)
+#define FCFS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(fcfuse, name, a, b, c, d)
+#else
+#define FCFS_PROBE1(name, a) do { } while (0)
+#define FCFS_PROBE2(name, a, b) do { } while (0)
+#define FCFS_PROBE3(name, a, b, c) do { } while (0)
+#define FCFS_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,497 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  With -o profile=FILE every worker thread is sampled -o profile_hz
+  times per second of the CPU time it uses.  A sample is the thread's
+  call stack together with the operation and container it was
+  serving, taken from the SIGPROF handler with backtrace().
+
+  The signal comes from a perf_event_open() software clock of the
+  thread when the kernel lets us open one, and from a POSIX timer on
+  the thread's CPU clock otherwise, so no perf tool or privileges are
+  needed on the host.
+
+  The handler only appends to a ring of the thread's own.  A thread
+  of ours drains the rings, adds identical stacks up, and every
+  PROFILE_WRITE seconds rewrites FILE in the folded format that
+  flamegraph.pl, speedscope and inferno read:
+
+    op=read;cid=3;start_thread;...;fcfuse_read;pread64 42
+
+  Samples taken outside a callback are tagged op=libfuse.  Frames
+  without a symbol of their own are written as binary+0xoffset, which
+  addr2line -f -e resolves.
+*/
+
+#include "fcfuse.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "fcfuse_profile.h"
+#include "fcfuse_stats.h"
+
+#define PROFILE_DEPTH 48
+#define PROFILE_SKIP 2                      // the handler and the signal frame
+#define PROFILE_RING 512                    // samples per thread, power of two
+#define PROFILE_DRAIN 1                     // seconds
+#define PROFILE_WRITE 10                    // seconds
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+struct profile_sample {
+    int op;                 // FCOP_MAX outside a callback
+    int cid;
+    int depth;
+    void *pc[PROFILE_DEPTH];
+};
+
+struct profile_ring {
+    uint64_t head;                          // written by the owner's handler
+    uint64_t tail;                          // read by the drain thread
+    uint64_t dropped;
+    struct profile_ring *next;              // all rings
+    struct profile_ring *next_free;         // rings of exited threads
+    struct profile_sample samples[PROFILE_RING];
+};
+
+// How a thread is sampled, so it can be undone when it exits
+struct profile_timer {
+    struct profile_ring *ring;
+    int perf_fd;            // -1 if a POSIX timer is used
+    timer_t timer;
+};
+
+// Identical samples added up
+struct profile_stack {
+    uint64_t hash;
+    uint64_t count;
+    struct profile_sample sample;
+};
+
+unsigned int fcfuse_profile_hz;
+__thread int fcfuse_profile_armed;
+
+static char profile_file[PATH_MAX];
+static unsigned int profile_period_ns;
+static int profile_perf = 1;                // perf_event_open() still worth trying
+
+static __thread struct profile_ring *my_ring;
+static __thread int my_perf_fd = -1;
+static struct profile_ring *rings;
+static struct profile_ring *free_rings;
+static pthread_key_t timer_key;
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct profile_stack *stacks;
+static size_t stacks_size;                  // slots, power of two
+static size_t stacks_used;
+static uint64_t profile_dropped;
+
+static pthread_t profile_thread;
+static int profile_running;
+static int profile_stop;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t profile_cond = PTHREAD_COND_INITIALIZER;
+
+static void profile_signal(int sig, siginfo_t *info, void *ucontext)
+{
+    struct profile_ring *ring = my_ring;
+    struct profile_sample *sample;
+    void *pc[PROFILE_DEPTH + PROFILE_SKIP];
+    int saved_errno = errno;
+    uint64_t head;
+    int depth;
+
+    if (ring == NULL) goto out;
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= PROFILE_RING) {
+        ring->dropped++;
+        goto out;
+    }
+
+    sample = &ring->samples[head & (PROFILE_RING - 1)];
+    depth = backtrace(pc, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+    if (depth <= 0) goto out;
+    memcpy(sample->pc, pc + PROFILE_SKIP, depth * sizeof(void *));
+    sample->depth = depth;
+    sample->op = fcfuse_cur_op.active ? fcfuse_cur_op.op : FCOP_MAX;
+    sample->cid = fcfuse_cur_op.active ? fcfuse_cur_op.cid : -1;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+out:
+    // a perf counter stops after each overflow until refreshed
+    if (my_perf_fd >= 0) ioctl(my_perf_fd, PERF_EVENT_IOC_REFRESH, 1);
+    errno = saved_errno;
+}
+
+static void ring_put(struct profile_ring *ring)
+{
+    pthread_mutex_lock(&ring_lock);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void timer_retire(void *arg)
+{
+    struct profile_timer *pt = arg;
+
+    if (pt->perf_fd >= 0) close(pt->perf_fd);
+    else timer_delete(pt->timer);
+    my_perf_fd = -1;
+    my_ring = NULL;
+
+    ring_put(pt->ring);
+    free(pt);
+}
+
+static void timer_key_init(void)
+{
+    pthread_key_create(&timer_key, timer_retire);
+}
+
+// An overflow signal every period of this thread's CPU time
+static int profile_perf_open(void)
+{
+    struct perf_event_attr attr;
+    struct f_owner_ex owner;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.sample_period = profile_period_ns;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) return -1;
+
+    owner.type = F_OWNER_TID;
+    owner.pid = syscall(SYS_gettid);
+    if ((fcntl(fd, F_SETFL, O_ASYNC) != 0) || (fcntl(fd, F_SETSIG, SIGPROF) != 0) ||
+        (fcntl(fd, F_SETOWN_EX, &owner) != 0)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int profile_timer_create(timer_t *timer)
+{
+    struct sigevent sev;
+    struct itimerspec its;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, timer) != 0) return -1;
+
+    its.it_interval.tv_sec = profile_period_ns / 1000000000u;
+    its.it_interval.tv_nsec = profile_period_ns % 1000000000u;
+    its.it_value = its.it_interval;
+    if (timer_settime(*timer, 0, &its, NULL) != 0) {
+        timer_delete(*timer);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Start sampling the calling thread; see fcfuse_profile_thread() */
+void fcfuse_profile_arm(void)
+{
+    struct profile_timer *pt;
+    struct profile_ring *ring;
+
+    // whatever happens, don't try again from this thread
+    fcfuse_profile_armed = 1;
+
+    pthread_once(&timer_once, timer_key_init);
+
+    pt = calloc(1, sizeof(*pt));
+    if (pt == NULL) return;
+
+    pthread_mutex_lock(&ring_lock);
+    ring = free_rings;
+    if (ring != NULL) {
+        free_rings = ring->next_free;
+    } else if ((ring = calloc(1, sizeof(*ring))) != NULL) {
+        ring->next = rings;
+        __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if (ring == NULL) {
+        free(pt);
+        return;
+    }
+    pt->ring = ring;
+    my_ring = ring;
+
+    pt->perf_fd = __atomic_load_n(&profile_perf, __ATOMIC_RELAXED) ? profile_perf_open() : -1;
+    if (pt->perf_fd >= 0) {
+        my_perf_fd = pt->perf_fd;
+        ioctl(pt->perf_fd, PERF_EVENT_IOC_REFRESH, 1);
+    } else {
+        // what failed for this thread fails for the others too
+        __atomic_store_n(&profile_perf, 0, __ATOMIC_RELAXED);
+        if (profile_timer_create(&pt->timer) != 0) {
+            log_at(LOG_LEVEL_WARN, "profile: can't sample thread: %s\n", strerror(errno));
+            my_ring = NULL;
+            ring_put(ring);
+            free(pt);
+            return;
+        }
+    }
+
+    pthread_setspecific(timer_key, pt);
+}
+
+static uint64_t stack_hash(const struct profile_sample *sample)
+{
+    uint64_t h = 14695981039346656037ull;
+    int i;
+
+    h = (h ^ (uint64_t) sample->op) * 1099511628211ull;
+    h = (h ^ (uint64_t) (uint32_t) sample->cid) * 1099511628211ull;
+    for (i = 0; i < sample->depth; i++) h = (h ^ (uintptr_t) sample->pc[i]) * 1099511628211ull;
+
+    return h;
+}
+
+static int stack_equal(const struct profile_sample *a, const struct profile_sample *b)
+{
+    return (a->op == b->op) && (a->cid == b->cid) && (a->depth == b->depth) &&
+           !memcmp(a->pc, b->pc, a->depth * sizeof(void *));
+}
+
+static int stacks_grow(void)
+{
+    struct profile_stack *old = stacks;
+    size_t old_size = stacks_size, size = old_size ? old_size * 2 : 1024;
+    size_t i, j;
+
+    stacks = calloc(size, sizeof(*stacks));
+    if (stacks == NULL) {
+        stacks = old;
+        return -ENOMEM;
+    }
+    stacks_size = size;
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i].count == 0) continue;
+        for (j = old[i].hash & (size - 1); stacks[j].count; j = (j + 1) & (size - 1))
+            ;
+        stacks[j] = old[i];
+    }
+    free(old);
+
+    return 0;
+}
+
+static void stacks_add(const struct profile_sample *sample)
+{
+    uint64_t h = stack_hash(sample);
+    size_t i;
+
+    if (((stacks_used + 1) * 4 > stacks_size * 3) && (stacks_grow() != 0)) {
+        profile_dropped++;
+        return;
+    }
+
+    for (i = h & (stacks_size - 1); stacks[i].count; i = (i + 1) & (stacks_size - 1)) {
+        if ((stacks[i].hash == h) && stack_equal(&stacks[i].sample, sample)) {
+            stacks[i].count++;
+            return;
+        }
+    }
+
+    stacks[i].hash = h;
+    stacks[i].count = 1;
+    stacks[i].sample = *sample;
+    stacks_used++;
+}
+
+static void profile_drain(void)
+{
+    struct profile_ring *ring;
+    uint64_t head, tail;
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail < head; tail++) stacks_add(&ring->samples[tail & (PROFILE_RING - 1)]);
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+// One frame of a folded line; return addresses point past the call
+static void profile_frame(FILE *out, void *pc, int leaf)
+{
+    uintptr_t addr = (uintptr_t) pc - (leaf ? 0 : 1);
+    const char *base;
+    Dl_info info;
+    int found = dladdr((void *) addr, &info);
+
+    if (found && (info.dli_sname != NULL)) {
+        fprintf(out, ";%s", info.dli_sname);
+    } else if (found && (info.dli_fname != NULL)) {
+        base = strrchr(info.dli_fname, '/');
+        fprintf(out, ";%s+0x%lx", base ? base + 1 : info.dli_fname,
+                (unsigned long) (addr - (uintptr_t) info.dli_fbase));
+    } else {
+        fprintf(out, ";0x%lx", (unsigned long) addr);
+    }
+}
+
+static int profile_write(void)
+{
+    char tmp[PATH_MAX + 8];
+    struct profile_stack *stack;
+    struct profile_ring *ring;
+    uint64_t dropped = profile_dropped;
+    FILE *out;
+    size_t i;
+    int d;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", profile_file);
+    out = fopen(tmp, "w");
+    if (out == NULL) return -errno;
+
+    for (i = 0; i < stacks_size; i++) {
+        stack = &stacks[i];
+        if (stack->count == 0) continue;
+        fprintf(out, "op=%s;cid=",
+                (stack->sample.op == FCOP_MAX) ? "libfuse" : fcfuse_op_name(stack->sample.op));
+        if (stack->sample.cid < 0) fprintf(out, "-");
+        else fprintf(out, "%d", stack->sample.cid);
+        for (d = stack->sample.depth - 1; d >= 0; d--) profile_frame(out, stack->sample.pc[d], d == 0);
+        fprintf(out, " %llu\n", (unsigned long long) stack->count);
+    }
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped) fprintf(out, "op=dropped;cid=- %llu\n", (unsigned long long) dropped);
+
+    if (fclose(out) != 0) return -errno;
+    if (rename(tmp, profile_file) != 0) return -errno;
+
+    return 0;
+}
+
+static void *profile_writer(void *arg)
+{
+    struct timespec deadline;
+    int stop = 0, ticks = 0, retstat;
+
+    while (!stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PROFILE_DRAIN;
+
+        pthread_mutex_lock(&profile_lock);
+        if (!profile_stop) pthread_cond_timedwait(&profile_cond, &profile_lock, &deadline);
+        stop = profile_stop;
+        pthread_mutex_unlock(&profile_lock);
+
+        profile_drain();
+        if (!stop && (++ticks < PROFILE_WRITE / PROFILE_DRAIN)) continue;
+        ticks = 0;
+
+        retstat = profile_write();
+        if (retstat != 0)
+            log_at(LOG_LEVEL_WARN, "profile: writing %s failed: %s\n", profile_file, strerror(-retstat));
+    }
+
+    return NULL;
+}
+
+/**
+ * Remember the options.  file is made absolute here since the daemon
+ * changes to / when it goes to the background.
+ */
+int fcfuse_profile_init(const char *file, unsigned int hz)
+{
+    char cwd[PATH_MAX];
+
+    if (file[0] == '/') {
+        if (strlen(file) >= sizeof(profile_file)) return -ENAMETOOLONG;
+        strcpy(profile_file, file);
+    } else {
+        if (getcwd(cwd, sizeof(cwd)) == NULL) return -errno;
+        if (snprintf(profile_file, sizeof(profile_file), "%s/%s", cwd, file) >= (int) sizeof(profile_file))
+            return -ENAMETOOLONG;
+    }
+
+    if ((hz == 0) || (hz > 10000)) return -EINVAL;
+    profile_period_ns = 1000000000u / hz;
+
+    return 0;
+}
+
+/** Catch SIGPROF and start the writer; runs from fcfuse_init() */
+int fcfuse_profile_start(void)
+{
+    struct sigaction sa;
+    void *pc[1];
+    int retstat;
+
+    if (profile_period_ns == 0) return 0;
+
+    // the first backtrace() loads libgcc, which a signal handler can't
+    backtrace(pc, 1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = profile_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    if (sigaction(SIGPROF, &sa, NULL) != 0) return -errno;
+
+    retstat = pthread_create(&profile_thread, NULL, profile_writer, NULL);
+    if (retstat) return -retstat;
+    profile_running = 1;
+
+    // worker threads arm themselves on their next request
+    __atomic_store_n(&fcfuse_profile_hz, 1000000000u / profile_period_ns, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/** Stop sampling and write the profile one last time */
+void fcfuse_profile_stop(void)
+{
+    if (!profile_running) return;
+
+    __atomic_store_n(&fcfuse_profile_hz, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&profile_lock);
+    profile_stop = 1;
+    pthread_cond_signal(&profile_cond);
+    pthread_mutex_unlock(&profile_lock);
+
+    pthread_join(profile_thread, NULL);
+    profile_running = 0;
+}
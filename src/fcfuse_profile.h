@@ -0,0 +1,28 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Sampling CPU profiler of the worker threads, written as folded
+  stacks tagged with the FUSE operation and container.
+*/
+
+#ifndef _FCFUSE_PROFILE_H_
+#define _FCFUSE_PROFILE_H_
+
+extern unsigned int fcfuse_profile_hz;
+extern __thread int fcfuse_profile_armed;
+
+int  fcfuse_profile_init(const char *file, unsigned int hz);
+int  fcfuse_profile_start(void);
+void fcfuse_profile_stop(void);
+void fcfuse_profile_arm(void);
+
+// Start sampling the calling thread if it isn't yet.  One branch
+// when profiling is off.
+static inline void fcfuse_profile_thread(void)
+{
+    if (__atomic_load_n(&fcfuse_profile_hz, __ATOMIC_RELAXED) && !fcfuse_profile_armed)
+        fcfuse_profile_arm();
+}
+
+#endif
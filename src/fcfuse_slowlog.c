@@ -0,0 +1,305 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A request is slow when it takes longer than -o slow_threshold, or
+  longer than -o slow_p99 times the recent p99 of its operation.  The
+  p99 comes from the histograms in fcfuse_stats.c: every
+  SLOW_INTERVAL a thread of our own takes what each operation added
+  since the last look and derives that operation's threshold, never
+  below the fixed one.  Operations with too few requests in a window
+  keep the threshold they had.  The thread only runs once slow_p99 is
+  set, at mount or through the control socket, and sleeps while it is
+  0.
+
+  Slow requests go into a ring of the last SLOW_RING of them, with
+  their path, container, thread and the time spent resolving,
+  in ioctls and in the backing filesystem, and to the log at warn
+  level.  Nothing touches the disk in the request's thread: the
+  ring is shown in FCFUSE_STATS_PATH and the logger writes in the
+  background.
+
+  A request that isn't slow costs one compare.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "fcfuse_slowlog.h"
+
+#define SLOW_RING 1024
+#define SLOW_PATH 256
+#define SLOW_INTERVAL 5                     // seconds
+#define SLOW_MIN_SAMPLES 100                // per window, for a p99
+
+struct slow_record {
+    struct timespec when;
+    int op;
+    int cid;
+    uint32_t tid;
+    long retstat;
+    uint64_t total_ns;
+    uint64_t resolve_ns;
+    uint64_t ioctl_ns;
+    uint64_t io_ns;
+    char path[SLOW_PATH];
+};
+
+uint64_t fcfuse_slow_ns[FCOP_MAX] = {
+    [0 ... FCOP_MAX - 1] = UINT64_MAX
+};
+
+static struct slow_record slow_ring[SLOW_RING];
+static uint64_t slow_count;                 // records ever written
+static pthread_mutex_t slow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t slow_fixed_ns = UINT64_MAX;
+static double slow_multiple;
+
+static pthread_t slow_thread;
+static int slow_started;                    // fcfuse_slowlog_start() ran
+static int slow_running;
+static int slow_stop;
+static pthread_mutex_t slow_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slow_cond = PTHREAD_COND_INITIALIZER;
+
+static void slow_set_all(uint64_t ns)
+{
+    int op;
+
+    for (op = 0; op < FCOP_MAX; op++)
+        __atomic_store_n(&fcfuse_slow_ns[op], ns, __ATOMIC_RELAXED);
+}
+
+static int slow_spawn(void);
+
+/**
+ * threshold_us <= 0 means no fixed threshold, p99_multiple <= 0 no
+ * adaptive one.  May be called at any time.
+ */
+void fcfuse_slowlog_set(double threshold_us, double p99_multiple)
+{
+    pthread_mutex_lock(&slow_thread_lock);
+    slow_fixed_ns = (threshold_us > 0) ? (uint64_t) (threshold_us * 1000) : UINT64_MAX;
+    slow_multiple = (p99_multiple > 0) ? p99_multiple : 0;
+    // the adaptive thresholds start from the fixed one and are
+    // refined by slow_adapt()
+    slow_set_all(slow_fixed_ns);
+    pthread_cond_signal(&slow_cond);
+    if (slow_spawn() != 0) log_at(LOG_LEVEL_WARN, "    adaptive slow thresholds unavailable\n");
+    pthread_mutex_unlock(&slow_thread_lock);
+}
+
+void fcfuse_slowlog_get(double *threshold_us, double *p99_multiple)
+{
+    pthread_mutex_lock(&slow_thread_lock);
+    *threshold_us = (slow_fixed_ns != UINT64_MAX) ? slow_fixed_ns / 1000.0 : 0;
+    *p99_multiple = slow_multiple;
+    pthread_mutex_unlock(&slow_thread_lock);
+}
+
+/** Slow requests seen so far */
+uint64_t fcfuse_slowlog_count(void)
+{
+    uint64_t count;
+
+    pthread_mutex_lock(&slow_lock);
+    count = slow_count;
+    pthread_mutex_unlock(&slow_lock);
+
+    return count;
+}
+
+void fcfuse_slowlog_record(const struct fcfuse_op *cur, uint64_t ns, long retstat)
+{
+    struct slow_record *rec;
+
+    pthread_mutex_lock(&slow_lock);
+    rec = &slow_ring[slow_count++ % SLOW_RING];
+    clock_gettime(CLOCK_REALTIME, &rec->when);
+    rec->op = cur->op;
+    rec->cid = cur->cid;
+    rec->tid = syscall(SYS_gettid);
+    rec->retstat = retstat;
+    rec->total_ns = ns;
+    rec->resolve_ns = cur->resolve_ns;
+    rec->ioctl_ns = cur->ioctl_ns;
+    rec->io_ns = cur->io_ns;
+    if (cur->path != NULL) {
+        strncpy(rec->path, cur->path, SLOW_PATH - 1);
+        rec->path[SLOW_PATH - 1] = '\0';
+    } else {
+        rec->path[0] = '\0';
+    }
+    pthread_mutex_unlock(&slow_lock);
+
+    log_at(LOG_LEVEL_WARN, "slow %s %s cid %d: %llu us (resolve %llu, ioctl %llu, io %llu) = %ld\n",
+           fcfuse_op_name(cur->op), rec->path, cur->cid, (unsigned long long) (ns / 1000),
+           (unsigned long long) (cur->resolve_ns / 1000), (unsigned long long) (cur->ioctl_ns / 1000),
+           (unsigned long long) (cur->io_ns / 1000), retstat);
+}
+
+/** Append the ring, oldest first, to a stats snapshot */
+void fcfuse_slowlog_dump(FILE *out)
+{
+    struct slow_record *rec;
+    struct tm tm;
+    uint64_t i, from, ns, fixed;
+    double multiple;
+    int op;
+
+    pthread_mutex_lock(&slow_thread_lock);
+    fixed = slow_fixed_ns;
+    multiple = slow_multiple;
+    pthread_mutex_unlock(&slow_thread_lock);
+
+    fprintf(out, "\n# slow request thresholds in microseconds\n");
+    if (fixed != UINT64_MAX) fprintf(out, "slow_threshold %.1f\n", fixed / 1000.0);
+    if (multiple > 0) fprintf(out, "slow_p99 %.2f\n", multiple);
+    // the ones slow_adapt() derived
+    for (op = 0; op < FCOP_IOCTL_GETCID; op++) {
+        ns = __atomic_load_n(&fcfuse_slow_ns[op], __ATOMIC_RELAXED);
+        if (ns == fixed) continue;
+        fprintf(out, "slow_threshold_%s %.1f\n", fcfuse_op_name(op), ns / 1000.0);
+    }
+
+    fprintf(out, "\n# slow requests, oldest first, times in microseconds\n");
+    fprintf(out, "%-26s %-16s %-6s %8s %10s %10s %10s %10s %8s  %s\n",
+            "time", "op", "cid", "tid", "total", "resolve", "ioctl", "io", "result", "path");
+
+    pthread_mutex_lock(&slow_lock);
+    from = (slow_count > SLOW_RING) ? slow_count - SLOW_RING : 0;
+    for (i = from; i < slow_count; i++) {
+        rec = &slow_ring[i % SLOW_RING];
+        localtime_r(&rec->when.tv_sec, &tm);
+        fprintf(out, "%04d-%02d-%02d %02d:%02d:%02d.%06ld %-16s %-6d %8u %10.1f %10.1f %10.1f %10.1f %8ld  %s\n",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                rec->when.tv_nsec / 1000, fcfuse_op_name(rec->op), rec->cid, rec->tid,
+                rec->total_ns / 1000.0, rec->resolve_ns / 1000.0, rec->ioctl_ns / 1000.0,
+                rec->io_ns / 1000.0, rec->retstat, rec->path);
+    }
+    if (from > 0) fprintf(out, "# %llu older slow requests dropped\n", (unsigned long long) from);
+    pthread_mutex_unlock(&slow_lock);
+}
+
+// Derive each operation's threshold from its p99 over the last window,
+// or (measure 0) only start a new window
+static void slow_adapt(uint64_t (*prev)[FCFUSE_STATS_BUCKETS], uint64_t *now, int measure)
+{
+    uint64_t count, rank, seen, ns, fixed;
+    double multiple;
+    int op, b;
+
+    pthread_mutex_lock(&slow_thread_lock);
+    fixed = slow_fixed_ns;
+    multiple = slow_multiple;
+    pthread_mutex_unlock(&slow_thread_lock);
+
+    for (op = 0; op < FCOP_IOCTL_GETCID; op++) {
+        fcfuse_stats_op_hist(op, now);
+
+        count = 0;
+        for (b = 0; b < FCFUSE_STATS_BUCKETS; b++) count += now[b] - prev[op][b];
+        if (measure && (multiple > 0) && (count >= SLOW_MIN_SAMPLES)) {
+            rank = count - count / 100;
+            seen = 0;
+            for (b = 0; b < FCFUSE_STATS_BUCKETS; b++) {
+                seen += now[b] - prev[op][b];
+                if (seen >= rank) break;
+            }
+            ns = (uint64_t) (fcfuse_stats_bucket_ns(b) * multiple);
+            if ((fixed != UINT64_MAX) && (ns < fixed)) ns = fixed;
+            __atomic_store_n(&fcfuse_slow_ns[op], ns, __ATOMIC_RELAXED);
+        }
+
+        memcpy(prev[op], now, sizeof(prev[op]));
+    }
+}
+
+static void *slow_adapter(void *arg)
+{
+    uint64_t (*prev)[FCFUSE_STATS_BUCKETS] = arg;
+    uint64_t *now = malloc(FCFUSE_STATS_BUCKETS * sizeof(*now));
+    struct timespec deadline;
+    int stop = 0, measure = 0;
+
+    while ((now != NULL) && !stop) {
+        slow_adapt(prev, now, measure);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SLOW_INTERVAL;
+
+        pthread_mutex_lock(&slow_thread_lock);
+        measure = 1;
+        if (!slow_stop && (slow_multiple > 0)) pthread_cond_timedwait(&slow_cond, &slow_thread_lock, &deadline);
+        // nothing to adapt until slow_p99 is set again, from a new window
+        while (!slow_stop && (slow_multiple == 0)) {
+            pthread_cond_wait(&slow_cond, &slow_thread_lock);
+            measure = 0;
+        }
+        stop = slow_stop;
+        pthread_mutex_unlock(&slow_thread_lock);
+    }
+
+    free(now);
+    free(prev);
+
+    return NULL;
+}
+
+// Start the adapter if slow_p99 is set and it isn't running yet.
+// slow_thread_lock must be held.
+static int slow_spawn(void)
+{
+    void *prev;
+    int retstat;
+
+    if (!slow_started || slow_running || (slow_multiple == 0)) return 0;
+
+    prev = calloc(FCOP_MAX, FCFUSE_STATS_BUCKETS * sizeof(uint64_t));
+    if (prev == NULL) return -ENOMEM;
+
+    retstat = pthread_create(&slow_thread, NULL, slow_adapter, prev);
+    if (retstat) {
+        free(prev);
+        return -retstat;
+    }
+    slow_running = 1;
+
+    return 0;
+}
+
+/** Adapt thresholds from now on if slow_p99 is set; runs from fcfuse_init() */
+int fcfuse_slowlog_start(void)
+{
+    int retstat;
+
+    pthread_mutex_lock(&slow_thread_lock);
+    slow_started = 1;
+    retstat = slow_spawn();
+    pthread_mutex_unlock(&slow_thread_lock);
+
+    return retstat;
+}
+
+void fcfuse_slowlog_stop(void)
+{
+    int running;
+
+    pthread_mutex_lock(&slow_thread_lock);
+    slow_started = 0;
+    slow_stop = 1;
+    running = slow_running;
+    pthread_cond_signal(&slow_cond);
+    pthread_mutex_unlock(&slow_thread_lock);
+
+    if (running) pthread_join(slow_thread, NULL);
+    slow_running = 0;
+}
@@ -0,0 +1,33 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Individual requests slower than a fixed or per-operation adaptive
+  threshold, kept in memory and shown in FCFUSE_STATS_PATH.
+*/
+
+#ifndef _FCFUSE_SLOWLOG_H_
+#define _FCFUSE_SLOWLOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fcfuse_stats.h"
+
+// Per-operation threshold in ns; UINT64_MAX when nothing is slow
+extern uint64_t fcfuse_slow_ns[FCOP_MAX];
+
+void fcfuse_slowlog_set(double threshold_us, double p99_multiple);
+void fcfuse_slowlog_get(double *threshold_us, double *p99_multiple);
+uint64_t fcfuse_slowlog_count(void);
+int  fcfuse_slowlog_start(void);
+void fcfuse_slowlog_stop(void);
+void fcfuse_slowlog_record(const struct fcfuse_op *cur, uint64_t ns, long retstat);
+void fcfuse_slowlog_dump(FILE *out);
+
+static inline int fcfuse_slowlog_check(int op, uint64_t ns)
+{
+    return ns >= __atomic_load_n(&fcfuse_slow_ns[op], __ATOMIC_RELAXED);
+}
+
+#endif
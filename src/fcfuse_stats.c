@@ -0,0 +1,563 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Every FUSE callback is timed by the wrappers in fcfuse.c, and the
+  fcontainer_* ioctls it issues are timed on their own.  Latencies go
+  into log-linear histograms (16 sub-buckets per power of two, so
+  percentiles are good to about 3%) kept per operation and per
+  container.
+
+  Each thread updates a shard of its own with plain stores, so the
+  hot path takes no lock and shares no cache line.  Readers of
+  FCFUSE_STATS_PATH add the shards up; a value read while its owner
+  updates it is at most one request behind.  Shards of exited threads
+  are handed to new ones, so counts are never lost.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fcfuse_capture.h"
+#include "fcfuse_probes.h"
+#include "fcfuse_profile.h"
+#include "fcfuse_slowlog.h"
+#include "fcfuse_stats.h"
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40                    // 2^40 ns, about 18 minutes
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+_Static_assert(HIST_BUCKETS == FCFUSE_STATS_BUCKETS, "fcfuse_stats.h is out of date");
+
+// Containers tracked on their own; the rest share one slot.  Slot 0
+// is for callers outside any container.
+#define STATS_CONTAINERS 64
+#define STATS_SLOT_NONE 0
+#define STATS_SLOT_OTHER (STATS_CONTAINERS + 1)
+#define STATS_SLOTS (STATS_CONTAINERS + 2)
+
+struct stats_hist {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t ioctl_ns;
+    uint64_t resolve_ns;
+    uint64_t io_ns;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct stats_shard {
+    struct stats_hist *hist[STATS_SLOTS][FCOP_MAX];     // allocated on first use
+    struct stats_shard *next;                           // all shards
+    struct stats_shard *next_free;                      // shards of exited threads
+};
+
+static const char *op_names[FCOP_MAX] = {
+    [FCOP_GETATTR] = "getattr",
+    [FCOP_READLINK] = "readlink",
+    [FCOP_MKNOD] = "mknod",
+    [FCOP_MKDIR] = "mkdir",
+    [FCOP_UNLINK] = "unlink",
+    [FCOP_RMDIR] = "rmdir",
+    [FCOP_SYMLINK] = "symlink",
+    [FCOP_RENAME] = "rename",
+    [FCOP_LINK] = "link",
+    [FCOP_CHMOD] = "chmod",
+    [FCOP_CHOWN] = "chown",
+    [FCOP_TRUNCATE] = "truncate",
+    [FCOP_UTIMENS] = "utimens",
+    [FCOP_OPEN] = "open",
+    [FCOP_READ] = "read",
+    [FCOP_WRITE] = "write",
+    [FCOP_STATFS] = "statfs",
+    [FCOP_FLUSH] = "flush",
+    [FCOP_RELEASE] = "release",
+    [FCOP_FSYNC] = "fsync",
+    [FCOP_SETXATTR] = "setxattr",
+    [FCOP_GETXATTR] = "getxattr",
+    [FCOP_LISTXATTR] = "listxattr",
+    [FCOP_REMOVEXATTR] = "removexattr",
+    [FCOP_OPENDIR] = "opendir",
+    [FCOP_READDIR] = "readdir",
+    [FCOP_RELEASEDIR] = "releasedir",
+    [FCOP_FSYNCDIR] = "fsyncdir",
+    [FCOP_ACCESS] = "access",
+    [FCOP_LSEEK] = "lseek",
+    [FCOP_COPY_FILE_RANGE] = "copy_file_range",
+    [FCOP_FTRUNCATE] = "ftruncate",
+    [FCOP_FGETATTR] = "fgetattr",
+    [FCOP_IOCTL_GETCID] = "ioctl_getcid",
+    [FCOP_IOCTL_DELETE] = "ioctl_delete",
+};
+
+__thread struct fcfuse_op fcfuse_cur_op;
+
+static __thread struct stats_shard *my_shard;
+static struct stats_shard *shards;
+static struct stats_shard *free_shards;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// cid + 2 of the container in each slot, 0 if the slot is free
+static int slot_cids[STATS_SLOTS];
+
+const char *fcfuse_op_name(int op)
+{
+    return ((op >= 0) && (op < FCOP_MAX)) ? op_names[op] : "unknown";
+}
+
+static int hist_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < HIST_SUB) return ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    if (msb >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Middle of the range of latencies that land in bucket b
+static double hist_value(int b)
+{
+    int e = b / HIST_SUB;
+
+    if (e == 0) return b;
+
+    return (double) ((uint64_t) (HIST_SUB + b % HIST_SUB) << (e - 1)) + ((1ull << (e - 1)) - 1) / 2.0;
+}
+
+// Slot for a container, claimed on first sight
+static int stats_slot(int cid)
+{
+    int key = cid + 2;
+    int i, slot, seen;
+
+    if (cid < 0) return STATS_SLOT_NONE;
+
+    for (i = 0; i < STATS_CONTAINERS; i++) {
+        slot = 1 + (unsigned int) (cid + i) % STATS_CONTAINERS;
+        seen = __atomic_load_n(&slot_cids[slot], __ATOMIC_RELAXED);
+        if (seen == key) return slot;
+        if ((seen == 0) &&
+            (__atomic_compare_exchange_n(&slot_cids[slot], &seen, key, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED) || (seen == key)))
+            return slot;
+    }
+
+    return STATS_SLOT_OTHER;
+}
+
+static void shard_retire(void *arg)
+{
+    struct stats_shard *shard = arg;
+
+    pthread_mutex_lock(&shard_lock);
+    shard->next_free = free_shards;
+    free_shards = shard;
+    pthread_mutex_unlock(&shard_lock);
+}
+
+static void shard_key_init(void)
+{
+    pthread_key_create(&shard_key, shard_retire);
+}
+
+static struct stats_shard *shard_get(void)
+{
+    struct stats_shard *shard = my_shard;
+
+    if (shard != NULL) return shard;
+
+    pthread_once(&shard_once, shard_key_init);
+
+    pthread_mutex_lock(&shard_lock);
+    shard = free_shards;
+    if (shard != NULL) {
+        free_shards = shard->next_free;
+    } else if ((shard = calloc(1, sizeof(*shard))) != NULL) {
+        shard->next = shards;
+        __atomic_store_n(&shards, shard, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&shard_lock);
+
+    if (shard == NULL) return NULL;
+    pthread_setspecific(shard_key, shard);
+    my_shard = shard;
+
+    return shard;
+}
+
+// Only the owning thread writes a shard; readers may see any prefix
+// of an update
+static inline void stat_add(uint64_t *p, uint64_t v)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static void stats_record(int op, int cid, uint64_t ns, long retstat, uint64_t ioctl_ns,
+                         uint64_t resolve_ns, uint64_t io_ns)
+{
+    struct stats_shard *shard = shard_get();
+    struct stats_hist *hist;
+    int slot = stats_slot(cid);
+
+    if (shard == NULL) return;
+
+    hist = shard->hist[slot][op];
+    if (hist == NULL) {
+        hist = calloc(1, sizeof(*hist));
+        if (hist == NULL) return;
+        __atomic_store_n(&shard->hist[slot][op], hist, __ATOMIC_RELEASE);
+    }
+
+    stat_add(&hist->count, 1);
+    stat_add(&hist->sum_ns, ns);
+    stat_add(&hist->ioctl_ns, ioctl_ns);
+    if (resolve_ns) stat_add(&hist->resolve_ns, resolve_ns);
+    if (io_ns) stat_add(&hist->io_ns, io_ns);
+    stat_add(&hist->buckets[hist_bucket(ns)], 1);
+    if (ns > hist->max_ns) __atomic_store_n(&hist->max_ns, ns, __ATOMIC_RELAXED);
+    if (retstat < 0) {
+        stat_add(&hist->errors, 1);
+    } else if ((op == FCOP_READ) || (op == FCOP_WRITE) || (op == FCOP_COPY_FILE_RANGE)) {
+        stat_add(&hist->bytes, retstat);
+    }
+}
+
+void fcfuse_op_begin(int op, const char *path)
+{
+    fcfuse_cur_op.op = op;
+    fcfuse_cur_op.path = path;
+    fcfuse_cur_op.cid = -1;
+    fcfuse_cur_op.traced = fcfuse_trace_pick();
+    fcfuse_cur_op.ioctl_ns = 0;
+    fcfuse_cur_op.resolve_ns = 0;
+    fcfuse_cur_op.io_ns = 0;
+    fcfuse_op_note(0, 0, 0, NULL);
+    fcfuse_cur_op.active = 1;
+    fcfuse_profile_thread();
+    fcfuse_cur_op.start = fcfuse_now();
+}
+
+long fcfuse_op_end(long retstat)
+{
+    struct fcfuse_op *cur = &fcfuse_cur_op;
+    uint64_t end = fcfuse_now();
+    uint64_t ns = end - cur->start;
+
+    FCFS_PROBE4(op__return, cur->op, cur->cid, retstat, ns);
+    stats_record(cur->op, cur->cid, ns, retstat, cur->ioctl_ns, cur->resolve_ns, cur->io_ns);
+    if (cur->traced) fcfuse_trace_span(FCPH_OP, cur->op, cur->cid, cur->start, end);
+    if (fcfuse_slowlog_check(cur->op, ns)) fcfuse_slowlog_record(cur, ns, retstat);
+    if (__atomic_load_n(&fcfuse_capture_on, __ATOMIC_RELAXED)) fcfuse_capture_record(cur, ns, retstat);
+    cur->active = 0;
+
+    return retstat;
+}
+
+/**
+ * An fcontainer_* ioctl issued since start finished.  For
+ * FCOP_IOCTL_GETCID, cid is what it returned and becomes the
+ * container of the current request.
+ */
+void fcfuse_op_ioctl(int op, uint64_t start, int cid)
+{
+    uint64_t end = fcfuse_now();
+    uint64_t ns = end - start;
+
+    FCFS_PROBE3(ioctl__return, op, cid, ns);
+    if (op == FCOP_IOCTL_GETCID) fcfuse_cur_op.cid = cid;
+    fcfuse_cur_op.ioctl_ns += ns;
+
+    stats_record(op, cid, ns, 0, ns, 0, 0);
+    if (fcfuse_cur_op.traced) fcfuse_trace_span(FCPH_IOCTL, op, cid, start, end);
+}
+
+/** A FCPH_RESOLVE or FCPH_IO step of the current request started at start */
+void fcfuse_op_phase(int phase, uint64_t start)
+{
+    struct fcfuse_op *cur = &fcfuse_cur_op;
+    uint64_t end = fcfuse_now();
+
+    if (phase == FCPH_RESOLVE) cur->resolve_ns += end - start;
+    else cur->io_ns += end - start;
+
+    if (cur->traced) fcfuse_trace_span(phase, cur->op, cur->cid, start, end);
+}
+
+static void hist_merge(struct stats_hist *sum, const struct stats_hist *hist)
+{
+    uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    int b;
+
+    sum->count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    sum->errors += __atomic_load_n(&hist->errors, __ATOMIC_RELAXED);
+    sum->bytes += __atomic_load_n(&hist->bytes, __ATOMIC_RELAXED);
+    sum->sum_ns += __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED);
+    sum->ioctl_ns += __atomic_load_n(&hist->ioctl_ns, __ATOMIC_RELAXED);
+    sum->resolve_ns += __atomic_load_n(&hist->resolve_ns, __ATOMIC_RELAXED);
+    sum->io_ns += __atomic_load_n(&hist->io_ns, __ATOMIC_RELAXED);
+    if (max > sum->max_ns) sum->max_ns = max;
+    for (b = 0; b < HIST_BUCKETS; b++)
+        sum->buckets[b] += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+}
+
+// Add up one (slot, op) over all shards, every slot if slot is -1
+static void stats_collect(struct stats_hist *sum, int slot, int op)
+{
+    struct stats_shard *shard;
+    struct stats_hist *hist;
+    int s;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        for (s = 0; s < STATS_SLOTS; s++) {
+            if ((slot != -1) && (s != slot)) continue;
+            hist = __atomic_load_n(&shard->hist[s][op], __ATOMIC_ACQUIRE);
+            if (hist != NULL) hist_merge(sum, hist);
+        }
+    }
+}
+
+/**
+ * Latencies of op so far over all containers, bucket by bucket, for
+ * callers that keep their own windows.  buckets has
+ * FCFUSE_STATS_BUCKETS entries; fcfuse_stats_bucket_ns() says what
+ * each one stands for.
+ */
+void fcfuse_stats_op_hist(int op, uint64_t *buckets)
+{
+    struct stats_shard *shard;
+    struct stats_hist *hist;
+    int s, b;
+
+    memset(buckets, 0, FCFUSE_STATS_BUCKETS * sizeof(*buckets));
+
+    for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        for (s = 0; s < STATS_SLOTS; s++) {
+            hist = __atomic_load_n(&shard->hist[s][op], __ATOMIC_ACQUIRE);
+            if (hist == NULL) continue;
+            for (b = 0; b < HIST_BUCKETS; b++)
+                buckets[b] += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+uint64_t fcfuse_stats_bucket_ns(int b)
+{
+    return hist_value(b);
+}
+
+// Latency at quantile q, in microseconds
+static double hist_quantile(const struct stats_hist *hist, double q)
+{
+    uint64_t rank = (uint64_t) (q * hist->count + 0.999999);
+    uint64_t seen = 0;
+    double value = hist->max_ns;
+    int b;
+
+    if (rank == 0) rank = 1;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) {
+            value = hist_value(b);
+            break;
+        }
+    }
+
+    // the top bucket may reach past the largest latency seen
+    if (value > hist->max_ns) value = hist->max_ns;
+
+    return value / 1000.0;
+}
+
+static void stats_line(FILE *out, int op, const char *cid, const struct stats_hist *hist)
+{
+    fprintf(out, "%-16s %-6s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            op_names[op], cid, (unsigned long long) hist->count,
+            (unsigned long long) hist->errors, (unsigned long long) hist->bytes,
+            hist->sum_ns / 1000.0 / hist->count,
+            hist_quantile(hist, 0.50), hist_quantile(hist, 0.90),
+            hist_quantile(hist, 0.99), hist_quantile(hist, 0.999),
+            hist->max_ns / 1000.0, hist->ioctl_ns / 1000.0 / hist->count,
+            hist->resolve_ns / 1000.0 / hist->count, hist->io_ns / 1000.0 / hist->count);
+}
+
+// What the cid column says for a slot
+static void slot_name(int slot, char *cid, size_t size)
+{
+    if (slot == STATS_SLOT_NONE) snprintf(cid, size, "-");
+    else if (slot == STATS_SLOT_OTHER) snprintf(cid, size, "other");
+    else snprintf(cid, size, "%d", __atomic_load_n(&slot_cids[slot], __ATOMIC_RELAXED) - 2);
+}
+
+/**
+ * Render the current counters as text, one line per operation for
+ * all containers and one per container that used it.  *buf is
+ * malloc()ed.  Returns 0 or -errno.
+ */
+int fcfuse_stats_snapshot(char **buf, size_t *len)
+{
+    struct stats_hist *sum;
+    char cid[16];
+    FILE *out;
+    int op, slot;
+
+    sum = malloc(sizeof(*sum));
+    if (sum == NULL) return -ENOMEM;
+    out = open_memstream(buf, len);
+    if (out == NULL) {
+        free(sum);
+        return -errno;
+    }
+
+    fprintf(out, "# latencies in microseconds; ioctl, resolve and io are the mean time spent in\n"
+                 "# fcontainer ioctls, resolving backing paths and calling the backing filesystem\n");
+    fprintf(out, "%-16s %-6s %10s %8s %14s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+            "op", "cid", "count", "errors", "bytes", "mean", "p50", "p90", "p99",
+            "p999", "max", "ioctl", "resolve", "io");
+
+    for (op = 0; op < FCOP_MAX; op++) {
+        stats_collect(sum, -1, op);
+        if (sum->count == 0) continue;
+        stats_line(out, op, "all", sum);
+
+        for (slot = 0; slot < STATS_SLOTS; slot++) {
+            stats_collect(sum, slot, op);
+            if (sum->count == 0) continue;
+            slot_name(slot, cid, sizeof(cid));
+            stats_line(out, op, cid, sum);
+        }
+    }
+
+    fcfuse_slowlog_dump(out);
+
+    free(sum);
+    if (fclose(out) != 0) return -ENOMEM;
+
+    return 0;
+}
+
+// One (op, container) of fcfuse_stats_metrics()
+struct metric_row {
+    int op;
+    char cid[16];
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t sum_ns;
+    uint64_t ioctl_ns;
+    uint64_t resolve_ns;
+    uint64_t io_ns;
+    double quantiles[4];    // microseconds
+};
+
+static const double metric_quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void metric_family(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Write the counters in the Prometheus text format, one series per
+ * operation and container.  Returns 0 or -errno.
+ */
+int fcfuse_stats_metrics(FILE *out)
+{
+    struct stats_hist *sum;
+    struct metric_row *rows, *row;
+    int op, slot, q, n = 0;
+
+    sum = malloc(sizeof(*sum));
+    rows = malloc(FCOP_MAX * STATS_SLOTS * sizeof(*rows));
+    if ((sum == NULL) || (rows == NULL)) {
+        free(sum);
+        free(rows);
+        return -ENOMEM;
+    }
+
+    // every family has to be written in one piece, so add the shards
+    // up once and keep what the families need
+    for (op = 0; op < FCOP_MAX; op++) {
+        for (slot = 0; slot < STATS_SLOTS; slot++) {
+            stats_collect(sum, slot, op);
+            if (sum->count == 0) continue;
+            row = &rows[n++];
+            row->op = op;
+            if (slot == STATS_SLOT_NONE) strcpy(row->cid, "none");
+            else slot_name(slot, row->cid, sizeof(row->cid));
+            row->count = sum->count;
+            row->errors = sum->errors;
+            row->bytes = sum->bytes;
+            row->sum_ns = sum->sum_ns;
+            row->ioctl_ns = sum->ioctl_ns;
+            row->resolve_ns = sum->resolve_ns;
+            row->io_ns = sum->io_ns;
+            for (q = 0; q < 4; q++) row->quantiles[q] = hist_quantile(sum, metric_quantiles[q]);
+        }
+    }
+
+#define FOR_ROWS for (row = rows; row < rows + n; row++)
+#define LABELS "{op=\"%s\",cid=\"%s\"}"
+
+    metric_family(out, "fcfuse_requests_total", "counter", "Requests served.");
+    FOR_ROWS fprintf(out, "fcfuse_requests_total" LABELS " %llu\n", op_names[row->op], row->cid,
+                     (unsigned long long) row->count);
+
+    metric_family(out, "fcfuse_request_errors_total", "counter", "Requests that failed.");
+    FOR_ROWS fprintf(out, "fcfuse_request_errors_total" LABELS " %llu\n", op_names[row->op], row->cid,
+                     (unsigned long long) row->errors);
+
+    metric_family(out, "fcfuse_bytes_total", "counter", "Bytes read, written or copied.");
+    FOR_ROWS if (row->bytes) fprintf(out, "fcfuse_bytes_total" LABELS " %llu\n", op_names[row->op],
+                                     row->cid, (unsigned long long) row->bytes);
+
+    metric_family(out, "fcfuse_ioctl_seconds_total", "counter", "Time spent in fcontainer ioctls.");
+    FOR_ROWS fprintf(out, "fcfuse_ioctl_seconds_total" LABELS " %.9f\n", op_names[row->op], row->cid,
+                     row->ioctl_ns / 1e9);
+
+    metric_family(out, "fcfuse_resolve_seconds_total", "counter", "Time spent resolving backing paths.");
+    FOR_ROWS if (row->resolve_ns) fprintf(out, "fcfuse_resolve_seconds_total" LABELS " %.9f\n",
+                                          op_names[row->op], row->cid, row->resolve_ns / 1e9);
+
+    metric_family(out, "fcfuse_backing_seconds_total", "counter", "Time spent in the backing filesystem.");
+    FOR_ROWS if (row->io_ns) fprintf(out, "fcfuse_backing_seconds_total" LABELS " %.9f\n",
+                                     op_names[row->op], row->cid, row->io_ns / 1e9);
+
+    metric_family(out, "fcfuse_request_duration_seconds", "summary", "Request latency.");
+    FOR_ROWS {
+        for (q = 0; q < 4; q++)
+            fprintf(out, "fcfuse_request_duration_seconds{op=\"%s\",cid=\"%s\",quantile=\"%g\"} %.9f\n",
+                    op_names[row->op], row->cid, metric_quantiles[q], row->quantiles[q] / 1e6);
+        fprintf(out, "fcfuse_request_duration_seconds_sum" LABELS " %.9f\n", op_names[row->op], row->cid,
+                row->sum_ns / 1e9);
+        fprintf(out, "fcfuse_request_duration_seconds_count" LABELS " %llu\n", op_names[row->op],
+                row->cid, (unsigned long long) row->count);
+    }
+
+#undef LABELS
+#undef FOR_ROWS
+
+    metric_family(out, "fcfuse_slow_requests_total", "counter", "Requests over the slow threshold.");
+    fprintf(out, "fcfuse_slow_requests_total %llu\n", (unsigned long long) fcfuse_slowlog_count());
+
+    free(rows);
+    free(sum);
+
+    return 0;
+}
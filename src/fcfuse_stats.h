@@ -0,0 +1,127 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Per-operation, per-container latency histograms and byte counters,
+  published read-only at FCFUSE_STATS_PATH in the mount.
+*/
+
+#ifndef _FCFUSE_STATS_H_
+#define _FCFUSE_STATS_H_
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fcfuse_trace.h"
+
+#define FCFUSE_STATS_PATH "/.fcstats"
+
+// Buckets of a latency histogram, see fcfuse_stats.c
+#define FCFUSE_STATS_BUCKETS 592
+
+// What fcfuse_op_begin() is timing.  The ioctls are timed on their
+// own and charged to the operation that issued them as well.
+enum fcfuse_opcode {
+    FCOP_GETATTR,
+    FCOP_READLINK,
+    FCOP_MKNOD,
+    FCOP_MKDIR,
+    FCOP_UNLINK,
+    FCOP_RMDIR,
+    FCOP_SYMLINK,
+    FCOP_RENAME,
+    FCOP_LINK,
+    FCOP_CHMOD,
+    FCOP_CHOWN,
+    FCOP_TRUNCATE,
+    FCOP_UTIMENS,
+    FCOP_OPEN,
+    FCOP_READ,
+    FCOP_WRITE,
+    FCOP_STATFS,
+    FCOP_FLUSH,
+    FCOP_RELEASE,
+    FCOP_FSYNC,
+    FCOP_SETXATTR,
+    FCOP_GETXATTR,
+    FCOP_LISTXATTR,
+    FCOP_REMOVEXATTR,
+    FCOP_OPENDIR,
+    FCOP_READDIR,
+    FCOP_RELEASEDIR,
+    FCOP_FSYNCDIR,
+    FCOP_ACCESS,
+    FCOP_LSEEK,
+    FCOP_COPY_FILE_RANGE,
+    FCOP_FTRUNCATE,
+    FCOP_FGETATTR,
+    FCOP_IOCTL_GETCID,
+    FCOP_IOCTL_DELETE,
+    FCOP_MAX
+};
+
+// The request a thread is serving
+struct fcfuse_op {
+    int op;
+    const char *path;       // as the callback got it
+    int cid;                // -1 until the caller's container is known
+    int traced;             // sampled by fcfuse_trace.c
+    int active;             // between fcfuse_op_begin() and fcfuse_op_end()
+    uint64_t start;         // fcfuse_now()
+    uint64_t ioctl_ns;      // spent in fcontainer_* ioctls so far
+    uint64_t resolve_ns;    // resolving backing paths
+    uint64_t io_ns;         // in calls to the backing filesystem
+    // arguments worth capturing, see fcfuse_op_note()
+    int64_t off;
+    uint64_t size;
+    uint64_t arg;
+    const char *path2;
+};
+
+extern __thread struct fcfuse_op fcfuse_cur_op;
+
+static inline uint64_t fcfuse_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const char *fcfuse_op_name(int op);
+void fcfuse_op_begin(int op, const char *path);
+long fcfuse_op_end(long retstat);
+void fcfuse_op_ioctl(int op, uint64_t start, int cid);
+void fcfuse_op_phase(int phase, uint64_t start);
+
+// Arguments of the current request beyond its path, for the capture
+static inline void fcfuse_op_note(int64_t off, uint64_t size, uint64_t arg, const char *path2)
+{
+    fcfuse_cur_op.off = off;
+    fcfuse_cur_op.size = size;
+    fcfuse_cur_op.arg = arg;
+    fcfuse_cur_op.path2 = path2;
+}
+
+// Time a call into the backing filesystem as part of the current
+// request; errno is what the call left
+#define FCFS_IO(call) \
+    ({ \
+        uint64_t _io_start = fcfuse_now(); \
+        __typeof__(call) _io_ret = (call); \
+        int _io_errno = errno; \
+        fcfuse_op_phase(FCPH_IO, _io_start); \
+        errno = _io_errno; \
+        _io_ret; \
+    })
+
+int  fcfuse_stats_snapshot(char **buf, size_t *len);
+int  fcfuse_stats_metrics(FILE *out);
+void fcfuse_stats_op_hist(int op, uint64_t *buckets);
+uint64_t fcfuse_stats_bucket_ns(int b);
+
+#endif
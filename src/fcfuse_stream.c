@@ -0,0 +1,162 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Containers given with -o stream=CID ingest or scan files that
+  nobody reads again soon, and left alone they fill the host's page
+  cache with them at the expense of the other tenants' working sets.
+  This is the lighter alternative to -o direct: the data still goes
+  through the page cache, but each handle's progress is tracked so its
+  pages don't stay there.
+
+  Behind a sequential writer, every STREAM_WINDOW written starts
+  writeback of that window with sync_file_range(), then waits for the
+  window before it and drops it with POSIX_FADV_DONTNEED.  A stream
+  thus has at most two windows of dirty pages, and the writer is held
+  to the speed of the disk rather than to that of dirty-page
+  throttling, which would stall every tenant.
+
+  A reader becomes sequential after STREAM_SEQUENTIAL requests that
+  follow each other.  The file is then marked POSIX_FADV_SEQUENTIAL,
+  the next STREAM_WINDOW is kept under POSIX_FADV_WILLNEED, and what
+  was read is dropped a window at a time.
+
+  On release all of the file's pages are written back and dropped.
+
+  Several workers may serve one handle at once; the ranges are worked
+  out under the stream's lock and the calls made outside it.  A
+  request that doesn't follow the previous one restarts the tracking
+  where it lands.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "fcfuse_cidset.h"
+#include "fcfuse_stream.h"
+
+#define STREAM_WINDOW (8 << 20)
+#define STREAM_SEQUENTIAL 2
+#define STREAM_PAGE 4096
+
+struct fcfuse_stream {
+    pthread_mutex_t lock;
+    off_t read_next;        // where a sequential read would start
+    off_t read_ahead;       // WILLNEED given up to here
+    off_t read_dropped;     // DONTNEED given from here back to where the run began
+    int sequential;         // reads in a row that followed each other
+    int advised;            // FADV_SEQUENTIAL given
+    off_t write_next;       // where a sequential write would start
+    off_t write_started;    // writeback started up to here
+    off_t write_dropped;    // written back and dropped up to here
+};
+
+// Containers with -o stream
+static struct fcfuse_cidset stream_cids;
+
+/** -o stream=CID.  Returns 0 or -ENOMEM. */
+int fcfuse_stream_add(int cid)
+{
+    return fcfuse_cidset_add(&stream_cids, cid);
+}
+
+/** Whether container cid streams */
+int fcfuse_stream_enabled(int cid)
+{
+    return fcfuse_cidset_has(&stream_cids, cid);
+}
+
+/** Tracking for a new handle, NULL if out of memory */
+struct fcfuse_stream *fcfuse_stream_open(void)
+{
+    struct fcfuse_stream *stream = calloc(1, sizeof(*stream));
+
+    if (stream) pthread_mutex_init(&stream->lock, NULL);
+
+    return stream;
+}
+
+/** After a read of size bytes at offset went through fd */
+void fcfuse_stream_read(struct fcfuse_stream *stream, int fd, off_t offset, size_t size)
+{
+    off_t ahead = 0, ahead_len = 0, drop = 0, drop_len = 0;
+    int advise = 0;
+
+    pthread_mutex_lock(&stream->lock);
+    if (offset == stream->read_next) {
+        stream->sequential++;
+    } else {
+        stream->sequential = 0;
+        stream->read_ahead = offset;
+        stream->read_dropped = offset & ~(off_t) (STREAM_PAGE - 1);
+    }
+    stream->read_next = offset + size;
+
+    if (stream->sequential >= STREAM_SEQUENTIAL) {
+        if (!stream->advised) stream->advised = advise = 1;
+        // top the window up once half of it has been read
+        if (stream->read_ahead < stream->read_next + STREAM_WINDOW / 2) {
+            ahead = (stream->read_ahead > stream->read_next) ? stream->read_ahead : stream->read_next;
+            ahead_len = stream->read_next + STREAM_WINDOW - ahead;
+            stream->read_ahead = ahead + ahead_len;
+        }
+        // whole pages only, the next read may want the last one
+        if (stream->read_next - stream->read_dropped >= STREAM_WINDOW) {
+            drop = stream->read_dropped;
+            drop_len = (stream->read_next & ~(off_t) (STREAM_PAGE - 1)) - drop;
+            stream->read_dropped = drop + drop_len;
+        }
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    if (advise) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (ahead_len) posix_fadvise(fd, ahead, ahead_len, POSIX_FADV_WILLNEED);
+    if (drop_len) posix_fadvise(fd, drop, drop_len, POSIX_FADV_DONTNEED);
+}
+
+/** After a write of size bytes at offset went through fd */
+void fcfuse_stream_write(struct fcfuse_stream *stream, int fd, off_t offset, size_t size)
+{
+    off_t start = 0, start_len = 0, drop = 0, drop_len = 0;
+
+    pthread_mutex_lock(&stream->lock);
+    if (offset != stream->write_next) {
+        stream->write_started = offset;
+        stream->write_dropped = offset;
+    }
+    stream->write_next = offset + size;
+
+    if (stream->write_next - stream->write_started >= STREAM_WINDOW) {
+        start = stream->write_started;
+        start_len = stream->write_next - start;
+        stream->write_started = stream->write_next;
+        drop = stream->write_dropped;
+        drop_len = start - drop;
+        stream->write_dropped = start;
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    if (start_len) sync_file_range(fd, start, start_len, SYNC_FILE_RANGE_WRITE);
+    if (drop_len) {
+        sync_file_range(fd, drop, drop_len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, drop, drop_len, POSIX_FADV_DONTNEED);
+    }
+}
+
+/** The handle is released: drop all of the file's pages, and the tracking */
+void fcfuse_stream_release(struct fcfuse_stream *stream, int fd)
+{
+    // dirty pages would survive DONTNEED
+    if (stream->write_next)
+        sync_file_range(fd, 0, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    pthread_mutex_destroy(&stream->lock);
+    free(stream);
+}
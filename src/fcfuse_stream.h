@@ -0,0 +1,25 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Page-cache hygiene for the containers given with -o stream=CID:
+  writeback and eviction behind writers, readahead ahead of
+  sequential readers.
+*/
+
+#ifndef _FCFUSE_STREAM_H_
+#define _FCFUSE_STREAM_H_
+
+#include <sys/types.h>
+
+struct fcfuse_stream;
+
+int  fcfuse_stream_add(int cid);
+int  fcfuse_stream_enabled(int cid);
+
+struct fcfuse_stream *fcfuse_stream_open(void);
+void fcfuse_stream_read(struct fcfuse_stream *stream, int fd, off_t offset, size_t size);
+void fcfuse_stream_write(struct fcfuse_stream *stream, int fd, off_t offset, size_t size);
+void fcfuse_stream_release(struct fcfuse_stream *stream, int fd);
+
+#endif
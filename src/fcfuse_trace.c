@@ -0,0 +1,298 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  With -o trace_sample=N one request in N per thread is traced: the
+  callback as a whole and, nested in it, resolving the backing path,
+  the fcontainer ioctls and the calls into the backing filesystem,
+  each tagged with the container and thread.  Spans go into a flight
+  recorder ring per thread that keeps the last TRACE_RING of them.
+
+  SIGUSR1 (or fcfuse_trace_dump()) writes the rings out as Chrome
+  trace-event JSON, which chrome://tracing and Perfetto load as they
+  are.  The dump runs in a thread of its own and never stops the
+  threads that are serving requests.
+
+  With sampling off a request costs one load and a branch, and no
+  ring is allocated.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "fcfuse_stats.h"
+#include "fcfuse_trace.h"
+
+#define TRACE_RING 16384                    // spans per thread, power of two
+
+struct trace_span {
+    uint64_t start;
+    uint64_t end;
+    int32_t cid;
+    uint16_t op;
+    uint8_t phase;
+};
+
+struct trace_ring {
+    uint64_t head;                          // spans ever written
+    uint32_t tid;
+    struct trace_ring *next;                // all rings
+    struct trace_ring *next_free;           // rings of exited threads
+    struct trace_span spans[TRACE_RING];
+};
+
+unsigned int fcfuse_trace_sample;
+
+static char trace_file[PATH_MAX];
+static __thread struct trace_ring *my_ring;
+static struct trace_ring *rings;
+static struct trace_ring *free_rings;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t dump_thread;
+static sem_t dump_sem;
+static int dump_running;
+static int dump_stop;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phase_names[] = {
+    [FCPH_OP] = "op",
+    [FCPH_RESOLVE] = "resolve",
+    [FCPH_IOCTL] = "ioctl",
+    [FCPH_IO] = "io",
+};
+
+static void ring_retire(void *arg)
+{
+    struct trace_ring *ring = arg;
+
+    pthread_mutex_lock(&ring_lock);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void ring_key_init(void)
+{
+    pthread_key_create(&ring_key, ring_retire);
+}
+
+static struct trace_ring *ring_get(void)
+{
+    struct trace_ring *ring = my_ring;
+
+    if (ring != NULL) return ring;
+
+    pthread_once(&ring_once, ring_key_init);
+
+    pthread_mutex_lock(&ring_lock);
+    ring = free_rings;
+    if (ring != NULL) {
+        free_rings = ring->next_free;
+    } else if ((ring = calloc(1, sizeof(*ring))) != NULL) {
+        ring->next = rings;
+        __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if (ring == NULL) return NULL;
+    __atomic_store_n(&ring->tid, (uint32_t) syscall(SYS_gettid), __ATOMIC_RELAXED);
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+
+    return ring;
+}
+
+/** Record a span of the current thread */
+void fcfuse_trace_span(int phase, int op, int cid, uint64_t start, uint64_t end)
+{
+    struct trace_ring *ring = ring_get();
+    struct trace_span *span;
+    uint64_t head;
+
+    if (ring == NULL) return;
+
+    head = ring->head;
+    span = &ring->spans[head & (TRACE_RING - 1)];
+    span->start = start;
+    span->end = end;
+    span->cid = cid;
+    span->op = op;
+    span->phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void fcfuse_trace_set_sample(unsigned int sample)
+{
+    __atomic_store_n(&fcfuse_trace_sample, sample, __ATOMIC_RELAXED);
+}
+
+static const char *span_name(const struct trace_span *span)
+{
+    if ((span->phase == FCPH_OP) || (span->phase == FCPH_IOCTL)) return fcfuse_op_name(span->op);
+
+    return phase_names[span->phase];
+}
+
+// Write out what one ring holds.  Spans the owner overwrote while we
+// copied them are left out.
+static int trace_dump_ring(FILE *out, struct trace_ring *ring, struct trace_span *copy, int first)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t from = (head > TRACE_RING) ? head - TRACE_RING : 0;
+    uint64_t now, i;
+    uint32_t tid = __atomic_load_n(&ring->tid, __ATOMIC_RELAXED);
+    pid_t pid = getpid();
+    struct trace_span *span;
+
+    for (i = from; i < head; i++) copy[i - from] = ring->spans[i & (TRACE_RING - 1)];
+
+    // slots the owner reused since, and the one it may be writing
+    now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (now + 1 > TRACE_RING) i = now + 1 - TRACE_RING;
+    else i = 0;
+    if (i < from) i = from;
+
+    for (; i < head; i++) {
+        span = &copy[i - from];
+        if (span->end < span->start) continue;
+        fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%u,\"args\":{\"cid\":%d}}",
+                first ? "" : ",", span_name(span), phase_names[span->phase],
+                span->start / 1000.0, (span->end - span->start) / 1000.0,
+                (int) pid, tid, span->cid);
+        first = 0;
+    }
+
+    return first;
+}
+
+/**
+ * Write every thread's recent spans to file (the -o trace_file one if
+ * NULL) as Chrome trace-event JSON.  Returns 0 or -errno.
+ */
+int fcfuse_trace_dump(const char *file)
+{
+    char tmp[PATH_MAX + 8];
+    struct trace_ring *ring;
+    struct trace_span *copy;
+    FILE *out;
+    int first = 1;
+
+    int retstat = 0;
+
+    if (file == NULL) file = trace_file;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int) sizeof(tmp)) return -ENAMETOOLONG;
+
+    copy = malloc(sizeof(struct trace_span) * TRACE_RING);
+    if (copy == NULL) return -ENOMEM;
+
+    pthread_mutex_lock(&dump_lock);
+    out = fopen(tmp, "w");
+    if (out == NULL) {
+        retstat = -errno;
+        goto out;
+    }
+
+    // timestamps are CLOCK_MONOTONIC in microseconds
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        first = trace_dump_ring(out, ring, copy, first);
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0) retstat = -errno;
+    else if (rename(tmp, file) != 0) retstat = -errno;
+
+out:
+    pthread_mutex_unlock(&dump_lock);
+    free(copy);
+
+    return retstat;
+}
+
+static void trace_signal(int sig)
+{
+    sem_post(&dump_sem);
+}
+
+static void *trace_dumper(void *arg)
+{
+    int retstat;
+
+    for (;;) {
+        if ((sem_wait(&dump_sem) != 0) && (errno == EINTR)) continue;
+        if (__atomic_load_n(&dump_stop, __ATOMIC_ACQUIRE)) break;
+        retstat = fcfuse_trace_dump(NULL);
+        if (retstat != 0) log_at(LOG_LEVEL_WARN, "trace dump to %s failed: %s\n", trace_file, strerror(-retstat));
+        else log_msg("trace written to %s\n", trace_file);
+    }
+
+    return NULL;
+}
+
+/**
+ * Remember the options.  file is made absolute here since the daemon
+ * changes to / when it goes to the background.
+ */
+int fcfuse_trace_init(const char *file, unsigned int sample)
+{
+    char cwd[PATH_MAX];
+
+    if (file == NULL) file = "fcfs-trace.json";
+    if (file[0] == '/') {
+        if (strlen(file) >= sizeof(trace_file)) return -ENAMETOOLONG;
+        strcpy(trace_file, file);
+    } else {
+        if (getcwd(cwd, sizeof(cwd)) == NULL) return -errno;
+        if (snprintf(trace_file, sizeof(trace_file), "%s/%s", cwd, file) >= (int) sizeof(trace_file))
+            return -ENAMETOOLONG;
+    }
+
+    fcfuse_trace_set_sample(sample);
+
+    return 0;
+}
+
+/** Start the dump thread and catch SIGUSR1; runs from fcfuse_init() */
+int fcfuse_trace_start(void)
+{
+    struct sigaction sa;
+    int retstat;
+
+    if (sem_init(&dump_sem, 0, 0) != 0) return -errno;
+
+    retstat = pthread_create(&dump_thread, NULL, trace_dumper, NULL);
+    if (retstat) return -retstat;
+    dump_running = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL) != 0) return -errno;
+
+    return 0;
+}
+
+void fcfuse_trace_stop(void)
+{
+    if (!dump_running) return;
+
+    signal(SIGUSR1, SIG_DFL);
+    __atomic_store_n(&dump_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&dump_sem);
+    pthread_join(dump_thread, NULL);
+    dump_running = 0;
+}
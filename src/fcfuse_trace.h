@@ -0,0 +1,43 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Sampled request tracing, dumped as Chrome trace-event JSON.
+*/
+
+#ifndef _FCFUSE_TRACE_H_
+#define _FCFUSE_TRACE_H_
+
+#include <stdint.h>
+
+// What a span covers
+enum fcfuse_phase {
+    FCPH_OP,                // a whole FUSE callback
+    FCPH_RESOLVE,           // mount path to backing path
+    FCPH_IOCTL,             // an fcontainer_* ioctl
+    FCPH_IO,                // a call into the backing filesystem
+};
+
+extern unsigned int fcfuse_trace_sample;
+
+int  fcfuse_trace_init(const char *file, unsigned int sample);
+int  fcfuse_trace_start(void);
+void fcfuse_trace_stop(void);
+void fcfuse_trace_set_sample(unsigned int sample);
+void fcfuse_trace_span(int phase, int op, int cid, uint64_t start, uint64_t end);
+int  fcfuse_trace_dump(const char *file);
+
+// Whether the request a thread starts now is traced.  One branch when
+// tracing is off.
+static inline int fcfuse_trace_pick(void)
+{
+    static __thread unsigned int countdown;
+    unsigned int sample = __atomic_load_n(&fcfuse_trace_sample, __ATOMIC_RELAXED);
+
+    if (sample == 0) return 0;
+    if (countdown == 0 || countdown > sample) countdown = sample;
+
+    return --countdown == 0;
+}
+
+#endif
@@ -0,0 +1,388 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Unlinking a file of many gigabytes keeps the caller waiting while
+  the backing filesystem frees every extent.  With -o trash, a file
+  that takes at least -o trash_min=MB (1) of disk and has no other
+  links is instead renamed into FCFUSE_TRASH_NAME in the data
+  location, which is instant.  A thread running at the lowest CPU and
+  I/O priority empties the trash.  It frees a file a step at a time
+  by truncating it, at most -o trash_rate=MB (1024) megabytes a
+  second, and then unlinks it.
+
+  The trash can be emptied that way only if nobody has the file open:
+  an unlinked file stays readable through open descriptors, ours (the
+  fd cache, open handles) included.  A write lease, which the kernel
+  grants only to the sole opener of a file, tells us so; without one
+  the file is just unlinked, and freed on its last close.  Somebody
+  opening the file later breaks the lease: the kernel then sends the
+  process SIGIO, whose default action would kill the daemon, so the
+  signal is ignored while the trash is on.  The lease is checked before
+  each step and while sleeping between steps, and once it is being
+  broken it is given back and the file just unlinked.
+
+  fcfuse_trash_purge() deletes a whole container at once: every
+  .containerN file and directory in the data location goes into the
+  trash in one walk, with the journal (see fcfuse_journal.c) held.
+  The control socket's "purge CID" calls it.  Without -o trash, the
+  purge unlinks everything itself.
+
+  What is left in the trash at unmount is emptied by the next mount.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "fcfuse_journal.h"
+#include "fcfuse_trash.h"
+
+#define TR_STEP (64 << 20)              // bytes freed by each truncation
+#define TR_POLL_NS 100000000ULL         // lease checks while throttling
+
+// <linux/ioprio.h> isn't always installed
+#define TR_IOPRIO_WHO_PROCESS 1
+#define TR_IOPRIO_IDLE (3 << 13)
+
+static int tr_on;
+static const char *tr_root;
+static int tr_dirfd = -1;
+static off_t tr_min;
+static uint64_t tr_rate;                // bytes a second
+static unsigned long tr_tag;            // keeps names unique across mounts
+static unsigned long long tr_next;
+
+static pthread_mutex_t tr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tr_work = PTHREAD_COND_INITIALIZER;
+static int tr_pending;                  // the trash has something new
+static int tr_stopping;
+static int tr_running;
+static pthread_t tr_thread;
+static struct sigaction tr_old_sigio;
+static int tr_sigio;                    // we ignore SIGIO
+
+static unsigned long long tr_moved, tr_reclaimed, tr_freed;
+
+/** -o trash, -o trash_min and -o trash_rate, before fuse_main().
+    Returns 0 or -errno. */
+int fcfuse_trash_init(const char *rootdir, int on, unsigned int min_mb, unsigned int rate_mb)
+{
+    char path[PATH_MAX];
+
+    tr_root = rootdir;
+    if (!on) return 0;
+
+    tr_min = (off_t) (min_mb ? min_mb : 1) << 20;
+    tr_rate = (uint64_t) (rate_mb ? rate_mb : 1024) << 20;
+    tr_tag = time(NULL);
+
+    snprintf(path, PATH_MAX, "%s/%s", rootdir, FCFUSE_TRASH_NAME);
+    if ((mkdir(path, 0700) != 0) && (errno != EEXIST)) return -errno;
+    tr_dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (tr_dirfd == -1) return -errno;
+    tr_on = 1;
+    // empty what the last mount left
+    tr_pending = 1;
+
+    return 0;
+}
+
+static void tr_wake(void)
+{
+    pthread_mutex_lock(&tr_lock);
+    tr_pending = 1;
+    pthread_cond_signal(&tr_work);
+    pthread_mutex_unlock(&tr_lock);
+}
+
+// Move dfd/name into the trash.  0, or -1 with errno set.
+static int tr_move(int dfd, const char *name)
+{
+    char victim[64];
+
+    snprintf(victim, sizeof(victim), "%lx.%llu", tr_tag, __atomic_add_fetch(&tr_next, 1, __ATOMIC_RELAXED));
+    if (renameat(dfd, name, tr_dirfd, victim) != 0) return -1;
+    __atomic_add_fetch(&tr_moved, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/** unlink() of fpath, through the trash if it is worth it */
+int fcfuse_trash_unlink(const char *fpath)
+{
+    struct stat st;
+
+    if (!tr_on || (lstat(fpath, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_nlink != 1) ||
+        ((off_t) st.st_blocks * 512 < tr_min))
+        return unlink(fpath);
+
+    // unlink() gives the error if the rename can't be done
+    if (tr_move(AT_FDCWD, fpath) != 0) return unlink(fpath);
+    tr_wake();
+
+    return 0;
+}
+
+// Whether we still hold the write lease on fd, nobody having opened it
+static int tr_leased(int fd)
+{
+    return fcntl(fd, F_GETLEASE) == F_WRLCK;
+}
+
+// Sleep off freeing bytes at tr_rate.  At a low rate that takes longer
+// than the kernel waits for a lease to be given back, so the lease on
+// fd is checked every TR_POLL_NS.  Returns 0, or -1 once the lease is
+// being broken or we are stopping.
+static int tr_throttle(int fd, uint64_t bytes)
+{
+    struct timespec ts;
+    uint64_t ns, nap;
+
+    ns = bytes * 1000000000ULL / tr_rate;
+    while (ns) {
+        if (!tr_leased(fd) || __atomic_load_n(&tr_stopping, __ATOMIC_RELAXED)) return -1;
+        nap = (ns > TR_POLL_NS) ? TR_POLL_NS : ns;
+        ts.tv_sec = nap / 1000000000ULL;
+        ts.tv_nsec = nap % 1000000000ULL;
+        nanosleep(&ts, NULL);
+        ns -= nap;
+    }
+
+    return 0;
+}
+
+// Give back the blocks of dfd/name, st, a step at a time if nobody
+// else has it open
+static void tr_shrink(int dfd, const char *name, const struct stat *st)
+{
+    off_t size = st->st_size;
+    int fd;
+
+    fd = openat(dfd, name, O_WRONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return;
+
+    if (fcntl(fd, F_SETLEASE, F_WRLCK) == 0) {
+        while ((size > 0) && !__atomic_load_n(&tr_stopping, __ATOMIC_RELAXED)) {
+            off_t step = (size > TR_STEP) ? TR_STEP : size;
+
+            // somebody opened it: let them have it
+            if (!tr_leased(fd)) break;
+
+            if (ftruncate(fd, size - step) != 0) break;
+            size -= step;
+            __atomic_add_fetch(&tr_freed, step, __ATOMIC_RELAXED);
+            if (tr_throttle(fd, step) != 0) break;
+        }
+        fcntl(fd, F_SETLEASE, F_UNLCK);
+    }
+    close(fd);
+}
+
+static void tr_empty_dir(int fd, int background);
+
+// Delete dfd/name, and everything in it if it is a directory.  In the
+// background, large files are shrunk first and a stop leaves the rest
+// for later.
+static void tr_delete(int dfd, const char *name, int background)
+{
+    struct stat st;
+    int fd;
+
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+
+    if (S_ISDIR(st.st_mode)) {
+        fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) return;
+        tr_empty_dir(fd, background);
+        if (background && __atomic_load_n(&tr_stopping, __ATOMIC_RELAXED)) return;
+        unlinkat(dfd, name, AT_REMOVEDIR);
+        return;
+    }
+
+    if (background && S_ISREG(st.st_mode) && (st.st_nlink == 1) && ((off_t) st.st_blocks * 512 > TR_STEP)) {
+        tr_shrink(dfd, name, &st);
+        if (__atomic_load_n(&tr_stopping, __ATOMIC_RELAXED)) return;
+    }
+    if (unlinkat(dfd, name, 0) == 0) __atomic_add_fetch(&tr_reclaimed, 1, __ATOMIC_RELAXED);
+}
+
+// Delete everything in the directory fd, which is closed
+static void tr_empty_dir(int fd, int background)
+{
+    struct dirent *de;
+    DIR *dp;
+
+    dp = fdopendir(fd);
+    if (dp == NULL) {
+        close(fd);
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if (background && __atomic_load_n(&tr_stopping, __ATOMIC_RELAXED)) break;
+        tr_delete(dirfd(dp), de->d_name, background);
+    }
+    closedir(dp);
+}
+
+static void *tr_reclaimer(void *arg)
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    // we are in no hurry
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set, TR_IOPRIO_WHO_PROCESS, tid, TR_IOPRIO_IDLE);
+
+    pthread_mutex_lock(&tr_lock);
+    while (!tr_stopping) {
+        if (!tr_pending) {
+            pthread_cond_wait(&tr_work, &tr_lock);
+            continue;
+        }
+        tr_pending = 0;
+        pthread_mutex_unlock(&tr_lock);
+
+        // a descriptor of its own, to read the trash from the start
+        tr_empty_dir(openat(tr_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC), 1);
+
+        pthread_mutex_lock(&tr_lock);
+    }
+    pthread_mutex_unlock(&tr_lock);
+
+    return NULL;
+}
+
+/** From fcfuse_init().  Returns 0, or -errno with files unlinked
+    right away. */
+int fcfuse_trash_start(void)
+{
+    struct sigaction sa;
+    int ret;
+
+    if (!tr_on) return 0;
+
+    // a broken lease raises SIGIO; a handler somebody set is left alone
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGIO, NULL, &tr_old_sigio) != 0) {
+        ret = errno;
+        goto fail;
+    }
+    if (!(tr_old_sigio.sa_flags & SA_SIGINFO) && (tr_old_sigio.sa_handler == SIG_DFL)) {
+        if (sigaction(SIGIO, &sa, NULL) != 0) {
+            ret = errno;
+            goto fail;
+        }
+        tr_sigio = 1;
+    }
+
+    ret = pthread_create(&tr_thread, NULL, tr_reclaimer, NULL);
+    if (ret != 0) {
+        if (tr_sigio) sigaction(SIGIO, &tr_old_sigio, NULL);
+        tr_sigio = 0;
+        goto fail;
+    }
+    tr_running = 1;
+
+    return 0;
+
+fail:
+    tr_on = 0;
+    return -ret;
+}
+
+/** Stop emptying the trash; the next mount finishes */
+void fcfuse_trash_stop(void)
+{
+    if (!tr_on) return;
+
+    if (tr_running) {
+        pthread_mutex_lock(&tr_lock);
+        __atomic_store_n(&tr_stopping, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&tr_work);
+        pthread_mutex_unlock(&tr_lock);
+        pthread_join(tr_thread, NULL);
+        tr_running = 0;
+    }
+    if (tr_sigio) {
+        sigaction(SIGIO, &tr_old_sigio, NULL);
+        tr_sigio = 0;
+    }
+
+    log_msg("    trash: %llu moved in, %llu deleted, %llu MB freed by truncation\n",
+            tr_moved, tr_reclaimed, tr_freed >> 20);
+}
+
+// Remove what belongs to a container under the directory fd, which is
+// closed.  Returns how much.
+static int tr_purge_dir(int fd, const char *suffix, int top)
+{
+    size_t slen = strlen(suffix), len;
+    struct dirent *de;
+    DIR *dp;
+    int n = 0;
+    int sub;
+
+    dp = fdopendir(fd);
+    if (dp == NULL) {
+        close(fd);
+        return 0;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if (top && (!strcmp(de->d_name, FCFUSE_TRASH_NAME) || !strcmp(de->d_name, FCFUSE_JOURNAL_NAME)))
+            continue;
+
+        len = strlen(de->d_name);
+        if ((len > slen) && !strcmp(de->d_name + len - slen, suffix)) {
+            if (!tr_on || (tr_move(dirfd(dp), de->d_name) != 0)) tr_delete(dirfd(dp), de->d_name, 0);
+            n++;
+            continue;
+        }
+
+        // directories without a suffix are shared, look inside
+        if ((de->d_type != DT_DIR) && (de->d_type != DT_UNKNOWN)) continue;
+        sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub != -1) n += tr_purge_dir(sub, suffix, 0);
+    }
+    closedir(dp);
+
+    return n;
+}
+
+/** Delete every file and directory of container cid.  Returns how
+    many or -errno. */
+int fcfuse_trash_purge(int cid)
+{
+    char suffix[32];
+    int fd, n;
+
+    if (cid < 0) return -EINVAL;
+    snprintf(suffix, sizeof(suffix), ".container%d", cid);
+
+    fd = open(tr_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+
+    // nothing journaled may come in between
+    fcfuse_journal_hold();
+    n = tr_purge_dir(fd, suffix, 1);
+    fcfuse_journal_done();
+
+    if (tr_on && n) tr_wake();
+    log_msg("    trash: purged %d entries of container %d\n", n, cid);
+
+    return n;
+}
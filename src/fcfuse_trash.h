@@ -0,0 +1,24 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Deferred deletion (-o trash): large files are unlinked by moving
+  them into a hidden trash directory, which a low-priority thread
+  empties at a bounded rate.  A container's whole data set can be
+  deleted at once with fcfuse_trash_purge().
+*/
+
+#ifndef _FCFUSE_TRASH_H_
+#define _FCFUSE_TRASH_H_
+
+// The trash, in the root of the data location
+#define FCFUSE_TRASH_NAME ".fcfuse-trash"
+
+int  fcfuse_trash_init(const char *rootdir, int on, unsigned int min_mb, unsigned int rate_mb);
+int  fcfuse_trash_start(void);
+void fcfuse_trash_stop(void);
+
+int  fcfuse_trash_unlink(const char *fpath);
+int  fcfuse_trash_purge(int cid);
+
+#endif
@@ -0,0 +1,502 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  With -o uring=DEPTH the backing reads, writes, fsyncs, opens and
+  stats go through one io_uring of DEPTH entries instead of a system
+  call each.
+
+  The FUSE callbacks are synchronous, so the worker thread still waits
+  for its result; what the ring saves is system calls.  A worker puts
+  its request in the submission queue and, unless another worker is
+  already in io_uring_enter(), submits everything queued so far.
+  Requests that arrive while a submit is under way are left for the
+  thread doing it, which goes round again before it returns, so under
+  load one enter carries the requests of many workers.  A thread of
+  ours waits for completions and wakes each worker on a futex.
+
+  No more requests are in flight than the submission queue holds, so
+  the completion queue, twice its size, can't overflow.
+
+  The ring is set up in fcfuse_init(), after fuse_main() has forked.
+  Kernels without io_uring, or without one of the operations (5.6 has
+  them all), and builds without <linux/io_uring.h> get the
+  synchronous calls.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// fcfuse doesn't include config.h; look for the header the way
+// fcfuse_probes.h looks for <sys/sdt.h>
+#if !defined(HAVE_LINUX_IO_URING_H) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_LINUX_IO_URING_H 1
+#endif
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "fcfuse_uring.h"
+
+static unsigned int uring_depth;
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#define URING_OP(op) (1u << (op))
+#define URING_WANTED (URING_OP(IORING_OP_READ) | URING_OP(IORING_OP_WRITE) | \
+                      URING_OP(IORING_OP_FSYNC) | URING_OP(IORING_OP_OPENAT) | \
+                      URING_OP(IORING_OP_STATX) | URING_OP(IORING_OP_NOP))
+
+// One request, on the stack of the worker waiting for it
+struct uring_req {
+    int res;
+    int done;               // futex
+};
+
+static int uring_fd = -1;
+static int uring_on;
+static unsigned int uring_ops;              // URING_OP() of what the kernel has
+
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned int sq_entries;
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_size, cq_ring_size, sqes_size;
+
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t uring_space = PTHREAD_COND_INITIALIZER;
+static unsigned int uring_inflight;         // queued and not yet completed
+static unsigned int uring_unsubmitted;      // queued and not yet entered
+static int uring_submitting;                // a thread is in io_uring_enter()
+static uint64_t uring_requests, uring_enters;
+static pthread_t uring_thread;
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, uring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// io_uring_enter() refused what is queued with err: take it back out
+// of the submission queue and fail it.  Only the submitting thread
+// calls this, with uring_lock held; the kernel consumes nothing unless
+// it is in io_uring_enter().
+static void uring_fail_unsubmitted(int err)
+{
+    unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *sq_tail, n = 0;
+    struct uring_req *req;
+
+    for (; head != tail; head++, n++) {
+        req = (struct uring_req *) (uintptr_t) sqes[sq_array[head & *sq_mask]].user_data;
+        if (req == NULL) continue;
+        req->res = -err;
+        __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &req->done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    __atomic_store_n(sq_tail, head - n, __ATOMIC_RELEASE);
+    uring_inflight -= n;
+    uring_unsubmitted = 0;
+    pthread_cond_broadcast(&uring_space);
+}
+
+// Queue sqe and see it submitted, with whatever else is queued.
+// Returns 0, or -errno if a submission this thread made failed; the
+// requests in it are completed with that error.
+static int uring_push(const struct io_uring_sqe *sqe)
+{
+    unsigned int tail, index;
+    int ret, retstat = 0;
+
+    pthread_mutex_lock(&uring_lock);
+    while (uring_inflight >= sq_entries) pthread_cond_wait(&uring_space, &uring_lock);
+
+    tail = *sq_tail;
+    index = tail & *sq_mask;
+    sqes[index] = *sqe;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring_inflight++;
+    uring_unsubmitted++;
+    uring_requests++;
+
+    if (!uring_submitting) {
+        uring_submitting = 1;
+        while (uring_unsubmitted) {
+            unsigned int n = uring_unsubmitted;
+
+            pthread_mutex_unlock(&uring_lock);
+            ret = uring_enter(n, 0, 0);
+            pthread_mutex_lock(&uring_lock);
+            if (ret > 0) {
+                uring_unsubmitted -= ret;
+                uring_enters++;
+            } else if ((ret < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+                // retrying won't help
+                retstat = -errno;
+                log_at(LOG_LEVEL_ERROR, "io_uring_enter: %s\n", strerror(errno));
+                uring_fail_unsubmitted(errno);
+            }
+        }
+        uring_submitting = 0;
+    }
+    pthread_mutex_unlock(&uring_lock);
+
+    return retstat;
+}
+
+// Run one request through the ring; returns its result, -errno on
+// failure
+static int uring_call(struct io_uring_sqe *sqe)
+{
+    struct uring_req req = { 0, 0 };
+
+    sqe->user_data = (uintptr_t) &req;
+    uring_push(sqe);
+    while (!__atomic_load_n(&req.done, __ATOMIC_ACQUIRE))
+        syscall(SYS_futex, &req.done, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+
+    return req.res;
+}
+
+static void *uring_main(void *arg)
+{
+    struct io_uring_cqe *cqe;
+    struct uring_req *req;
+    unsigned int head, tail, n;
+    int stop = 0;
+
+    (void) arg;
+
+    while (!stop) {
+        if ((uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR))
+            log_at(LOG_LEVEL_ERROR, "io_uring_enter: %s\n", strerror(errno));
+
+        head = *cq_head;
+        tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (n = 0; head != tail; head++, n++) {
+            cqe = &cqes[head & *cq_mask];
+            req = (struct uring_req *) (uintptr_t) cqe->user_data;
+            // the NOP of fcfuse_uring_stop() carries no request
+            if (req == NULL) {
+                stop = 1;
+                continue;
+            }
+            req->res = cqe->res;
+            __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+            // req may be gone by now, a stray wake is harmless
+            syscall(SYS_futex, &req->done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        if (n) {
+            pthread_mutex_lock(&uring_lock);
+            uring_inflight -= n;
+            pthread_cond_broadcast(&uring_space);
+            pthread_mutex_unlock(&uring_lock);
+        }
+    }
+
+    return NULL;
+}
+
+// Which of the operations we use the kernel has
+static unsigned int uring_probe(void)
+{
+    struct io_uring_probe *probe;
+    size_t size = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    unsigned int ops = 0;
+    int i;
+
+    probe = calloc(1, size);
+    if (probe == NULL) return 0;
+    if (syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        for (i = 0; (i < probe->ops_len) && (i < 32); i++)
+            if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) ops |= URING_OP(i);
+    }
+    free(probe);
+
+    return ops & URING_WANTED;
+}
+
+static void uring_unmap(void)
+{
+    if (sqes && (sqes != MAP_FAILED)) munmap(sqes, sqes_size);
+    if (cq_ring && (cq_ring != MAP_FAILED) && (cq_ring != sq_ring)) munmap(cq_ring, cq_ring_size);
+    if (sq_ring && (sq_ring != MAP_FAILED)) munmap(sq_ring, sq_ring_size);
+    sqes = NULL;
+    sq_ring = cq_ring = NULL;
+    close(uring_fd);
+    uring_fd = -1;
+}
+
+static int uring_setup(void)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    uring_fd = syscall(__NR_io_uring_setup, uring_depth, &p);
+    if (uring_fd < 0) return -errno;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd,
+                   IORING_OFF_SQ_RING);
+    cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring :
+        mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd,
+             IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+    if ((sq_ring == MAP_FAILED) || (cq_ring == MAP_FAILED) || (sqes == MAP_FAILED)) {
+        int err = errno;
+        uring_unmap();
+        return -err;
+    }
+
+    sq_head = (unsigned int *) ((char *) sq_ring + p.sq_off.head);
+    sq_tail = (unsigned int *) ((char *) sq_ring + p.sq_off.tail);
+    sq_mask = (unsigned int *) ((char *) sq_ring + p.sq_off.ring_mask);
+    sq_array = (unsigned int *) ((char *) sq_ring + p.sq_off.array);
+    cq_head = (unsigned int *) ((char *) cq_ring + p.cq_off.head);
+    cq_tail = (unsigned int *) ((char *) cq_ring + p.cq_off.tail);
+    cq_mask = (unsigned int *) ((char *) cq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) ((char *) cq_ring + p.cq_off.cqes);
+    sq_entries = p.sq_entries;
+
+    return 0;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+// The ring is used for op
+#define URING_USE(op) \
+    (__atomic_load_n(&uring_on, __ATOMIC_RELAXED) && (uring_ops & URING_OP(op)))
+
+// Hand back a ring result the way the system call would
+static int uring_ret(int res)
+{
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    return res;
+}
+
+static int uring_statx(int dirfd, const char *path, int flags, struct stat *st)
+{
+    struct io_uring_sqe sqe;
+    struct statx stx;
+    int res;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = dirfd;
+    sqe.addr = (uintptr_t) path;
+    sqe.len = STATX_BASIC_STATS;
+    sqe.off = (uintptr_t) &stx;
+    sqe.statx_flags = flags;
+    res = uring_call(&sqe);
+    if (res == 0) statx_to_stat(&stx, st);
+
+    return uring_ret(res);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/**
+ * Remember -o uring before fuse_main(); the ring itself is set up
+ * by fcfuse_uring_start().
+ */
+void fcfuse_uring_init(unsigned int depth)
+{
+    uring_depth = depth;
+}
+
+/** Set up the ring, from fcfuse_init().  Returns 0 or -errno. */
+int fcfuse_uring_start(void)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    int retstat;
+
+    if (uring_depth == 0) return 0;
+
+    retstat = uring_setup();
+    if (retstat != 0) return retstat;
+
+    uring_ops = uring_probe();
+    if (!(uring_ops & URING_OP(IORING_OP_NOP))) {
+        uring_unmap();
+        return -ENOSYS;
+    }
+    if (uring_ops != URING_WANTED)
+        log_at(LOG_LEVEL_WARN, "    io_uring lacks some operations, using system calls for them\n");
+
+    retstat = -pthread_create(&uring_thread, NULL, uring_main, NULL);
+    if (retstat != 0) {
+        uring_unmap();
+        return retstat;
+    }
+    __atomic_store_n(&uring_on, 1, __ATOMIC_RELEASE);
+    log_msg("    io_uring of %u entries\n", sq_entries);
+
+    return 0;
+#else
+    return uring_depth ? -ENOSYS : 0;
+#endif
+}
+
+void fcfuse_uring_stop(void)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    struct io_uring_sqe sqe;
+
+    if (!uring_on) return;
+
+    // by now the workers are gone; a NOP without a request ends
+    // uring_main()
+    __atomic_store_n(&uring_on, 0, __ATOMIC_RELEASE);
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_NOP;
+    if (uring_push(&sqe) != 0) {
+        // uring_main() waits on a ring it will never hear from again;
+        // leave it, and the ring, to the exit
+        log_at(LOG_LEVEL_ERROR, "    io_uring: can't stop the completion thread\n");
+        return;
+    }
+    pthread_join(uring_thread, NULL);
+    uring_unmap();
+
+    log_msg("    io_uring: %llu requests in %llu submits\n",
+            (unsigned long long) uring_requests, (unsigned long long) uring_enters);
+#endif
+}
+
+ssize_t fcfuse_uring_pread(int fd, void *buf, size_t size, off_t offset)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if (URING_USE(IORING_OP_READ)) {
+        struct io_uring_sqe sqe;
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = (uintptr_t) buf;
+        sqe.len = size;
+        sqe.off = offset;
+        return uring_ret(uring_call(&sqe));
+    }
+#endif
+    return pread(fd, buf, size, offset);
+}
+
+ssize_t fcfuse_uring_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if (URING_USE(IORING_OP_WRITE)) {
+        struct io_uring_sqe sqe;
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = fd;
+        sqe.addr = (uintptr_t) buf;
+        sqe.len = size;
+        sqe.off = offset;
+        return uring_ret(uring_call(&sqe));
+    }
+#endif
+    return pwrite(fd, buf, size, offset);
+}
+
+int fcfuse_uring_fsync(int fd, int datasync)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if (URING_USE(IORING_OP_FSYNC)) {
+        struct io_uring_sqe sqe;
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_FSYNC;
+        sqe.fd = fd;
+        sqe.fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+        return uring_ret(uring_call(&sqe));
+    }
+#endif
+#ifdef HAVE_FDATASYNC
+    if (datasync) return fdatasync(fd);
+#endif
+    return fsync(fd);
+}
+
+int fcfuse_uring_open(const char *path, int flags, mode_t mode)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if (URING_USE(IORING_OP_OPENAT)) {
+        struct io_uring_sqe sqe;
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_OPENAT;
+        sqe.fd = AT_FDCWD;
+        sqe.addr = (uintptr_t) path;
+        sqe.len = mode;
+        sqe.open_flags = flags;
+        return uring_ret(uring_call(&sqe));
+    }
+#endif
+    return open(path, flags, mode);
+}
+
+int fcfuse_uring_lstat(const char *path, struct stat *st)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if (URING_USE(IORING_OP_STATX)) return uring_statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, st);
+#endif
+    return lstat(path, st);
+}
+
+int fcfuse_uring_fstat(int fd, struct stat *st)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if (URING_USE(IORING_OP_STATX)) return uring_statx(fd, "", AT_EMPTY_PATH, st);
+#endif
+    return fstat(fd, st);
+}
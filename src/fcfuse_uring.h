@@ -0,0 +1,27 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Backing-file I/O through an io_uring, with the synchronous calls as
+  the fallback.  Each call behaves like the one it replaces: -1 and
+  errno on failure.
+*/
+
+#ifndef _FCFUSE_URING_H_
+#define _FCFUSE_URING_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+void fcfuse_uring_init(unsigned int depth);
+int  fcfuse_uring_start(void);
+void fcfuse_uring_stop(void);
+
+ssize_t fcfuse_uring_pread(int fd, void *buf, size_t size, off_t offset);
+ssize_t fcfuse_uring_pwrite(int fd, const void *buf, size_t size, off_t offset);
+int fcfuse_uring_fsync(int fd, int datasync);
+int fcfuse_uring_open(const char *path, int flags, mode_t mode);
+int fcfuse_uring_lstat(const char *path, struct stat *st);
+int fcfuse_uring_fstat(int fd, struct stat *st);
+
+#endif
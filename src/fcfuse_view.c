@@ -0,0 +1,477 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  With writeback caching the kernel keeps pages, attributes (and,
+  for regular files, its own idea of the size) per path, but every
+  container sees a different .containerN file behind that path.  The
+  kernel's cache for a path therefore belongs to one container at a
+  time:
+
+  - handles from the owning container share the cache,
+  - handles from other containers opened while the owner still has
+    the file open bypass it with direct_io,
+  - an idle path changes owner once the kernel's pages and attributes
+    for it are invalidated, and the last release of a path that more
+    than one container touched invalidates them for the next tenant,
+  - namespace and attribute changes made by a container that does not
+    own the cached view are invalidated behind the kernel's back.
+
+  Every invalidation is made by a notifier thread, since notifying the
+  kernel from inside some requests deadlocks; an open that changes the
+  owner waits for it.
+
+  The high-level API can invalidate a path's inode but not its dentry,
+  so a name stays bound to whatever it last resolved to until the
+  entry timeout, which fcfuse_init() sets to 0 in writeback mode.
+*/
+
+#include "fcfuse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fcfuse_probes.h"
+#include "fcfuse_view.h"
+
+#define VIEW_BUCKETS 4096
+// idle views we remember before forgetting them all; a forgotten
+// view only costs its next open an invalidation
+#define VIEW_MAX (64 * 1024)
+#define VIEW_NONE INT_MIN
+
+struct fcfuse_view {
+    char *path;             // NULL once renamed over or forgotten
+    int cid;                // container the kernel's cache belongs to
+    int opens;              // handles sharing the kernel's cache
+    int bypass;             // direct_io handles of other containers
+    int shared;             // touched by more than one container
+    struct fcfuse_view *next;
+};
+
+struct view_inval {
+    char *path;
+    int wait;               // on the stack of view_queue_wait()
+    int done;
+    struct view_inval *next;
+};
+
+static struct fuse *view_fuse;
+static struct fcfuse_view *view_table[VIEW_BUCKETS];
+static int view_count;
+static pthread_mutex_t view_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct view_inval *inval_head, *inval_tail;
+static int inval_stop;
+static pthread_t inval_thread;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t inval_done = PTHREAD_COND_INITIALIZER;
+
+static unsigned int view_hash(const char *path)
+{
+    unsigned int h = 2166136261u;
+
+    while (*path) h = (h ^ (unsigned char) *path++) * 16777619u;
+
+    return h % VIEW_BUCKETS;
+}
+
+// Drop the kernel's pages and attributes for path, writing back dirty
+// pages first.  Only libfuse 3 can do this, and writeback caching
+// needs libfuse 3.
+static void view_invalidate(const char *path)
+{
+#if FUSE_USE_VERSION >= 30
+    fuse_invalidate_path(view_fuse, path);
+#endif
+}
+
+// inval_lock must be held
+static void view_push(struct view_inval *inval)
+{
+    inval->next = NULL;
+    if (inval_tail) inval_tail->next = inval;
+    else inval_head = inval;
+    inval_tail = inval;
+    pthread_cond_signal(&inval_cond);
+}
+
+// inval_lock must be held.  Its waiter frees a waited-for inval.
+static void view_finish(struct view_inval *inval)
+{
+    if (inval->wait) {
+        inval->done = 1;
+        pthread_cond_broadcast(&inval_done);
+        return;
+    }
+    free(inval->path);
+    free(inval);
+}
+
+static void view_queue(const char *path)
+{
+    struct view_inval *inval = calloc(1, sizeof(*inval));
+
+    if (inval == NULL) return;
+    inval->path = strdup(path);
+    if (inval->path == NULL) {
+        free(inval);
+        return;
+    }
+
+    pthread_mutex_lock(&inval_lock);
+    view_push(inval);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+// Have the notifier invalidate path and wait until it has
+static void view_queue_wait(const char *path)
+{
+    struct view_inval inval = { (char *) path, 1, 0, NULL };
+
+    pthread_mutex_lock(&inval_lock);
+    view_push(&inval);
+    while (!inval.done) pthread_cond_wait(&inval_done, &inval_lock);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+static void *view_notifier(void *arg)
+{
+    struct view_inval *inval;
+
+    pthread_mutex_lock(&inval_lock);
+    while (!inval_stop) {
+        if (inval_head == NULL) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+            continue;
+        }
+        inval = inval_head;
+        inval_head = inval->next;
+        if (inval_head == NULL) inval_tail = NULL;
+        pthread_mutex_unlock(&inval_lock);
+
+        view_invalidate(inval->path);
+
+        pthread_mutex_lock(&inval_lock);
+        view_finish(inval);
+    }
+    pthread_mutex_unlock(&inval_lock);
+
+    return NULL;
+}
+
+// view_lock must be held for all of the helpers below
+
+static struct fcfuse_view *view_unhash(const char *path)
+{
+    struct fcfuse_view **link = &view_table[view_hash(path)];
+    struct fcfuse_view *view;
+
+    for (view = *link; view != NULL; link = &view->next, view = view->next) {
+        if (strcmp(view->path, path) == 0) {
+            *link = view->next;
+            view->next = NULL;
+            view_count--;
+            return view;
+        }
+    }
+
+    return NULL;
+}
+
+static void view_hash_in(struct fcfuse_view *view)
+{
+    unsigned int h = view_hash(view->path);
+
+    view->next = view_table[h];
+    view_table[h] = view;
+    view_count++;
+}
+
+// Free a view that is no longer in the table once no handle refers
+// to it any more
+static void view_put(struct fcfuse_view *view)
+{
+    if (view->opens || view->bypass) return;
+
+    free(view->path);
+    free(view);
+}
+
+static void view_forget(struct fcfuse_view *view)
+{
+    free(view->path);
+    view->path = NULL;
+    view_put(view);
+}
+
+static void view_forget_idle(void)
+{
+    struct fcfuse_view **link, *view;
+    int h;
+
+    for (h = 0; h < VIEW_BUCKETS; h++) {
+        link = &view_table[h];
+        while ((view = *link) != NULL) {
+            if (view->opens || view->bypass) {
+                link = &view->next;
+                continue;
+            }
+            *link = view->next;
+            view_count--;
+            view_forget(view);
+        }
+    }
+}
+
+static struct fcfuse_view *view_lookup(const char *path, int create)
+{
+    struct fcfuse_view *view;
+
+    for (view = view_table[view_hash(path)]; view != NULL; view = view->next)
+        if (strcmp(view->path, path) == 0) return view;
+
+    if (!create) return NULL;
+
+    if (view_count >= VIEW_MAX) view_forget_idle();
+
+    view = calloc(1, sizeof(*view));
+    if (view == NULL) return NULL;
+    view->path = strdup(path);
+    if (view->path == NULL) {
+        free(view);
+        return NULL;
+    }
+    view->cid = VIEW_NONE;
+    view_hash_in(view);
+
+    return view;
+}
+
+int fcfuse_view_init(struct fuse *fuse)
+{
+    view_fuse = fuse;
+    inval_stop = 0;
+
+    return pthread_create(&inval_thread, NULL, view_notifier, NULL);
+}
+
+void fcfuse_view_destroy(void)
+{
+    struct view_inval *inval;
+
+    pthread_mutex_lock(&inval_lock);
+    inval_stop = 1;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+    pthread_join(inval_thread, NULL);
+
+    // the connection is gone, nothing left to invalidate
+    pthread_mutex_lock(&inval_lock);
+    while ((inval = inval_head) != NULL) {
+        inval_head = inval->next;
+        view_finish(inval);
+    }
+    inval_tail = NULL;
+    pthread_mutex_unlock(&inval_lock);
+}
+
+/**
+ * Register a handle about to be opened on path by container
+ * file->cid, one that must not use the kernel's cache if bypass is
+ * set.  Returns 1 if the handle may use the kernel's cache, 0 if it
+ * has to be opened with direct_io.  Undo with fcfuse_view_release()
+ * if the open fails.
+ */
+int fcfuse_view_open(const char *path, struct fcfuse_file *file, int bypass)
+{
+    struct fcfuse_view *view;
+    int cid = file->cid;
+    int cached, claim = 0;
+
+    pthread_mutex_lock(&view_lock);
+
+    view = view_lookup(path, 1);
+    // bypassing the cache is always safe
+    if (view == NULL) {
+        pthread_mutex_unlock(&view_lock);
+        file->view = NULL;
+        file->cached = 0;
+        return 0;
+    }
+
+    if (bypass || ((view->opens > 0) && (view->cid != cid))) {
+        view->bypass++;
+        view->shared = 1;
+        cached = 0;
+    } else {
+        if ((view->opens == 0) && (view->cid != cid)) {
+            claim = 1;
+            if (view->cid != VIEW_NONE) view->shared = 1;
+        }
+        view->cid = cid;
+        view->opens++;
+        cached = 1;
+    }
+    file->view = view;
+    file->cached = cached;
+
+    pthread_mutex_unlock(&view_lock);
+
+    FCFS_PROBE3(view__open, cid, path, cached);
+
+    // Pages of another container's file may still be cached.  Drop
+    // them before this handle can read; with writeback caching this
+    // also writes back dirty pages through the other worker threads.
+    if (claim) view_queue_wait(path);
+
+    return cached;
+}
+
+/** Forget a handle registered with fcfuse_view_open() */
+void fcfuse_view_release(const char *path, struct fcfuse_file *file)
+{
+    struct fcfuse_view *view = file->view;
+    int flush = 0;
+
+    if (view == NULL) return;
+
+    pthread_mutex_lock(&view_lock);
+
+    if (file->cached) view->opens--;
+    else view->bypass--;
+    file->view = NULL;
+
+    if (view->path == NULL) {
+        view_put(view);
+    } else if ((view->opens == 0) && (view->bypass == 0) && view->shared) {
+        // let the next tenant start from fresh pages and attributes
+        flush = 1;
+        view->shared = 0;
+    }
+
+    pthread_mutex_unlock(&view_lock);
+
+    if (flush) view_queue(path);
+}
+
+/**
+ * Container cid changed path (its attributes or its name) in the
+ * backing tree.  If the kernel caches another container's file for
+ * path, what it saw no longer matches anything and has to go.
+ */
+void fcfuse_view_changed(const char *path, int cid)
+{
+    struct fcfuse_view *view;
+    int stale = 0;
+
+    pthread_mutex_lock(&view_lock);
+
+    view = view_lookup(path, 0);
+    if ((view != NULL) && (view->cid != cid)) {
+        stale = 1;
+        if ((view->opens == 0) && (view->bypass == 0)) {
+            view_unhash(path);
+            view_forget(view);
+        }
+    }
+
+    pthread_mutex_unlock(&view_lock);
+
+    if (stale) view_queue(path);
+}
+
+/**
+ * Container cid renamed path to newpath.  The kernel moved its dentry
+ * along, so the view moves too; whatever was cached for newpath
+ * before is gone.
+ */
+void fcfuse_view_renamed(const char *path, const char *newpath, int cid)
+{
+    struct fcfuse_view *view, *old;
+    char *newcopy = strdup(newpath);
+    int stale = 0;
+
+    pthread_mutex_lock(&view_lock);
+
+    old = view_unhash(newpath);
+    if (old != NULL) view_forget(old);
+
+    view = view_unhash(path);
+    if (view != NULL) {
+        stale = (view->cid != cid);
+        free(view->path);
+        view->path = newcopy;
+        if (newcopy != NULL) view_hash_in(view);
+        else view_put(view);
+        newcopy = NULL;
+    }
+
+    pthread_mutex_unlock(&view_lock);
+
+    free(newcopy);
+    if (stale) view_queue(newpath);
+}
+
+/**
+ * Drop what the kernel caches for the idle paths whose view belongs
+ * to container cid (every container if cid is -1).  Dirty pages are
+ * written back first.
+ */
+void fcfuse_view_flush(int cid)
+{
+    struct fcfuse_view **link, *view;
+    struct view_inval *inval, *queue = NULL;
+    int h;
+
+    if (view_fuse == NULL) return;
+
+    pthread_mutex_lock(&view_lock);
+    for (h = 0; h < VIEW_BUCKETS; h++) {
+        link = &view_table[h];
+        while ((view = *link) != NULL) {
+            if (view->opens || view->bypass || ((cid != -1) && (view->cid != cid))) {
+                link = &view->next;
+                continue;
+            }
+            *link = view->next;
+            view_count--;
+            // the path moves to the queue, the view goes
+            inval = malloc(sizeof(*inval));
+            if (inval != NULL) {
+                inval->path = view->path;
+                inval->next = queue;
+                queue = inval;
+                view->path = NULL;
+            }
+            view_forget(view);
+        }
+    }
+    pthread_mutex_unlock(&view_lock);
+
+    while ((inval = queue) != NULL) {
+        queue = inval->next;
+        view_queue(inval->path);
+        free(inval->path);
+        free(inval);
+    }
+}
+
+/** Call fn for every view, with its container and whether a handle shares the kernel's cache */
+void fcfuse_view_foreach(void (*fn)(int cid, int busy, void *arg), void *arg)
+{
+    struct fcfuse_view *view;
+    int h;
+
+    pthread_mutex_lock(&view_lock);
+    for (h = 0; h < VIEW_BUCKETS; h++)
+        for (view = view_table[h]; view != NULL; view = view->next)
+            if (view->cid != VIEW_NONE) fn(view->cid, view->opens > 0, arg);
+    pthread_mutex_unlock(&view_lock);
+}
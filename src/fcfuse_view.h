@@ -0,0 +1,22 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Tracks which container's backing file the kernel currently caches
+  for each path, so writeback caching stays correct when the same
+  path resolves to a different .containerN file per tenant.
+*/
+
+#ifndef _FCFUSE_VIEW_H_
+#define _FCFUSE_VIEW_H_
+
+int  fcfuse_view_init(struct fuse *fuse);
+void fcfuse_view_destroy(void);
+int  fcfuse_view_open(const char *path, struct fcfuse_file *file, int bypass);
+void fcfuse_view_release(const char *path, struct fcfuse_file *file);
+void fcfuse_view_changed(const char *path, int cid);
+void fcfuse_view_renamed(const char *path, const char *newpath, int cid);
+void fcfuse_view_flush(int cid);
+void fcfuse_view_foreach(void (*fn)(int cid, int busy, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Turn the binary fcfs.log written by fcfuse back into text.
+
+  usage:  fclogdump [-t] [fcfs.log]
+
+  -t prefixes every message with its time and thread id.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log_format.h"
+
+static char **formats;
+static uint32_t nformats;
+
+static int set_format(uint32_t id, const char *format)
+{
+    char **grown;
+    uint32_t n;
+
+    if (id >= nformats) {
+        n = nformats ? nformats : 64;
+        while (n <= id) n *= 2;
+        grown = realloc(formats, n * sizeof(*formats));
+        if (grown == NULL) return -1;
+        memset(grown + nformats, 0, (n - nformats) * sizeof(*formats));
+        formats = grown;
+        nformats = n;
+    }
+
+    free(formats[id]);
+    formats[id] = strdup(format);
+
+    return formats[id] ? 0 : -1;
+}
+
+// Print one conversion spec (a copy of it, NUL terminated) with the
+// argument at *argp
+static int print_arg(FILE *out, const char *spec, int type, int stars,
+                     const unsigned char **argp, const unsigned char *end)
+{
+    const unsigned char *arg = *argp;
+    int64_t star[2] = { 0, 0 };
+    int64_t l;
+    double d;
+    uint16_t len;
+    char str[LOG_STR_MAX + 1];
+    int i;
+
+    for (i = 0; i < stars; i++) {
+        if ((i >= 2) || (arg + sizeof(l) > end)) return -1;
+        memcpy(&star[i], arg, sizeof(l));
+        arg += sizeof(l);
+    }
+
+    if (type == LOG_ARG_STR) {
+        if (arg + sizeof(len) > end) return -1;
+        memcpy(&len, arg, sizeof(len));
+        arg += sizeof(len);
+        if ((len > LOG_STR_MAX) || (arg + len > end)) return -1;
+        memcpy(str, arg, len);
+        str[len] = '\0';
+        arg += len;
+    } else {
+        if (arg + sizeof(l) > end) return -1;
+        memcpy(&l, arg, sizeof(l));
+        arg += sizeof(l);
+    }
+    *argp = arg;
+
+    // the producer saw the same spec, so the types match it
+#define PRINT(value) \
+    do { \
+        if (stars == 0) fprintf(out, spec, value); \
+        else if (stars == 1) fprintf(out, spec, (int) star[0], value); \
+        else fprintf(out, spec, (int) star[0], (int) star[1], value); \
+    } while (0)
+
+    switch (type) {
+    case LOG_ARG_INT:
+        PRINT((int) l);
+        break;
+    case LOG_ARG_LONG:
+        PRINT((long long) l);
+        break;
+    case LOG_ARG_PTR:
+        PRINT((void *) (intptr_t) l);
+        break;
+    case LOG_ARG_DOUBLE:
+        memcpy(&d, &l, sizeof(d));
+        PRINT(d);
+        break;
+    case LOG_ARG_STR:
+        PRINT(str);
+        break;
+    }
+#undef PRINT
+
+    return 0;
+}
+
+static void print_message(FILE *out, const struct log_record *rec,
+                          const unsigned char *arg, const unsigned char *end)
+{
+    const char *format = (rec->fmt < nformats) ? formats[rec->fmt] : NULL;
+    const char *p, *conv;
+    char spec[64];
+    int type, stars;
+
+    if (format == NULL) {
+        fprintf(out, "<message with unknown format %u>\n", rec->fmt);
+        return;
+    }
+
+    for (p = format; *p; ) {
+        if (*p != '%') {
+            conv = strchr(p, '%');
+            if (conv == NULL) conv = p + strlen(p);
+            fwrite(p, 1, conv - p, out);
+            p = conv;
+            continue;
+        }
+
+        conv = p;
+        type = log_format_next(&p, &stars);
+        if (type == LOG_ARG_NONE) {
+            if (conv[1] == '%') fputc('%', out);
+            else fwrite(conv, 1, p - conv, out);
+            continue;
+        }
+        if ((size_t) (p - conv) >= sizeof(spec)) {
+            fprintf(out, "<bad conversion>");
+            return;
+        }
+        memcpy(spec, conv, p - conv);
+        spec[p - conv] = '\0';
+        if (print_arg(out, spec, type, stars, &arg, end) != 0) {
+            // the producer cut the record short
+            fprintf(out, "<truncated>\n");
+            return;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct log_file_header header;
+    struct log_record rec;
+    static unsigned char payload[LOG_PAYLOAD_MAX];
+    uint64_t dropped;
+    size_t len;
+    FILE *in;
+    int opt, times = 0;
+
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        switch (opt) {
+        case 't':
+            times = 1;
+            break;
+        default:
+            fprintf(stderr, "usage:  fclogdump [-t] [fcfs.log]\n");
+            return 1;
+        }
+    }
+
+    in = fopen((optind < argc) ? argv[optind] : "fcfs.log", "r");
+    if (in == NULL) {
+        perror("fclogdump");
+        return 1;
+    }
+
+    if ((fread(&header, sizeof(header), 1, in) != 1) ||
+        memcmp(header.magic, LOG_MAGIC, sizeof(header.magic))) {
+        fprintf(stderr, "fclogdump: not an fcfuse log\n");
+        return 1;
+    }
+    if (header.byteorder != LOG_BYTEORDER) {
+        fprintf(stderr, "fclogdump: log was written with a different byte order\n");
+        return 1;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        // nothing past this can be trusted to be where a record starts
+        if ((rec.size < sizeof(rec)) || (rec.size - sizeof(rec) > sizeof(payload))) {
+            fprintf(stderr, "fclogdump: corrupt record of %u bytes at offset %ld\n",
+                    rec.size, ftell(in) - (long) sizeof(rec));
+            return 1;
+        }
+        len = rec.size - sizeof(rec);
+        if (fread(payload, 1, len, in) != len) {
+            fprintf(stderr, "fclogdump: log ends in the middle of a record\n");
+            break;
+        }
+
+        switch (rec.type) {
+        case LOG_REC_FORMAT:
+            if (len == 0) break;
+            payload[len - 1] = '\0';
+            if (set_format(rec.fmt, (char *) payload) != 0) {
+                perror("fclogdump");
+                return 1;
+            }
+            break;
+        case LOG_REC_MSG:
+            if (times)
+                printf("[%llu.%09llu %u] ", (unsigned long long) (rec.time / 1000000000ull),
+                       (unsigned long long) (rec.time % 1000000000ull), rec.tid);
+            print_message(stdout, &rec, payload, payload + len);
+            break;
+        case LOG_REC_DROPPED:
+            if (len < sizeof(dropped)) break;
+            memcpy(&dropped, payload, sizeof(dropped));
+            printf("*** %llu messages dropped\n", (unsigned long long) dropped);
+            break;
+        default:
+            // newer record types are skipped
+            break;
+        }
+    }
+
+    fclose(in);
+
+    return 0;
+}
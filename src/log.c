@@ -20,35 +20,418 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "log.h"
+#include "log_format.h"
+
+/*
+  Messages are not formatted in the FUSE threads any more.  Each
+  thread appends compact binary records (format id plus raw
+  arguments, see log_format.h) to a ring buffer of its own without
+  taking a lock.  A drain thread collects them every
+  LOG_DRAIN_INTERVAL and writes them to fcfs.log in large chunks.
+  fclogdump turns the file back into the text this used to write.
+  When a ring is full its messages are dropped and counted, never
+  waited for.
+*/
+
+#define LOG_RING_SIZE (256 * 1024)          // power of two
+#define LOG_FORMATS 4096                    // power of two
+#define LOG_DRAIN_INTERVAL 20               // ms
+
+struct log_ring {
+    uint64_t head;                          // written by the owning thread
+    uint64_t tail;                          // written by the drain thread
+    uint64_t dropped;
+    int orphaned;                           // owning thread exited
+    struct log_ring *next;
+    unsigned char data[LOG_RING_SIZE];
+};
+
+struct log_format {
+    const char *format;
+    uint32_t id;
+};
+
+int log_level = LOG_LEVEL_INFO;
+
+static FILE *log_file;
+static struct log_ring *log_rings;
+static pthread_key_t log_ring_key;
+static __thread struct log_ring *log_my_ring;
+static __thread uint32_t log_my_tid;
+
+static struct log_format log_formats[LOG_FORMATS];
+static uint32_t log_nformats;
+static uint32_t log_nformats_written;
+static pthread_mutex_t log_format_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t log_drain_thread;
+static int log_running;
+static int log_stop;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_drain_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *log_level_names[] = { "error", "warn", "info", "debug" };
+
+int log_parse_level(const char *name)
+{
+    int level;
+
+    if (!strcmp(name, "off")) return LOG_LEVEL_OFF;
+    for (level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++)
+        if (!strcmp(name, log_level_names[level])) return level;
+
+    return -2;
+}
+
+void log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+const char *log_level_name(int level)
+{
+    if ((level < LOG_LEVEL_ERROR) || (level > LOG_LEVEL_DEBUG)) return "off";
+
+    return log_level_names[level];
+}
+
+// Id of a format string, registering it on first use.  Formats are
+// string literals, so the pointer identifies them.
+static int log_format_id(const char *format, uint32_t *id)
+{
+    uint32_t h = ((uintptr_t) format >> 3) & (LOG_FORMATS - 1);
+    uint32_t i;
+    const char *seen;
+
+    for (i = 0; i < LOG_FORMATS; i++, h = (h + 1) & (LOG_FORMATS - 1)) {
+        seen = __atomic_load_n(&log_formats[h].format, __ATOMIC_ACQUIRE);
+        if (seen == format) {
+            *id = log_formats[h].id;
+            return 0;
+        }
+        if (seen != NULL) continue;
+
+        pthread_mutex_lock(&log_format_lock);
+        seen = log_formats[h].format;
+        if (seen == NULL) {
+            log_formats[h].id = log_nformats;
+            // publish the id before the format, and the format before
+            // the count the drain thread goes by
+            __atomic_store_n(&log_formats[h].format, format, __ATOMIC_RELEASE);
+            __atomic_store_n(&log_nformats, log_nformats + 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&log_format_lock);
+        if ((seen == NULL) || (seen == format)) {
+            *id = log_formats[h].id;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void log_ring_orphan(void *arg)
+{
+    struct log_ring *ring = arg;
+
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *log_ring_get(void)
+{
+    struct log_ring *ring = log_my_ring;
+
+    if (ring != NULL) return ring;
+
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) return NULL;
+    log_my_tid = syscall(SYS_gettid);
+
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    pthread_setspecific(log_ring_key, ring);
+    log_my_ring = ring;
+
+    return ring;
+}
+
+static void log_ring_put(struct log_ring *ring, const void *rec, size_t size)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t off = head & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - off;
+
+    if (LOG_RING_SIZE - (head - tail) < size) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (first >= size) {
+        memcpy(ring->data + off, rec, size);
+    } else {
+        memcpy(ring->data + off, rec, first);
+        memcpy(ring->data, (const char *) rec + first, size - first);
+    }
+
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+void log_write(int level, const char *format, ...)
+{
+    unsigned char rec[LOG_RECORD_MAX];
+    struct log_record *hdr = (struct log_record *) rec;
+    size_t size = sizeof(*hdr);
+    struct log_ring *ring;
+    struct timespec ts;
+    const char *p = format;
+    int type, stars;
+    int64_t l;
+    double d;
+    const char *str;
+    uint16_t len;
+    va_list ap;
+
+    ring = log_ring_get();
+    if ((ring == NULL) || (log_format_id(format, &hdr->fmt) != 0)) return;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr->type = LOG_REC_MSG;
+    hdr->level = level;
+    hdr->tid = log_my_tid;
+    hdr->time = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    hdr->reserved = 0;
+
+    va_start(ap, format);
+    while ((p = strchr(p, '%')) != NULL) {
+        type = log_format_next(&p, &stars);
+        if (type == LOG_ARG_NONE) continue;
+        while (stars-- > 0) {
+            l = va_arg(ap, int);
+            if (size + sizeof(l) > sizeof(rec)) goto out;
+            memcpy(rec + size, &l, sizeof(l));
+            size += sizeof(l);
+        }
+        switch (type) {
+        case LOG_ARG_INT:
+            l = va_arg(ap, int);
+            break;
+        case LOG_ARG_LONG:
+            l = va_arg(ap, long long);
+            break;
+        case LOG_ARG_PTR:
+            l = (intptr_t) va_arg(ap, void *);
+            break;
+        case LOG_ARG_DOUBLE:
+            d = va_arg(ap, double);
+            memcpy(&l, &d, sizeof(l));
+            break;
+        case LOG_ARG_STR:
+            str = va_arg(ap, const char *);
+            if (str == NULL) str = "(null)";
+            len = strnlen(str, LOG_STR_MAX);
+            if (size + sizeof(len) + len > sizeof(rec)) goto out;
+            memcpy(rec + size, &len, sizeof(len));
+            memcpy(rec + size + sizeof(len), str, len);
+            size += sizeof(len) + len;
+            continue;
+        }
+        if (size + sizeof(l) > sizeof(rec)) goto out;
+        memcpy(rec + size, &l, sizeof(l));
+        size += sizeof(l);
+    }
+out:
+    va_end(ap);
+
+    hdr->size = size;
+    log_ring_put(ring, rec, size);
+}
+
+static void log_put_record(int type, uint32_t fmt, const void *payload, size_t len)
+{
+    struct log_record hdr;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.size = sizeof(hdr) + len;
+    hdr.type = type;
+    hdr.time = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    hdr.fmt = fmt;
+
+    fwrite(&hdr, sizeof(hdr), 1, log_file);
+    fwrite(payload, len, 1, log_file);
+}
+
+// Copy everything a ring holds to out, which has room for a full ring
+static size_t log_ring_take(struct log_ring *ring, unsigned char *out)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    size_t size = head - tail;
+    size_t off = tail & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - off;
+
+    if (size == 0) return 0;
+
+    if (first >= size) {
+        memcpy(out, ring->data + off, size);
+    } else {
+        memcpy(out, ring->data + off, first);
+        memcpy(out + first, ring->data, size - first);
+    }
+
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+    return size;
+}
+
+static void log_drain(unsigned char *buf)
+{
+    struct log_ring *ring, **link;
+    uint64_t dropped;
+    uint32_t n, h;
+    size_t size;
+    int orphaned;
+
+    for (link = &log_rings; (ring = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL; ) {
+        orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        size = log_ring_take(ring, buf);
+
+        // messages always follow the formats they use, and a message
+        // can only be in a ring once its format has an id
+        n = __atomic_load_n(&log_nformats, __ATOMIC_ACQUIRE);
+        for (h = 0; (log_nformats_written < n) && (h < LOG_FORMATS); h++) {
+            const char *format = __atomic_load_n(&log_formats[h].format, __ATOMIC_ACQUIRE);
+            if ((format == NULL) || (log_formats[h].id < log_nformats_written) ||
+                (log_formats[h].id >= n))
+                continue;
+            // a format too long for a record is cut short; the decoder
+            // terminates it
+            log_put_record(LOG_REC_FORMAT, log_formats[h].id, format,
+                           (strlen(format) < LOG_PAYLOAD_MAX) ? strlen(format) + 1 : LOG_PAYLOAD_MAX);
+        }
+        log_nformats_written = n;
+
+        if (size) fwrite(buf, size, 1, log_file);
+
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) log_put_record(LOG_REC_DROPPED, 0, &dropped, sizeof(dropped));
+
+        // a ring whose thread is gone can go once it is empty; only
+        // the first ring is ever swapped by new threads
+        if (orphaned && (link != &log_rings)) {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+
+    fflush(log_file);
+}
+
+static void *log_drainer(void *arg)
+{
+    unsigned char *buf = arg;
+    struct timespec deadline;
+    int stop = 0;
+
+    while (!stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_DRAIN_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&log_drain_lock);
+        if (!log_stop) pthread_cond_timedwait(&log_drain_cond, &log_drain_lock, &deadline);
+        stop = log_stop;
+        pthread_mutex_unlock(&log_drain_lock);
+
+        log_drain(buf);
+    }
+
+    free(buf);
+
+    return NULL;
+}
 
 FILE *log_open()
 {
-    FILE *logfile;
+    struct log_file_header header;
     
     // very first thing, open up the logfile and mark that we got in
     // here.  If we can't open the logfile, we're dead.
-    logfile = fopen("fcfs.log", "w");
-    if (logfile == NULL) {
+    log_file = fopen("fcfs.log", "w");
+    if (log_file == NULL) {
 	perror("logfile");
 	exit(EXIT_FAILURE);
     }
     
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // the drain thread writes in large chunks
+    setvbuf(log_file, NULL, _IOFBF, 1024 * 1024);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.byteorder = LOG_BYTEORDER;
+    fwrite(&header, sizeof(header), 1, log_file);
 
-    return logfile;
+    if (pthread_key_create(&log_ring_key, log_ring_orphan)) {
+	perror("logger");
+	exit(EXIT_FAILURE);
+    }
+
+    return log_file;
 }
 
-void log_msg(const char *format, ...)
+/**
+ * Start writing messages out.  fuse_main() forks when it daemonizes
+ * and threads don't survive that, so this runs from fcfuse_init();
+ * anything logged before stays in the rings until then.
+ */
+int log_start(void)
 {
-    va_list ap;
-    va_start(ap, format);
+    unsigned char *buf = malloc(LOG_RING_SIZE);
+    int retstat;
 
-    vfprintf(NPHFS_DATA->logfile, format, ap);
+    if (buf == NULL) return -ENOMEM;
+
+    retstat = pthread_create(&log_drain_thread, NULL, log_drainer, buf);
+    if (retstat) {
+	free(buf);
+	return -retstat;
+    }
+    log_running = 1;
+
+    return 0;
+}
+
+// Write out whatever is still buffered and stop the drain thread
+void log_close(void)
+{
+    if (!log_running) return;
+
+    pthread_mutex_lock(&log_drain_lock);
+    log_stop = 1;
+    pthread_cond_signal(&log_drain_cond);
+    pthread_mutex_unlock(&log_drain_lock);
+
+    pthread_join(log_drain_thread, NULL);
+    log_running = 0;
+    fflush(log_file);
 }
 
 // Report errors to logfile and give -errno to caller
@@ -56,15 +439,15 @@ int log_error(char *func)
 {
     int ret = -errno;
     
-    log_msg("    ERROR %s: %s\n", func, strerror(errno));
+    log_at(LOG_LEVEL_ERROR, "    ERROR %s: %s\n", func, strerror(errno));
     
     return ret;
 }
 
 // fuse context
-void log_fuse_context(struct fuse_context *context)
+void log_dump_fuse_context(struct fuse_context *context)
 {
-    log_msg("    context:\n");
+    log_write(LOG_LEVEL_DEBUG, "    context:\n");
     
     /** Pointer to the fuse object */
     //	struct fuse *fuse;
@@ -96,9 +479,9 @@ void log_fuse_context(struct fuse_context *context)
 // struct fuse_conn_info contains information about the socket
 // connection being used.  I don't actually use any of this
 // information in NPHeapFS
-void log_conn(struct fuse_conn_info *conn)
+void log_dump_conn(struct fuse_conn_info *conn)
 {
-    log_msg("    conn:\n");
+    log_write(LOG_LEVEL_DEBUG, "    conn:\n");
     
     /** Major version of the protocol (read-only) */
     // unsigned proto_major;
@@ -108,13 +491,21 @@ void log_conn(struct fuse_conn_info *conn)
     // unsigned proto_minor;
     log_struct(conn, proto_minor, %d, );
 
+#if FUSE_USE_VERSION < 30
     /** Is asynchronous read supported (read-write) */
     // unsigned async_read;
     log_struct(conn, async_read, %d, );
+#endif
 
     /** Maximum size of the write buffer */
     // unsigned max_write;
     log_struct(conn, max_write, %d, );
+
+#if FUSE_USE_VERSION >= 30
+    /** Maximum size of read requests */
+    // unsigned max_read;
+    log_struct(conn, max_read, %d, );
+#endif
     
     /** Maximum readahead */
     // unsigned max_readahead;
@@ -136,6 +527,12 @@ void log_conn(struct fuse_conn_info *conn)
     // unsigned congestion_threshold;
     log_struct(conn, congestion_threshold, %d, );
     
+#if FUSE_USE_VERSION >= 30
+    /** Timestamp granularity supported by the file system */
+    // unsigned time_gran;
+    log_struct(conn, time_gran, %d, );
+#endif
+
     /** For future use. */
     // unsigned reserved[23];
 }
@@ -144,17 +541,19 @@ void log_conn(struct fuse_conn_info *conn)
 // This dumps all the information in a struct fuse_file_info.  The struct
 // definition, and comments, come from /usr/include/fuse/fuse_common.h
 // Duplicated here for convenience.
-void log_fi (struct fuse_file_info *fi)
+void log_dump_fi (struct fuse_file_info *fi)
 {
-    log_msg("    fi:\n");
+    log_write(LOG_LEVEL_DEBUG, "    fi:\n");
     
     /** Open flags.  Available in open() and release() */
     //	int flags;
 	log_struct(fi, flags, 0x%08x, );
 	
+#if FUSE_USE_VERSION < 30
     /** Old file handle, don't use */
     //	unsigned long fh_old;	
 	log_struct(fi, fh_old, 0x%08lx,  );
+#endif
 
     /** In case of a write operation indicates if this was caused by a
         writepage */
@@ -207,9 +606,9 @@ int log_syscall(char *func, int retstat, int min_ret)
 
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
-void log_stat(struct stat *si)
+void log_dump_stat(struct stat *si)
 {
-    log_msg("    si:\n");
+    log_write(LOG_LEVEL_DEBUG, "    si:\n");
     
     //  dev_t     st_dev;     /* ID of device containing file */
 	log_struct(si, st_dev, %lld, );
@@ -252,9 +651,9 @@ void log_stat(struct stat *si)
 	
 }
 
-void log_statvfs(struct statvfs *sv)
+void log_dump_statvfs(struct statvfs *sv)
 {
-    log_msg("    sv:\n");
+    log_write(LOG_LEVEL_DEBUG, "    sv:\n");
     
     //  unsigned long  f_bsize;    /* file system block size */
 	log_struct(sv, f_bsize, %ld, );
@@ -291,9 +690,10 @@ void log_statvfs(struct statvfs *sv)
 	
 }
 
-void log_utime(struct utimbuf *buf)
+#if FUSE_USE_VERSION < 30
+void log_dump_utime(struct utimbuf *buf)
 {
-    log_msg("    buf:\n");
+    log_write(LOG_LEVEL_DEBUG, "    buf:\n");
     
     //    time_t actime;
     log_struct(buf, actime, 0x%08lx, );
@@ -301,4 +701,5 @@ void log_utime(struct utimbuf *buf)
     //    time_t modtime;
     log_struct(buf, modtime, 0x%08lx, );
 }
+#endif
 
@@ -9,20 +9,58 @@
 #define _LOG_H_
 #include <stdio.h>
 
+#define LOG_LEVEL_OFF   -1
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+extern int log_level;
+
+// A disabled level costs one load and a branch: the arguments aren't
+// even evaluated.
+#define log_enabled(level) ((level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+#define log_at(level, ...) \
+  do { if (log_enabled(level)) log_write(level, __VA_ARGS__); } while (0)
+
+#define log_msg(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
-  log_msg("    " #field " = " #format "\n", typecast st->field)
+  log_write(LOG_LEVEL_DEBUG, "    " #field " = " #format "\n", typecast st->field)
+
+// The struct dumps are debug output
+#define log_conn(conn) \
+  do { if (log_enabled(LOG_LEVEL_DEBUG)) log_dump_conn(conn); } while (0)
+#define log_fi(fi) \
+  do { if (log_enabled(LOG_LEVEL_DEBUG)) log_dump_fi(fi); } while (0)
+#define log_fuse_context(context) \
+  do { if (log_enabled(LOG_LEVEL_DEBUG)) log_dump_fuse_context(context); } while (0)
+#define log_stat(si) \
+  do { if (log_enabled(LOG_LEVEL_DEBUG)) log_dump_stat(si); } while (0)
+#define log_statvfs(sv) \
+  do { if (log_enabled(LOG_LEVEL_DEBUG)) log_dump_statvfs(sv); } while (0)
+#define log_utime(buf) \
+  do { if (log_enabled(LOG_LEVEL_DEBUG)) log_dump_utime(buf); } while (0)
 
 FILE *log_open(void);
-void log_msg(const char *format, ...);
-void log_conn(struct fuse_conn_info *conn);
+int  log_start(void);
+void log_close(void);
+int  log_parse_level(const char *name);
+void log_set_level(int level);
+const char *log_level_name(int level);
+void log_write(int level, const char *format, ...);
+void log_dump_conn(struct fuse_conn_info *conn);
 int log_error(char *func);
-void log_fi(struct fuse_file_info *fi);
-void log_fuse_context(struct fuse_context *context);
+void log_dump_fi(struct fuse_file_info *fi);
+void log_dump_fuse_context(struct fuse_context *context);
 void log_retstat(char *func, int retstat);
-void log_stat(struct stat *si);
-void log_statvfs(struct statvfs *sv);
+void log_dump_stat(struct stat *si);
+void log_dump_statvfs(struct statvfs *sv);
 int  log_syscall(char *func, int retstat, int min_ret);
-void log_utime(struct utimbuf *buf);
+#if FUSE_USE_VERSION < 30
+void log_dump_utime(struct utimbuf *buf);
+#endif
 
 #endif
@@ -0,0 +1,125 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  On-disk format of fcfs.log, shared by the logger in log.c and the
+  offline decoder fclogdump.
+
+  The file starts with a struct log_file_header, followed by records.
+  Every record starts with a struct log_record.  A format record
+  carries the format string for one id, and it is always written
+  before the first message that uses that id.  A message record
+  carries the arguments only, encoded in the order the format string
+  consumes them:
+
+    LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_PTR   int64_t
+    LOG_ARG_DOUBLE                           double
+    LOG_ARG_STR                              uint16_t length, bytes
+
+  Records are written in the byte order of the machine that ran the
+  daemon; the header tells the decoder which one that was.
+*/
+
+#ifndef _LOG_FORMAT_H_
+#define _LOG_FORMAT_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_MAGIC "FCFSLOG1"
+#define LOG_BYTEORDER 0x01020304u
+
+struct log_file_header {
+    char magic[8];
+    uint32_t byteorder;
+    uint32_t reserved;
+};
+
+enum {
+    LOG_REC_FORMAT = 1,         // payload: NUL terminated format string
+    LOG_REC_MSG = 2,            // payload: arguments
+    LOG_REC_DROPPED = 3,        // payload: uint64_t messages lost
+};
+
+struct log_record {
+    uint16_t size;              // of the whole record
+    uint8_t type;
+    uint8_t level;
+    uint32_t tid;
+    uint64_t time;              // CLOCK_REALTIME, ns
+    uint32_t fmt;               // format id
+    uint32_t reserved;
+};
+
+#define LOG_RECORD_MAX 4096         // of a message record
+#define LOG_STR_MAX 1024
+
+// The most any record can carry after its header.  Format records
+// hold a whole format string and can be longer than LOG_RECORD_MAX.
+#define LOG_PAYLOAD_MAX (UINT16_MAX - sizeof(struct log_record))
+
+enum {
+    LOG_ARG_NONE = 0,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_PTR,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STR,
+};
+
+/**
+ * Walk one conversion of a printf format.  *fmt points at the '%'; on
+ * return it points past the conversion, stars holds how many '*'
+ * width/precision arguments come first and the argument type of the
+ * conversion itself is returned (LOG_ARG_NONE for "%%").
+ */
+static inline int log_format_next(const char **fmt, int *stars)
+{
+    const char *p = *fmt + 1;
+    int longs = 0;
+    int type;
+
+    *stars = 0;
+
+    if (*p == '%') {
+        *fmt = p + 1;
+        return LOG_ARG_NONE;
+    }
+
+    // flags, width, precision
+    while (*p && strchr("-+ #0'123456789.*", *p)) {
+        if (*p == '*') (*stars)++;
+        p++;
+    }
+
+    // length modifiers
+    while (*p && strchr("hlLqjzt", *p)) {
+        if (strchr("lLqjzt", *p)) longs++;
+        p++;
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+        type = longs ? LOG_ARG_LONG : LOG_ARG_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        type = LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        type = LOG_ARG_STR;
+        break;
+    case 'p':
+        type = LOG_ARG_PTR;
+        break;
+    default:
+        // %n and anything we don't know are printed as they are
+        type = LOG_ARG_NONE;
+        break;
+    }
+
+    *fmt = *p ? p + 1 : p;
+
+    return type;
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  fclogdump on damaged logs: a record whose size is too small for a
+  record must be reported and stop the dump, not crash it.  Records
+  up to the largest size the header can give, such as long format
+  strings, are read whole.
+  $FCLOGDUMP names the binary under test.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "log_format.h"
+
+static char log_path[] = "/tmp/test_fclogdump.XXXXXX";
+static char out_path[] = "/tmp/test_fclogdump.out.XXXXXX";
+
+static void put_record(FILE *f, int type, uint32_t fmt, uint16_t size, const void *payload, size_t len)
+{
+    struct log_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.size = size;
+    rec.type = type;
+    rec.fmt = fmt;
+    fwrite(&rec, sizeof(rec), 1, f);
+    fwrite(payload, 1, len, f);
+}
+
+// A log with a format, a message using it, then bad_size as the size
+// of a message record followed by payload bytes of junk, and with
+// long_len a format and message of that many bytes
+static void write_log(int bad, uint16_t bad_size, size_t junk, size_t long_len)
+{
+    struct log_file_header header;
+    int64_t arg = 42;
+    char *filler;
+    FILE *f;
+
+    f = fopen(log_path, "w");
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.byteorder = LOG_BYTEORDER;
+    header.reserved = 0;
+    fwrite(&header, sizeof(header), 1, f);
+
+    put_record(f, LOG_REC_FORMAT, 0, sizeof(struct log_record) + sizeof("hello %d\n"),
+               "hello %d\n", sizeof("hello %d\n"));
+    put_record(f, LOG_REC_MSG, 0, sizeof(struct log_record) + sizeof(arg), &arg, sizeof(arg));
+
+    if (bad) {
+        filler = malloc(junk);
+        memset(filler, 'x', junk);
+        put_record(f, LOG_REC_MSG, 0, bad_size, filler, junk);
+        free(filler);
+    }
+    if (long_len) {
+        filler = malloc(long_len);
+        memset(filler, 'y', long_len - 1);
+        filler[long_len - 1] = '\0';
+        put_record(f, LOG_REC_FORMAT, 1, sizeof(struct log_record) + long_len, filler, long_len);
+        put_record(f, LOG_REC_MSG, 1, sizeof(struct log_record), NULL, 0);
+        free(filler);
+    }
+    fclose(f);
+}
+
+// Exit status of fclogdump on the log, -1 if it died of a signal
+static int dump(void)
+{
+    const char *bin = getenv("FCLOGDUMP");
+    int status;
+    pid_t pid;
+
+    if (bin == NULL) bin = "../src/fclogdump";
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        if (freopen(out_path, "w", stdout) == NULL) _exit(127);
+        execl(bin, "fclogdump", log_path, (char *) NULL);
+        _exit(127);
+    }
+    waitpid(pid, &status, 0);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Whether the dump printed the good message, and with long_len the
+// long one after it
+static int printed_hello(size_t long_len)
+{
+    char line[64] = "";
+    FILE *f = fopen(out_path, "r");
+    size_t n = 0;
+    int c;
+
+    if (f == NULL) return 0;
+    if (fgets(line, sizeof(line), f) == NULL) line[0] = '\0';
+    while (long_len && ((c = getc(f)) == 'y')) n++;
+    fclose(f);
+
+    return !strcmp(line, "hello 42\n") && (n + 1 == (long_len ? long_len : 1));
+}
+
+static int check(const char *what, int bad, uint16_t bad_size, size_t junk, size_t long_len, int want)
+{
+    int ret;
+
+    write_log(bad, bad_size, junk, long_len);
+    ret = dump();
+    if ((ret != want) || !printed_hello(long_len)) {
+        fprintf(stderr, "FAIL %s: exit %d, wanted %d%s\n", what, ret, want,
+                printed_hello(long_len) ? "" : ", good records not printed");
+        return 1;
+    }
+    printf("ok   %s\n", what);
+
+    return 0;
+}
+
+int main(void)
+{
+    int fd, failed = 0;
+
+    fd = mkstemp(log_path);
+    if (fd == -1) return 99;
+    close(fd);
+    fd = mkstemp(out_path);
+    if (fd == -1) return 99;
+    close(fd);
+
+    failed |= check("well-formed log", 0, 0, 0, 0, 0);
+    failed |= check("format longer than LOG_RECORD_MAX", 0, 0, 0, LOG_RECORD_MAX + 1000, 0);
+    failed |= check("format of the largest size", 0, 0, 0, LOG_PAYLOAD_MAX, 0);
+    failed |= check("record smaller than its header", 1, 4, 0, 0, 1);
+    failed |= check("record cut short by the end of the log", 1, 1000, 10, 0, 0);
+
+    unlink(log_path);
+    unlink(out_path);
+
+    return failed;
+}
@@ -0,0 +1,140 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  -o group_commit: a batch costs one flush, its members get the
+  writeback error of their own file, and a failed syncfs() fails the
+  whole batch.  The test provides the flushes in place of
+  fcfuse_uring.c and the kernel, counting them and injecting errors.
+*/
+
+// the module's syncfs() and sync_file_range() are ours
+#define syncfs test_syncfs
+#define sync_file_range test_sync_file_range
+
+#include "../src/fcfuse_gcommit.c"
+
+#include <stdarg.h>
+
+int log_level = LOG_LEVEL_OFF;
+
+void log_write(int level, const char *format, ...)
+{
+}
+
+static int slow_fd = -1;            // the flush running while the batch gathers
+static int bad_fd = -1;             // its file had a writeback error
+static int syncfs_err;              // what the next syncfs() fails with
+static int flushes;                 // fsyncs and syncfs() calls sent
+
+int fcfuse_uring_fsync(int fd, int datasync)
+{
+    __atomic_add_fetch(&flushes, 1, __ATOMIC_RELAXED);
+    if (fd == slow_fd) usleep(200000);
+
+    return 0;
+}
+
+int test_syncfs(int fd)
+{
+    __atomic_add_fetch(&flushes, 1, __ATOMIC_RELAXED);
+    if (syncfs_err) {
+        errno = syncfs_err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int test_sync_file_range(int fd, __off64_t offset, __off64_t nbytes, unsigned int flags)
+{
+    if (fd == bad_fd) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+struct request {
+    int fd;
+    int delay_us;                   // after the first fsync started
+    int ret;
+    int err;
+};
+
+static void *do_fsync(void *arg)
+{
+    struct request *req = arg;
+
+    usleep(req->delay_us);
+    req->ret = fcfuse_gcommit_fsync(req->fd, 0);
+    req->err = errno;
+
+    return NULL;
+}
+
+// Three fsyncs: the first goes alone and slowly; the second leads the
+// batch that gathers meanwhile, the third joins it and has the bad
+// file.  want[] is the errno each should end with.
+static int run(const char *what, const int want[3])
+{
+    char paths[3][32];
+    struct request reqs[3];
+    pthread_t threads[3];
+    int i, failed = 0;
+
+    for (i = 0; i < 3; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/tmp/test_gcommit.XXXXXX");
+        reqs[i].fd = mkstemp(paths[i]);
+        if (reqs[i].fd == -1) return 99;
+        reqs[i].delay_us = i * 50000;
+    }
+    slow_fd = reqs[0].fd;
+    bad_fd = reqs[2].fd;
+    flushes = 0;
+    gc_flushes = 0;
+
+    for (i = 0; i < 3; i++) pthread_create(&threads[i], NULL, do_fsync, &reqs[i]);
+    for (i = 0; i < 3; i++) pthread_join(threads[i], NULL);
+
+    if ((flushes != 2) || (gc_flushes != 2)) {
+        fprintf(stderr, "FAIL: %s: %d flushes (%llu counted) for 3 fsyncs, wanted 2\n", what, flushes,
+                gc_flushes);
+        failed = 1;
+    }
+    for (i = 0; i < 3; i++) {
+        if (want[i] ? ((reqs[i].ret == -1) && (reqs[i].err == want[i])) : (reqs[i].ret == 0)) continue;
+        fprintf(stderr, "FAIL: %s: fsync %d got %d (%s), wanted %s\n", what, i, reqs[i].ret,
+                reqs[i].ret ? strerror(reqs[i].err) : "success", want[i] ? strerror(want[i]) : "success");
+        failed = 1;
+    }
+    if (!failed) printf("ok   %s\n", what);
+
+    for (i = 0; i < 3; i++) {
+        close(reqs[i].fd);
+        unlink(paths[i]);
+    }
+
+    return failed;
+}
+
+int main(void)
+{
+    static const int own[3] = { 0, 0, EIO };
+    static const int all[3] = { 0, ENOSPC, ENOSPC };
+    int failed;
+
+    fcfuse_gcommit_init(1, 50000);
+    if (fcfuse_gcommit_start() != 0) {
+        printf("SKIP: group commit needs Linux 5.8\n");
+        return 77;
+    }
+
+    failed = run("the batch member gets its own EIO", own);
+    syncfs_err = ENOSPC;
+    failed |= run("a failed syncfs fails the batch", all);
+    fcfuse_gcommit_stop();
+
+    return failed;
+}
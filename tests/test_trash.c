@@ -0,0 +1,152 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  -o trash: opening a file while the reclaimer truncates it under a
+  write lease breaks the lease.  The daemon must survive the SIGIO
+  that raises, let the opener in soon and keep its data, rather than
+  make it wait out the rest of a step or the kernel's lease-break-time.
+  The reclaimer runs in a child so that a fatal signal shows up as a
+  failure.
+*/
+
+#include "../src/fcfuse_trash.c"
+
+#include <stdarg.h>
+#include <sys/wait.h>
+
+int log_level = LOG_LEVEL_OFF;
+
+void log_write(int level, const char *format, ...)
+{
+}
+
+void fcfuse_journal_hold(void)
+{
+}
+
+void fcfuse_journal_done(void)
+{
+}
+
+#define FILE_MB 512
+#define RATE_MB 8                   // a step takes 8 s to sleep off
+
+static char dir[] = "/tmp/test_trash.XXXXXX";
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The name of the one file in the trash, or NULL
+static char *trashed(char *path)
+{
+    struct dirent *de;
+    DIR *dp;
+
+    snprintf(path, PATH_MAX, "%s/%s", dir, FCFUSE_TRASH_NAME);
+    dp = opendir(path);
+    if (dp == NULL) return NULL;
+    while ((de = readdir(dp)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        snprintf(path, PATH_MAX, "%s/%s/%s", dir, FCFUSE_TRASH_NAME, de->d_name);
+        closedir(dp);
+        return path;
+    }
+    closedir(dp);
+
+    return NULL;
+}
+
+static int run(void)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    double t;
+    int fd;
+
+    snprintf(path, PATH_MAX, "%s/big", dir);
+    fd = open(path, O_WRONLY | O_CREAT, 0600);
+    if ((fd == -1) || (posix_fallocate(fd, 0, (off_t) FILE_MB << 20) != 0)) return 77;
+    close(fd);
+
+    if (fcfuse_trash_init(dir, 1, 1, RATE_MB) != 0) return 77;
+    if (fcfuse_trash_unlink(path) != 0) {
+        fprintf(stderr, "trash_unlink: %s\n", strerror(errno));
+        return 1;
+    }
+    if (trashed(path) == NULL) {
+        fprintf(stderr, "nothing in the trash\n");
+        return 1;
+    }
+
+    // the reclaimer takes the lease and sleeps off its first step
+    if (fcfuse_trash_start() != 0) return 1;
+    usleep(500000);
+    if (__atomic_load_n(&tr_freed, __ATOMIC_RELAXED) == 0) {
+        // leases aren't granted here
+        fcfuse_trash_stop();
+        return 77;
+    }
+
+    t = now();
+    fd = open(path, O_RDONLY);
+    t = now() - t;
+    if (fd == -1) {
+        fprintf(stderr, "open: %s\n", strerror(errno));
+        return 1;
+    }
+    if (t > 1) {
+        fprintf(stderr, "open waited %.1f s for the lease\n", t);
+        return 1;
+    }
+    fstat(fd, &st);
+    if (st.st_size == 0) {
+        fprintf(stderr, "the file was truncated under its reader\n");
+        return 1;
+    }
+
+    // and once given back, the file is just unlinked
+    usleep(1500000);
+    if (trashed(path) != NULL) {
+        fprintf(stderr, "%s still in the trash\n", path);
+        return 1;
+    }
+    if (fstat(fd, &st) || (st.st_size == 0)) {
+        fprintf(stderr, "the reader lost the file\n");
+        return 1;
+    }
+    close(fd);
+    fcfuse_trash_stop();
+
+    return 0;
+}
+
+int main(void)
+{
+    char cmd[PATH_MAX + 16];
+    int status;
+    pid_t pid;
+
+    if (mkdtemp(dir) == NULL) return 77;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) _exit(run());
+    waitpid(pid, &status, 0);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) fprintf(stderr, "could not remove %s\n", dir);
+
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "killed by signal %d\n", WTERMSIG(status));
+        return 1;
+    }
+    if (WEXITSTATUS(status) == 0) printf("a reader breaks the lease and keeps the file\n");
+
+    return WEXITSTATUS(status);
+}
@@ -0,0 +1,101 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  -o uring: the backing calls go through the ring, not around it, and
+  a submission the kernel refuses fails its requests instead of
+  retrying forever.  Skipped where the build or the kernel has no
+  io_uring.
+*/
+
+#include "../src/fcfuse_uring.c"
+
+#include <stdarg.h>
+
+int log_level = LOG_LEVEL_OFF;
+
+void log_write(int level, const char *format, ...)
+{
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+static int failed;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAIL line %d: %s\n", __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+int main(void)
+{
+    char path[] = "/tmp/test_uring.XXXXXX";
+    char buf[4096], back[4096];
+    struct stat st, fst;
+    uint64_t requests;
+    int fd, fd2, ret, devnull;
+
+    fcfuse_uring_init(64);
+    ret = fcfuse_uring_start();
+    if (ret != 0) {
+        printf("SKIP: no io_uring here (%s)\n", strerror(-ret));
+        return 77;
+    }
+    if (uring_ops != URING_WANTED) {
+        printf("SKIP: this kernel's io_uring lacks some operations\n");
+        fcfuse_uring_stop();
+        return 77;
+    }
+
+    fd = mkstemp(path);
+    CHECK(fd != -1);
+    memset(buf, 'u', sizeof(buf));
+    requests = uring_requests;
+
+    // each call is one request through the ring
+    CHECK(fcfuse_uring_pwrite(fd, buf, sizeof(buf), 0) == sizeof(buf));
+    CHECK(fcfuse_uring_pread(fd, back, sizeof(back), 0) == sizeof(back));
+    CHECK(memcmp(buf, back, sizeof(buf)) == 0);
+    CHECK(fcfuse_uring_fsync(fd, 1) == 0);
+    CHECK(fcfuse_uring_fstat(fd, &fst) == 0);
+    CHECK(fcfuse_uring_lstat(path, &st) == 0);
+    CHECK((st.st_ino == fst.st_ino) && (st.st_size == sizeof(buf)));
+    fd2 = fcfuse_uring_open(path, O_RDONLY, 0);
+    CHECK(fd2 != -1);
+    CHECK(fcfuse_uring_lstat("/nonexistent/test_uring", &st) == -1 && errno == ENOENT);
+    CHECK(uring_requests - requests == 7);
+    CHECK(uring_enters > 0);
+    printf("ring: %llu requests in %llu submits\n",
+           (unsigned long long) uring_requests, (unsigned long long) uring_enters);
+
+    // io_uring_enter() on something that isn't a ring fails for good:
+    // the request comes back with the error and the ring is left usable
+    devnull = open("/dev/null", O_RDONLY);
+    ret = uring_fd;
+    uring_fd = devnull;
+    CHECK(fcfuse_uring_pread(fd, back, sizeof(back), 0) == -1);
+    uring_fd = ret;
+    CHECK(fcfuse_uring_pread(fd, back, sizeof(back), 0) == sizeof(back));
+    close(devnull);
+
+    close(fd2);
+    close(fd);
+    unlink(path);
+    fcfuse_uring_stop();
+    CHECK(uring_fd == -1);
+
+    return failed;
+}
+
+#else
+
+int main(void)
+{
+    printf("SKIP: built without <linux/io_uring.h>\n");
+    return 77;
+}
+
+#endif